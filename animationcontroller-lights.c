@@ -4,9 +4,9 @@
  *
  * Based on: Animation Controller v1.0 (11/04/2021)
  *
- * This template provides a basic FPS-limited render loop for an animated scene,
- * plus keyboard handling for smooth game-like control of an object such as a
- * character or vehicle.
+ * This template provides a fixed-timestep simulation loop (on its own thread)
+ * with interpolated rendering for an animated scene, plus keyboard handling for
+ * smooth game-like control of an object such as a character or vehicle.
  *
  * A simple static lighting setup is provided via initLights(), which is not
  * included in the animationalcontrol.c template. There are no other changes.
@@ -14,24 +14,415 @@
  ******************************************************************************/
 
 #define _CRT_SECURE_NO_WARNINGS
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L		// clock_gettime() and nanosleep() for frame pacing, whatever the C dialect.
+#endif
 
+#ifdef _WIN32
 #include <Windows.h>
 #include <freeglut.h>
+#pragma comment(lib, "winmm.lib")	// timeBeginPeriod/timeEndPeriod, for 1 ms Sleep() granularity.
+#else
+#include <GL/freeglut.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <ctype.h>
+#include <float.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Rain is updated with SSE2 wherever the compiler targets it (which x64 always does).
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RAIN_SIMD
+#endif
 
  /******************************************************************************
   * Animation & Timing Setup
   ******************************************************************************/
 
-  // Target frame rate (number of Frames Per Second).
-#define TARGET_FPS 30				
+  // Simulation rate (number of think() ticks per second). Rendering is not tied to this.
+#define TARGET_FPS 30
 #define PI 3.1416
 
-#define NUM_RAIN_DROPS 1000
+// Rain drops unless --rain-drops says otherwise. The rain is stored and updated in groups
+// of RAIN_LANES drops, the width of an SSE2 register, and handed to the worker pool in
+// chunks of RAIN_CHUNK_DROPS (a multiple of RAIN_ALIGN_DROPS, so no two threads ever
+// write to the same cache line).
+#define DEFAULT_RAIN_DROPS 1000
+#define MAX_RAIN_DROPS 10000000		// --rain-drops is capped here: 400 MB of drops, and two 240 MB buffers to draw them from.
+#define RAIN_LANES 4
+#define RAIN_ALIGN_DROPS 16		// Drops to a 64-byte cache line.
+#define RAIN_CHUNK_DROPS 4096
+#define RAIN_DROP_LENGTH 0.5f
+#define RAIN_BOX_SIZE 64.0f		// Rain falls in a box this wide around the camera, beyond the rain's fog on every side.
+#define RAIN_LINE_FLOATS 6		// Each drop is drawn as a line, from x y z to x y+RAIN_DROP_LENGTH z.
+
+// Particle effects (see particleKinds). Every type has a pool of its own, allocated once at
+// startup, and no more than MAX_PARTICLES are alive at once across all of them.
+#define MAX_PARTICLES 4096
+#define PARTICLE_VERTEX_FLOATS 7		// x y z r g b a, as drawParticles() hands them over.
+#define PARTICLE_MIN_SPAWN_SCALE 0.1f	// However slow frames get, emitters keep at least this fraction of their rate.
+#define DOWNWASH_HEIGHT 4.0f			// The rotors raise dust below this height,
+#define DOWNWASH_RATE 400.0f			// at up to this many particles a second (at full rotor speed, on the ground).
+#define EXHAUST_RATE 8.0f				// Exhaust particles a second from each tank,
+#define EXHAUST_DISTANCE 40.0f			// within this distance of the camera (the fog hides the rest).
+#define SPLASH_LANDINGS (0.1875f * TARGET_FPS / 35.0f)	// Fraction of the rain that lands each second (see emitRainSplashes()).
+#define SPLASH_DISTANCE 16.0f			// Rain splashes on the ground this far either side of the camera,
+#define SPLASH_DROPLETS 3				// each throwing up this many droplets.
+
+// Longest stretch of real time (in milliseconds) a single idle() call will catch up on.
+// Anything beyond this (a window drag, a breakpoint, a very slow frame) is dropped, so one
+// long stall can't snowball into an ever-growing backlog of think() calls.
+#define MAX_FRAME_CATCHUP 250
+
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+// When waiting for the next frame, sleep until this close to the deadline, then spin the rest.
+// OS sleeps routinely overshoot by a millisecond or more; spinning the last stretch doesn't.
+#define PACING_SPIN_THRESHOLD_NS (2 * NS_PER_MS)
+
+// Frame time histogram: 0.1 ms buckets covering 0-100 ms (slower frames land in the last bucket),
+// over a rolling window of the most recent FRAME_HISTORY_SIZE frames.
+#define FRAME_HISTOGRAM_BUCKET_NS 100000ULL
+#define FRAME_HISTOGRAM_BUCKETS 1000
+#define FRAME_HISTORY_SIZE 1024
+
+// Keyboard events waiting for the next simulation tick. GLUT can deliver several per frame, but
+// never anywhere near this many between two ticks.
+#define INPUT_QUEUE_SIZE 256
+
+// Input recordings: "HREC", then version, tick rate, tick count and event count (uint32 each),
+// then 6 bytes per event (uint32 tick, uint8 type, uint8 key). All little-endian.
+#define INPUT_RECORDING_VERSION 1
+#define INPUT_RECORDING_HEADER_SIZE 20
+#define INPUT_RECORDING_EVENT_SIZE 6
+
+// Profiler: timing samples waiting to be collected (must be a power of two), and the number
+// of frames the HUD's rolling averages and maxima cover.
+#define PROFILE_RING_SIZE 4096
+#define PROFILE_WINDOW_FRAMES 120
+
+// Camera projection, shared by reshape() and the view frustum used for culling.
+#define CAMERA_FOV_Y 45.0f
+#define CAMERA_NEAR 1.0f
+#define CAMERA_FAR 100.0f
+
+// The ground is split into square chunks this wide, each drawn at one of GROUND_LOD_LEVELS
+// tessellations depending on its distance from the camera (see groundLodDivisions).
+#define GROUND_CHUNK_SIZE 20.0f
+#define GROUND_LOD_LEVELS 4
+
+// Models in the mesh registry are built at MESH_LOD_LEVELS tessellations (see meshLodDetail),
+// and each copy is drawn at the one that suits its size on screen (see selectMeshLod()). A copy
+// only changes level once its size is this fraction past the threshold, so it doesn't flicker.
+#define MESH_LOD_LEVELS 3
+#define MESH_LOD_HYSTERESIS 0.2f
+
+// Instance groups sort their instances into buckets: one per level of detail, then the group's
+// impostor, then the ones outside the view frustum, which aren't drawn at all.
+#define INSTANCE_IMPOSTOR MESH_LOD_LEVELS
+#define INSTANCE_CULLED (MESH_LOD_LEVELS + 1)
+#define INSTANCE_BUCKETS (MESH_LOD_LEVELS + 2)
+
+// The scene's spatial index is a grid of square cells this wide over the ground (see spatialindex_t).
+#define SPATIAL_CELL_SIZE 20.0f
+#define SPATIAL_BLOCK_CELLS 8			// Frustum queries test cells this many square at a time first.
+
+// Distant trees are drawn as quads showing one of IMPOSTOR_VIEWS pictures of the tree, taken at
+// even angles around it and packed side by side in one texture (see initImpostors()).
+#define IMPOSTOR_VIEWS 8
+#define IMPOSTOR_VIEW_WIDTH 128
+#define IMPOSTOR_VIEW_HEIGHT 256
+#define IMPOSTOR_VERTEX_FLOATS 8		// Position, texture coordinate and colour.
+#define IMPOSTOR_BAKE_AMBIENT 0.7f		// Daytime ambient (see setupNightMode()) the pictures are lit with.
+
+// Capabilities the state cache tracks (see stateCacheCaps); glEnable()/glDisable() of others always go through.
+#define STATE_CACHE_CAPS 9
+
+/******************************************************************************
+ * Atomic Operations and Threads (used where state is shared between threads)
+ ******************************************************************************/
+
+#ifdef _WIN32
+#define atomicFetchAdd(target, value) InterlockedExchangeAdd((target), (value))
+#define atomicLoad(target) InterlockedCompareExchange((target), 0, 0)
+#define atomicStore(target, value) InterlockedExchange((target), (value))
+#define atomicExchange(target, value) InterlockedExchange((target), (value))
+#define threadLocal __declspec(thread)
+typedef HANDLE threadhandle_t;
+typedef HANDLE semaphore_t;
+#else
+#define atomicFetchAdd(target, value) __atomic_fetch_add((target), (value), __ATOMIC_ACQ_REL)
+#define atomicLoad(target) __atomic_load_n((target), __ATOMIC_ACQUIRE)
+#define atomicStore(target, value) __atomic_store_n((target), (value), __ATOMIC_RELEASE)
+#define atomicExchange(target, value) __atomic_exchange_n((target), (value), __ATOMIC_ACQ_REL)
+#define threadLocal __thread
+typedef pthread_t threadhandle_t;
+typedef sem_t semaphore_t;
+#endif
+
+// Most threads the worker pool will start, whatever --workers asks for.
+#define MAX_WORKER_THREADS 64
+
+// World snapshots are handed from the simulation thread to display() through a triple buffer.
+// The shared slot index carries this flag while it holds a snapshot display() hasn't picked up yet.
+#define SNAPSHOT_FRESH 4
+
+/******************************************************************************
+ * OpenGL Extension Functions
+ *
+ * Windows only exports OpenGL 1.1 from opengl32.dll, so anything newer is
+ * looked up at runtime with glutGetProcAddress() in loadGLExtensions(). The
+ * same path is used on every platform. A pointer left NULL means the driver
+ * doesn't have that function, and the feature using it must stay disabled.
+ ******************************************************************************/
 
-// Ideal time each frame should be displayed for (in milliseconds).
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+#ifndef GL_VERSION_1_5
+typedef ptrdiff_t GLsizeiptr;
+typedef ptrdiff_t GLintptr;
+#endif
+#ifndef GL_VERSION_3_2
+typedef unsigned long long GLuint64;
+#endif
+
+#ifndef GL_VERSION_2_0
+typedef char GLchar;
+#endif
+
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_ELEMENT_ARRAY_BUFFER 0x8893
+#define GL_STATIC_DRAW 0x88E4
+#endif
+#ifndef GL_DYNAMIC_DRAW
+#define GL_DYNAMIC_DRAW 0x88E8
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+
+#ifndef GL_VERTEX_SHADER
+#define GL_FRAGMENT_SHADER 0x8B30
+#define GL_VERTEX_SHADER 0x8B31
+#define GL_COMPILE_STATUS 0x8B81
+#define GL_LINK_STATUS 0x8B82
+#define GL_INFO_LOG_LENGTH 0x8B84
+#endif
+
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT 0x8866
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+
+#ifndef GL_UNIFORM_BUFFER
+#define GL_UNIFORM_BUFFER 0x8A11
+#define GL_INVALID_INDEX 0xFFFFFFFFu
+#endif
+
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+#ifndef GL_DEPTH_COMPONENT24
+#define GL_DEPTH_COMPONENT24 0x81A6
+#endif
+#ifndef GL_FRAMEBUFFER
+#define GL_FRAMEBUFFER_BINDING 0x8CA6
+#define GL_FRAMEBUFFER_COMPLETE 0x8CD5
+#define GL_COLOR_ATTACHMENT0 0x8CE0
+#define GL_DEPTH_ATTACHMENT 0x8D00
+#define GL_FRAMEBUFFER 0x8D40
+#define GL_RENDERBUFFER 0x8D41
+#endif
+
+typedef void (APIENTRY* GenQueriesFunc)(GLsizei n, GLuint* ids);
+typedef void (APIENTRY* DeleteQueriesFunc)(GLsizei n, const GLuint* ids);
+typedef void (APIENTRY* BeginQueryFunc)(GLenum target, GLuint id);
+typedef void (APIENTRY* EndQueryFunc)(GLenum target);
+typedef void (APIENTRY* GetQueryObjectivFunc)(GLuint id, GLenum pname, GLint* params);
+typedef void (APIENTRY* GetQueryObjectui64vFunc)(GLuint id, GLenum pname, GLuint64* params);
+typedef void (APIENTRY* GenBuffersFunc)(GLsizei n, GLuint* buffers);
+typedef void (APIENTRY* DeleteBuffersFunc)(GLsizei n, const GLuint* buffers);
+typedef void (APIENTRY* BindBufferFunc)(GLenum target, GLuint buffer);
+typedef void (APIENTRY* BufferDataFunc)(GLenum target, GLsizeiptr size, const void* data, GLenum usage);
+typedef void* (APIENTRY* MapBufferRangeFunc)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+typedef GLboolean(APIENTRY* UnmapBufferFunc)(GLenum target);
+typedef GLuint(APIENTRY* CreateShaderFunc)(GLenum type);
+typedef void (APIENTRY* ShaderSourceFunc)(GLuint shader, GLsizei count, const GLchar* const* strings, const GLint* lengths);
+typedef void (APIENTRY* CompileShaderFunc)(GLuint shader);
+typedef void (APIENTRY* GetShaderivFunc)(GLuint shader, GLenum pname, GLint* params);
+typedef void (APIENTRY* GetShaderInfoLogFunc)(GLuint shader, GLsizei bufSize, GLsizei* length, GLchar* infoLog);
+typedef void (APIENTRY* DeleteShaderFunc)(GLuint shader);
+typedef GLuint(APIENTRY* CreateProgramFunc)(void);
+typedef void (APIENTRY* AttachShaderFunc)(GLuint program, GLuint shader);
+typedef void (APIENTRY* BindAttribLocationFunc)(GLuint program, GLuint index, const GLchar* name);
+typedef void (APIENTRY* LinkProgramFunc)(GLuint program);
+typedef void (APIENTRY* GetProgramivFunc)(GLuint program, GLenum pname, GLint* params);
+typedef void (APIENTRY* GetProgramInfoLogFunc)(GLuint program, GLsizei bufSize, GLsizei* length, GLchar* infoLog);
+typedef void (APIENTRY* DeleteProgramFunc)(GLuint program);
+typedef void (APIENTRY* UseProgramFunc)(GLuint program);
+typedef GLint(APIENTRY* GetUniformLocationFunc)(GLuint program, const GLchar* name);
+typedef void (APIENTRY* Uniform1iFunc)(GLint location, GLint v0);
+typedef void (APIENTRY* Uniform1fFunc)(GLint location, GLfloat v0);
+typedef void (APIENTRY* Uniform1fvFunc)(GLint location, GLsizei count, const GLfloat* value);
+typedef void (APIENTRY* Uniform3fvFunc)(GLint location, GLsizei count, const GLfloat* value);
+typedef void (APIENTRY* Uniform4fvFunc)(GLint location, GLsizei count, const GLfloat* value);
+typedef void (APIENTRY* UniformMatrix3fvFunc)(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value);
+typedef void (APIENTRY* UniformMatrix4fvFunc)(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value);
+typedef void (APIENTRY* VertexAttrib4fvFunc)(GLuint index, const GLfloat* v);
+typedef void (APIENTRY* VertexAttribPointerFunc)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer);
+typedef void (APIENTRY* EnableVertexAttribArrayFunc)(GLuint index);
+typedef void (APIENTRY* DisableVertexAttribArrayFunc)(GLuint index);
+typedef void (APIENTRY* VertexAttribDivisorFunc)(GLuint index, GLuint divisor);
+typedef void (APIENTRY* DrawElementsInstancedFunc)(GLenum mode, GLsizei count, GLenum type, const void* indices, GLsizei instancecount);
+typedef void (APIENTRY* BufferSubDataFunc)(GLenum target, GLintptr offset, GLsizeiptr size, const void* data);
+typedef GLuint(APIENTRY* GetUniformBlockIndexFunc)(GLuint program, const GLchar* uniformBlockName);
+typedef void (APIENTRY* UniformBlockBindingFunc)(GLuint program, GLuint uniformBlockIndex, GLuint uniformBlockBinding);
+typedef void (APIENTRY* BindBufferBaseFunc)(GLenum target, GLuint index, GLuint buffer);
+typedef void (APIENTRY* GenFramebuffersFunc)(GLsizei n, GLuint* framebuffers);
+typedef void (APIENTRY* DeleteFramebuffersFunc)(GLsizei n, const GLuint* framebuffers);
+typedef void (APIENTRY* BindFramebufferFunc)(GLenum target, GLuint framebuffer);
+typedef void (APIENTRY* FramebufferTexture2DFunc)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
+typedef GLenum(APIENTRY* CheckFramebufferStatusFunc)(GLenum target);
+typedef void (APIENTRY* GenRenderbuffersFunc)(GLsizei n, GLuint* renderbuffers);
+typedef void (APIENTRY* DeleteRenderbuffersFunc)(GLsizei n, const GLuint* renderbuffers);
+typedef void (APIENTRY* BindRenderbufferFunc)(GLenum target, GLuint renderbuffer);
+typedef void (APIENTRY* RenderbufferStorageFunc)(GLenum target, GLenum internalformat, GLsizei width, GLsizei height);
+typedef void (APIENTRY* FramebufferRenderbufferFunc)(GLenum target, GLenum attachment, GLenum renderbuffertarget, GLuint renderbuffer);
+typedef void (APIENTRY* GenerateMipmapFunc)(GLenum target);
+
+GenQueriesFunc pglGenQueries = NULL;
+DeleteQueriesFunc pglDeleteQueries = NULL;
+BeginQueryFunc pglBeginQuery = NULL;
+EndQueryFunc pglEndQuery = NULL;
+GetQueryObjectivFunc pglGetQueryObjectiv = NULL;
+GetQueryObjectui64vFunc pglGetQueryObjectui64v = NULL;
+GenBuffersFunc pglGenBuffers = NULL;
+DeleteBuffersFunc pglDeleteBuffers = NULL;
+BindBufferFunc pglBindBuffer = NULL;
+BufferDataFunc pglBufferData = NULL;
+MapBufferRangeFunc pglMapBufferRange = NULL;
+UnmapBufferFunc pglUnmapBuffer = NULL;
+CreateShaderFunc pglCreateShader = NULL;
+ShaderSourceFunc pglShaderSource = NULL;
+CompileShaderFunc pglCompileShader = NULL;
+GetShaderivFunc pglGetShaderiv = NULL;
+GetShaderInfoLogFunc pglGetShaderInfoLog = NULL;
+DeleteShaderFunc pglDeleteShader = NULL;
+CreateProgramFunc pglCreateProgram = NULL;
+AttachShaderFunc pglAttachShader = NULL;
+BindAttribLocationFunc pglBindAttribLocation = NULL;
+LinkProgramFunc pglLinkProgram = NULL;
+GetProgramivFunc pglGetProgramiv = NULL;
+GetProgramInfoLogFunc pglGetProgramInfoLog = NULL;
+DeleteProgramFunc pglDeleteProgram = NULL;
+UseProgramFunc pglUseProgram = NULL;
+GetUniformLocationFunc pglGetUniformLocation = NULL;
+Uniform1iFunc pglUniform1i = NULL;
+Uniform1fFunc pglUniform1f = NULL;
+Uniform1fvFunc pglUniform1fv = NULL;
+Uniform3fvFunc pglUniform3fv = NULL;
+Uniform4fvFunc pglUniform4fv = NULL;
+UniformMatrix3fvFunc pglUniformMatrix3fv = NULL;
+UniformMatrix4fvFunc pglUniformMatrix4fv = NULL;
+VertexAttrib4fvFunc pglVertexAttrib4fv = NULL;
+VertexAttribPointerFunc pglVertexAttribPointer = NULL;
+EnableVertexAttribArrayFunc pglEnableVertexAttribArray = NULL;
+DisableVertexAttribArrayFunc pglDisableVertexAttribArray = NULL;
+VertexAttribDivisorFunc pglVertexAttribDivisor = NULL;
+DrawElementsInstancedFunc pglDrawElementsInstanced = NULL;
+BufferSubDataFunc pglBufferSubData = NULL;
+GetUniformBlockIndexFunc pglGetUniformBlockIndex = NULL;
+UniformBlockBindingFunc pglUniformBlockBinding = NULL;
+BindBufferBaseFunc pglBindBufferBase = NULL;
+GenFramebuffersFunc pglGenFramebuffers = NULL;
+DeleteFramebuffersFunc pglDeleteFramebuffers = NULL;
+BindFramebufferFunc pglBindFramebuffer = NULL;
+FramebufferTexture2DFunc pglFramebufferTexture2D = NULL;
+CheckFramebufferStatusFunc pglCheckFramebufferStatus = NULL;
+GenRenderbuffersFunc pglGenRenderbuffers = NULL;
+DeleteRenderbuffersFunc pglDeleteRenderbuffers = NULL;
+BindRenderbufferFunc pglBindRenderbuffer = NULL;
+RenderbufferStorageFunc pglRenderbufferStorage = NULL;
+FramebufferRenderbufferFunc pglFramebufferRenderbuffer = NULL;
+GenerateMipmapFunc pglGenerateMipmap = NULL;
+
+#define glGenQueries pglGenQueries
+#define glDeleteQueries pglDeleteQueries
+#define glBeginQuery pglBeginQuery
+#define glEndQuery pglEndQuery
+#define glGetQueryObjectiv pglGetQueryObjectiv
+#define glGetQueryObjectui64v pglGetQueryObjectui64v
+#define glGenBuffers pglGenBuffers
+#define glDeleteBuffers pglDeleteBuffers
+#define glBindBuffer pglBindBuffer
+#define glBufferData pglBufferData
+#define glMapBufferRange pglMapBufferRange
+#define glUnmapBuffer pglUnmapBuffer
+#define glCreateShader pglCreateShader
+#define glShaderSource pglShaderSource
+#define glCompileShader pglCompileShader
+#define glGetShaderiv pglGetShaderiv
+#define glGetShaderInfoLog pglGetShaderInfoLog
+#define glDeleteShader pglDeleteShader
+#define glCreateProgram pglCreateProgram
+#define glAttachShader pglAttachShader
+#define glBindAttribLocation pglBindAttribLocation
+#define glLinkProgram pglLinkProgram
+#define glGetProgramiv pglGetProgramiv
+#define glGetProgramInfoLog pglGetProgramInfoLog
+#define glDeleteProgram pglDeleteProgram
+#define glUseProgram pglUseProgram
+#define glGetUniformLocation pglGetUniformLocation
+#define glUniform1i pglUniform1i
+#define glUniform1f pglUniform1f
+#define glUniform1fv pglUniform1fv
+#define glUniform3fv pglUniform3fv
+#define glUniform4fv pglUniform4fv
+#define glUniformMatrix3fv pglUniformMatrix3fv
+#define glUniformMatrix4fv pglUniformMatrix4fv
+#define glVertexAttrib4fv pglVertexAttrib4fv
+#define glVertexAttribPointer pglVertexAttribPointer
+#define glEnableVertexAttribArray pglEnableVertexAttribArray
+#define glDisableVertexAttribArray pglDisableVertexAttribArray
+#define glVertexAttribDivisor pglVertexAttribDivisor
+#define glDrawElementsInstanced pglDrawElementsInstanced
+#define glBufferSubData pglBufferSubData
+#define glGetUniformBlockIndex pglGetUniformBlockIndex
+#define glUniformBlockBinding pglUniformBlockBinding
+#define glBindBufferBase pglBindBufferBase
+#define glGenFramebuffers pglGenFramebuffers
+#define glDeleteFramebuffers pglDeleteFramebuffers
+#define glBindFramebuffer pglBindFramebuffer
+#define glFramebufferTexture2D pglFramebufferTexture2D
+#define glCheckFramebufferStatus pglCheckFramebufferStatus
+#define glGenRenderbuffers pglGenRenderbuffers
+#define glDeleteRenderbuffers pglDeleteRenderbuffers
+#define glBindRenderbuffer pglBindRenderbuffer
+#define glRenderbufferStorage pglRenderbufferStorage
+#define glFramebufferRenderbuffer pglFramebufferRenderbuffer
+#define glGenerateMipmap pglGenerateMipmap
+
+// Fixed amount of simulated time each call to think() advances the world by (in milliseconds).
 const unsigned int FRAME_TIME = 1000 / TARGET_FPS;
 
 // Frame time in fractional seconds.
@@ -40,8 +431,12 @@ const unsigned int FRAME_TIME = 1000 / TARGET_FPS;
 // value we'd get if we simply calculated "FRAME_TIME_SEC = 1.0f / TARGET_FPS".
 const float FRAME_TIME_SEC = (1000 / TARGET_FPS) / 1000.0f;
 
-// Time we started preparing the current frame (in milliseconds since GLUT was initialized).
-unsigned int frameStartTime = 0;
+// Time of the previous idle() call (in nanoseconds, from pacingNowNs()).
+unsigned long long frameStartTime = 0;
+
+// Real time that has passed but has not been simulated by think() yet (in nanoseconds).
+// Always less than FRAME_TIME after idle() returns; display() uses it to interpolate.
+unsigned long long simulationAccumulator = 0;
 
 /******************************************************************************
  * Some Simple Definitions of Motion
@@ -91,6 +486,25 @@ typedef enum {
 
 CameraView currentView = VIEW_BEHIND;
 
+// How idle() paces rendered frames. The simulation always runs at TARGET_FPS regardless.
+typedef enum {
+	PACING_CAPPED,		// Render at most TARGET_FPS frames per second.
+	PACING_UNCAPPED,	// Render as fast as possible (or as fast as the driver's vsync allows).
+	PACING_TARGET_FPS,	// Render at pacingTargetFps frames per second.
+	NUM_PACING_MODES
+} pacingmode_t;
+
+// Rolling record of recent frame times, bucketed so percentiles are cheap to read back.
+typedef struct {
+	unsigned long long history[FRAME_HISTORY_SIZE];		// Ring of the most recent frame times (ns).
+	unsigned int buckets[FRAME_HISTOGRAM_BUCKETS];		// Counts for the frames currently in history.
+	unsigned int runBuckets[FRAME_HISTOGRAM_BUCKETS];	// Counts for every frame since startup.
+	int historyCount;									// Number of valid entries in history.
+	int historyNext;									// Where the next frame time will be written.
+	unsigned long long runFrames;						// Frames recorded since startup.
+	unsigned long long runMax;							// Slowest frame since startup (ns).
+} frametimehistogram_t;
+
 // Represents the states of a set of keys used to control an object's motion.
 typedef struct {
 	keystate_t MoveForward;
@@ -103,11 +517,546 @@ typedef struct {
 	keystate_t TurnRight;
 } motionkeys_t;
 
-//rain effect
+//rain effect: one array per field, so the updates can move RAIN_LANES drops at once
+typedef struct {
+	int count;			// Drops drawn.
+	int capacity;		// count rounded up to whole groups of RAIN_ALIGN_DROPS; the spare drops fall unseen.
+	int chunkCount;		// Chunks of RAIN_CHUNK_DROPS (the last may be short), updated independently.
+	float* x;			// From the box's corner, 0 to RAIN_BOX_SIZE.
+	float* y;			// Bottom of the drop, above the ground.
+	float* z;
+	float* speed;		// Fall per frame.
+	float* lines;		// Every drop's line, for when there's no vertex buffer to write them to.
+	unsigned int* seeds;	// Each chunk's lanes' random number generators, RAIN_LANES per chunk (see updateRainScalar()).
+	void* memory;		// The block x to lines are carved from, before aligning it to a cache line.
+	float boxX, boxZ;	// World position of the box's corner.
+	float shiftX, shiftZ;	// How far the box moved at the last centerRainBox(), which the drops move back by.
+} rainfield_t;
+
+// A batch of work for the worker pool: run(context, item) for every item from 0 to
+// itemCount - 1, each on whichever thread claims it first (see startWorkerJob()).
+typedef struct {
+	void (*run)(void* context, int item);
+	void* context;
+	int itemCount;
+	volatile long nextItem;		// The next item to claim, with atomicFetchAdd.
+	int workersWoken;			// How many of the pool's threads were handed the job.
+} workerjob_t;
+
+// Threads that sleep until a job is started, then help the thread that started it through it.
+typedef struct {
+	int threadCount;
+	threadhandle_t threads[MAX_WORKER_THREADS];
+	semaphore_t wake;			// Posted once for every worker a job is handed to.
+	semaphore_t done;			// Posted by each of those workers once nothing is left to claim.
+	workerjob_t* job;			// The job being run (written before wake is posted).
+	volatile long running;		// Cleared by stopWorkerPool().
+} workerpool_t;
+
+// The rain update handed to the worker pool, one chunk of field per item.
+typedef struct {
+	rainfield_t* field;
+	float* lines;
+} rainupdate_t;
+
+// Kinds of particle effect, each with its own pool (see particleKinds).
+typedef enum {
+	PARTICLE_DUST,		// Raised by the rotors' downwash near the ground.
+	PARTICLE_EXHAUST,	// Smoke from the tanks.
+	PARTICLE_SPLASH,	// Rain hitting the ground.
+	NUM_PARTICLE_TYPES
+} particletype_t;
+
+typedef struct {
+	float position[3];
+	float velocity[3];		// Units per second.
+	float age;				// Seconds since it was spawned.
+	float life;				// Seconds it lasts.
+} particle_t;
+
+// How one kind of particle looks and moves.
+typedef struct {
+	const char* name;
+	int budget;				// Size of the kind's pool: the most that can be alive at once.
+	float life;				// Longest a particle lasts (seconds); each gets between half this and all of it.
+	float gravity;			// Added to the upward velocity every second (negative falls).
+	float drag;				// Fraction of the velocity lost every second.
+	float pointSize;		// In pixels.
+	GLfloat color[4];		// The alpha fades to nothing over a particle's life.
+} particlekind_t;
+
+// One kind's particles, the live ones packed at the start (see moveParticles()).
+typedef struct {
+	particle_t* particles;	// particleKinds[type].budget of them, allocated by initParticles().
+	int live;
+	float spawnDebt;		// Fraction of a particle the emitter was owed by earlier frames.
+	int spawned;			// This frame.
+	int dropped;			// This frame, for want of room in the pool or under MAX_PARTICLES.
+} particlepool_t;
+
+typedef struct {
+	particlepool_t pools[NUM_PARTICLE_TYPES];
+	int live;					// Across every pool; never more than MAX_PARTICLES.
+	float spawnScale;			// Emitters' share of their full rate, cut while frames run over budget.
+	unsigned int seed;			// For particleRandom().
+	float* vertices;			// MAX_PARTICLES vertices for drawParticles() to fill.
+	int* nearTanks;				// Scratch for emitTankExhaust(): the tanks close enough to smoke.
+	int exhaustCursor;			// The tank in nearTanks to smoke next.
+	unsigned long long lastUpdate;	// When updateParticles() last ran (ns), 0 before the first frame.
+} particlesystem_t;
+
+// Kinds of keyboard input that can be queued, recorded and replayed.
+typedef enum {
+	INPUT_KEY_PRESSED,
+	INPUT_KEY_RELEASED,
+	INPUT_SPECIAL_PRESSED,
+	INPUT_SPECIAL_RELEASED
+} inputeventtype_t;
+
+// One keyboard event, stamped with the simulation tick it takes effect on.
+typedef struct {
+	unsigned int tick;		// Applied just before this think() tick runs.
+	unsigned char type;		// inputeventtype_t.
+	unsigned char key;		// Lowercase character for KEY events, GLUT_KEY_* code for SPECIAL events.
+} inputevent_t;
+
+// Timed sections of each frame, reported by the profiler HUD and CSV export.
+typedef enum {
+	PASS_THINK,
+	PASS_GRID,
+	PASS_MODELS,				// Culling, picking levels of detail and queueing every model; no GL drawing.
+	PASS_RENDER_QUEUE,			// Drawing every model, impostors included.
+	PASS_RAIN,
+	PASS_PARTICLES,
+	NUM_PASSES
+} profilepass_t;
+
+// One timing measurement, written by whichever thread ran the pass.
+typedef struct {
+	volatile long sequence;		// Ring index + 1 once the sample is complete; readers skip anything else.
+	int pass;					// profilepass_t.
+	unsigned long long duration;	// CPU time spent in the pass (ns).
+} profilesample_t;
+
+// Per-pass totals for the most recent PROFILE_WINDOW_FRAMES frames.
+typedef struct {
+	unsigned long long cpuTime[PROFILE_WINDOW_FRAMES];	// Per-frame CPU time (ns).
+	unsigned long long gpuTime[PROFILE_WINDOW_FRAMES];	// Per-frame GPU time (ns), when GPU profiling is on.
+	unsigned long long cpuThisFrame;						// Collected so far for the frame being drawn.
+	unsigned long long cpuPending[2];					// CPU time of the last two frames, waiting for their GPU time.
+} passstats_t;
+
+// The parts of the world state that display() draws from. Positions and angles are blended
+// between two simulation ticks; the flags are taken from the newer tick.
+typedef struct {
+	float objectLocation[3];
+	float objectRotation[3];
+	float tankPosition[3];
+	float tankRotation;
+	float propellerRotationAngle;
+	float cameraLookAt[3];
+	int renderFill;
+	int rainActive;
+	float rotorSpeed;
+} interpstate_t;
+
+// A grid of ground cells as indexed triangles in buffer objects, built by buildGroundMesh().
+typedef struct {
+	GLuint vertexBuffer;		// Interleaved x, y, z, s, t floats.
+	GLuint indexBuffer;			// Triangle indices, followed by the wireframe's line indices.
+	float size;					// Size and divisions the buffers were last built for.
+	int divisions;
+	int triangleIndexCount;
+	int lineIndexCount;
+} groundmesh_t;
+
+// Static models compiled once by initMeshes(), and drawn by handle with drawMesh().
+typedef enum {
+	MESH_TREE,
+	MESH_HOUSE,
+	MESH_TANK,
+	MESH_AIRFRAME,
+	MESH_ROTOR,
+	MESH_HANGAR,
+	MESH_AIRSTRIP,
+	NUM_MESHES
+} meshid_t;
+
+// Limits for a single model (see meshbuilder_t).
+#define MESH_MAX_PARTS 16
+#define MESH_MATRIX_DEPTH 8
+#define MAX_PRIMITIVES 32
+#define MAX_MESH_MATERIALS 256		// Distinct materials across the registry (see internMeshMaterial()); fits in a render key.
+#define MAX_IMPOSTOR_RUNS 4			// Instance groups with impostors queued in one frame.
+
+// Vertex attribute slots for the per-instance data. Slots 0-5 and 8 up can alias the
+// built-in gl_Vertex, gl_Normal, gl_Color etc. on some drivers, so these stay clear of them.
+#define INSTANCE_PLACEMENT_ATTRIBUTE 6
+#define INSTANCE_TINT_ATTRIBUTE 7
+
+// Vertex attribute slots the per-pixel lighting shaders read a vertex from. They're the slots
+// those drivers alias gl_Vertex, gl_Normal, gl_Color and gl_MultiTexCoord0 to, so nothing clashes.
+#define SHADER_POSITION_ATTRIBUTE 0
+#define SHADER_NORMAL_ATTRIBUTE 2
+#define SHADER_COLOR_ATTRIBUTE 3
+#define SHADER_TEXCOORD_ATTRIBUTE 8
+
+// Lights the per-pixel lighting shaders' Frame block has room for (fixed-function stops at 8).
+#define MAX_SHADER_LIGHTS 16
+#define FRAME_BLOCK_BINDING 0		// Uniform buffer binding point of the Frame block.
+
+// A vertex as stored in a mesh's vertex buffer, interleaved (see bindMeshArrays()).
+typedef struct {
+	float position[3];
+	float normal[3];
+	float texCoord[2];
+	GLubyte color[4];
+} meshvertex_t;
+
+// The surface state a model's drawing code had set up for a run of its triangles.
+typedef struct {
+	GLuint texture;				// 0 when texturing was off.
+	int colorMaterial;			// Ambient and diffuse follow the vertex colour (GL_COLOR_MATERIAL).
+	GLfloat ambient[4];			// Only used when colorMaterial is 0.
+	GLfloat diffuse[4];
+	GLfloat specular[4];
+	GLfloat shininess;
+} meshmaterial_t;
+
+// A range of a mesh's triangle indices that share one material.
+typedef struct {
+	meshmaterial_t material;
+	int materialId;				// Index in meshMaterials, set by initMeshes(); parts with equal materials share it.
+	int firstIndex;
+	int indexCount;
+} meshpart_t;
+
+/*
+	Collects a model as indexed triangles instead of drawing it. The builder*() functions
+	mirror the OpenGL calls of the same name, including the matrix stack and the current
+	normal, texture coordinate and colour, so drawing code can be pointed at a builder
+	almost line for line.
+*/
+typedef struct {
+	meshvertex_t* vertices;
+	int vertexCount;
+	int vertexCapacity;
+	GLuint* indices;
+	int indexCount;
+	int indexCapacity;
+	meshpart_t parts[MESH_MAX_PARTS];
+	int partCount;
+	float matrix[MESH_MATRIX_DEPTH][16];	// Column-major, like OpenGL's.
+	int matrixDepth;
+	float normal[3];
+	int normalSet;				// No normal has been given yet (see builderEnd()).
+	float texCoord[2];
+	GLubyte color[4];
+	meshmaterial_t material;	// Material for the next primitive (texture is filled in from the two below).
+	GLuint boundTexture;
+	int textureEnabled;
+	GLenum primitive;			// Mode passed to builderBegin().
+	int primitiveStart;			// First vertex of the current primitive.
+	int failed;					// Ran out of memory, or overflowed the matrix stack or part list.
+	float detail;				// Fraction of the slices and stacks asked for that curved shapes get.
+} meshbuilder_t;
+
+// One tessellation of a model: a run of parts in its registry entry's buffers.
+typedef struct {
+	meshpart_t parts[MESH_MAX_PARTS];
+	int partCount;
+	int triangleCount;
+} meshlod_t;
+
+// One entry in the mesh registry: the function that builds the model, and the buffers it was built into.
+typedef struct {
+	const char* name;
+	void (*build)(meshbuilder_t* builder);
+	GLuint vertexBuffer;		// 0 without buffer objects, in which case vertices and indices are
+	GLuint indexBuffer;			// drawn straight from memory.
+	meshvertex_t* vertices;
+	GLuint* indices;
+	int vertexCount;			// All levels together.
+	int indexCount;
+	meshlod_t lods[MESH_LOD_LEVELS];	// Finest first.
+	float radius;				// Bounding sphere about the model's origin, for picking a level.
+	float boxMin[3];			// Bounding box in the model's own frame.
+	float boxMax[3];
+} meshentry_t;
+
+// Pictures of a mesh from IMPOSTOR_VIEWS angles, for drawing far-away copies of it as single quads.
+typedef struct {
+	meshid_t mesh;
+	GLuint texture;				// The views side by side, left to right; 0 when impostors are off.
+	float halfWidth;			// Quad size in the model's units, before each copy's scale.
+	float bottom;
+	float top;
+	float* vertices;			// Quads built by drawImpostors() (IMPOSTOR_VERTEX_FLOATS per corner).
+	int capacity;				// Quads vertices has room for.
+} impostor_t;
+
+// One placed copy of a mesh, laid out as the two vec4 attributes the instancing shader reads.
+typedef struct {
+	float position[3];
+	float yaw;					// Degrees about +y.
+	float tint[3];				// Multiplies the model's ambient and diffuse colours.
+	float scale;				// Uniform scale.
+} meshinstance_t;
+
+// Shapes in the primitive cache (see cachedPrimitive()).
+typedef enum {
+	PRIMITIVE_SPHERE
+} primitivetype_t;
+
+// A unit-sized shape, tessellated once and scaled into place by drawPrimitive().
+typedef struct {
+	primitivetype_t type;
+	int slices;
+	int stacks;
+	GLuint vertexBuffer;		// 0 without buffer objects, in which case vertices and indices are
+	GLuint indexBuffer;			// drawn straight from memory.
+	meshvertex_t* vertices;
+	GLuint* indices;
+	int indexCount;
+} primitive_t;
+
+// Every copy of one mesh, queued together by queueInstanceGroup().
+typedef struct {
+	meshid_t mesh;
+	meshinstance_t* instances;
+	int count;
+	GLuint buffer;				// Per-instance attributes for the instanced path, or 0.
+	int dirty;					// instances has changed since it was last copied to buffer.
+	unsigned char* lods;		// Bucket each instance was last sorted into (see INSTANCE_BUCKETS).
+	meshinstance_t* drawOrder;	// The instances sorted by bucket; the mesh levels are copied to buffer.
+	int levelStart[INSTANCE_BUCKETS];
+	int levelCount[INSTANCE_BUCKETS];
+	impostor_t* impostor;		// Stands in for far-away copies, or NULL.
+	int spatialFirst;			// sceneIndex entry of the first instance; the rest follow in order.
+} instancegroup_t;
+
+/*
+	A shader program and its uniform locations (see getShaderUniforms()). Uniforms a
+	program doesn't have are -1, which glUniform*() ignores.
+*/
+typedef struct {
+	GLuint program;				// 0 when the program isn't in use.
+	GLint lightEnabled;			// Only the fixed-function-style instancing shader has these two.
+	GLint fogEnabled;
+	GLint useTexture;
+	GLint colorMaterial;
+	GLint ambient;
+	GLint diffuse;
+	GLint specular;
+	GLint shininess;
+	GLint texture;
+	GLint modelView;			// Only the per-pixel lighting shaders have these two.
+	GLint normalMatrix;
+	GLint modelTint;			// Only the per-pixel lighting shader without instancing has this.
+} shaderprogram_t;
+
+/*
+	The fixed-function light colours as they were before the batched fallback started
+	tinting copies (see tintLightColors()). Only lights that were on are kept.
+*/
+typedef struct {
+	int saved;
+	GLfloat sceneAmbient[4];
+	int lightCount;
+	GLenum lights[8];			// Fixed-function OpenGL guarantees 8 lights.
+	GLfloat ambient[8][4];
+	GLfloat diffuse[8][4];
+	float tint[3];				// Tint the colours are currently scaled by.
+} lightcolors_t;
+
+// One light in the Frame block, laid out by std140 rules (see frameBlockSource).
+typedef struct {
+	GLfloat position[4];		// Eye space; w is 0 for a directional light.
+	GLfloat ambient[4];
+	GLfloat diffuse[4];
+	GLfloat specular[4];
+	GLfloat spotDirection[4];	// Eye space; w unused.
+	GLfloat spotCosCutoff;		// -1 when GL_SPOT_CUTOFF is 180 (not a spotlight).
+	GLfloat spotExponent;
+	GLfloat enabled;			// Filled in by uploadFrameBlock().
+	GLfloat padding;
+	GLfloat attenuation[4];		// Constant, linear and quadratic; w unused.
+} shaderlight_t;
+
+// The per-pixel lighting shaders' Frame uniform block, laid out by std140 rules.
+typedef struct {
+	GLfloat projection[16];
+	GLfloat ambient[4];			// GL_LIGHT_MODEL_AMBIENT.
+	GLfloat fogColor[4];
+	GLfloat fogStart;
+	GLfloat fogEnd;
+	GLfloat fogEnabled;			// Filled in by uploadFrameBlock().
+	GLint lightCount;			// One past the highest light set through sceneLightfv().
+	shaderlight_t lights[MAX_SHADER_LIGHTS];
+} frameblock_t;
+
+// One draw waiting in the render queue: a part of a mesh, either one copy or a run of an instance group's copies.
+typedef struct {
+	unsigned long long key;		// Sort order, from renderKey().
+	meshid_t mesh;
+	int level;
+	int part;					// Index in the level's parts.
+	const instancegroup_t* group;	// NULL for a single copy.
+	int first;					// Run of group->drawOrder to draw.
+	int count;
+	float matrix[16];			// Modelview matrix when the item was queued.
+} renderitem_t;
+
+// The copies of an instance group drawn as impostors, queued for flushRenderQueue() to draw after the items.
+typedef struct {
+	const instancegroup_t* group;	// Its INSTANCE_IMPOSTOR bucket is drawn.
+	float matrix[16];				// Modelview matrix when the run was queued.
+} impostorrun_t;
+
+// This frame's draws, collected by the queue*() functions and drawn in sorted order by flushRenderQueue().
+typedef struct {
+	renderitem_t* items;
+	int count;
+	int capacity;
+	impostorrun_t impostors[MAX_IMPOSTOR_RUNS];
+	int impostorCount;
+} renderqueue_t;
+
+// Draws and state changes for one flush of the render queue, shown on the profiler HUD.
+typedef struct {
+	int items;
+	int shaderSwitches;
+	int arrayBinds;			// A different mesh's vertex arrays.
+	int textureBinds;		// Including turning texturing on or off.
+	int materialChanges;
+} renderstats_t;
+
+// A view frustum as six inward-facing planes (a, b, c, d): a point is inside when ax + by + cz + d >= 0 for all six.
+typedef struct {
+	float planes[6][4];
+} frustum_t;
+
+// What an entry in a spatialindex_t stands for.
+typedef enum {
+	SPATIAL_TREE,
+	SPATIAL_HOUSE,
+	SPATIAL_TANK,
+	SPATIAL_HANGAR,
+	SPATIAL_AIRSTRIP,
+	NUM_SPATIAL_KINDS
+} spatialkind_t;
+
+// One object's bounding box in a spatialindex_t.
+typedef struct {
+	float position[3];			// Where the object stands; its box moves with it.
+	float boxMin[3];			// World space.
+	float boxMax[3];
+	spatialkind_t kind;
+	int instance;				// Instance in the kind's group, or -1 for the copy display() draws on its own.
+	int cell;					// Cell whose list it's in, or -1 for the oversized list.
+	int prev;					// Neighbours in that list, or -1.
+	int next;
+	unsigned int stamp;			// Last ray query that tested it, so it's only tested once.
+	unsigned int visibleFrame;	// Last frame cullScene() found it in the view frustum.
+} spatialentry_t;
+
+/*
+	A loose uniform grid over the XZ plane, for finding objects in view, near a point
+	or along a ray without testing every one. Each entry is listed in the cell holding
+	the centre of its box, so it can reach up to half a cell (the widest box allowed)
+	into the neighbouring cells; queries allow for that. Wider entries, and any centred
+	off the grid, go in one oversized list that every query tests.
+*/
+typedef struct {
+	float originX, originZ;		// Corner of cell 0.
+	int cellsX, cellsZ;
+	int* cells;					// First entry in each cell's list, or -1.
+	int oversized;				// First entry in the oversized list, or -1.
+	spatialentry_t* entries;
+	int count;
+	int capacity;
+	float minY, maxY;			// Vertical extent of every entry so far (the cells' height for frustum tests).
+	unsigned int stamp;			// Bumped by every ray query.
+} spatialindex_t;
+
+// What drawGround() drew in the most recent frame, shown on the profiler HUD.
+typedef struct {
+	int chunksDrawn;
+	int chunksCulled;		// Within range of the camera, but outside the view frustum.
+	int trianglesDrawn;
+} groundstats_t;
+
+// What the mesh registry drew in the most recent frame, shown on the profiler HUD.
+typedef struct {
+	int copiesDrawn[MESH_LOD_LEVELS];
+	int impostorsDrawn;
+	int trianglesDrawn;
+	int trianglesSaved;		// Compared with drawing every copy at the finest level.
+} meshlodstats_t;
+
+// What view-frustum culling kept and skipped in the most recent frame, shown on the profiler HUD.
+// Ground chunks are counted in groundstats_t instead.
+typedef struct {
+	int objectsDrawn;		// Every model copy, the hangar, the airstrip and the origin marker.
+	int objectsCulled;
+	int rainDrawn;			// Rain isn't culled: the GPU clips the lines for less than testing them would cost.
+} cullstats_t;
+
+/*
+	What the state cache last set, so calls that wouldn't change anything can be
+	dropped. Only state set through the cached*() functions is known; everything else
+	in here starts unknown (see resetStateCache()) and its next call always goes through.
+*/
+typedef struct {
+	unsigned char capKnown[STATE_CACHE_CAPS];
+	unsigned char capEnabled[STATE_CACHE_CAPS];
+	GLuint texture;				// Bound to GL_TEXTURE_2D.
+	unsigned char textureKnown;
+	GLfloat material[2][4][4];	// Front and back: ambient, diffuse, specular, shininess.
+	unsigned char materialKnown[2][4];
+	GLfloat fog[5][4];			// Colour, mode, start, end, density.
+	unsigned char fogKnown[5];
+	GLenum fogHint;
+	unsigned char fogHintKnown;
+} statecache_t;
+
+// Calls through the state cache in the most recent frame, shown on the profiler HUD.
+typedef struct {
+	int callsMade;			// Passed on to the driver.
+	int callsSkipped;		// Dropped because they matched the cached state.
+} statecachestats_t;
+
+// What drawAircraft() submitted in the most recent frame, shown on the profiler HUD.
+typedef struct {
+	int drawCalls;
+	int verticesSubmitted;	// Indices drawn, counting shared vertices once per triangle.
+} aircraftstats_t;
+
+// Where every tank in the fleet is at one tick, one array per field (indexed like tankGroup's instances).
+typedef struct {
+	float* x;
+	float* z;
+	float* heading;		// Degrees about the y axis; 0 drives towards -z.
+} tankposes_t;
+
+// The tanks driving around the map, stored as parallel arrays so think() can sweep
+// through thousands of them. Set up by initTankFleet(), drawn from tankGroup.
+typedef struct {
+	int count;
+	tankposes_t pose;
+	float* speed;		// Forward speed (units per second).
+	float* turnRate;	// Degrees per second; negative turns the other way.
+} tankfleet_t;
+
+// An immutable copy of the world published after a simulation tick, for display() to draw.
 typedef struct {
-	float x, y, z;  // Position of the raindrop
-	float speed;    // Falling speed
-} Raindrop;
+	interpstate_t previous;			// World state before the newest tick.
+	interpstate_t current;			// World state after the newest tick.
+	tankposes_t previousTanks;		// The fleet before and after the newest tick.
+	tankposes_t currentTanks;
+	unsigned int tick;				// simulationTicks after the newest tick.
+	unsigned long long tickTime;	// When the newest tick was due (ns, from pacingNowNs()).
+} worldsnapshot_t;
 
 // Current state of all keys used to control our "player-controlled" object's motion.
 motionkeys_t motionKeyStates = {
@@ -132,6 +1081,8 @@ motionstate4_t keyboardMotion = { MOTION_NONE, MOTION_NONE, MOTION_NONE, MOTION_
 #define KEY_EXIT			27 // Escape key.
 
 #define KEY_CHANGE_VIEW 'v'
+#define KEY_PACING_MODE 'p'
+#define KEY_PROFILER_HUD 'h'
 
 // Define all GLUT special keys used for input (add any new key definitions here).
 
@@ -154,31 +1105,44 @@ void idle(void);
 
 void drawOriginMarker(void);
 void drawXZGrid(float size, int divisions);
+void drawXZGridImmediate(float size, int divisions);
+void drawGroundChunkImmediate(float x, float z, int divisions);
+void applyGroundState(void);
+void drawGround(void);
 
 void drawSkybox(float size);
 
-void drawHouse(float width, float height, float depth);
+void buildHouse(meshbuilder_t* builder, float width, float height, float depth);
 void applyMetallicMaterial();
 void drawAircraft();
+void buildAirframeMesh(meshbuilder_t* builder);
+void buildRotorMesh(meshbuilder_t* builder);
 
-void drawTree(float trunkHeight, float trunkRadius, float foliageHeight, float foliageRadius);
+void buildTree(meshbuilder_t* builder, float trunkHeight, float trunkRadius, float foliageHeight, float foliageRadius);
 
 void setupFog();
 
-void drawAirplaneParkingHall(float radius, float height);
+void buildAirplaneParkingHall(meshbuilder_t* builder, float radius, float height);
+void buildHangarMesh(meshbuilder_t* builder);
 
-void drawAirstrip(float width, float length, float thickness);
+void buildAirstrip(meshbuilder_t* builder, float width, float length, float thickness);
+void buildAirstripMesh(meshbuilder_t* builder);
 
-void drawTank(float topWidth, float bottomWidth, float height, float depth);
-void drawFrontBackPart(float topWidth, float bottomWidth, float height, float depth, float cylinderRadius, float cylinderLength);
+void buildTank(meshbuilder_t* builder, float topWidth, float bottomWidth, float height, float depth);
+void buildFrontBackPart(meshbuilder_t* builder, float topWidth, float bottomWidth, float height, float depth, float cylinderRadius, float cylinderLength);
 
-void createTreeDisplayList();
+void buildTreeMesh(meshbuilder_t* builder);
 void drawMultipleTrees();
 
-void createHouseDisplayList();
+void buildHouseMesh(meshbuilder_t* builder);
 void drawMultipleHouses();
 
-void createTankDisplayList();
+void buildTankMesh(meshbuilder_t* builder);
+void applyTankTransform(void);
+int allocTankPoses(tankposes_t* poses, int count);
+void copyTankPoses(tankposes_t* to, const tankposes_t* from);
+int initTankFleet(void);
+void moveTankFleet(void);
 void drawMultipleTanks();
 void setupNightMode();
 
@@ -186,7 +1150,8 @@ void setupNightMode();
  * Animation-Specific Function Prototypes (add your own here)
  ******************************************************************************/
 
-void main(int argc, char** argv);
+int main(int argc, char** argv);
+void parseCommandLine(int argc, char** argv);
 void init(void);
 void think(void);
 void initLights(void);
@@ -195,9 +1160,222 @@ void loadTextures(void);
 
 int isGrounded();
 
+int initRainField(rainfield_t* field, int count);
+void centerRainBox(rainfield_t* field, float x, float z);
+void freeRainField(rainfield_t* field);
+void updateRainScalar(rainfield_t* field, float* lines, int chunk);
+#ifdef RAIN_SIMD
+void updateRainSimd(rainfield_t* field, float* lines, int chunk);
+#endif
 void initializeRain();
-void updateRain();
+void freeRain(void);
+void updateRainChunk(void* context, int chunk);
+void startRainUpdate();
+void finishRainUpdate();
 void drawRain();
+int rainFieldsMatch(const rainfield_t* a, const rainfield_t* b);
+void runRainBenchmark(void);
+void initParticles(void);
+void freeParticles(void);
+float particleRandom(void);
+particle_t* spawnParticle(particletype_t type);
+int particlesDue(particletype_t type, float count);
+void adjustParticleSpawnScale(unsigned long long frameCost);
+void moveParticles(particletype_t type, float seconds);
+void emitDownwashDust(float seconds);
+void emitTankExhaust(float seconds);
+void emitRainSplashes(float seconds);
+void updateParticles(void);
+void drawParticles(void);
+
+unsigned long long pacingNowNs(void);
+void pacingSleepNs(unsigned long long duration);
+#ifdef _WIN32
+void restoreTimerPeriod(void);
+#endif
+void pacingWaitUntil(unsigned long long deadline);
+void pacingWaitForNextFrame(void);
+void recordFrameTime(unsigned long long frameTime);
+unsigned long long frameTimePercentile(const unsigned int* buckets, unsigned long long count, double percentile);
+void dumpFrameTimeHistogram(void);
+
+void simulationTick(void);
+void publishWorldSnapshot(unsigned long long tickTime);
+const worldsnapshot_t* latestWorldSnapshot(void);
+int startSimulationThread(void);
+void stopSimulationThread(void);
+void runSimulationLoop(void);
+int semaphoreInit(semaphore_t* semaphore);
+void semaphorePost(semaphore_t* semaphore);
+void semaphoreWait(semaphore_t* semaphore);
+void semaphoreDestroy(semaphore_t* semaphore);
+int processorCount(void);
+int startWorkerPool(workerpool_t* pool, int threadCount);
+void stopWorkerPool(workerpool_t* pool);
+void stopWorkerThreads(void);
+void runWorkerJobItems(workerjob_t* job);
+void runWorker(workerpool_t* pool);
+void startWorkerJob(workerpool_t* pool, workerjob_t* job);
+void finishWorkerJob(workerpool_t* pool, workerjob_t* job);
+void queueInputEvent(inputeventtype_t type, unsigned char key);
+void applyQueuedInput(void);
+void applyInputEvent(const inputevent_t* event);
+void positionSpotlight(void);
+void resetFrameBlock(void);
+void sceneLightfv(GLenum light, GLenum pname, const GLfloat* params);
+void sceneLightf(GLenum light, GLenum pname, GLfloat param);
+void sceneLightModelfv(GLenum pname, const GLfloat* params);
+void uploadFrameBlock(void);
+
+int startInputRecording(const char* fileName);
+void recordInputEvent(const inputevent_t* event);
+void finishInputRecording(void);
+int loadInputRecording(const char* fileName);
+int runReplay(int renderFrames);
+unsigned long long hashSimulationState(void);
+
+void loadGLExtensions(void);
+int glVersionAtLeast(int major, int minor);
+int hasGLExtension(const char* name);
+
+void resetStateCache(void);
+int stateCacheCapIndex(GLenum cap);
+int stateCacheMatches(GLfloat* cached, unsigned char* known, const GLfloat* values, int count);
+void setCachedCapability(GLenum cap, int enabled);
+void cachedEnable(GLenum cap);
+void cachedDisable(GLenum cap);
+void cachedBindTexture(GLuint texture);
+void cachedMaterialfv(GLenum face, GLenum pname, const GLfloat* params);
+void cachedMaterialf(GLenum face, GLenum pname, GLfloat param);
+void cachedFogfv(GLenum pname, const GLfloat* params);
+void cachedFogf(GLenum pname, GLfloat param);
+void cachedFogi(GLenum pname, GLint param);
+void cachedFogHint(GLenum mode);
+
+void initGpuProfiler(void);
+void readGpuProfileResults(void);
+
+int buildGroundMesh(groundmesh_t* mesh, float origin, float size, int divisions, float texturesPerUnit);
+void bindGroundMesh(const groundmesh_t* mesh);
+void drawGroundMesh(const groundmesh_t* mesh);
+void unbindGroundMesh(void);
+int buildGroundChunks(void);
+void runGridBenchmark(void);
+
+void initMeshBuilder(meshbuilder_t* builder);
+void freeMeshBuilder(meshbuilder_t* builder);
+int builderReserve(meshbuilder_t* builder, int vertices, int indices);
+void builderMultMatrix(meshbuilder_t* builder, const float m[16]);
+void builderPushMatrix(meshbuilder_t* builder);
+void builderPopMatrix(meshbuilder_t* builder);
+void builderTranslatef(meshbuilder_t* builder, float x, float y, float z);
+void builderRotatef(meshbuilder_t* builder, float angle, float x, float y, float z);
+void builderScalef(meshbuilder_t* builder, float x, float y, float z);
+void builderNormal3f(meshbuilder_t* builder, float x, float y, float z);
+void builderTexCoord2f(meshbuilder_t* builder, float s, float t);
+void builderColor3f(meshbuilder_t* builder, float red, float green, float blue);
+void builderEnableTexture(meshbuilder_t* builder, int enabled);
+void builderBindTexture(meshbuilder_t* builder, GLuint texture);
+void builderColorMaterial(meshbuilder_t* builder, int enabled);
+void builderMaterialfv(meshbuilder_t* builder, GLenum pname, const GLfloat* params);
+void builderMaterialf(meshbuilder_t* builder, GLenum pname, GLfloat param);
+void builderBegin(meshbuilder_t* builder, GLenum mode);
+void builderVertex3f(meshbuilder_t* builder, float x, float y, float z);
+meshpart_t* builderCurrentPart(meshbuilder_t* builder);
+void builderEnd(meshbuilder_t* builder);
+void builderCylinder(meshbuilder_t* builder, float baseRadius, float topRadius, float height, int slices, int stacks, int textured);
+void builderDisk(meshbuilder_t* builder, float innerRadius, float outerRadius, int slices, int loops, int textured);
+void builderCone(meshbuilder_t* builder, float base, float height, int slices, int stacks);
+void builderSphere(meshbuilder_t* builder, float radius, int slices, int stacks, int textured);
+void builderCube(meshbuilder_t* builder, float size);
+int builderDivisions(const meshbuilder_t* builder, int divisions, int minimum);
+
+primitive_t* cachedPrimitive(primitivetype_t type, int slices, int stacks);
+void drawPrimitive(const primitive_t* primitive, float x, float y, float z);
+void drawSphere(float radius, int slices, int stacks);
+void freePrimitives(void);
+
+int initMeshes(void);
+void bindMeshArrays(const meshentry_t* mesh);
+const void* meshIndices(const meshentry_t* mesh, const meshpart_t* part);
+void applyMeshTexture(GLuint texture);
+void applyMeshColors(const meshmaterial_t* material);
+void applyMeshMaterial(const meshmaterial_t* material);
+void unbindMeshArrays(void);
+int selectMeshLod(meshid_t mesh, const float position[3], float scale, int current);
+void drawMesh(meshid_t mesh, int level);
+void countMeshLod(meshid_t mesh, int level, int copies);
+int internMeshMaterial(const meshmaterial_t* material);
+void beginRenderQueue(void);
+unsigned long long renderKey(int shader, GLuint texture, int material, meshid_t mesh, float depth);
+renderitem_t* pushRenderItem(meshid_t mesh, int level, int part);
+void queueMesh(meshid_t mesh, int level);
+void queueMeshAt(meshid_t mesh, const float position[3]);
+void countRenderStateChanges(const renderitem_t* items, int count, renderstats_t* stats);
+int compareRenderItems(const void* a, const void* b);
+void flushRenderQueue(void);
+void freeMeshes(void);
+
+GLuint buildShaderProgram(const char* name, const char* header, const char* vertexSource, const char* fragmentSource,
+	const char* const* attributes, const GLuint* attributeSlots, int attributeCount);
+GLuint buildLightingProgram(const char* name, int instanced);
+void getShaderUniforms(shaderprogram_t* program);
+void initShaderLighting(void);
+void normalMatrixOf(const float modelView[16], float normal[9]);
+void setShaderMatrices(const shaderprogram_t* program, const float modelView[16]);
+void loadShaderModelView(const shaderprogram_t* program);
+void placeInstanceMatrix(const float matrix[16], const meshinstance_t* instance, float placed[16]);
+void saveLightColors(lightcolors_t* colors);
+void tintLightColors(lightcolors_t* colors, const float tint[3]);
+void applyShaderMaterial(const shaderprogram_t* program, const meshmaterial_t* material);
+void bindMeshAttributes(const meshentry_t* mesh);
+void bindGroundAttributes(const groundmesh_t* mesh);
+void unbindShaderAttributes(void);
+int initInstanceGroups(void);
+int sortInstancesByLod(instancegroup_t* group);
+int useImpostor(const instancegroup_t* group, const float position[3], int wasImpostor);
+void initImpostors(void);
+int bakeImpostor(impostor_t* impostor);
+void drawImpostors(impostor_t* impostor, const meshinstance_t* instances, int count);
+void queueInstanceGroup(instancegroup_t* group);
+
+void buildViewFrustum(frustum_t* frustum, const float eye[3], const float target[3], float aspect);
+int frustumIntersectsBox(const frustum_t* frustum, const float boxMin[3], const float boxMax[3]);
+int frustumIntersectsSphere(const frustum_t* frustum, const float center[3], float radius);
+int sphereVisible(const float center[3], float radius);
+
+int initSpatialIndex(spatialindex_t* index, float minX, float minZ, float maxX, float maxZ, int capacity);
+void freeSpatialIndex(spatialindex_t* index);
+int spatialCellOf(const spatialindex_t* index, const float boxMin[3], const float boxMax[3]);
+void spatialFitHeight(spatialindex_t* index, const spatialentry_t* entry);
+void spatialLink(spatialindex_t* index, int id);
+void spatialUnlink(spatialindex_t* index, int id);
+int spatialInsert(spatialindex_t* index, spatialkind_t kind, int instance, const float position[3], const float boxMin[3], const float boxMax[3]);
+void spatialMove(spatialindex_t* index, int id, const float position[3]);
+int spatialQueryFrustum(const spatialindex_t* index, const frustum_t* frustum, int* results, int maxResults);
+int spatialEntryWithin(const spatialentry_t* entry, const float center[3], float radius);
+int spatialQueryRadius(const spatialindex_t* index, const float center[3], float radius, int* results, int maxResults);
+void spatialRayTest(const spatialindex_t* index, int id, const float origin[3], const float direction[3], float* nearest, int* hit);
+int spatialQueryRay(spatialindex_t* index, const float origin[3], const float direction[3], float maxDistance, float* hitDistance);
+void meshBounds(meshid_t id, const float position[3], float scale, float boxMin[3], float boxMax[3]);
+int initSceneIndex(void);
+void placeTanks(const worldsnapshot_t* snapshot, float alpha);
+void cullScene(void);
+int sceneEntryVisible(int id);
+float benchmarkRandom(unsigned int* seed);
+void runSpatialBenchmark(void);
+
+int passGpuTimed(profilepass_t pass);
+void profileBegin(profilepass_t pass);
+void profileEnd(profilepass_t pass);
+void collectProfileSamples(void);
+void drawProfilerHud(void);
+int startProfileCsv(const char* fileName);
+void finishProfileCsv(void);
+
+float lerpAngle(float from, float to, float t);
+void captureInterpolationState(interpstate_t* state);
+void interpolateRenderState(const worldsnapshot_t* snapshot, float alpha);
 
 /******************************************************************************
  * Animation-Specific Setup (Add your own definitions, constants, and globals here)
@@ -218,8 +1396,6 @@ int renderFillEnabled = 1;
 GLint windowWidth = 800;
 GLint windowHeight = 600;
 
-GLUquadricObj* sphereQuadric;
-GLUquadricObj* quadricPtr;
 
 float wingAngle = 0.0f;  // Angle of wing rotation
 int wingDirection = 1;   // Direction of wing movement: 1 for up, -1 for down
@@ -240,6 +1416,7 @@ const GLfloat PALE_GREEN[3] = { 0.596f, 0.984f, 0.596f };
 const GLfloat PALE_ORANGE[3] = { 1.0f, 0.714f, 0.221f };
 const GLfloat BLACK[3] = { 1.0f, 1.0f, 1.0f };
 const GLfloat WHITE[3] = { 0.0f, 0.0f, 0.0f };
+const GLfloat UNTINTED[3] = { 1.0f, 1.0f, 1.0f };	// Tint that leaves a model's colours alone.
 
 float cameraDistance = 5.0f; // Distance of camera from bird
 float cameraHeight = 2.0f; // Height of camera above bird
@@ -261,10 +1438,79 @@ int rotorSpeedLocked = 0;
 float timeGrounded = 0.0f;
 int engineShutdownInitiated = 0;
 
-GLuint treeDisplayList, HouseDisplayList, TankDisplayList;
-
+// Mesh registry (see meshid_t). initMeshes() fills in the rest, and freeMeshes() deletes the buffers on exit.
+meshentry_t meshes[NUM_MESHES] = {
+	{ .name = "tree", .build = buildTreeMesh },
+	{ .name = "house", .build = buildHouseMesh },
+	{ .name = "tank", .build = buildTankMesh },
+	{ .name = "airframe", .build = buildAirframeMesh },
+	{ .name = "rotor", .build = buildRotorMesh },
+	{ .name = "hangar", .build = buildHangarMesh },
+	{ .name = "airstrip", .build = buildAirstripMesh }
+};
 
-Raindrop rain[NUM_RAIN_DROPS];
+// Where the copies of each model stand (x, z). The tanks start out from theirs (see initTankFleet()).
+const float treePlacements[][2] = {
+	// North-west
+	{ -5.0f, -10.0f }, { -14.0f, -15.0f }, { -27.0f, -20.0f }, { -34.0f, -25.0f }, { -25.0f, -30.0f },
+	// North-east
+	{ 6.0f, -20.0f }, { 9.0f, -11.0f }, { 15.0f, -17.0f }, { 23.0f, -27.0f }, { 35.0f, -22.0f }, { 7.0f, -15.0f },
+	// South-west
+	{ -5.0f, 10.0f }, { -14.0f, 15.0f }, { -27.0f, 20.0f }, { -34.0f, 25.0f }, { -25.0f, 30.0f },
+	// South-east
+	{ 6.0f, 10.0f }, { 9.0f, 13.0f }, { 15.0f, 21.0f }, { 23.0f, 24.0f }, { 25.0f, 35.0f }, { 7.0f, 31.0f }
+};
+const float housePlacements[][2] = { { -10.0f, -5.0f }, { 15.0f, 0.0f }, { -10.0f, 5.0f } };
+const float tankPlacements[][2] = { { 30.0f, -5.0f }, { 25.0f, 40.0f }, { -10.0f, 20.0f } };
+const float standaloneTreePosition[3] = { -4.0f, 0.0f, -2.0f };		// The tree and house display() draws on their own.
+const float standaloneHousePosition[3] = { 7.0f, 0.0f, -5.0f };
+
+int extraTreeCount = 0;			// Trees scattered over the ground on top of treePlacements (set with --trees).
+int extraTankCount = 0;			// Tanks scattered over the ground on top of tankPlacements (set with --tanks).
+int instancingRequested = 1;	// Cleared by --no-instancing, to compare against the batched fallback.
+int shaderLightingRequested = 1;	// Cleared by --fixed-function, to compare against per-vertex lighting.
+instancegroup_t treeGroup = { .mesh = MESH_TREE };
+instancegroup_t houseGroup = { .mesh = MESH_HOUSE };
+instancegroup_t tankGroup = { .mesh = MESH_TANK };
+shaderprogram_t instanceProgram;
+shaderprogram_t lightingProgram;	// Per-pixel lighting for everything the render queue and drawGround() draw.
+frameblock_t frameBlock;			// What the Frame block's buffer will get at the next uploadFrameBlock().
+GLuint frameBlockBuffer = 0;
+
+const float meshLodDetail[MESH_LOD_LEVELS] = { 1.0f, 0.5f, 0.25f };	// Fraction of each shape's slices and stacks.
+const float meshLodPixels[MESH_LOD_LEVELS - 1] = { 120.0f, 40.0f };	// Smallest on-screen radius (pixels) for each level but the last.
+int meshLods[NUM_MESHES];		// Level the single copy of each mesh queued with queueMeshAt() was last drawn at.
+meshmaterial_t meshMaterials[MAX_MESH_MATERIALS];	// Every distinct part material, filled by initMeshes().
+int meshMaterialCount = 0;
+renderqueue_t renderQueue;		// Refilled every frame by display(); freed by freeMeshes().
+renderstats_t renderStats;		// The last flush, sorted.
+renderstats_t renderStatsUnsorted;	// What the same flush would have taken in the order it was queued.
+
+float impostorDistance = 50.0f;	// Trees farther than this are drawn as impostors (set with --impostor-distance; 0 turns them off).
+impostor_t treeImpostor = { MESH_TREE };
+
+primitive_t primitiveCache[MAX_PRIMITIVES];	// Filled on demand by cachedPrimitive().
+int primitiveCount = 0;
+
+
+rainfield_t rain;
+int rainDropCount = DEFAULT_RAIN_DROPS;	// Set with --rain-drops.
+GLuint rainBuffers[2] = { 0, 0 };	// Line buffers updateRain() writes to on alternate frames (0 if buffers can't be mapped).
+int rainBufferIndex = 0;			// Which of rainBuffers updateRain() wrote to last.
+GLuint rainDrawBuffer = 0;			// The buffer drawRain() draws from, or 0 for rain.lines.
+int rainLineCount = 0;				// Drops drawRain() has lines for.
+rainupdate_t rainUpdate;			// What startRainUpdate() handed rainJob.
+workerjob_t rainJob;				// The rain update in flight, from startRainUpdate() to finishRainUpdate().
+int rainUpdatePending = 0;			// Set by startRainUpdate() until finishRainUpdate().
+
+particlesystem_t particleSystem;
+const particlekind_t particleKinds[NUM_PARTICLE_TYPES] = {
+	// name			budget	life	gravity	drag	size	colour
+	{ "dust",		2048,	1.2f,	-1.0f,	1.5f,	4.0f,	{ 0.6f, 0.5f, 0.35f, 0.6f } },
+	{ "exhaust",	2048,	2.5f,	0.4f,	0.8f,	5.0f,	{ 0.25f, 0.25f, 0.25f, 0.5f } },
+	{ "splash",		1024,	0.4f,	-9.8f,	0.0f,	2.0f,	{ 0.7f, 0.7f, 1.0f, 0.8f } }
+};
+unsigned long long displayCpuTime = 0;	// How long the last display() took, up to the buffer swap (ns).
 
 float tankSpeed = 2.0f;        // Tank forward speed
 float tankRotationSpeed = 30.0f; // Tank rotation speed in degrees per second
@@ -272,8 +1518,117 @@ float tankRotationSpeed = 30.0f; // Tank rotation speed in degrees per second
 float tankPosition[3] = { 0.0f, 0.0f, 0.0f }; // X, Y, Z position of the tank
 float tankRotation = 0.0f; // Rotation angle of the tank around the Y-axis
 
+tankfleet_t tankFleet;			// Every tank but the one above, moved by think().
+tankposes_t previousTankPoses;	// The fleet just before the most recent think() call (simulation side).
+
 int rainActive = 0;  // 0 = Rain off, 1 = Rain on
 
+pacingmode_t pacingMode = PACING_CAPPED;
+const char* pacingModeNames[NUM_PACING_MODES] = { "capped", "uncapped", "target-fps" };
+double pacingTargetFps = 60.0;				// Frame rate used by PACING_TARGET_FPS (set with --fps).
+unsigned long long nextFrameDeadline = 0;	// When the next frame should start (ns); 0 = not scheduled yet.
+
+frametimehistogram_t frameTimes;
+const char* frameHistogramFileName = NULL;	// Optional CSV written on exit (set with --frame-histogram).
+
+interpstate_t previousState;  // World state just before the most recent think() call (simulation side).
+interpstate_t renderState;    // Blend of the latest snapshot's two states, drawn by display().
+float renderAlpha = 0.0f;     // How far (0..1) display() should blend, when the simulation runs on the GLUT thread.
+
+unsigned int simulationTicks = 0;	// Number of think() ticks run so far.
+int nightModeApplied = 0;			// Rain state setupNightMode() was last run for (display() keeps it in sync).
+
+// Triple buffer: the simulation side only writes snapshots[snapshotBack], display() only reads
+// snapshots[snapshotFront], and the slot in between is swapped in and out with atomicExchange.
+worldsnapshot_t snapshots[3];
+int snapshotBack = 0;
+volatile long snapshotShared = 1;	// Slot index, plus SNAPSHOT_FRESH when display() hasn't seen it.
+int snapshotFront = 2;
+
+int simulationThreadRequested = 1;			// Cleared with --single-thread.
+volatile long simulationThreadRunning = 0;	// Set while the simulation thread owns think() and the input queue.
+threadhandle_t simulationThread;
+
+int workerThreadCount = -1;					// Set with --workers; -1 means one fewer than the processors.
+workerpool_t workerPool;					// Helps the GLUT thread update the rain.
+
+// Single-producer, single-consumer ring: key callbacks add events on the GLUT thread, and the
+// simulation (on whichever thread runs it) removes them.
+inputevent_t inputQueue[INPUT_QUEUE_SIZE];
+volatile long inputQueueHead = 0;				// Next event to apply (only the consumer writes it).
+volatile long inputQueueTail = 0;				// Where the next event will be queued (only the producer writes it).
+threadLocal int applyingInputEvent = 0;			// Set while queued events are passed back through the key callbacks.
+
+const char* recordFileName = NULL;	// Record keyboard input to this file (set with --record).
+FILE* recordFile = NULL;
+unsigned int recordedEventCount = 0;
+
+const char* replayFileName = NULL;	// Replay keyboard input from this file (set with --replay).
+int replayRender = 0;				// Also render each tick offscreen while replaying (--replay-render).
+inputevent_t* replayEvents = NULL;
+unsigned int replayEventCount = 0;
+unsigned int replayTickCount = 0;
+
+const char* profilePassNames[NUM_PASSES] = {
+	"think", "grid", "models", "draw", "rain", "particles"
+};
+unsigned long long profilePassStart[NUM_PASSES];	// When each pass last began (ns); one writer per pass.
+profilesample_t profileRing[PROFILE_RING_SIZE];		// Lock-free ring: any thread writes, display() reads.
+volatile long profileWriteIndex = 0;				// Next ring slot to claim (only ever increases).
+long profileReadIndex = 0;							// Next ring slot display() will collect.
+passstats_t passStats[NUM_PASSES];
+int profileWindowNext = 0;							// Slot in passstats_t.cpuTime for the current frame.
+int profileWindowCount = 0;							// Number of completed frames in the window.
+unsigned int renderedFrames = 0;
+int profilerHudVisible = 0;							// Toggled with KEY_PROFILER_HUD.
+
+const char* profileCsvFileName = NULL;	// Per-frame pass timings are written here (set with --profile-csv).
+FILE* profileCsvFile = NULL;
+
+int glMajorVersion = 1, glMinorVersion = 0;	// Version of the current context, read by loadGLExtensions().
+int vertexBuffersAvailable = 0;				// OpenGL 1.5 buffer objects can be used (set by loadGLExtensions()).
+int bufferMappingAvailable = 0;				// OpenGL 3.0 glMapBufferRange(), along with buffer objects.
+int shadersAvailable = 0;					// OpenGL 2.0 GLSL shaders can be used (set by loadGLExtensions()).
+int instancingAvailable = 0;				// OpenGL 3.3 instanced arrays, along with shaders and buffer objects.
+int shaderLightingAvailable = 0;			// OpenGL 3.3 GLSL 3.30 shaders and uniform buffers, along with buffer objects.
+int framebuffersAvailable = 0;				// OpenGL 3.0 (or ARB_framebuffer_object) framebuffer objects and glGenerateMipmap().
+
+groundmesh_t groundMesh = { 0, 0, 0.0f, 0, 0, 0 };	// Built on first use by drawXZGrid().
+const GLfloat groundColor[4] = { 0.6f, 0.6f, 0.6f, 1.0f };	// Darkens the grass texture (see applyGroundState()).
+
+float groundSize = 100.0f;									// Width and length of the ground (set with --ground-size).
+int groundChunksPerSide = 0;								// Chunks along each side, set by init().
+groundmesh_t groundChunkMeshes[GROUND_LOD_LEVELS];			// One chunk-sized mesh per level, shared by every chunk.
+const int groundLodDivisions[GROUND_LOD_LEVELS] = { 40, 20, 10, 5 };	// Cells per chunk side (0.5 to 4 units).
+const float groundLodDistances[GROUND_LOD_LEVELS - 1] = { 20.0f, 40.0f, 70.0f };	// Farthest distance for each level but the last.
+groundstats_t groundStats;
+aircraftstats_t aircraftStats;
+meshlodstats_t meshLodStats;
+cullstats_t cullStats;
+statecache_t stateCache;
+statecachestats_t stateCacheStats;
+const GLenum stateCacheCaps[STATE_CACHE_CAPS] = {
+	GL_TEXTURE_2D, GL_COLOR_MATERIAL, GL_LIGHTING, GL_FOG, GL_DEPTH_TEST, GL_NORMALIZE, GL_LIGHT0, GL_LIGHT1, GL_LIGHT2
+};
+frustum_t viewFrustum;										// Rebuilt by display() each frame, once the camera is known.
+spatialindex_t sceneIndex;									// Every tree, house, tank, the hangar and the airstrip (see initSceneIndex()).
+int* sceneVisibleEntries = NULL;							// Filled by cullScene() each frame.
+unsigned int sceneFrame = 0;								// Bumped by cullScene() each frame.
+const char* spatialKindNames[NUM_SPATIAL_KINDS] = { "tree", "house", "tank", "hangar", "airstrip" };
+int spatialBenchmarkRequested = 0;							// Set with --bench-spatial.
+int rainBenchmarkRequested = 0;								// Set with --bench-rain.
+int gridBenchmarkRequested = 0;						// Set with --bench-grid.
+
+// GPU profiling uses two sets of GL_TIME_ELAPSED queries, alternating between frames. A set is
+// only read back two frames after it was issued, by which time the GPU has long finished with
+// it, so reading results never stalls the pipeline.
+int gpuProfilingRequested = 0;						// Set with --gpu-profile.
+int gpuProfilingEnabled = 0;						// Requested, and the driver supports timer queries.
+GLuint gpuQueries[2][NUM_PASSES];
+int gpuQueryIssued[2][NUM_PASSES];					// Whether the query was issued in that set's last frame.
+unsigned long long gpuResults[NUM_PASSES];			// Results read back at the start of the current frame (ns).
+unsigned int gpuResultsDropped = 0;					// Results that weren't ready in time and were skipped.
+
 const float GROUND_WIDTH = 100.0f;  // Width of the ground
 const float GROUND_LENGTH = 100.0f; // Length of the ground
 
@@ -285,8 +1640,32 @@ const float GROUND_LENGTH = 100.0f; // Length of the ground
 
 
 
-void main(int argc, char** argv)
+int main(int argc, char** argv)
 {
+	// Pick up our own options (anything else is left for glutInit).
+	parseCommandLine(argc, argv);
+
+	// The simulation moves the tanks, so even replays without a window need them.
+	if (!initTankFleet()) {
+		printf("Could not allocate %d tanks\n", extraTankCount);
+		return 1;
+	}
+
+	// Simulation-only replays never touch GLUT or OpenGL, so they run without a display.
+	if (replayFileName != NULL && !replayRender) {
+		return runReplay(0);
+	}
+
+	// So do the spatial index and rain benchmarks.
+	if (spatialBenchmarkRequested) {
+		runSpatialBenchmark();
+		return 0;
+	}
+	if (rainBenchmarkRequested) {
+		runRainBenchmark();
+		return 0;
+	}
+
 	// Initialize the OpenGL window.
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
@@ -296,6 +1675,30 @@ void main(int argc, char** argv)
 	// Set up the scene.
 	init();
 
+	// The grid benchmark also runs in a hidden window, then exits.
+	if (gridBenchmarkRequested) {
+		glutHideWindow();
+		reshape(windowWidth, windowHeight);
+		runGridBenchmark();
+		return 0;
+	}
+
+	// Offscreen replays draw every tick into the (hidden) window as fast as possible, then exit.
+	if (replayFileName != NULL) {
+		glutHideWindow();
+		reshape(windowWidth, windowHeight);
+		return runReplay(1);
+	}
+
+	// Start interpolating from the initial world state, so the first frames don't blend in from the origin.
+	captureInterpolationState(&previousState);
+	copyTankPoses(&previousTankPoses, &tankFleet.pose);
+	publishWorldSnapshot(pacingNowNs());
+
+	if (recordFileName != NULL && !startInputRecording(recordFileName)) {
+		return 1;
+	}
+
 	// Disable key repeat (keyPressed or specialKeyPressed will only be called once when a key is first pressed).
 	glutSetKeyRepeat(GLUT_KEY_REPEAT_OFF);
 
@@ -308,11 +1711,31 @@ void main(int argc, char** argv)
 	glutSpecialUpFunc(specialKeyReleased);
 	glutIdleFunc(idle);
 
+#ifdef _WIN32
+	// Ask for 1 ms scheduler granularity, so Sleep() can be used for frame pacing.
+	timeBeginPeriod(1);
+	atexit(restoreTimerPeriod);
+#endif
+
+	// Report frame pacing statistics however we exit (Escape key or closing the window).
+	atexit(dumpFrameTimeHistogram);
+
+	if (profileCsvFileName != NULL && !startProfileCsv(profileCsvFileName)) {
+		return 1;
+	}
+
+	// Hand think() over to its own thread. Registered last, so on exit it's stopped before
+	// anything else (e.g. finishInputRecording) looks at the simulation.
+	if (simulationThreadRequested && !startSimulationThread()) {
+		printf("Could not start the simulation thread, running it on the GLUT thread instead\n");
+	}
+
 	// Record when we started rendering the very first frame (which should happen after we call glutMainLoop).
-	frameStartTime = (unsigned int)glutGet(GLUT_ELAPSED_TIME);
+	frameStartTime = pacingNowNs();
 
 	// Enter the main drawing loop (this will never return).
 	glutMainLoop();
+	return 0;
 }
 
 /******************************************************************************
@@ -328,8 +1751,33 @@ void main(int argc, char** argv)
  */
 void display(void)
 {
+	unsigned long long displayStart = pacingNowNs();
+
+	// Collect the GPU timings of the frame before last, before this frame reuses its queries.
+	if (gpuProfilingEnabled) {
+		readGpuProfileResults();
+	}
+
 	// clear the screen and depth buffer
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	memset(&stateCacheStats, 0, sizeof(stateCacheStats));
+
+	// Work out where everything is between the last two simulation ticks. With the simulation on
+	// its own thread, that depends on how long ago the newest tick in the snapshot was due.
+	const worldsnapshot_t* snapshot = latestWorldSnapshot();
+	float alpha = renderAlpha;
+	if (atomicLoad(&simulationThreadRunning)) {
+		unsigned long long now = pacingNowNs();
+		alpha = now > snapshot->tickTime ? (float)((double)(now - snapshot->tickTime) / (double)(FRAME_TIME * NS_PER_MS)) : 0.0f;
+		if (alpha > 1.0f) alpha = 1.0f;
+	}
+	interpolateRenderState(snapshot, alpha);
+
+	// Bring the sky and ambient light up to date if the rain was toggled since the last frame.
+	if (nightModeApplied != renderState.rainActive) {
+		setupNightMode();
+		nightModeApplied = renderState.rainActive;
+	}
 
 
 	// Setup fog
@@ -340,78 +1788,107 @@ void display(void)
 	glLoadIdentity();
 
 	// Calculate camera position based on bird's position and rotation
-	float radians = objectRotation[1] * PI / 180.0f;  // Convert the bird's rotation (yaw) to radians
+	float radians = renderState.objectRotation[1] * PI / 180.0f;  // Convert the bird's rotation (yaw) to radians
 
 	// Camera distance behind the bird
 	float cameraDistance = 5.0f;   // Distance behind the bird (adjust as needed)
 	float cameraHeight = 2.0f;     // Height above the bird
 
 	// Camera position relative to the bird
-	float cameraPosX = objectLocation[0] - sinf(radians) * cameraDistance;
-	float cameraPosY = objectLocation[1] + cameraHeight;  // Keep camera slightly above the bird
-	float cameraPosZ = objectLocation[2] - cosf(radians) * cameraDistance;
+	float cameraPosX = renderState.objectLocation[0] - sinf(radians) * cameraDistance;
+	float cameraPosY = renderState.objectLocation[1] + cameraHeight;  // Keep camera slightly above the bird
+	float cameraPosZ = renderState.objectLocation[2] - cosf(radians) * cameraDistance;
 
 	// Camera look-at point (look at the bird)
-	float lookAtX = objectLocation[0];
-	float lookAtY = objectLocation[1];
-	float lookAtZ = objectLocation[2];
+	float lookAtX = renderState.objectLocation[0];
+	float lookAtY = renderState.objectLocation[1];
+	float lookAtZ = renderState.objectLocation[2];
 
 	// Set the camera position
-	gluLookAt(cameraLookAt[0], cameraLookAt[1], cameraLookAt[2],
-		objectLocation[0], objectLocation[1], objectLocation[2],
+	gluLookAt(renderState.cameraLookAt[0], renderState.cameraLookAt[1], renderState.cameraLookAt[2],
+		renderState.objectLocation[0], renderState.objectLocation[1], renderState.objectLocation[2],
 		0, 1, 0);
 
+	// Place the helicopter's spotlight now that the camera is set up.
+	positionSpotlight();
+
+	// Hand the per-pixel lighting shaders this frame's projection, lights and fog in one upload.
+	if (lightingProgram.program != 0) {
+		uploadFrameBlock();
+	}
+
+	// Work out what the camera can see, for culling.
+	buildViewFrustum(&viewFrustum, renderState.cameraLookAt, renderState.objectLocation, (float)windowWidth / (float)windowHeight);
+	memset(&meshLodStats, 0, sizeof(meshLodStats));
+	memset(&cullStats, 0, sizeof(cullStats));
+	placeTanks(snapshot, alpha);
+	cullScene();
+	beginRenderQueue();
+
+	// Let the worker threads move the rain while the scene is drawn; drawing it waits for them.
+	startRainUpdate();
 
 
-	drawOriginMarker();
 
-	// Draw the XZ grid
-	drawXZGrid(100.0f, 200);
+	const float origin[3] = { 0.0f, 0.0f, 0.0f };
+	if (sphereVisible(origin, 2.0f)) {  // The axis lines are 2 units long
+		drawOriginMarker();
+	}
+
+	// Draw the ground
+	profileBegin(PASS_GRID);
+	drawGround();
+	profileEnd(PASS_GRID);
 	
 	
 
+	// The models below are only culled and queued here; flushRenderQueue() draws them all at once.
+	profileBegin(PASS_MODELS);
+
 	// Draw the tree (ensure tree transformations are isolated)
-	glPushMatrix();
-	glTranslatef(-4.0f, 0.0f, -2.0f);  // Use fixed coordinates for the tree position
-	glScalef(0.75f, 0.75f, 0.75f);  // Scale the tree down to 50% of its original size
-	drawTree(10.0f, 0.3f, 2.0f, 1.0f);  // Example tree: 3 unit high trunk, 0.2 radius trunk, 2 unit high foliage
-	glPopMatrix();
+	if (sceneEntryVisible(SPATIAL_TREE)) {
+		glPushMatrix();
+		glTranslatef(standaloneTreePosition[0], standaloneTreePosition[1], standaloneTreePosition[2]);
+		queueMeshAt(MESH_TREE, standaloneTreePosition);  // Same (scaled) tree as drawMultipleTrees() uses
+		glPopMatrix();
+	}
 
 
 	// Draw the house next to the aircraft (e.g., fixed position on the ground)
-	glPushMatrix();
-		glTranslatef(7.0f, 0.0f, -5.0f);  // Fixed position of the house (e.g., 10 units right and 10 units back)
-		glScalef(2.0f, 2.0f, 2.0f);
-		drawHouse(2.0f, 2.0f, 4.0f);  // Draw the house with a base size of 2 units
-	glPopMatrix();
+	if (sceneEntryVisible(SPATIAL_HOUSE)) {
+		glPushMatrix();
+			glTranslatef(standaloneHousePosition[0], standaloneHousePosition[1], standaloneHousePosition[2]);
+			queueMeshAt(MESH_HOUSE, standaloneHousePosition);  // House with a base size of 2 units, scaled up 2x
+		glPopMatrix();
+	}
 
 	// draw parking hall
-	glPushMatrix();
-	// Translate the entire parking hall behind the aircraft
-	glTranslatef(0.0f, 0.0f, 8.0f);  // Adjust as needed
-	glScalef(1.0f, 1.0f, 3.0f);
-	// Call the function to draw the airplane parking hall
-	glRotatef(270.0f, 0.0f, 1.0f, 0.0f);  // Rotate 90 degrees around Y-axis
-	drawAirplaneParkingHall(3.0f, 4.0f);  // Example dimensions: radius = 3.0, height = 4.0
-	glPopMatrix();
+	if (sceneEntryVisible(SPATIAL_HANGAR)) {
+		const float hangarPosition[3] = { 0.0f, 0.0f, 8.0f };
+		glPushMatrix();
+		// Translate the entire parking hall behind the aircraft
+		glTranslatef(hangarPosition[0], hangarPosition[1], hangarPosition[2]);  // Adjust as needed
+		queueMeshAt(MESH_HANGAR, hangarPosition);  // Scaled and turned by buildHangarMesh()
+		glPopMatrix();
+	}
 
-	glPushMatrix();
-	// Translate the airstrip below the aircraft
-	glTranslatef(0.0f, 0.0f, -10.0f);  // Adjust as needed to place under the aircraft
-	glScalef(1.0f, 1.0f, 1.5f);
-	// Call the function to draw the airstrip
-	drawAirstrip(6.0f, 40.0f, 0.05f);  // Example dimensions: width = 6.0, length = 20.0, thickness = 0.1
-	glPopMatrix();
+	if (sceneEntryVisible(SPATIAL_AIRSTRIP)) {
+		const float airstripPosition[3] = { 0.0f, 0.0f, -10.0f };
+		glPushMatrix();
+		// Translate the airstrip below the aircraft
+		glTranslatef(airstripPosition[0], airstripPosition[1], airstripPosition[2]);  // Adjust as needed to place under the aircraft
+		queueMeshAt(MESH_AIRSTRIP, airstripPosition);  // Scaled by buildAirstripMesh()
+		glPopMatrix();
+	}
 
 
 	// Draw the tank at its current position and orientation
-	glPushMatrix();
-	glTranslatef(tankPosition[0], tankPosition[1], tankPosition[2]); // Move tank to current position
-	glTranslatef(-10.0f, 0.0f, -20.0f);
-	glRotatef(tankRotation, 0.0f, 1.0f, 0.0f);  // Rotate the tank around the Y-axis
-	glRotatef(270.0f, 0.0f, 1.0f, 0.0f);
-	drawTank(2.0f, 1.0f, 1.0f, 1.0f);  // Draw the tank (or call your custom tank drawing function)
-	glPopMatrix();
+	if (sceneEntryVisible(SPATIAL_TANK)) {
+		glPushMatrix();
+		applyTankTransform();
+		queueMeshAt(MESH_TANK, sceneIndex.entries[SPATIAL_TANK].position);  // Placed by placeTanks()
+		glPopMatrix();
+	}
 
 	
 
@@ -419,9 +1896,9 @@ void display(void)
 
 	// Move the aircraft to its current position (objectLocation)
 	glPushMatrix();
-		glTranslatef(objectLocation[0], objectLocation[1], objectLocation[2]);
+		glTranslatef(renderState.objectLocation[0], renderState.objectLocation[1], renderState.objectLocation[2]);
 		// Add rotation for the aircraft
-		glRotatef(objectRotation[1], 0.0f, 1.0f, 0.0f);
+		glRotatef(renderState.objectRotation[1], 0.0f, 1.0f, 0.0f);
 		// Draw the aircraft
 		drawAircraft();  // Call the new function to draw the aircraft
 	glPopMatrix();
@@ -435,10 +1912,33 @@ void display(void)
 
 	// Draw the multiple Tanks
 	drawMultipleTanks();
+	profileEnd(PASS_MODELS);
+
+	// Draw everything queued above, sorted to keep shader, texture and material changes down
+	profileBegin(PASS_RENDER_QUEUE);
+	flushRenderQueue();
+	profileEnd(PASS_RENDER_QUEUE);
 
-	// Update and draw rain
-	updateRain();
+	// Wait for the rain update, then draw rain
+	profileBegin(PASS_RAIN);
+	finishRainUpdate();
 	drawRain();
+	profileEnd(PASS_RAIN);
+
+	// Move, spawn and draw the dust, exhaust and splashes
+	profileBegin(PASS_PARTICLES);
+	updateParticles();
+	drawParticles();
+	profileEnd(PASS_PARTICLES);
+
+	// Gather this frame's timings (including any think() ticks since the last frame), then show them.
+	collectProfileSamples();
+	if (profilerHudVisible) {
+		drawProfilerHud();
+	}
+
+	// The next frame's emitters slow down if this one ran over budget (see adjustParticleSpawnScale()).
+	displayCpuTime = pacingNowNs() - displayStart;
 
 	// swap the drawing buffers
 	glutSwapBuffers();
@@ -474,7 +1974,7 @@ void reshape(int width, int h)
 	glLoadIdentity();
 
 	// gluPerspective(fovy, aspect, near, far)
-	gluPerspective(45.0f, (float)windowWidth / (float)windowHeight, 1.0f, 100.0f);
+	gluPerspective(CAMERA_FOV_Y, (float)windowWidth / (float)windowHeight, CAMERA_NEAR, CAMERA_FAR);
 
 	// change into model-view mode so that we can change the object positions
 	glMatrixMode(GL_MODELVIEW);
@@ -488,6 +1988,34 @@ void reshape(int width, int h)
 */
 void keyPressed(unsigned char key, int x, int y)
 {
+	if (!applyingInputEvent) {
+		switch (tolower(key)) {
+			/*
+				Program Controls (add keys that don't affect the simulated world here)
+
+				These act immediately. Everything else is queued until the next
+				simulation tick (and recorded, if --record was given), then passed back
+				through this function with applyingInputEvent set.
+			*/
+		case KEY_PACING_MODE:
+			pacingMode = (pacingMode + 1) % NUM_PACING_MODES;
+			nextFrameDeadline = 0;  // Start the new mode's schedule from the next frame.
+			printf("Frame pacing: %s\n", pacingModeNames[pacingMode]);
+			return;
+
+		case KEY_PROFILER_HUD:
+			profilerHudVisible = !profilerHudVisible;
+			return;
+
+		case KEY_EXIT:
+			exit(0);
+			return;
+		}
+
+		queueInputEvent(INPUT_KEY_PRESSED, (unsigned char)tolower(key));
+		return;
+	}
+
 	switch (tolower(key)) {
 
 		/*
@@ -559,9 +2087,6 @@ void keyPressed(unsigned char key, int x, int y)
 			cameraDistance = 0.1f;
 			break;
 		}
-
-		glutPostRedisplay();  // Request a redraw to update the view
-
 		break;
 
 	
@@ -580,12 +2105,7 @@ void keyPressed(unsigned char key, int x, int y)
 
 	case 'r':  // Toggle rain on/off
 		rainActive = !rainActive;  // Toggle the rain state
-		setupFog();  // Update the fog settings based on the rain state
-		setupNightMode();  // Update the scene lighting and colors for night mode
-		break;
-
-	case KEY_EXIT:
-		exit(0);
+		// Note: display() picks up the fog and night mode changes on the next frame.
 		break;
 	}
 }
@@ -595,6 +2115,11 @@ void keyPressed(unsigned char key, int x, int y)
 */
 void specialKeyPressed(int key, int x, int y)
 {
+	if (!applyingInputEvent) {
+		queueInputEvent(INPUT_SPECIAL_PRESSED, (unsigned char)key);
+		return;
+	}
+
 	switch (key) {
 
 		/*
@@ -620,7 +2145,6 @@ void specialKeyPressed(int key, int x, int y)
 		break;
 	case KEY_CHANGE_VIEW:
 		currentView = (currentView + 1) % NUM_VIEWS;
-		glutPostRedisplay();
 		break;
 		/*
 			Other Keyboard Functions (add any new special key controls here)
@@ -638,6 +2162,11 @@ void specialKeyPressed(int key, int x, int y)
 */
 void keyReleased(unsigned char key, int x, int y)
 {
+	if (!applyingInputEvent) {
+		queueInputEvent(INPUT_KEY_RELEASED, (unsigned char)tolower(key));
+		return;
+	}
+
 	switch (tolower(key)) {
 
 		/*
@@ -688,6 +2217,11 @@ void keyReleased(unsigned char key, int x, int y)
 */
 void specialKeyReleased(int key, int x, int y)
 {
+	if (!applyingInputEvent) {
+		queueInputEvent(INPUT_SPECIAL_RELEASED, (unsigned char)key);
+		return;
+	}
+
 	switch (key) {
 		/*
 			Keyboard-Controlled Motion Handler - DON'T CHANGE THIS SECTION
@@ -739,7 +2273,6 @@ void specialKeyReleased(int key, int x, int y)
 			cameraDistance = 0.1f;
 			break;
 		}
-		glutPostRedisplay();
 		break;
 
 		/*
@@ -758,39 +2291,46 @@ void specialKeyReleased(int key, int x, int y)
 	Note: We use this to handle animation and timing. You shouldn't need to modify
 	this callback at all. Instead, place your animation logic (e.g. moving or rotating
 	things) within the think() method provided with this template.
+
+	Normally think() runs on the simulation thread (see runSimulationLoop), and
+	this only paces frames: how often they are started is up to pacingMode.
+
+	With --single-thread, real time is fed into an accumulator here instead, which
+	is then drained in fixed FRAME_TIME steps: think() runs zero or more times per
+	rendered frame, so a slow frame doesn't slow the simulation down, and display()
+	can run at any rate.
 */
 void idle(void)
 {
-	// Wait until it's time to render the next frame.
-
-	unsigned int frameTimeElapsed = (unsigned int)glutGet(GLUT_ELAPSED_TIME) - frameStartTime;
-	if (frameTimeElapsed < FRAME_TIME)
-	{
-		// This frame took less time to render than the ideal FRAME_TIME: we'll suspend this thread for the remaining time,
-		// so we're not taking up the CPU until we need to render another frame.
-		unsigned int timeLeft = FRAME_TIME - frameTimeElapsed;
-		Sleep(timeLeft);
-	}
-
-	// Begin processing the next frame.
-
-	frameStartTime = glutGet(GLUT_ELAPSED_TIME); // Record when we started work on the new frame.
-
-	think(); // Update our simulated world before the next call to display().
-
-	// Only rotate the rotors if they are active (rotorsActive == 1)
-	if (rotorsActive == 1) {
-		propellerRotationAngle += rotorSpeed;  // Rotate the propellers based on rotor speed
-		if (propellerRotationAngle >= 360.0f) {
-			propellerRotationAngle -= 360.0f;
+	// Wait until it's time to start the next frame.
+	pacingWaitForNextFrame();
+
+	unsigned long long currentTime = pacingNowNs();
+	unsigned long long frameTimeElapsed = currentTime - frameStartTime;
+	frameStartTime = currentTime;
+	recordFrameTime(frameTimeElapsed);
+
+	if (!atomicLoad(&simulationThreadRunning)) {
+		// Don't try to catch up on huge stalls (see MAX_FRAME_CATCHUP).
+		if (frameTimeElapsed > MAX_FRAME_CATCHUP * NS_PER_MS) {
+			frameTimeElapsed = MAX_FRAME_CATCHUP * NS_PER_MS;
+		}
+		simulationAccumulator += frameTimeElapsed;
+
+		// Step the simulated world until it has caught up with real time.
+		int ticked = 0;
+		while (simulationAccumulator >= FRAME_TIME * NS_PER_MS) {
+			simulationTick();
+			simulationAccumulator -= FRAME_TIME * NS_PER_MS;
+			ticked = 1;
 		}
+		if (ticked) {
+			publishWorldSnapshot(currentTime - simulationAccumulator);
+		}
+		renderAlpha = (float)((double)simulationAccumulator / (double)(FRAME_TIME * NS_PER_MS));
 	}
 
 	glutPostRedisplay(); // Tell OpenGL there's a new frame ready to be drawn.
-
-
-	
-
 }
 
 /******************************************************************************
@@ -802,15 +2342,28 @@ void idle(void)
  */
 void init(void)
 {
+	// Find out what the driver can do before anything depends on it.
+	loadGLExtensions();
+	if (gpuProfilingRequested) {
+		initGpuProfiler();
+	}
+
+	// The ground's chunk meshes never change, so they're built once up front. Without buffer
+	// objects drawGround() sends the same chunks in immediate mode.
+	groundChunksPerSide = (int)ceilf(groundSize / GROUND_CHUNK_SIZE);
+	if (vertexBuffersAvailable && !buildGroundChunks()) {
+		vertexBuffersAvailable = 0;
+	}
+
 	// Set the background color to sky blue
 	glClearColor(0.529f, 0.808f, 0.922f, 1.0f);  // Sky blue color (RGBA)
 
 	// enable depth testing
-	glEnable(GL_DEPTH_TEST);
+	cachedEnable(GL_DEPTH_TEST);
 
 
 	// Enable texturing globally
-    glEnable(GL_TEXTURE_2D);
+    cachedEnable(GL_TEXTURE_2D);
     
     // Load textures
     loadTextures();
@@ -822,7 +2375,7 @@ void init(void)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     
     // Enable color material (allows textures to show their true colors)
-    glEnable(GL_COLOR_MATERIAL);
+    cachedEnable(GL_COLOR_MATERIAL);
     glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
 	// set background color to be black
 	//glClearColor(0, 0, 0, 1.0);
@@ -837,30 +2390,47 @@ void init(void)
 	GLfloat globalAmbient[] = { 0.8f, 0.8f, 0.8f, 1 };\
 	GLfloat diffuseLight[] = { 1, 1, 1, 1 };
 	GLfloat specularLight[] = { 1, 1, 1, 1 };
-	glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
-	glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseLight);
-	glLightfv(GL_LIGHT0, GL_SPECULAR, specularLight);
+	resetFrameBlock();
+	sceneLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
+	sceneLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseLight);
+	sceneLightfv(GL_LIGHT0, GL_SPECULAR, specularLight);
 
-	glEnable(GL_LIGHTING);
-	glEnable(GL_LIGHT0);
+	cachedEnable(GL_LIGHTING);
+	cachedEnable(GL_LIGHT0);
 
 	// Make GL normalize the normal vectors we supply.
-	glEnable(GL_NORMALIZE);
+	cachedEnable(GL_NORMALIZE);
 
 	// Enable use of simple GL colours as materials.
-	glEnable(GL_COLOR_MATERIAL);
+	cachedEnable(GL_COLOR_MATERIAL);
 
 
 
 	initLights();
 
+	// Start the threads that help move the rain, one fewer than the processors unless --workers says otherwise.
+	int workers = workerThreadCount >= 0 ? workerThreadCount : processorCount() - 1;
+	if (workers > 0 && !startWorkerPool(&workerPool, workers)) {
+		printf("Could not start %d worker threads, updating the rain on the GLUT thread alone\n", workers);
+	}
+	else if (workers > 0) {
+		atexit(stopWorkerThreads);
+	}
 	initializeRain();
+	initParticles();
 
 	// Initialize position of helicopter (already done with objectLocation)
 	objectLocation[1] = 0.8f;  // Helicopter starts 1.0 unit above the ground
 
-	sphereQuadric = gluNewQuadric();
-	quadricPtr = gluNewQuadric();
+	// Light per pixel if the driver can; initInstanceGroups() builds the instanced variant to match.
+	initShaderLighting();
+
+	// Build the static models (needs the textures, which their parts refer to), then place their copies.
+	if (!initMeshes() || !initInstanceGroups() || !initSceneIndex()) {
+		printf("Could not build the scene's meshes\n");
+		exit(1);
+	}
+	initImpostors();
 
 	// Anything that relies on lighting or specifies normals must be initialised after initLights.
 }
@@ -868,10 +2438,10 @@ void init(void)
 /*
 	Advance our animation by FRAME_TIME milliseconds.
 
-	Note: Our template's GLUT idle() callback calls this once before each new
-	frame is drawn, EXCEPT the very first frame drawn after our application
-	starts. Any setup required before the first frame is drawn should be placed
-	in init().
+	Note: Our template's GLUT idle() callback calls this zero or more times before
+	each new frame is drawn, once for every FRAME_TIME milliseconds of real time
+	that has passed. Any setup required before the first frame is drawn should be
+	placed in init().
 */
 void think(void)
 {
@@ -934,7 +2504,8 @@ void think(void)
 		objectRotation[1] += keyboardMotion.Yaw * rotationSpeed * FRAME_TIME_SEC;
 		if (objectRotation[1] <= -360 || objectRotation[1] >= 360)
 			objectRotation[1] = 0.0f;
-		printf("X: %f, Z: %f, R: %f\n", objectLocation[0], objectLocation[2], objectLocation[1]);
+		if (replayFileName == NULL)
+			printf("X: %f, Z: %f, R: %f\n", objectLocation[0], objectLocation[2], objectLocation[1]);
 
 		/* TEMPLATE: Turn your object right (clockwise) if .Yaw < 0, or left (anticlockwise) if .Yaw > 0 */
 	}
@@ -947,7 +2518,8 @@ void think(void)
 
 		objectLocation[0] += dx;
 		objectLocation[2] += dz;
-		printf("X: %f, Z: %f, R: %f\n", dx, dz, objectLocation[1]);
+		if (replayFileName == NULL)
+			printf("X: %f, Z: %f, R: %f\n", dx, dz, objectLocation[1]);
 
 		/* TEMPLATE: Move your object backward if .Surge < 0, or forward if .Surge > 0 */
 	}
@@ -962,7 +2534,8 @@ void think(void)
 		objectLocation[0] += dx;
 		objectLocation[2] += dz;
 
-		printf("X: %f, Z: %f, R: %f\n", dx, dz, objectRotation[1]);
+		if (replayFileName == NULL)
+			printf("X: %f, Z: %f, R: %f\n", dx, dz, objectRotation[1]);
 
 		/* TEMPLATE: Move (strafe) your object left if .Sway < 0, or right if .Sway > 0 */
 	}
@@ -1054,14 +2627,6 @@ void think(void)
 	cameraLookAt[2] = objectLocation[2] - cameraDistance * cosf(cameraAngle);
 
 
-	// Update spotlight to follow the helicopter's position
-	GLfloat spotlightPosition[] = { objectLocation[0], objectLocation[1] + 2.0f, objectLocation[2], 1.0f };  // Spotlight follows the helicopter
-
-	// Calculate the spotlight direction based on the helicopter's rotation (yaw)
-	float radians = objectRotation[1] * PI / 180.0f;  // Convert the yaw angle (objectRotation[1]) to radians
-	GLfloat spotlightDirection[] = { -sinf(radians), -0.5f, -cosf(radians) };  // Spotlight points forward and downward
-
-
 	float moveSpeed = tankSpeed;            // Speed of the tank's forward movement
 	float rotationSpeed = tankRotationSpeed; // Speed of the tank's rotation
 
@@ -1074,11 +2639,17 @@ void think(void)
 	tankRotation += rotationSpeed * FRAME_TIME_SEC;
 	if (tankRotation >= 360.0f) tankRotation -= 360.0f; // Keep rotation within 0-360 degrees
 
+	// Every other tank drives its own circle
+	moveTankFleet();
 
-	// Update spotlight properties
-	glLightfv(GL_LIGHT2, GL_POSITION, spotlightPosition);
-	glLightfv(GL_LIGHT2, GL_SPOT_DIRECTION, spotlightDirection);
-
+	// Only rotate the rotors if they are active (rotorsActive == 1).
+	// Note: this used to run in idle() after every think(), so it stays once per tick.
+	if (rotorsActive == 1) {
+		propellerRotationAngle += rotorSpeed;  // Rotate the propellers based on rotor speed
+		if (propellerRotationAngle >= 360.0f) {
+			propellerRotationAngle -= 360.0f;
+		}
+	}
 }
 
 /*
@@ -1093,7 +2664,7 @@ void initLights(void)
 	
 	// Global ambient lighting
 	GLfloat globalAmbient[] = { 0.2f, 0.2f, 0.2f, 1.0f };
-	glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
+	sceneLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
 
 	// Directional Light (Sunlight)
 	GLfloat directionalLightDirection[] = { -1.0f, -1.0f, -1.0f, 0.0f };  // Directional light from top-right
@@ -1101,11 +2672,11 @@ void initLights(void)
 	GLfloat directionalLightDiffuse[] = { 1.0f, 1.0f, 1.0f, 1.0f };
 	GLfloat directionalLightSpecular[] = { 1.0f, 1.0f, 1.0f, 1.0f };
 
-	glEnable(GL_LIGHT1);  // Light 1 for the directional light
-	glLightfv(GL_LIGHT1, GL_POSITION, directionalLightDirection);
-	glLightfv(GL_LIGHT1, GL_AMBIENT, directionalLightAmbient);
-	glLightfv(GL_LIGHT1, GL_DIFFUSE, directionalLightDiffuse);
-	glLightfv(GL_LIGHT1, GL_SPECULAR, directionalLightSpecular);
+	cachedEnable(GL_LIGHT1);  // Light 1 for the directional light
+	sceneLightfv(GL_LIGHT1, GL_POSITION, directionalLightDirection);
+	sceneLightfv(GL_LIGHT1, GL_AMBIENT, directionalLightAmbient);
+	sceneLightfv(GL_LIGHT1, GL_DIFFUSE, directionalLightDiffuse);
+	sceneLightfv(GL_LIGHT1, GL_SPECULAR, directionalLightSpecular);
 
 	// Spotlight (attached to helicopter)
 	GLfloat spotlightPosition[] = { objectLocation[0], objectLocation[1], objectLocation[2], 1.0f };  // Dynamic position
@@ -1114,19 +2685,19 @@ void initLights(void)
 	GLfloat spotlightDiffuse[] = { 1.0f, 1.0f, 0.8f, 1.0f };  // Soft yellow spotlight
 	GLfloat spotlightSpecular[] = { 1.0f, 1.0f, 0.8f, 1.0f };
 
-	glEnable(GL_LIGHT2);  // Light 2 for the spotlight
-	glLightfv(GL_LIGHT2, GL_POSITION, spotlightPosition);
-	glLightfv(GL_LIGHT2, GL_AMBIENT, spotlightAmbient);
-	glLightfv(GL_LIGHT2, GL_DIFFUSE, spotlightDiffuse);
-	glLightfv(GL_LIGHT2, GL_SPECULAR, spotlightSpecular);
-	glLightf(GL_LIGHT2, GL_SPOT_CUTOFF, 30.0f);  // Spotlight cutoff angle (30 degrees)
-	glLightfv(GL_LIGHT2, GL_SPOT_DIRECTION, spotlightDirection);
-	glLightf(GL_LIGHT2, GL_SPOT_EXPONENT, 2.0f);  // Focus the beam
+	cachedEnable(GL_LIGHT2);  // Light 2 for the spotlight
+	sceneLightfv(GL_LIGHT2, GL_POSITION, spotlightPosition);
+	sceneLightfv(GL_LIGHT2, GL_AMBIENT, spotlightAmbient);
+	sceneLightfv(GL_LIGHT2, GL_DIFFUSE, spotlightDiffuse);
+	sceneLightfv(GL_LIGHT2, GL_SPECULAR, spotlightSpecular);
+	sceneLightf(GL_LIGHT2, GL_SPOT_CUTOFF, 30.0f);  // Spotlight cutoff angle (30 degrees)
+	sceneLightfv(GL_LIGHT2, GL_SPOT_DIRECTION, spotlightDirection);
+	sceneLightf(GL_LIGHT2, GL_SPOT_EXPONENT, 2.0f);  // Focus the beam
 
 	// Enable general lighting
-	glEnable(GL_LIGHTING);
-	glEnable(GL_COLOR_MATERIAL);
-	glEnable(GL_NORMALIZE);  // Ensure normals are normalized
+	cachedEnable(GL_LIGHTING);
+	cachedEnable(GL_COLOR_MATERIAL);
+	cachedEnable(GL_NORMALIZE);  // Ensure normals are normalized
 	
 }
 
@@ -1135,7 +2706,7 @@ void initLights(void)
 void drawOriginMarker(void){
 
 	glColor3f(0.0, 1.0, 1.0);
-	glutSolidSphere(0.1, 10, 10);
+	drawSphere(0.1f, 10, 10);
 
 	glBegin(GL_LINES);
 	//draw red x axes line from -2.0 to 2.0
@@ -1157,46 +2728,186 @@ void drawOriginMarker(void){
 }
 
 void drawXZGrid(float size, int divisions) {
-	
+	applyGroundState();
+
+	// The grid never changes, so it lives in buffer objects built on first use (and rebuilt only if
+	// size or divisions change). Drivers without buffer objects get the original immediate-mode grid.
+	if (vertexBuffersAvailable && (groundMesh.size != size || groundMesh.divisions != divisions)) {
+		if (!buildGroundMesh(&groundMesh, -size / 2.0f, size, divisions, 100.0f / size)) {
+			vertexBuffersAvailable = 0;
+		}
+	}
+
+	if (vertexBuffersAvailable) {
+		bindGroundMesh(&groundMesh);
+		drawGroundMesh(&groundMesh);
+		unbindGroundMesh();
+	}
+	else {
+		drawXZGridImmediate(size, divisions);
+	}
+
+	cachedDisable(GL_TEXTURE_2D);  // Disable texture mapping after drawing
+}
+
+/*
+	Set up the grass texture, colour and fill mode every ground drawing path uses.
+*/
+void applyGroundState(void) {
 	// Bind the grass texture for the grid
-	glBindTexture(GL_TEXTURE_2D, texID[1]);  // Assuming texID[1] is the grass texture
+	cachedBindTexture(texID[1]);  // Assuming texID[1] is the grass texture
 
-	glEnable(GL_TEXTURE_2D);  // Enable 2D texture mapping
+	cachedEnable(GL_TEXTURE_2D);  // Enable 2D texture mapping
 
 	// Set the color to a darker green (multiply the texture color)
-	glColor3f(0.6f, 0.6f, 0.6f);  // Darken the texture by setting a darker color
+	glColor4fv(groundColor);  // Darken the texture by setting a darker color
 
 	// Set polygon mode based on renderFillEnabled (1 = filled, 0 = wireframe)
-	if (renderFillEnabled) {
+	if (renderState.renderFill) {
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);  // Filled mode
 	}
 	else {
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);  // Wireframe mode
 	}
+}
 
-	float halfSize = size / 2.0f;  // Half the size for centering the grid
-	float step = size / (float)divisions;  // Distance between each line/grid square
+/*
+	Draw the ground chunk by chunk. Only chunks within CAMERA_FAR of the camera are
+	looked at, so the cost doesn't grow with the size of the map; of those, chunks
+	outside viewFrustum are skipped, and the rest use a coarser mesh the farther
+	away they are. The ground is flat, so mixing levels leaves no cracks. Without
+	buffer objects the same chunks are sent in immediate mode.
+*/
+void drawGround(void) {
+	memset(&groundStats, 0, sizeof(groundStats));
+
+	const float* eye = renderState.cameraLookAt;
+	float origin = -groundChunksPerSide * GROUND_CHUNK_SIZE / 2.0f;
+
+	// Range of chunks (inclusive) that could be within CAMERA_FAR of the camera.
+	int firstX = (int)floorf((eye[0] - CAMERA_FAR - origin) / GROUND_CHUNK_SIZE);
+	int lastX = (int)floorf((eye[0] + CAMERA_FAR - origin) / GROUND_CHUNK_SIZE);
+	int firstZ = (int)floorf((eye[2] - CAMERA_FAR - origin) / GROUND_CHUNK_SIZE);
+	int lastZ = (int)floorf((eye[2] + CAMERA_FAR - origin) / GROUND_CHUNK_SIZE);
+	if (firstX < 0) firstX = 0;
+	if (firstZ < 0) firstZ = 0;
+	if (lastX > groundChunksPerSide - 1) lastX = groundChunksPerSide - 1;
+	if (lastZ > groundChunksPerSide - 1) lastZ = groundChunksPerSide - 1;
+
+	applyGroundState();
+
+	// With per-pixel lighting the ground is lit like the models: colour material, no highlight.
+	int lit = lightingProgram.program != 0 && vertexBuffersAvailable;
+	if (lit) {
+		static const meshmaterial_t groundMaterial = { 0, 1, { 0.0f }, { 0.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }, 0.0f };
+		glUseProgram(lightingProgram.program);
+		glUniform1i(lightingProgram.texture, 0);
+		glUniform1i(lightingProgram.useTexture, 1);
+		applyShaderMaterial(&lightingProgram, &groundMaterial);
+	}
 
-	// Scale the texture repetition. Higher values make the texture repeat more.
-	float textureScale = 100.0f;  // Adjust this value to control how often the texture repeats
+	// One pass per level, so each mesh is bound once however many chunks use it.
+	for (int level = 0; level < GROUND_LOD_LEVELS; level++) {
+		int bound = 0;
+		for (int x = firstX; x <= lastX; x++) {
+			for (int z = firstZ; z <= lastZ; z++) {
+				float boxMin[3] = { origin + x * GROUND_CHUNK_SIZE, 0.0f, origin + z * GROUND_CHUNK_SIZE };
+				float boxMax[3] = { boxMin[0] + GROUND_CHUNK_SIZE, 0.0f, boxMin[2] + GROUND_CHUNK_SIZE };
+
+				// Distance from the camera to the nearest point of the chunk.
+				float dx = fmaxf(fmaxf(boxMin[0] - eye[0], eye[0] - boxMax[0]), 0.0f);
+				float dz = fmaxf(fmaxf(boxMin[2] - eye[2], eye[2] - boxMax[2]), 0.0f);
+				float distance = sqrtf(dx * dx + eye[1] * eye[1] + dz * dz);
+				if (distance > CAMERA_FAR) continue;
+
+				int chunkLevel = 0;
+				while (chunkLevel < GROUND_LOD_LEVELS - 1 && distance > groundLodDistances[chunkLevel]) chunkLevel++;
+				if (chunkLevel != level) continue;
+
+				if (!frustumIntersectsBox(&viewFrustum, boxMin, boxMax)) {
+					groundStats.chunksCulled++;
+					continue;
+				}
 
-	glBegin(GL_QUADS);
-	for (float i = -halfSize; i < halfSize; i += step) {
-		for (float j = -halfSize; j < halfSize; j += step) {
-			// Map the texture to each grid cell with scaled texture coordinates
-			glTexCoord2f(i / size * textureScale, j / size * textureScale); glVertex3f(i, 0.0f, j);            // Bottom-left corner
-			glTexCoord2f((i + step) / size * textureScale, j / size * textureScale); glVertex3f(i + step, 0.0f, j);     // Bottom-right corner
-			glTexCoord2f((i + step) / size * textureScale, (j + step) / size * textureScale); glVertex3f(i + step, 0.0f, j + step);  // Top-right corner
-			glTexCoord2f(i / size * textureScale, (j + step) / size * textureScale); glVertex3f(i, 0.0f, j + step);     // Top-left corner
+				if (!vertexBuffersAvailable) {
+					drawGroundChunkImmediate(boxMin[0], boxMin[2], groundLodDivisions[level]);
+					groundStats.chunksDrawn++;
+					groundStats.trianglesDrawn += groundLodDivisions[level] * groundLodDivisions[level] * 2;
+					continue;
+				}
+				if (!bound) {
+					if (lit) bindGroundAttributes(&groundChunkMeshes[level]);
+					else bindGroundMesh(&groundChunkMeshes[level]);
+					bound = 1;
+				}
+				glPushMatrix();
+				glTranslatef(boxMin[0], 0.0f, boxMin[2]);
+				if (lit) loadShaderModelView(&lightingProgram);
+				drawGroundMesh(&groundChunkMeshes[level]);
+				glPopMatrix();
+				groundStats.chunksDrawn++;
+				groundStats.trianglesDrawn += groundChunkMeshes[level].triangleIndexCount / 3;
+			}
+		}
+		if (bound) {
+			if (lit) unbindShaderAttributes();
+			else unbindGroundMesh();
 		}
 	}
-	glEnd();
+	if (lit) {
+		glUseProgram(0);
+	}
 
-	glDisable(GL_TEXTURE_2D);  // Disable texture mapping after drawing
+	cachedDisable(GL_TEXTURE_2D);
 }
 
+/*
+	One ground chunk with its corner at (x, z), divisions cells a side, as textured
+	quads in immediate mode, with the same texture coordinates and winding as the
+	chunk meshes buildGroundChunks() makes.
+*/
+void drawGroundChunkImmediate(float x, float z, int divisions) {
+	float step = GROUND_CHUNK_SIZE / (float)divisions;
+	glBegin(GL_QUADS);
+	for (int i = 0; i < divisions; i++) {
+		for (int j = 0; j < divisions; j++) {
+			float x0 = x + i * step;
+			float z0 = z + j * step;
+			glTexCoord2f(x0, z0); glVertex3f(x0, 0.0f, z0);
+			glTexCoord2f(x0 + step, z0); glVertex3f(x0 + step, 0.0f, z0);
+			glTexCoord2f(x0 + step, z0 + step); glVertex3f(x0 + step, 0.0f, z0 + step);
+			glTexCoord2f(x0, z0 + step); glVertex3f(x0, 0.0f, z0 + step);
+		}
+	}
+	glEnd();
+}
+
+/*
+	The original ground grid: one textured quad per cell, sent in immediate mode
+	every frame. Used when buffer objects aren't available, and by --bench-grid.
+*/
+void drawXZGridImmediate(float size, int divisions) {
+	float halfSize = size / 2.0f;  // Half the size for centering the grid
+	float step = size / (float)divisions;  // Distance between each line/grid square
+
+	// Scale the texture repetition. Higher values make the texture repeat more.
+	float textureScale = 100.0f;  // Adjust this value to control how often the texture repeats
+
+	glBegin(GL_QUADS);
+	for (float i = -halfSize; i < halfSize; i += step) {
+		for (float j = -halfSize; j < halfSize; j += step) {
+			// Map the texture to each grid cell with scaled texture coordinates
+			glTexCoord2f(i / size * textureScale, j / size * textureScale); glVertex3f(i, 0.0f, j);            // Bottom-left corner
+			glTexCoord2f((i + step) / size * textureScale, j / size * textureScale); glVertex3f(i + step, 0.0f, j);     // Bottom-right corner
+			glTexCoord2f((i + step) / size * textureScale, (j + step) / size * textureScale); glVertex3f(i + step, 0.0f, j + step);  // Top-right corner
+			glTexCoord2f(i / size * textureScale, (j + step) / size * textureScale); glVertex3f(i, 0.0f, j + step);     // Top-left corner
+		}
+	}
+	glEnd();
+}
+
+
 
-
 void loadTextures(void)
 {
 	glGenTextures(4, texID);  // Get the texture object IDs.
@@ -1289,7 +3000,7 @@ void loadTextures(void)
 		fclose(fileID);
 		if (imageData)
 		{
-			glBindTexture(GL_TEXTURE_2D, texID[j]);
+			cachedBindTexture(texID[j]);
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, imageWidth, imageHeight, 0, GL_RGB,
 				GL_UNSIGNED_BYTE, imageData);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); // Required since there are no mipmaps.
@@ -1317,15 +3028,15 @@ int isGrounded() {
 
 void drawSkybox(float size) {
 
-	glDisable(GL_DEPTH_TEST);  // Disable depth testing so skybox appears behind everything
+	cachedDisable(GL_DEPTH_TEST);  // Disable depth testing so skybox appears behind everything
 
 	// Bind the same sky texture for all faces
-	glBindTexture(GL_TEXTURE_2D, texID[3]);
+	cachedBindTexture(texID[3]);
 
 	// Add this line to ensure full texture color
 	glColor3f(1.0f, 1.0f, 1.0f);
 	// Enable texturing for the skybox
-	glEnable(GL_TEXTURE_2D);
+	cachedEnable(GL_TEXTURE_2D);
 
 
 	glBegin(GL_QUADS);
@@ -1369,21 +3080,21 @@ void drawSkybox(float size) {
 	glEnd();
 
 
-	glDisable(GL_TEXTURE_2D);
+	cachedDisable(GL_TEXTURE_2D);
 
 
-	glEnable(GL_DEPTH_TEST);  // Re-enable depth testing after drawing the skybox
+	cachedEnable(GL_DEPTH_TEST);  // Re-enable depth testing after drawing the skybox
 }
 
-void drawHouse(float width, float height, float depth) {
+void buildHouse(meshbuilder_t* builder, float width, float height, float depth) {
 	// Bind the marble texture for the walls
-	glBindTexture(GL_TEXTURE_2D, texID[2]);  // Assuming texID[2] is the marble texture
+	builderBindTexture(builder, texID[2]);  // Assuming texID[2] is the marble texture
 
 	// Enable 2D texture mapping
-	glEnable(GL_TEXTURE_2D);
+	builderEnableTexture(builder, 1);
 
 	// Set the house color to white to avoid altering the texture's color
-	glColor3f(1.0f, 1.0f, 1.0f);
+	builderColor3f(builder, 1.0f, 1.0f, 1.0f);
 
 	// Half dimensions for positioning
 	float halfWidth = width / 2.0f;
@@ -1391,164 +3102,164 @@ void drawHouse(float width, float height, float depth) {
 	float halfDepth = depth / 2.0f;
 
 	// Draw the walls of the house (a cuboid with texture)
-	glPushMatrix();
+	builderPushMatrix(builder);
 
 	// Front wall with texture
-	glBegin(GL_QUADS);
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-halfWidth, -halfHeight, halfDepth);   // Bottom-left
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(halfWidth, -halfHeight, halfDepth);    // Bottom-right
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(halfWidth, halfHeight, halfDepth);     // Top-right
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(-halfWidth, halfHeight, halfDepth);    // Top-left
-	glEnd();
+	builderBegin(builder, GL_QUADS);
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -halfWidth, -halfHeight, halfDepth);   // Bottom-left
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, halfWidth, -halfHeight, halfDepth);    // Bottom-right
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, halfWidth, halfHeight, halfDepth);     // Top-right
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, -halfWidth, halfHeight, halfDepth);    // Top-left
+	builderEnd(builder);
 
 	// Back wall with texture
-	glBegin(GL_QUADS);
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(halfWidth, -halfHeight, -halfDepth);   // Bottom-right
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(-halfWidth, -halfHeight, -halfDepth);  // Bottom-left
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(-halfWidth, halfHeight, -halfDepth);   // Top-left
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(halfWidth, halfHeight, -halfDepth);    // Top-right
-	glEnd();
+	builderBegin(builder, GL_QUADS);
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, halfWidth, -halfHeight, -halfDepth);   // Bottom-right
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, -halfWidth, -halfHeight, -halfDepth);  // Bottom-left
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, -halfWidth, halfHeight, -halfDepth);   // Top-left
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, halfWidth, halfHeight, -halfDepth);    // Top-right
+	builderEnd(builder);
 
 	// Left wall with texture
-	glBegin(GL_QUADS);
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-halfWidth, -halfHeight, -halfDepth);  // Bottom-left
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(-halfWidth, -halfHeight, halfDepth);   // Bottom-right
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(-halfWidth, halfHeight, halfDepth);    // Top-right
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(-halfWidth, halfHeight, -halfDepth);   // Top-left
-	glEnd();
+	builderBegin(builder, GL_QUADS);
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -halfWidth, -halfHeight, -halfDepth);  // Bottom-left
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, -halfWidth, -halfHeight, halfDepth);   // Bottom-right
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, -halfWidth, halfHeight, halfDepth);    // Top-right
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, -halfWidth, halfHeight, -halfDepth);   // Top-left
+	builderEnd(builder);
 
 	// Right wall with texture
-	glBegin(GL_QUADS);
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(halfWidth, -halfHeight, halfDepth);    // Bottom-right
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(halfWidth, -halfHeight, -halfDepth);   // Bottom-left
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(halfWidth, halfHeight, -halfDepth);    // Top-left
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(halfWidth, halfHeight, halfDepth);     // Top-right
-	glEnd();
+	builderBegin(builder, GL_QUADS);
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, halfWidth, -halfHeight, halfDepth);    // Bottom-right
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, halfWidth, -halfHeight, -halfDepth);   // Bottom-left
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, halfWidth, halfHeight, -halfDepth);    // Top-left
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, halfWidth, halfHeight, halfDepth);     // Top-right
+	builderEnd(builder);
 
-	glPopMatrix();
+	builderPopMatrix(builder);
 
 	// Disable 2D texture mapping after drawing the walls
-	glDisable(GL_TEXTURE_2D);
+	builderEnableTexture(builder, 0);
 
 
 	// **Drawing the roof with texture coordinates**
-	glBindTexture(GL_TEXTURE_2D, texID[0]);  // Assuming texID[0] is the roof texture
+	builderBindTexture(builder, texID[0]);  // Assuming texID[0] is the roof texture
 
 	// Enable 2D texture mapping
-	glEnable(GL_TEXTURE_2D);
+	builderEnableTexture(builder, 1);
 
 	// Draw the roof of the house (5-sided roof)
-	glColor3f(1.0f, 1.0f, 1.0f);  // White color to avoid altering the roof texture
+	builderColor3f(builder, 1.0f, 1.0f, 1.0f);  // White color to avoid altering the roof texture
 
 	float roofHeight = height / 2.0f;  // Half the height for the roof
 	float overhang = 0.2f * width;  // Amount to extend the roof beyond the house edges
 
 	// Front triangular gable (with texture coordinates)
-	glBegin(GL_TRIANGLES);
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-halfWidth - overhang, halfHeight, halfDepth);  // Left bottom corner (extended)
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(halfWidth + overhang, halfHeight, halfDepth);   // Right bottom corner (extended)
-	glTexCoord2f(0.5f, 1.0f); glVertex3f(0.0f, halfHeight + roofHeight, halfDepth);  // Roof peak (center top)
-	glEnd();
+	builderBegin(builder, GL_TRIANGLES);
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -halfWidth - overhang, halfHeight, halfDepth);  // Left bottom corner (extended)
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, halfWidth + overhang, halfHeight, halfDepth);   // Right bottom corner (extended)
+	builderTexCoord2f(builder, 0.5f, 1.0f); builderVertex3f(builder, 0.0f, halfHeight + roofHeight, halfDepth);  // Roof peak (center top)
+	builderEnd(builder);
 
 	// Back triangular gable (with texture coordinates)
-	glBegin(GL_TRIANGLES);
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-halfWidth - overhang, halfHeight, -halfDepth);  // Left bottom corner (extended)
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(halfWidth + overhang, halfHeight, -halfDepth);   // Right bottom corner (extended)
-	glTexCoord2f(0.5f, 1.0f); glVertex3f(0.0f, halfHeight + roofHeight, -halfDepth);  // Roof peak (center top)
-	glEnd();
+	builderBegin(builder, GL_TRIANGLES);
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -halfWidth - overhang, halfHeight, -halfDepth);  // Left bottom corner (extended)
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, halfWidth + overhang, halfHeight, -halfDepth);   // Right bottom corner (extended)
+	builderTexCoord2f(builder, 0.5f, 1.0f); builderVertex3f(builder, 0.0f, halfHeight + roofHeight, -halfDepth);  // Roof peak (center top)
+	builderEnd(builder);
 
 	// Left sloped roof side (with texture coordinates)
-	glBegin(GL_QUADS);
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-halfWidth - overhang, halfHeight, halfDepth);   // Front left bottom (extended)
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(-halfWidth - overhang, halfHeight, -halfDepth);  // Back left bottom (extended)
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(0.0f, halfHeight + roofHeight, -halfDepth);  // Back roof peak
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(0.0f, halfHeight + roofHeight, halfDepth);   // Front roof peak
-	glEnd();
+	builderBegin(builder, GL_QUADS);
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -halfWidth - overhang, halfHeight, halfDepth);   // Front left bottom (extended)
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, -halfWidth - overhang, halfHeight, -halfDepth);  // Back left bottom (extended)
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, 0.0f, halfHeight + roofHeight, -halfDepth);  // Back roof peak
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, 0.0f, halfHeight + roofHeight, halfDepth);   // Front roof peak
+	builderEnd(builder);
 
 	// Right sloped roof side (with texture coordinates)
-	glBegin(GL_QUADS);
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(halfWidth + overhang, halfHeight, halfDepth);    // Front right bottom (extended)
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(halfWidth + overhang, halfHeight, -halfDepth);   // Back right bottom (extended)
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(0.0f, halfHeight + roofHeight, -halfDepth);  // Back roof peak
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(0.0f, halfHeight + roofHeight, halfDepth);   // Front roof peak
-	glEnd();
+	builderBegin(builder, GL_QUADS);
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, halfWidth + overhang, halfHeight, halfDepth);    // Front right bottom (extended)
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, halfWidth + overhang, halfHeight, -halfDepth);   // Back right bottom (extended)
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, 0.0f, halfHeight + roofHeight, -halfDepth);  // Back roof peak
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, 0.0f, halfHeight + roofHeight, halfDepth);   // Front roof peak
+	builderEnd(builder);
 
 	// Disable 2D texture mapping after drawing the roof
-	glDisable(GL_TEXTURE_2D);
+	builderEnableTexture(builder, 0);
 
 	// **Draw windows on the walls**
-	glColor3f(0.53f, 0.81f, 0.98f);  // Light blue for the windows
+	builderColor3f(builder, 0.53f, 0.81f, 0.98f);  // Light blue for the windows
 
 	// Window on the front wall (left side)
-	glPushMatrix();
-	glBegin(GL_QUADS);
-	glVertex3f(-halfWidth / 1.5, halfHeight / 3, halfDepth + 0.01f);  // Bottom-left (raised)
-	glVertex3f(-halfWidth / 4, halfHeight / 3, halfDepth + 0.01f);    // Bottom-right (raised)
-	glVertex3f(-halfWidth / 4, halfHeight / 1.5, halfDepth + 0.01f);  // Top-right (raised)
-	glVertex3f(-halfWidth / 1.5, halfHeight / 1.5, halfDepth + 0.01f); // Top-left (raised)
-	glEnd();
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderBegin(builder, GL_QUADS);
+	builderVertex3f(builder, -halfWidth / 1.5, halfHeight / 3, halfDepth + 0.01f);  // Bottom-left (raised)
+	builderVertex3f(builder, -halfWidth / 4, halfHeight / 3, halfDepth + 0.01f);    // Bottom-right (raised)
+	builderVertex3f(builder, -halfWidth / 4, halfHeight / 1.5, halfDepth + 0.01f);  // Top-right (raised)
+	builderVertex3f(builder, -halfWidth / 1.5, halfHeight / 1.5, halfDepth + 0.01f); // Top-left (raised)
+	builderEnd(builder);
+	builderPopMatrix(builder);
 
 	// Window on the back wall (centered)
-	glPushMatrix();
-	glBegin(GL_QUADS);
-	glVertex3f(-halfWidth / 1.5, halfHeight / 3, -halfDepth - 0.01f);  // Bottom-left (raised)
-	glVertex3f(-halfWidth / 4, halfHeight / 3, -halfDepth - 0.01f);    // Bottom-right (raised)
-	glVertex3f(-halfWidth / 4, halfHeight / 1.5, -halfDepth - 0.01f);  // Top-right (raised)
-	glVertex3f(-halfWidth / 1.5, halfHeight / 1.5, -halfDepth - 0.01f); // Top-left (raised)
-	glEnd();
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderBegin(builder, GL_QUADS);
+	builderVertex3f(builder, -halfWidth / 1.5, halfHeight / 3, -halfDepth - 0.01f);  // Bottom-left (raised)
+	builderVertex3f(builder, -halfWidth / 4, halfHeight / 3, -halfDepth - 0.01f);    // Bottom-right (raised)
+	builderVertex3f(builder, -halfWidth / 4, halfHeight / 1.5, -halfDepth - 0.01f);  // Top-right (raised)
+	builderVertex3f(builder, -halfWidth / 1.5, halfHeight / 1.5, -halfDepth - 0.01f); // Top-left (raised)
+	builderEnd(builder);
+	builderPopMatrix(builder);
 
 	// Left wall - first window (left side)
-	glPushMatrix();
-	glBegin(GL_QUADS);
-	glVertex3f(-halfWidth - 0.01f, halfHeight / 3, halfDepth / 2);  // Bottom-left (raised)
-	glVertex3f(-halfWidth - 0.01f, halfHeight / 3, halfDepth / 1.5); // Bottom-right (raised)
-	glVertex3f(-halfWidth - 0.01f, halfHeight / 1.5, halfDepth / 1.5); // Top-right (raised)
-	glVertex3f(-halfWidth - 0.01f, halfHeight / 1.5, halfDepth / 2); // Top-left (raised)
-	glEnd();
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderBegin(builder, GL_QUADS);
+	builderVertex3f(builder, -halfWidth - 0.01f, halfHeight / 3, halfDepth / 2);  // Bottom-left (raised)
+	builderVertex3f(builder, -halfWidth - 0.01f, halfHeight / 3, halfDepth / 1.5); // Bottom-right (raised)
+	builderVertex3f(builder, -halfWidth - 0.01f, halfHeight / 1.5, halfDepth / 1.5); // Top-right (raised)
+	builderVertex3f(builder, -halfWidth - 0.01f, halfHeight / 1.5, halfDepth / 2); // Top-left (raised)
+	builderEnd(builder);
+	builderPopMatrix(builder);
 
 	// Left wall - second window (right side)
-	glPushMatrix();
-	glBegin(GL_QUADS);
-	glVertex3f(-halfWidth - 0.01f, halfHeight / 3, -halfDepth / 1.5);  // Bottom-left (raised)
-	glVertex3f(-halfWidth - 0.01f, halfHeight / 3, -halfDepth / 2); // Bottom-right (raised)
-	glVertex3f(-halfWidth - 0.01f, halfHeight / 1.5, -halfDepth / 2); // Top-right (raised)
-	glVertex3f(-halfWidth - 0.01f, halfHeight / 1.5, -halfDepth / 1.5); // Top-left (raised)
-	glEnd();
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderBegin(builder, GL_QUADS);
+	builderVertex3f(builder, -halfWidth - 0.01f, halfHeight / 3, -halfDepth / 1.5);  // Bottom-left (raised)
+	builderVertex3f(builder, -halfWidth - 0.01f, halfHeight / 3, -halfDepth / 2); // Bottom-right (raised)
+	builderVertex3f(builder, -halfWidth - 0.01f, halfHeight / 1.5, -halfDepth / 2); // Top-right (raised)
+	builderVertex3f(builder, -halfWidth - 0.01f, halfHeight / 1.5, -halfDepth / 1.5); // Top-left (raised)
+	builderEnd(builder);
+	builderPopMatrix(builder);
 
 	// Right wall - first window (left side)
-	glPushMatrix();
-	glBegin(GL_QUADS);
-	glVertex3f(halfWidth + 0.01f, halfHeight / 3, halfDepth / 2);  // Bottom-left (raised)
-	glVertex3f(halfWidth + 0.01f, halfHeight / 3, halfDepth / 1.5); // Bottom-right (raised)
-	glVertex3f(halfWidth + 0.01f, halfHeight / 1.5, halfDepth / 1.5); // Top-right (raised)
-	glVertex3f(halfWidth + 0.01f, halfHeight / 1.5, halfDepth / 2); // Top-left (raised)
-	glEnd();
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderBegin(builder, GL_QUADS);
+	builderVertex3f(builder, halfWidth + 0.01f, halfHeight / 3, halfDepth / 2);  // Bottom-left (raised)
+	builderVertex3f(builder, halfWidth + 0.01f, halfHeight / 3, halfDepth / 1.5); // Bottom-right (raised)
+	builderVertex3f(builder, halfWidth + 0.01f, halfHeight / 1.5, halfDepth / 1.5); // Top-right (raised)
+	builderVertex3f(builder, halfWidth + 0.01f, halfHeight / 1.5, halfDepth / 2); // Top-left (raised)
+	builderEnd(builder);
+	builderPopMatrix(builder);
 
 	// Right wall - second window (right side)
-	glPushMatrix();
-	glBegin(GL_QUADS);
-	glVertex3f(halfWidth + 0.01f, halfHeight / 3, -halfDepth / 1.5);  // Bottom-left (raised)
-	glVertex3f(halfWidth + 0.01f, halfHeight / 3, -halfDepth / 2); // Bottom-right (raised)
-	glVertex3f(halfWidth + 0.01f, halfHeight / 1.5, -halfDepth / 2); // Top-right (raised)
-	glVertex3f(halfWidth + 0.01f, halfHeight / 1.5, -halfDepth / 1.5); // Top-left (raised)
-	glEnd();
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderBegin(builder, GL_QUADS);
+	builderVertex3f(builder, halfWidth + 0.01f, halfHeight / 3, -halfDepth / 1.5);  // Bottom-left (raised)
+	builderVertex3f(builder, halfWidth + 0.01f, halfHeight / 3, -halfDepth / 2); // Bottom-right (raised)
+	builderVertex3f(builder, halfWidth + 0.01f, halfHeight / 1.5, -halfDepth / 2); // Top-right (raised)
+	builderVertex3f(builder, halfWidth + 0.01f, halfHeight / 1.5, -halfDepth / 1.5); // Top-left (raised)
+	builderEnd(builder);
+	builderPopMatrix(builder);
 
 	// Front wall - Wooden door (centered on the front wall)
-	glPushMatrix();
-	glColor3f(0.55f, 0.27f, 0.07f);  // Brown color for the wooden door
-	glBegin(GL_QUADS);
-	glVertex3f(-halfWidth / 8, 0.0f, halfDepth + 0.01f);  // Bottom-left (moved right)
-	glVertex3f(halfWidth / 8 + halfWidth / 8, 0.0f, halfDepth + 0.01f);   // Bottom-right (moved right)
-	glVertex3f(halfWidth / 8 + halfWidth / 8, halfHeight / 2, halfDepth + 0.01f);  // Top-right (moved right)
-	glVertex3f(-halfWidth / 8, halfHeight / 2, halfDepth + 0.01f);  // Top-left (moved right)
-	glEnd();
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderColor3f(builder, 0.55f, 0.27f, 0.07f);  // Brown color for the wooden door
+	builderBegin(builder, GL_QUADS);
+	builderVertex3f(builder, -halfWidth / 8, 0.0f, halfDepth + 0.01f);  // Bottom-left (moved right)
+	builderVertex3f(builder, halfWidth / 8 + halfWidth / 8, 0.0f, halfDepth + 0.01f);   // Bottom-right (moved right)
+	builderVertex3f(builder, halfWidth / 8 + halfWidth / 8, halfHeight / 2, halfDepth + 0.01f);  // Top-right (moved right)
+	builderVertex3f(builder, -halfWidth / 8, halfHeight / 2, halfDepth + 0.01f);  // Top-left (moved right)
+	builderEnd(builder);
+	builderPopMatrix(builder);
 
 	
 }
@@ -1560,17 +3271,18 @@ void applyMetallicMaterial() {
 	GLfloat mat_specular[] = { 0.1f, 0.1f, 0.1f, 1.0f }; // High specular reflectance for shininess
 	GLfloat mat_shininess[] = { 10.0f }; // High shininess for sharp highlights
 
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, mat_ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mat_diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat_specular);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, mat_shininess);
+	cachedMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, mat_ambient);
+	cachedMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mat_diffuse);
+	cachedMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat_specular);
+	cachedMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, mat_shininess);
 }
 
-void drawAircraft() {
-
-	// Apply metallic material
-	//applyMetallicMaterial();
-
+/*
+	Built into meshes[MESH_AIRFRAME] by initMeshes(): everything on the aircraft that
+	doesn't move relative to the body. The pieces are grouped by material (body, cockpit,
+	landing gear), so the whole airframe is one draw call per material.
+*/
+void buildAirframeMesh(meshbuilder_t* builder) {
 	// Define material properties for the matte body
 	GLfloat body_ambient[] = { 0.2f, 0.3f, 0.7f, 1.0f };
 	GLfloat body_diffuse[] = { 0.2f, 0.3f, 0.7f, 1.0f };
@@ -1589,454 +3301,429 @@ void drawAircraft() {
 	GLfloat landing_specular[] = { 0.8f, 0.8f, 0.8f, 1.0f };
 	GLfloat langding_shininess[] = { 50.0f };
 
-	// Material properties for the propeller blades
-	GLfloat propeller_ambient[] = { 0.2f, 0.2f, 0.2f, 1.0f };
-	GLfloat propeller_diffuse[] = { 0.2f, 0.2f, 0.2f, 1.0f };
-	GLfloat propeller_specular[] = { 0.1f, 0.1f, 0.1f, 1.0f };
-	GLfloat propeller_shininess[] = { 10.0f };
-
-	// Enable lighting
-	glEnable(GL_LIGHTING);
+	// Use the materials above rather than GL_COLOR_MATERIAL
+	builderColorMaterial(builder, 0);
 
 	// Apply metallic material for the body
-	glMaterialfv(GL_FRONT, GL_AMBIENT, body_ambient);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, body_diffuse);
-	glMaterialfv(GL_FRONT, GL_SPECULAR, body_specular);
-	glMaterialfv(GL_FRONT, GL_SHININESS, body_shininess);
+	builderMaterialfv(builder, GL_AMBIENT, body_ambient);
+	builderMaterialfv(builder, GL_DIFFUSE, body_diffuse);
+	builderMaterialfv(builder, GL_SPECULAR, body_specular);
+	builderMaterialfv(builder, GL_SHININESS, body_shininess);
 
 	//Double Propeller Fighter
-	glPushMatrix();
 	//glColor3f(0.1f, 0.1f, 0.3f);
 
 	// Draw body
-	glPushMatrix();
-	glScalef(0.25f, 0.25f, 1.0f);  // Scale along the x, y, and z axes to create an oval
-	gluSphere(sphereQuadric, BODY_RADIUS, 50.0, 50.0);
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);  // Scale along the x, y, and z axes to create an oval
+	builderSphere(builder, BODY_RADIUS, 50, 50, 0);
+	builderPopMatrix(builder);
 
 
 	// draw Tail
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f);
-	glScalef(0.25f, 0.25f, 1.0f);
-	glTranslatef(0.0f, 0.0f, BODY_RADIUS * 0.5f);
-	glRotatef(0.0f, 0.0f, 1.0f, 0.0f);
-	glScalef(0.9f, 0.9f, 1.5f);
-	glutSolidCone(1.0, 1.0, 50.0, 50.0);
-	glPopMatrix();
-
-
-	// Apply glass-like material for the cockpit
-	glMaterialfv(GL_FRONT, GL_AMBIENT, cockpit_ambient);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, cockpit_diffuse);
-	glMaterialfv(GL_FRONT, GL_SPECULAR, cockpit_specular);
-	glMaterialfv(GL_FRONT, GL_SHININESS, cockpit_shininess);
-
-	// Draw cockpit
-	glPushMatrix();
-	//glColor3f(0.9f, 0.9f, 0.9f);
-	glScalef(0.125f, 0.25f, 0.5f);  // Scale along the x, y, and z axes to create an oval
-	glTranslatef(0.0f, 0.5f, -0.5f);  // Adjust to position the left body beside the main body
-	gluSphere(sphereQuadric, BODY_RADIUS, 50.0, 50.0);
-	glPopMatrix();
-
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
+	builderTranslatef(builder, 0.0f, 0.0f, BODY_RADIUS * 0.5f);
+	builderRotatef(builder, 0.0f, 0.0f, 1.0f, 0.0f);
+	builderScalef(builder, 0.9f, 0.9f, 1.5f);
+	builderCone(builder, 1.0f, 1.0f, 50, 50);
+	builderPopMatrix(builder);
 
-	// Apply matte material again for the rest of the body
-	glMaterialfv(GL_FRONT, GL_AMBIENT, body_ambient);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, body_diffuse);
-	glMaterialfv(GL_FRONT, GL_SPECULAR, body_specular);
-	glMaterialfv(GL_FRONT, GL_SHININESS, body_shininess);
 
 	// Draw Left engine and Tail
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f);  // Same color as the main body
-	glScalef(0.25f, 0.25f, 1.0f);
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
 	// Translate the left side body to the left of the main body
-	glTranslatef(-3.5f, -0.5f, 0.0f);  // Adjust to position the left body beside the main body
+	builderTranslatef(builder, -3.5f, -0.5f, 0.0f);  // Adjust to position the left body beside the main body
 	// Scale along the x, y, and z axes to create an oval (same as main body)
-	glScalef(0.75f, 0.75f, 0.5f);
+	builderScalef(builder, 0.75f, 0.75f, 0.5f);
 	// Draw the left engine
-	gluSphere(sphereQuadric, BODY_RADIUS, 50.0, 50.0);
+	builderSphere(builder, BODY_RADIUS, 50, 50, 0);
 	// Draw the left enginetail
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f);  // Color for the tail
-	glTranslatef(0.0f, 0.0f, BODY_RADIUS * 0.5f);  // Position the tail at the back of the body
-	glRotatef(0.0f, 0.0f, 1.0f, 0.0f);  // Rotate if needed
-	glScalef(0.9f, 0.9f, 1.5f);  // Scale the tail to desired size
-	glutSolidCone(1.0, 1.0, 50.0, 50.0);  // Draw the cone-shaped tail
-	glPopMatrix();
+	builderTranslatef(builder, 0.0f, 0.0f, BODY_RADIUS * 0.5f);  // Position the tail at the back of the body
+	builderRotatef(builder, 0.0f, 0.0f, 1.0f, 0.0f);  // Rotate if needed
+	builderScalef(builder, 0.9f, 0.9f, 1.5f);  // Scale the tail to desired size
+	builderCone(builder, 1.0f, 1.0f, 50, 50);  // Draw the cone-shaped tail
+	builderPopMatrix(builder);
 	// Draw the left enginehead
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3fv(PALE_ORANGE);  // Color for the tail
-	glTranslatef(0.0f, 0.0f, -BODY_RADIUS * 0.9f);  // Position the tail at the back of the body
-	glRotatef(180.0f, 0.0f, 1.0f, 0.0f);  // Rotate if needed
-	glScalef(0.25f, 0.25f, 0.25f);  // Scale the tail to desired size
-	glutSolidCone(1.0, 1.0, 50.0, 50.0);  // Draw the cone-shaped tail
-	glPopMatrix();
-	glPopMatrix();
+	builderTranslatef(builder, 0.0f, 0.0f, -BODY_RADIUS * 0.9f);  // Position the tail at the back of the body
+	builderRotatef(builder, 180.0f, 0.0f, 1.0f, 0.0f);  // Rotate if needed
+	builderScalef(builder, 0.25f, 0.25f, 0.25f);  // Scale the tail to desired size
+	builderCone(builder, 1.0f, 1.0f, 50, 50);  // Draw the cone-shaped tail
+	builderPopMatrix(builder);
+	builderPopMatrix(builder);
 
 
 	// Draw Right Side engine and Tail
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f); // Same color as the main body
-	glScalef(0.25f, 0.25f, 1.0f);
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
 	// Translate the right side body to the right of the main body
-	glTranslatef(3.5f, -0.5f, 0.0f);  // Adjust to position the right body beside the main body
+	builderTranslatef(builder, 3.5f, -0.5f, 0.0f);  // Adjust to position the right body beside the main body
 	// Scale along the x, y, and z axes to create an oval (same as main body)
-	glScalef(0.75f, 0.75f, 0.5f);
+	builderScalef(builder, 0.75f, 0.75f, 0.5f);
 	// Draw the right engine
-	gluSphere(sphereQuadric, BODY_RADIUS, 50.0, 50.0);
+	builderSphere(builder, BODY_RADIUS, 50, 50, 0);
 	// Draw the right enginetail
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f); // Color for the tail
-	glTranslatef(0.0f, 0.0f, BODY_RADIUS * 0.5f);  // Position the tail at the back of the body
-	glRotatef(0.0f, 0.0f, 1.0f, 0.0f);  // Rotate if needed
-	glScalef(0.9f, 0.9f, 1.5f);  // Scale the tail to desired size
-	glutSolidCone(1.0, 1.0, 50.0, 50.0);  // Draw the cone-shaped tail
-	glPopMatrix();
+	builderTranslatef(builder, 0.0f, 0.0f, BODY_RADIUS * 0.5f);  // Position the tail at the back of the body
+	builderRotatef(builder, 0.0f, 0.0f, 1.0f, 0.0f);  // Rotate if needed
+	builderScalef(builder, 0.9f, 0.9f, 1.5f);  // Scale the tail to desired size
+	builderCone(builder, 1.0f, 1.0f, 50, 50);  // Draw the cone-shaped tail
+	builderPopMatrix(builder);
 	// Draw the right enginehead
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3fv(PALE_ORANGE);  // Color for the tail
-	glTranslatef(0.0f, 0.0f, -BODY_RADIUS * 0.9f);  // Position the tail at the back of the body
-	glRotatef(180.0f, 0.0f, 1.0f, 0.0f);  // Rotate if needed
-	glScalef(0.25f, 0.25f, 0.25f);  // Scale the tail to desired size
-	glutSolidCone(1.0, 1.0, 50.0, 50.0);  // Draw the cone-shaped tail
-	glPopMatrix();
-	glPopMatrix();
+	builderTranslatef(builder, 0.0f, 0.0f, -BODY_RADIUS * 0.9f);  // Position the tail at the back of the body
+	builderRotatef(builder, 180.0f, 0.0f, 1.0f, 0.0f);  // Rotate if needed
+	builderScalef(builder, 0.25f, 0.25f, 0.25f);  // Scale the tail to desired size
+	builderCone(builder, 1.0f, 1.0f, 50, 50);  // Draw the cone-shaped tail
+	builderPopMatrix(builder);
+	builderPopMatrix(builder);
 
 
 
 	// Draw center tailfan
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f);  // Color of the cylinder
-	glScalef(0.25f, 0.25f, 1.0f);
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
 	// Translate the cylinder to be on top of the tail (adjust the height and position based on your model)
-	glTranslatef(0.0f, BODY_RADIUS * 1.2f, BODY_RADIUS * 1.6f);  // Adjust to place on top of the tail
-	glRotatef(90.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make it vertical (standing on the tail)
+	builderTranslatef(builder, 0.0f, BODY_RADIUS * 1.2f, BODY_RADIUS * 1.6f);  // Adjust to place on top of the tail
+	builderRotatef(builder, 90.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make it vertical (standing on the tail)
 	// Flatten the cylinder by scaling it along the z-axis
-	glScalef(0.5f, 1.0f, 1.0f);  // Scale along z-axis to make it flatter
+	builderScalef(builder, 0.5f, 1.0f, 1.0f);  // Scale along z-axis to make it flatter
 	// Draw the base disk of the cylinder
-	GLUquadric* quadric = gluNewQuadric();
-	gluDisk(quadric, 0.0f, 0.2f, 32, 1);  // Disk at the base with radius 0.2
+	builderDisk(builder, 0.0f, 0.2f, 32, 1, 0);  // Disk at the base with radius 0.2
 	// Draw the cylinder (base radius, top radius, height, slices, stacks)
-	gluCylinder(quadric, 0.2f, 0.3f, 1.25f, 32, 32);  // Small radius cylinder
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderCylinder(builder, 0.2f, 0.3f, 1.25f, 32, 32, 0);  // Small radius cylinder
+	builderPopMatrix(builder);
 
 	// Draw Left tailfan
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f);// Same color for the left cylinder
-	glScalef(0.25f, 0.25f, 1.0f);
-	glTranslatef(-1.3f, BODY_RADIUS * 0.0f, BODY_RADIUS * 1.6f);  // Translate to the left of the first cylinder
-	glRotatef(0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
-	glRotatef(90.0f, 0.0f, 1.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
+	builderTranslatef(builder, -1.3f, BODY_RADIUS * 0.0f, BODY_RADIUS * 1.6f);  // Translate to the left of the first cylinder
+	builderRotatef(builder, 0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
+	builderRotatef(builder, 90.0f, 0.0f, 1.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
 	// Flatten the cylinder by scaling it along the y-axis
-	glScalef(1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
+	builderScalef(builder, 1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
 	// Draw the base disk of the cylinder
-	quadric = gluNewQuadric();
-	gluDisk(quadric, 0.0f, 0.2f, 32, 1);  // Disk at the base with radius 0.2
+	builderDisk(builder, 0.0f, 0.2f, 32, 1, 0);  // Disk at the base with radius 0.2
 	// Draw the cylinder
-	gluCylinder(quadric, 0.2f, 0.3f, 1.25f, 32, 32);  // Left cylinder
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderCylinder(builder, 0.2f, 0.3f, 1.25f, 32, 32, 0);  // Left cylinder
+	builderPopMatrix(builder);
 
 
 	// Draw Right tailfan
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f);  // Same color for the right cylinder
-	glScalef(0.25f, 0.25f, 1.0f);
-	glTranslatef(1.3f, BODY_RADIUS * 0.0f, BODY_RADIUS * 1.6f);  // Translate to the right of the first cylinder
-	glRotatef(0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
-	glRotatef(270.0f, 0.0f, 1.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
+	builderTranslatef(builder, 1.3f, BODY_RADIUS * 0.0f, BODY_RADIUS * 1.6f);  // Translate to the right of the first cylinder
+	builderRotatef(builder, 0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
+	builderRotatef(builder, 270.0f, 0.0f, 1.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
 	// Flatten the cylinder by scaling it along the y-axis
-	glScalef(1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
+	builderScalef(builder, 1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
 	// Draw the base disk of the cylinder
-	quadric = gluNewQuadric();
-	gluDisk(quadric, 0.0f, 0.2f, 32, 1);  // Disk at the base with radius 0.2
+	builderDisk(builder, 0.0f, 0.2f, 32, 1, 0);  // Disk at the base with radius 0.2
 	// Draw the cylinder
-	gluCylinder(quadric, 0.2f, 0.3f, 1.25f, 32, 32);  // Right cylinder
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderCylinder(builder, 0.2f, 0.3f, 1.25f, 32, 32, 0);  // Right cylinder
+	builderPopMatrix(builder);
 
 
 
 	// Draw Leftbody tailfan
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f);  // Same color for the left cylinder
-	glScalef(0.25f, 0.25f, 1.0f);
-	glTranslatef(-6.3f, BODY_RADIUS * 0.0f, -BODY_RADIUS * 0.0f);  // Translate to the left of the first cylinder
-	glRotatef(0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
-	glRotatef(90.0f, 0.0f, 1.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
+	builderTranslatef(builder, -6.3f, BODY_RADIUS * 0.0f, -BODY_RADIUS * 0.0f);  // Translate to the left of the first cylinder
+	builderRotatef(builder, 0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
+	builderRotatef(builder, 90.0f, 0.0f, 1.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
 	// Flatten the cylinder by scaling it along the y-axis
-	glScalef(1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
+	builderScalef(builder, 1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
 	// Draw the base disk of the cylinder
-	quadric = gluNewQuadric();
-	gluDisk(quadric, 0.0f, 0.2f, 32, 1);  // Disk at the base with radius 0.2
+	builderDisk(builder, 0.0f, 0.2f, 32, 1, 0);  // Disk at the base with radius 0.2
 	// Draw the cylinder
-	gluCylinder(quadric, 0.2f, 0.3f, 5.5f, 32, 32);  // Left cylinder
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderCylinder(builder, 0.2f, 0.3f, 5.5f, 32, 32, 0);  // Left cylinder
+	builderPopMatrix(builder);
 
 
 	// Draw Rightbody tailfan
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.1f, 0.1f, 0.3f);  // Same color for the right cylinder
-	glScalef(0.25f, 0.25f, 1.0f);
-	glTranslatef(6.3f, BODY_RADIUS * 0.0f, -BODY_RADIUS * 0.0f);  // Translate to the right of the first cylinder
-	glRotatef(0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
-	glRotatef(270.0f, 0.0f, 1.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
+	builderTranslatef(builder, 6.3f, BODY_RADIUS * 0.0f, -BODY_RADIUS * 0.0f);  // Translate to the right of the first cylinder
+	builderRotatef(builder, 0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
+	builderRotatef(builder, 270.0f, 0.0f, 1.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
 	// Flatten the cylinder by scaling it along the y-axis
-	glScalef(1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
+	builderScalef(builder, 1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
 	// Draw the base disk of the cylinder
-	quadric = gluNewQuadric();
-	gluDisk(quadric, 0.0f, 0.2f, 32, 1);  // Disk at the base with radius 0.2
+	builderDisk(builder, 0.0f, 0.2f, 32, 1, 0);  // Disk at the base with radius 0.2
 	// Draw the cylinder
-	gluCylinder(quadric, 0.2f, 0.3f, 5.5f, 32, 32);  // Right cylinder
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderCylinder(builder, 0.2f, 0.3f, 5.5f, 32, 32, 0);  // Right cylinder
+	builderPopMatrix(builder);
+
+
+	// Apply glass-like material for the cockpit
+	builderMaterialfv(builder, GL_AMBIENT, cockpit_ambient);
+	builderMaterialfv(builder, GL_DIFFUSE, cockpit_diffuse);
+	builderMaterialfv(builder, GL_SPECULAR, cockpit_specular);
+	builderMaterialfv(builder, GL_SHININESS, cockpit_shininess);
+
+	// Draw cockpit
+	builderPushMatrix(builder);
+	//glColor3f(0.9f, 0.9f, 0.9f);
+	builderScalef(builder, 0.125f, 0.25f, 0.5f);  // Scale along the x, y, and z axes to create an oval
+	builderTranslatef(builder, 0.0f, 0.5f, -0.5f);  // Adjust to position the left body beside the main body
+	builderSphere(builder, BODY_RADIUS, 50, 50, 0);
+	builderPopMatrix(builder);
 
 
 	// Apply metallic material for the body
-	glMaterialfv(GL_FRONT, GL_AMBIENT, landing_ambient);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, landing_diffuse);
-	glMaterialfv(GL_FRONT, GL_SPECULAR, landing_specular);
-	glMaterialfv(GL_FRONT, GL_SHININESS, langding_shininess);
+	builderMaterialfv(builder, GL_AMBIENT, landing_ambient);
+	builderMaterialfv(builder, GL_DIFFUSE, landing_diffuse);
+	builderMaterialfv(builder, GL_SPECULAR, landing_specular);
+	builderMaterialfv(builder, GL_SHININESS, langding_shininess);
 
 	// Draw center landing gear
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.5f, 0.5f, 0.5f);  // Same color for the right cylinder
-	glScalef(0.25f, 0.25f, 1.0f);
-	glTranslatef(0.0f, -2.0f, -0.5f);  // Translate to the right of the first cylinder
-	glRotatef(0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
-	glRotatef(270.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
+	builderTranslatef(builder, 0.0f, -2.0f, -0.5f);  // Translate to the right of the first cylinder
+	builderRotatef(builder, 0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
+	builderRotatef(builder, 270.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
 	// Flatten the cylinder by scaling it along the y-axis
-	glScalef(1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
+	builderScalef(builder, 1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
 	// Draw the base disk of the cylinder
-	quadric = gluNewQuadric();
-	gluDisk(quadric, 0.0f, 0.05f, 32, 1);  // Disk at the base with radius 0.2
+	builderDisk(builder, 0.0f, 0.05f, 32, 1, 0);  // Disk at the base with radius 0.2
 	// Draw the cylinder
-	gluCylinder(quadric, 0.05f, 0.075f, 1.5f, 32, 32);  // Right cylinder
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderCylinder(builder, 0.05f, 0.075f, 1.5f, 32, 32, 0);  // Right cylinder
+	builderPopMatrix(builder);
 
 	// Draw wheel under center landing gear
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.0f, 0.0f, 0.0f);   // Color for the wheel
 	// Translate the wheel to be under the Rightbody cylinder
-	glTranslatef(-0.025f, -0.5f, -0.5f);  // Lower the wheel slightly under the Rightbody cylinder
+	builderTranslatef(builder, -0.025f, -0.5f, -0.5f);  // Lower the wheel slightly under the Rightbody cylinder
 	// Rotate the wheel by 90 degrees along the Z-axis
-	glRotatef(90.0f, 0.0f, 0.0f, 1.0f);  // Rotate the wheel by 90 degrees around the Z-axis
+	builderRotatef(builder, 90.0f, 0.0f, 0.0f, 1.0f);  // Rotate the wheel by 90 degrees around the Z-axis
 	// Rotate to make the wheel lie flat on the ground
-	glRotatef(90.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make the wheel lie flat (along the ground plane)
+	builderRotatef(builder, 90.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make the wheel lie flat (along the ground plane)
 	// No scaling to ensure the wheel remains round
 	// Draw the cylinder (body of the wheel)
-	quadric = gluNewQuadric();
-	gluCylinder(quadric, 0.05f, 0.05f, 0.05f, 32, 32);  // Cylinder for the wheel (same radius for top and bottom)
+	builderCylinder(builder, 0.05f, 0.05f, 0.05f, 32, 32, 0);  // Cylinder for the wheel (same radius for top and bottom)
 	// Draw the front disk of the wheel
-	glPushMatrix();
-	glTranslatef(0.0f, 0.0f, 0.0f);  // Place the disk at the front
-	gluDisk(quadric, 0.0f, 0.05f, 32, 1);  // Front disk with radius 0.2
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, 0.0f, 0.0f);  // Place the disk at the front
+	builderDisk(builder, 0.0f, 0.05f, 32, 1, 0);  // Front disk with radius 0.2
+	builderPopMatrix(builder);
 	// Draw the back disk of the wheel
-	glPushMatrix();
-	glTranslatef(0.0f, 0.0f, 0.05f);  // Move slightly along the z-axis to place the disk at the back
-	gluDisk(quadric, 0.0f, 0.05f, 32, 1);  // Back disk with radius 0.2
-	glPopMatrix();
-	// Clean up
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, 0.0f, 0.05f);  // Move slightly along the z-axis to place the disk at the back
+	builderDisk(builder, 0.0f, 0.05f, 32, 1, 0);  // Back disk with radius 0.2
+	builderPopMatrix(builder);
+	builderPopMatrix(builder);
 
 
 	// Draw Leftbody landing gear
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.5f, 0.5f, 0.5f);  // Same color for the right cylinder
-	glScalef(0.25f, 0.25f, 1.0f);
-	glTranslatef(-3.3f, -2.0f, 0.0f);  // Translate to the right of the first cylinder
-	glRotatef(0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
-	glRotatef(270.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
+	builderTranslatef(builder, -3.3f, -2.0f, 0.0f);  // Translate to the right of the first cylinder
+	builderRotatef(builder, 0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
+	builderRotatef(builder, 270.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
 	// Flatten the cylinder by scaling it along the y-axis
-	glScalef(1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
+	builderScalef(builder, 1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
 	// Draw the base disk of the cylinder
-	quadric = gluNewQuadric();
-	gluDisk(quadric, 0.0f, 0.05f, 32, 1);  // Disk at the base with radius 0.2
+	builderDisk(builder, 0.0f, 0.05f, 32, 1, 0);  // Disk at the base with radius 0.2
 	// Draw the cylinder
-	gluCylinder(quadric, 0.05f, 0.075f, 1.5f, 32, 32);  // Right cylinder
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderCylinder(builder, 0.05f, 0.075f, 1.5f, 32, 32, 0);  // Right cylinder
+	builderPopMatrix(builder);
 
 
 	// Draw Rightbody landing gear
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.5f, 0.5f, 0.5f);  // Same color for the right cylinder
-	glScalef(0.25f, 0.25f, 1.0f);
-	glTranslatef(3.3f, -2.0f, 0.0f);  // Translate to the right of the first cylinder
-	glRotatef(0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
-	glRotatef(270.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
+	builderScalef(builder, 0.25f, 0.25f, 1.0f);
+	builderTranslatef(builder, 3.3f, -2.0f, 0.0f);  // Translate to the right of the first cylinder
+	builderRotatef(builder, 0.0f, 1.0f, 0.0f, 0.0f);  // No vertical rotation
+	builderRotatef(builder, 270.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make it lie down (along the z-axis)
 	// Flatten the cylinder by scaling it along the y-axis
-	glScalef(1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
+	builderScalef(builder, 1.0f, 0.5f, 1.0f);  // Scale it along the y-axis to make it flatter
 	// Draw the base disk of the cylinder
-	quadric = gluNewQuadric();
-	gluDisk(quadric, 0.0f, 0.05f, 32, 1);  // Disk at the base with radius 0.2
+	builderDisk(builder, 0.0f, 0.05f, 32, 1, 0);  // Disk at the base with radius 0.2
 	// Draw the cylinder
-	gluCylinder(quadric, 0.05f, 0.075f, 1.5f, 32, 32);  // Right cylinder
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderCylinder(builder, 0.05f, 0.075f, 1.5f, 32, 32, 0);  // Right cylinder
+	builderPopMatrix(builder);
 
 
 	// Draw wheel under Rightbody landing gear
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.0f, 0.0f, 0.0f);  // Color for the wheel
 	// Translate the wheel to be under the Rightbody cylinder
-	glTranslatef(0.8f, -0.5f, 0.0f);  // Lower the wheel slightly under the Rightbody cylinder
+	builderTranslatef(builder, 0.8f, -0.5f, 0.0f);  // Lower the wheel slightly under the Rightbody cylinder
 	// Rotate the wheel by 90 degrees along the Z-axis
-	glRotatef(90.0f, 0.0f, 0.0f, 1.0f);  // Rotate the wheel by 90 degrees around the Z-axis
+	builderRotatef(builder, 90.0f, 0.0f, 0.0f, 1.0f);  // Rotate the wheel by 90 degrees around the Z-axis
 	// Rotate to make the wheel lie flat on the ground
-	glRotatef(90.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make the wheel lie flat (along the ground plane)
+	builderRotatef(builder, 90.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make the wheel lie flat (along the ground plane)
 	// No scaling to ensure the wheel remains round
 	// Draw the cylinder (body of the wheel)
-	quadric = gluNewQuadric();
-	gluCylinder(quadric, 0.05f, 0.05f, 0.05f, 32, 32);  // Cylinder for the wheel (same radius for top and bottom)
+	builderCylinder(builder, 0.05f, 0.05f, 0.05f, 32, 32, 0);  // Cylinder for the wheel (same radius for top and bottom)
 	// Draw the front disk of the wheel
-	glPushMatrix();
-	glTranslatef(0.0f, 0.0f, 0.0f);  // Place the disk at the front
-	gluDisk(quadric, 0.0f, 0.05f, 32, 1);  // Front disk with radius 0.2
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, 0.0f, 0.0f);  // Place the disk at the front
+	builderDisk(builder, 0.0f, 0.05f, 32, 1, 0);  // Front disk with radius 0.2
+	builderPopMatrix(builder);
 	// Draw the back disk of the wheel
-	glPushMatrix();
-	glTranslatef(0.0f, 0.0f, 0.05f);  // Move slightly along the z-axis to place the disk at the back
-	gluDisk(quadric, 0.0f, 0.05f, 32, 1);  // Back disk with radius 0.2
-	glPopMatrix();
-	// Clean up
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, 0.0f, 0.05f);  // Move slightly along the z-axis to place the disk at the back
+	builderDisk(builder, 0.0f, 0.05f, 32, 1, 0);  // Back disk with radius 0.2
+	builderPopMatrix(builder);
+	builderPopMatrix(builder);
 
 
 
 	// Draw wheel under Leftbody cylinder
-	glPushMatrix();
+	builderPushMatrix(builder);
 	//glColor3f(0.0f, 0.0f, 0.0f);   // Color for the wheel
 	// Translate the wheel to be under the Rightbody cylinder
-	glTranslatef(-0.85f, -0.5f, 0.0f);  // Lower the wheel slightly under the Rightbody cylinder
+	builderTranslatef(builder, -0.85f, -0.5f, 0.0f);  // Lower the wheel slightly under the Rightbody cylinder
 	// Rotate the wheel by 90 degrees along the Z-axis
-	glRotatef(90.0f, 0.0f, 0.0f, 1.0f);  // Rotate the wheel by 90 degrees around the Z-axis
+	builderRotatef(builder, 90.0f, 0.0f, 0.0f, 1.0f);  // Rotate the wheel by 90 degrees around the Z-axis
 	// Rotate to make the wheel lie flat on the ground
-	glRotatef(90.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make the wheel lie flat (along the ground plane)
+	builderRotatef(builder, 90.0f, 1.0f, 0.0f, 0.0f);  // Rotate to make the wheel lie flat (along the ground plane)
 	// No scaling to ensure the wheel remains round
 	// Draw the cylinder (body of the wheel)
-	quadric = gluNewQuadric();
-	gluCylinder(quadric, 0.05f, 0.05f, 0.05f, 32, 32);  // Cylinder for the wheel (same radius for top and bottom)
+	builderCylinder(builder, 0.05f, 0.05f, 0.05f, 32, 32, 0);  // Cylinder for the wheel (same radius for top and bottom)
 	// Draw the front disk of the wheel
-	glPushMatrix();
-	glTranslatef(0.0f, 0.0f, 0.0f);  // Place the disk at the front
-	gluDisk(quadric, 0.0f, 0.05f, 32, 1);  // Front disk with radius 0.2
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, 0.0f, 0.0f);  // Place the disk at the front
+	builderDisk(builder, 0.0f, 0.05f, 32, 1, 0);  // Front disk with radius 0.2
+	builderPopMatrix(builder);
 	// Draw the back disk of the wheel
-	glPushMatrix();
-	glTranslatef(0.0f, 0.0f, 0.05f);  // Move slightly along the z-axis to place the disk at the back
-	gluDisk(quadric, 0.0f, 0.05f, 32, 1);  // Back disk with radius 0.2
-	glPopMatrix();
-	// Clean up
-	gluDeleteQuadric(quadric);
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, 0.0f, 0.05f);  // Move slightly along the z-axis to place the disk at the back
+	builderDisk(builder, 0.0f, 0.05f, 32, 1, 0);  // Back disk with radius 0.2
+	builderPopMatrix(builder);
+	builderPopMatrix(builder);
+}
 
+/*
+	Built into meshes[MESH_ROTOR] by initMeshes(): one propeller, centred on its hub.
+	drawAircraft() spins a copy on each engine head.
+*/
+void buildRotorMesh(meshbuilder_t* builder) {
+	// Material properties for the propeller blades
+	GLfloat propeller_ambient[] = { 0.2f, 0.2f, 0.2f, 1.0f };
+	GLfloat propeller_diffuse[] = { 0.2f, 0.2f, 0.2f, 1.0f };
+	GLfloat propeller_specular[] = { 0.1f, 0.1f, 0.1f, 1.0f };
+	GLfloat propeller_shininess[] = { 10.0f };
 
-	// Apply metallic material for the body
-	glMaterialfv(GL_FRONT, GL_AMBIENT, propeller_ambient);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, propeller_diffuse);
-	glMaterialfv(GL_FRONT, GL_SPECULAR, propeller_specular);
-	glMaterialfv(GL_FRONT, GL_SHININESS, propeller_shininess);
+	builderColorMaterial(builder, 0);
+	builderMaterialfv(builder, GL_AMBIENT, propeller_ambient);
+	builderMaterialfv(builder, GL_DIFFUSE, propeller_diffuse);
+	builderMaterialfv(builder, GL_SPECULAR, propeller_specular);
+	builderMaterialfv(builder, GL_SHININESS, propeller_shininess);
 
-	// Draw propeller blades on the  left engine head
-	glPushMatrix();
-	//glColor3f(0.0f, 0.0f, 0.0f);  // Blade color (light gray)
-	// Translate to the tip of the engine head cone
-	glTranslatef(-0.87f, -0.12f, -0.55f * BODY_RADIUS);  // Adjust the translation based on the size of the cone
-	// Rotate propeller blades (add animation here if needed)
-	glRotatef(propellerRotationAngle, 0.0f, 0.0f, 1.0f);  // Rotate around z-axis for spinning effect
 	// Draw four blades (thin rectangles)
 	for (int i = 0; i < 4; ++i) {
-		glPushMatrix();
+		builderPushMatrix(builder);
 		// Rotate each blade by 90 degrees relative to the previous one
-		glRotatef(i * 90.0f, 0.0f, 0.0f, 1.0f);
+		builderRotatef(builder, i * 90.0f, 0.0f, 0.0f, 1.0f);
 
 		// Draw a single blade (a thin rectangle)
-		glScalef(0.25f, 0.25f, 0.5f);  // Scale to make the blade long and thin
-		glBegin(GL_QUADS);
-		glVertex3f(-1.0f, 0.0f, -0.05f);  // Quad vertices to form a rectangle
-		glVertex3f(1.0f, 0.0f, -0.05f);
-		glVertex3f(1.0f, 0.0f, 0.05f);
-		glVertex3f(-1.0f, 0.0f, 0.05f);
-		glEnd();
-		glPopMatrix();
+		builderScalef(builder, 0.25f, 0.25f, 0.5f);  // Scale to make the blade long and thin
+		builderBegin(builder, GL_QUADS);
+		builderVertex3f(builder, -1.0f, 0.0f, -0.05f);  // Quad vertices to form a rectangle
+		builderVertex3f(builder, 1.0f, 0.0f, -0.05f);
+		builderVertex3f(builder, 1.0f, 0.0f, 0.05f);
+		builderVertex3f(builder, -1.0f, 0.0f, 0.05f);
+		builderEnd(builder);
+		builderPopMatrix(builder);
 	}
-	glPopMatrix();
-
-
-	// Draw propeller blades on the  right engine head
-	glPushMatrix();
-	//glColor3f(0.0f, 0.0f, 0.0f);  // Blade color (light gray)
+}
 
-	// Translate to the tip of the engine head cone
-	glTranslatef(0.87f, -0.12f, -0.55f * BODY_RADIUS);  // Adjust the translation based on the size of the cone
+/*
+	Draw the aircraft: the baked airframe, then a propeller on each engine head turned
+	to renderState.propellerRotationAngle. Only the two propellers are transformed per frame.
+	The current matrix must put the aircraft at renderState.objectLocation.
+*/
+void drawAircraft() {
+	// Where the propeller hubs sit, at the tips of the engine head cones
+	const float rotorHubs[2][3] = {
+		{ -0.87f, -0.12f, -0.55f * BODY_RADIUS },
+		{ 0.87f, -0.12f, -0.55f * BODY_RADIUS }
+	};
+
+	// The propellers reach past the airframe's bounding sphere, so the aircraft is culled as a whole.
+	if (!sphereVisible(renderState.objectLocation, meshes[MESH_AIRFRAME].radius + meshes[MESH_ROTOR].radius)) {
+		memset(&aircraftStats, 0, sizeof(aircraftStats));
+		return;
+	}
 
-	// Rotate propeller blades (add animation here if needed)
-	glRotatef(propellerRotationAngle, 0.0f, 0.0f, 1.0f);  // Rotate around z-axis for spinning effect
+	// The propellers follow the airframe's level of detail.
+	int level = selectMeshLod(MESH_AIRFRAME, renderState.objectLocation, 1.0f, meshLods[MESH_AIRFRAME]);
+	meshLods[MESH_AIRFRAME] = level;
+	queueMesh(MESH_AIRFRAME, level);
+	aircraftStats.drawCalls = meshes[MESH_AIRFRAME].lods[level].partCount;
+	aircraftStats.verticesSubmitted = meshes[MESH_AIRFRAME].lods[level].triangleCount * 3;
 
-	// Draw four blades (thin rectangles)
-	for (int i = 0; i < 4; ++i) {
+	for (int i = 0; i < 2; i++) {
 		glPushMatrix();
-		// Rotate each blade by 90 degrees relative to the previous one
-		glRotatef(i * 90.0f, 0.0f, 0.0f, 1.0f);
-
-		// Draw a single blade (a thin rectangle)
-		glScalef(0.25f, 0.25f, 0.5f);  // Scale to make the blade long and thin
-		glBegin(GL_QUADS);
-		glVertex3f(-1.0f, 0.0f, -0.05f);  // Quad vertices to form a rectangle
-		glVertex3f(1.0f, 0.0f, -0.05f);
-		glVertex3f(1.0f, 0.0f, 0.05f);
-		glVertex3f(-1.0f, 0.0f, 0.05f);
-		glEnd();
+		glTranslatef(rotorHubs[i][0], rotorHubs[i][1], rotorHubs[i][2]);
+		glRotatef(renderState.propellerRotationAngle, 0.0f, 0.0f, 1.0f);  // Rotate around z-axis for spinning effect
+		queueMesh(MESH_ROTOR, level);
 		glPopMatrix();
+		aircraftStats.drawCalls += meshes[MESH_ROTOR].lods[level].partCount;
+		aircraftStats.verticesSubmitted += meshes[MESH_ROTOR].lods[level].triangleCount * 3;
 	}
-
-	glPopMatrix();
-
-
-	glPopMatrix();
 }
 
 void setupFog() {
-	glEnable(GL_FOG);  // Enable fog
+	cachedEnable(GL_FOG);  // Enable fog
 
 	// Set fog color (RGBA)
 	GLfloat fogColor[4] = { 0.7f, 0.7f, 0.7f, 1.0f };  // Light gray fog
-	glFogfv(GL_FOG_COLOR, fogColor);
+	cachedFogfv(GL_FOG_COLOR, fogColor);
 
 	// Set fog mode (GL_LINEAR, GL_EXP, GL_EXP2)
-	glFogi(GL_FOG_MODE, GL_LINEAR);  // Linear fog for gradual transition
+	cachedFogi(GL_FOG_MODE, GL_LINEAR);  // Linear fog for gradual transition
 
-	if (rainActive) {
+	GLfloat fogStart, fogEnd, fogDensity;
+	if (renderState.rainActive) {
 		// Heavy fog when rain is active
-		glFogf(GL_FOG_START, 10.0f);  // Fog starts closer when heavy
-		glFogf(GL_FOG_END, 30.0f);   // Fog ends sooner when heavy
-		glFogf(GL_FOG_DENSITY, 1.05f);  // Denser fog for heavy fog effect
+		fogStart = 10.0f;  // Fog starts closer when heavy
+		fogEnd = 30.0f;   // Fog ends sooner when heavy
+		fogDensity = 1.05f;  // Denser fog for heavy fog effect
 	}
 	else {
 		// Light fog when rain is not active
-		glFogf(GL_FOG_START, 30.0f);  // Fog starts farther away
-		glFogf(GL_FOG_END, 80.0f);   // Fog ends farther away for light fog
-		glFogf(GL_FOG_DENSITY, 0.35f);  // Lighter density for subtle fog effect
+		fogStart = 30.0f;  // Fog starts farther away
+		fogEnd = 80.0f;   // Fog ends farther away for light fog
+		fogDensity = 0.35f;  // Lighter density for subtle fog effect
 	}
+	cachedFogf(GL_FOG_START, fogStart);
+	cachedFogf(GL_FOG_END, fogEnd);
+	cachedFogf(GL_FOG_DENSITY, fogDensity);
+
+	// The per-pixel lighting shaders read the same fog from the Frame block.
+	memcpy(frameBlock.fogColor, fogColor, sizeof(frameBlock.fogColor));
+	frameBlock.fogStart = fogStart;
+	frameBlock.fogEnd = fogEnd;
 
 	// Enable smooth shading for better fog effects
-	glHint(GL_FOG_HINT, GL_NICEST);
+	cachedFogHint(GL_NICEST);
 }
 
-void drawTree(float trunkHeight, float trunkRadius, float foliageHeight, float foliageRadius) {
-	GLUquadric* quadric = gluNewQuadric();
-
+void buildTree(meshbuilder_t* builder, float trunkHeight, float trunkRadius, float foliageHeight, float foliageRadius) {
 	// Disable GL_COLOR_MATERIAL to use glMaterialfv for setting materials
-	glDisable(GL_COLOR_MATERIAL);
+	builderColorMaterial(builder, 0);
 
 	// Set material properties for the trunk (wood-like, matte finish)
 	GLfloat trunkAmbient[] = { 0.35f, 0.16f, 0.14f, 1.0f }; // Ambient color (darker)
@@ -2044,20 +3731,17 @@ void drawTree(float trunkHeight, float trunkRadius, float foliageHeight, float f
 	GLfloat trunkSpecular[] = { 0.05f, 0.05f, 0.05f, 1.0f }; // Low specular for matte appearance
 	GLfloat trunkShininess = 2.0f;  // Low shininess for a broad, soft reflection (matte)
 
-	// Enable lighting
-	glEnable(GL_LIGHTING);
-
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, trunkAmbient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, trunkDiffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, trunkSpecular);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, trunkShininess);
+	builderMaterialfv(builder, GL_AMBIENT, trunkAmbient);
+	builderMaterialfv(builder, GL_DIFFUSE, trunkDiffuse);
+	builderMaterialfv(builder, GL_SPECULAR, trunkSpecular);
+	builderMaterialf(builder, GL_SHININESS, trunkShininess);
 
 	// Draw the trunk (cylinder)
-	glPushMatrix();
-	glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);  // Rotate the cylinder to stand vertically (point along the y-axis)
-	glTranslatef(0.0f, 0.0f, -trunkHeight / 2.0f);  // Center the trunk vertically
-	gluCylinder(quadric, trunkRadius, trunkRadius, trunkHeight, 32, 32);  // Draw the trunk
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderRotatef(builder, -90.0f, 1.0f, 0.0f, 0.0f);  // Rotate the cylinder to stand vertically (point along the y-axis)
+	builderTranslatef(builder, 0.0f, 0.0f, -trunkHeight / 2.0f);  // Center the trunk vertically
+	builderCylinder(builder, trunkRadius, trunkRadius, trunkHeight, 32, 32, 0);  // Draw the trunk
+	builderPopMatrix(builder);
 
 	// Set material properties for the foliage (leaf-like)
 	GLfloat foliageAmbient[] = { 0.1f, 0.3f, 0.1f, 1.0f };
@@ -2065,39 +3749,37 @@ void drawTree(float trunkHeight, float trunkRadius, float foliageHeight, float f
 	GLfloat foliageSpecular[] = { 0.1f, 0.1f, 0.1f, 1.0f };
 	GLfloat foliageShininess = 5.0f;  // Less shiny
 
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, foliageAmbient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, foliageDiffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, foliageSpecular);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, foliageShininess);
+	builderMaterialfv(builder, GL_AMBIENT, foliageAmbient);
+	builderMaterialfv(builder, GL_DIFFUSE, foliageDiffuse);
+	builderMaterialfv(builder, GL_SPECULAR, foliageSpecular);
+	builderMaterialf(builder, GL_SHININESS, foliageShininess);
 
 	// Draw the 1st foliage (cone) on top of the trunk
-	glPushMatrix();
-	glTranslatef(0.0f, trunkHeight / 2, 0.0f);  // Position the cone on top of the trunk (at trunk height)
-	glScalef(1.0f, 0.5f, 1.0f);  // Scale: wider in X and Z, flatter in Y
-	glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);   // Rotate the cone to point upwards
-	glutSolidCone(foliageRadius, foliageHeight, 32, 32);  // Draw the cone as foliage
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, trunkHeight / 2, 0.0f);  // Position the cone on top of the trunk (at trunk height)
+	builderScalef(builder, 1.0f, 0.5f, 1.0f);  // Scale: wider in X and Z, flatter in Y
+	builderRotatef(builder, -90.0f, 1.0f, 0.0f, 0.0f);   // Rotate the cone to point upwards
+	builderCone(builder, foliageRadius, foliageHeight, 32, 32);  // Draw the cone as foliage
+	builderPopMatrix(builder);
 
 	// Draw the 2nd foliage (cone) on top of the trunk
-	glPushMatrix();
-	glTranslatef(0.0f, trunkHeight / 2.5, 0.0f);  // Position the cone on top of the trunk (at trunk height)
-	glScalef(2.0f, 0.6f, 2.0f);  // Scale: wider in X and Z, flatter in Y
-	glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);   // Rotate the cone to point upwards
-	glutSolidCone(foliageRadius, foliageHeight, 32, 32);  // Draw the cone as foliage
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, trunkHeight / 2.5, 0.0f);  // Position the cone on top of the trunk (at trunk height)
+	builderScalef(builder, 2.0f, 0.6f, 2.0f);  // Scale: wider in X and Z, flatter in Y
+	builderRotatef(builder, -90.0f, 1.0f, 0.0f, 0.0f);   // Rotate the cone to point upwards
+	builderCone(builder, foliageRadius, foliageHeight, 32, 32);  // Draw the cone as foliage
+	builderPopMatrix(builder);
 
 	// Draw the 3rd foliage (cone) on top of the trunk
-	glPushMatrix();
-	glTranslatef(0.0f, trunkHeight / 3.5, 0.0f);  // Position the cone on top of the trunk (at trunk height)
-	glScalef(3.0f, 0.8f, 3.0f);  // Scale: wider in X and Z, flatter in Y
-	glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);   // Rotate the cone to point upwards
-	glutSolidCone(foliageRadius, foliageHeight, 32, 32);  // Draw the cone as foliage
-	glPopMatrix();
-
-	gluDeleteQuadric(quadric);
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, trunkHeight / 3.5, 0.0f);  // Position the cone on top of the trunk (at trunk height)
+	builderScalef(builder, 3.0f, 0.8f, 3.0f);  // Scale: wider in X and Z, flatter in Y
+	builderRotatef(builder, -90.0f, 1.0f, 0.0f, 0.0f);   // Rotate the cone to point upwards
+	builderCone(builder, foliageRadius, foliageHeight, 32, 32);  // Draw the cone as foliage
+	builderPopMatrix(builder);
 
 	// Disable GL_COLOR_MATERIAL to use glMaterialfv for setting materials
-	glEnable(GL_COLOR_MATERIAL);
+	builderColorMaterial(builder, 1);
 }
 
 
@@ -2107,12 +3789,21 @@ void drawTree(float trunkHeight, float trunkRadius, float foliageHeight, float f
 
 
 
-void drawAirplaneParkingHall(float radius, float height) {
+/*
+	Built into meshes[MESH_HANGAR] by initMeshes(): the hall stretched to three times its
+	length and turned to face the airstrip, as display() used to place it.
+*/
+void buildHangarMesh(meshbuilder_t* builder) {
+	builderScalef(builder, 1.0f, 1.0f, 3.0f);
+	builderRotatef(builder, 270.0f, 0.0f, 1.0f, 0.0f);  // Rotate 90 degrees around Y-axis
+	buildAirplaneParkingHall(builder, 3.0f, 4.0f);  // Example dimensions: radius = 3.0, height = 4.0
+}
+
+void buildAirplaneParkingHall(meshbuilder_t* builder, float radius, float height) {
 	
-	GLUquadric* quadric = gluNewQuadric();
 
 	// Disable GL_COLOR_MATERIAL to use glMaterialfv for setting materials
-	glDisable(GL_COLOR_MATERIAL);
+	builderColorMaterial(builder, 0);
 
 	// Define material properties for a matte surface
 	GLfloat mat_ambient[] = { 0.65f, 0.37f, 0.17f, 1.0f };  // Ambient color (similar to diffuse color)
@@ -2120,529 +3811,5492 @@ void drawAirplaneParkingHall(float radius, float height) {
 	GLfloat mat_specular[] = { 0.1f, 0.1f, 0.1f, 1.0f };    // Very low specular reflection for a matte effect
 	GLfloat mat_shininess[] = { 1.0f };                     // Low shininess for a matte look
 
-	// Enable lighting and material
-	glEnable(GL_LIGHTING);
-
 	// Set material properties
-	glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-	glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-	glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+	builderMaterialfv(builder, GL_AMBIENT, mat_ambient);
+	builderMaterialfv(builder, GL_DIFFUSE, mat_diffuse);
+	builderMaterialfv(builder, GL_SPECULAR, mat_specular);
+	builderMaterialfv(builder, GL_SHININESS, mat_shininess);
 
-	glPushMatrix();
+	builderPushMatrix(builder);
 	// Set the color for the cylinder (Red wood color)
 	//glColor3f(0.55f, 0.27f, 0.07f);
 	// Rotate the cylinder to lay horizontally (along the X-axis)
-	glRotatef(90.0f, 0.0f, 1.0f, 0.0f);  // Rotate 90 degrees around Y-axis to make it horizontal
+	builderRotatef(builder, 90.0f, 0.0f, 1.0f, 0.0f);  // Rotate 90 degrees around Y-axis to make it horizontal
 	// Translate the cylinder so half of it is underground
-	glTranslatef(0.0f, -radius / 10.0f, 0.0f);  // Move downwards to sink half into the ground
+	builderTranslatef(builder, 0.0f, -radius / 10.0f, 0.0f);  // Move downwards to sink half into the ground
 	// Draw the half-cut cylinder
-	gluCylinder(quadric, radius, radius, height, 32, 1);  // Draw the cylinder
+	builderCylinder(builder, radius, radius, height, 32, 1, 0);  // Draw the cylinder
 	// Move to the back of the cylinder and draw the closing disk
-	glTranslatef(0.0f, 0.0f, height);  // Move to the back of the cylinder (height of the cylinder)
-	gluDisk(quadric, 0.0f, radius, 32, 1);  // Draw the disk with the same radius
-
-	glPopMatrix();
+	builderTranslatef(builder, 0.0f, 0.0f, height);  // Move to the back of the cylinder (height of the cylinder)
+	builderDisk(builder, 0.0f, radius, 32, 1, 0);  // Draw the disk with the same radius
 
-	// Clean up the quadric object
-	gluDeleteQuadric(quadric);
+	builderPopMatrix(builder);
+}
 
-	// Disable GL_COLOR_MATERIAL to use glMaterialfv for setting materials
-	glEnable(GL_COLOR_MATERIAL);
+// Built into meshes[MESH_AIRSTRIP] by initMeshes(), half as long again as buildAirstrip() makes it.
+void buildAirstripMesh(meshbuilder_t* builder) {
+	builderScalef(builder, 1.0f, 1.0f, 1.5f);
+	buildAirstrip(builder, 6.0f, 40.0f, 0.05f);  // Example dimensions: width = 6.0, length = 20.0, thickness = 0.1
 }
 
-void drawAirstrip(float width, float length, float thickness) {
+void buildAirstrip(meshbuilder_t* builder, float width, float length, float thickness) {
 	// Set the color for the airstrip (dark gray)
-	glColor3f(0.2f, 0.2f, 0.2f);  // Dark gray for the airstrip surface
+	builderColor3f(builder, 0.2f, 0.2f, 0.2f);  // Dark gray for the airstrip surface
 
-	glPushMatrix();
-	// Translate to position the airstrip below the aircraft
-	glTranslatef(0.0f, 0.0f, 0.0f);  // Move down slightly to put it on the ground
+	builderPushMatrix(builder);
 	// Scale and draw the airstrip
-	glScalef(width, thickness, length);  // Width (X), thickness (Y), and length (Z)
-	glutSolidCube(1.0f);  // A solid cube scaled to form the airstrip
-	glPopMatrix();
+	builderScalef(builder, width, thickness, length);  // Width (X), thickness (Y), and length (Z)
+	builderCube(builder, 1.0f);  // A solid cube scaled to form the airstrip
+	builderPopMatrix(builder);
 
 	// Draw the center white line
-	glPushMatrix();
+	builderPushMatrix(builder);
 	// Set the color for the white line
-	glColor3f(1.0f, 1.0f, 1.0f);  // White color for the line
+	builderColor3f(builder, 1.0f, 1.0f, 1.0f);  // White color for the line
 	// Translate the line to the center of the airstrip
-	glTranslatef(0.0f, 0.01f, 0.0f);  // Slightly above the airstrip surface
+	builderTranslatef(builder, 0.0f, 0.01f, 0.0f);  // Slightly above the airstrip surface
 	// Scale and draw the thin white line at the center
-	glScalef(0.1f, thickness, length);  // Narrow width, same thickness, full length
-	glutSolidCube(1.0f);  // A solid cube scaled to form the line
-	glPopMatrix();
+	builderScalef(builder, 0.1f, thickness, length);  // Narrow width, same thickness, full length
+	builderCube(builder, 1.0f);  // A solid cube scaled to form the line
+	builderPopMatrix(builder);
 }
 
-void drawTank(float topWidth, float bottomWidth, float height, float depth) {
-	glPushMatrix();
+void buildTank(meshbuilder_t* builder, float topWidth, float bottomWidth, float height, float depth) {
+	builderPushMatrix(builder);
 
 	// Enable texture mapping and bind the texture
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, texID[3]);  // Assuming texID[3] is your tank texture
-	glColor3f(0.2f, 0.3f, 0.2f);
-	glBegin(GL_QUADS);
+	builderEnableTexture(builder, 1);
+	builderBindTexture(builder, texID[3]);  // Assuming texID[3] is your tank texture
+	builderColor3f(builder, 0.2f, 0.3f, 0.2f);
+	builderBegin(builder, GL_QUADS);
 
 	//main body
 	// Front face (connects top and bottom widths)
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-bottomWidth / 2, 0.0f, depth / 2);  // Bottom-left
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(bottomWidth / 2, 0.0f, depth / 2);   // Bottom-right
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(topWidth / 2, height, depth / 2);    // Top-right
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(-topWidth / 2, height, depth / 2);   // Top-left
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -bottomWidth / 2, 0.0f, depth / 2);  // Bottom-left
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, bottomWidth / 2, 0.0f, depth / 2);   // Bottom-right
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, topWidth / 2, height, depth / 2);    // Top-right
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, -topWidth / 2, height, depth / 2);   // Top-left
 
 	// Back face
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-bottomWidth / 2, 0.0f, -depth / 2);  // Bottom-left
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-right
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(topWidth / 2, height, -depth / 2);    // Top-right
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(-topWidth / 2, height, -depth / 2);   // Top-left
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -bottomWidth / 2, 0.0f, -depth / 2);  // Bottom-left
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-right
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, topWidth / 2, height, -depth / 2);    // Top-right
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, -topWidth / 2, height, -depth / 2);   // Top-left
 
 	// Left face
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-bottomWidth / 2, 0.0f, depth / 2);    // Bottom-front
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(-bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-back
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(-topWidth / 2, height, -depth / 2);    // Top-back
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(-topWidth / 2, height, depth / 2);     // Top-front
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -bottomWidth / 2, 0.0f, depth / 2);    // Bottom-front
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, -bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-back
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, -topWidth / 2, height, -depth / 2);    // Top-back
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, -topWidth / 2, height, depth / 2);     // Top-front
 
 	// Right face
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(bottomWidth / 2, 0.0f, depth / 2);    // Bottom-front
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-back
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(topWidth / 2, height, -depth / 2);    // Top-back
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(topWidth / 2, height, depth / 2);     // Top-front
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, bottomWidth / 2, 0.0f, depth / 2);    // Bottom-front
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-back
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, topWidth / 2, height, -depth / 2);    // Top-back
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, topWidth / 2, height, depth / 2);     // Top-front
 
 	// Top face
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-topWidth / 2, height, depth / 2);    // Top-left
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(topWidth / 2, height, depth / 2);     // Top-right
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(topWidth / 2, height, -depth / 2);    // Bottom-right
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(-topWidth / 2, height, -depth / 2);   // Bottom-left
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -topWidth / 2, height, depth / 2);    // Top-left
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, topWidth / 2, height, depth / 2);     // Top-right
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, topWidth / 2, height, -depth / 2);    // Bottom-right
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, -topWidth / 2, height, -depth / 2);   // Bottom-left
 
 	// Bottom face
-	glTexCoord2f(0.0f, 0.0f); glVertex3f(-bottomWidth / 2, 0.0f, depth / 2);    // Bottom-left
-	glTexCoord2f(1.0f, 0.0f); glVertex3f(bottomWidth / 2, 0.0f, depth / 2);     // Bottom-right
-	glTexCoord2f(1.0f, 1.0f); glVertex3f(bottomWidth / 2, 0.0f, -depth / 2);    // Top-right
-	glTexCoord2f(0.0f, 1.0f); glVertex3f(-bottomWidth / 2, 0.0f, -depth / 2);   // Top-left
+	builderTexCoord2f(builder, 0.0f, 0.0f); builderVertex3f(builder, -bottomWidth / 2, 0.0f, depth / 2);    // Bottom-left
+	builderTexCoord2f(builder, 1.0f, 0.0f); builderVertex3f(builder, bottomWidth / 2, 0.0f, depth / 2);     // Bottom-right
+	builderTexCoord2f(builder, 1.0f, 1.0f); builderVertex3f(builder, bottomWidth / 2, 0.0f, -depth / 2);    // Top-right
+	builderTexCoord2f(builder, 0.0f, 1.0f); builderVertex3f(builder, -bottomWidth / 2, 0.0f, -depth / 2);   // Top-left
 
-	glEnd();
+	builderEnd(builder);
 
-	glPopMatrix();
+	builderPopMatrix(builder);
 
 	// Disable texture mapping after drawing the tank body
-	glDisable(GL_TEXTURE_2D);
+	builderEnableTexture(builder, 0);
 
 	// Draw the top cylinder on the main body
-	GLUquadric* quadric = gluNewQuadric();
-	glPushMatrix();
-	glColor3f(0.2f, 0.3f, 0.2f);
-	glTranslatef(0.0f, 0.7f, 0.0f);
-	glTranslatef(0.0f, height + 0.1f, 0.0f);  // Translate cylinder above the main body
+	builderPushMatrix(builder);
+	builderColor3f(builder, 0.2f, 0.3f, 0.2f);
+	builderTranslatef(builder, 0.0f, 0.7f, 0.0f);
+	builderTranslatef(builder, 0.0f, height + 0.1f, 0.0f);  // Translate cylinder above the main body
 
 	// Enable texture for the cylinder
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, texID[3]);
-	gluQuadricTexture(quadric, GL_TRUE);  // Enable texture for the quadric
-
-	glRotatef(90.0f, 1.0f, 0.0f, 0.0f);  // Rotate the cylinder to be vertical
-	gluCylinder(quadric, 0.3f, 0.5f, 0.8f, 32, 32);  // Draw the cylinder (radius = 0.5, height = 1.5)
+	builderEnableTexture(builder, 1);
+	builderBindTexture(builder, texID[3]);
+	builderRotatef(builder, 90.0f, 1.0f, 0.0f, 0.0f);  // Rotate the cylinder to be vertical
+	builderCylinder(builder, 0.3f, 0.5f, 0.8f, 32, 32, 1);  // Draw the cylinder (radius = 0.5, height = 1.5)
 	// Draw the disk to close the top of the cylinder
-	gluDisk(quadric, 0.0f, 0.3f, 32, 1);  // Draw the disk (radius = 0.3)
+	builderDisk(builder, 0.0f, 0.3f, 32, 1, 1);  // Draw the disk (radius = 0.3)
 
 	// Disable texture mapping for the cylinder
-	glDisable(GL_TEXTURE_2D);
+	builderEnableTexture(builder, 0);
 
 	// Draw the cannon (horizontal cylinder)
-	glPushMatrix();
-	glTranslatef(-1.5f, 0.0f, -0.4f);  // Position the cannon on top of the vertical cylinder
-	glRotatef(60.0f, 0.0f, 1.0f, 0.0f);  // Rotate the cannon cylinder to be horizontal
+	builderPushMatrix(builder);
+	builderTranslatef(builder, -1.5f, 0.0f, -0.4f);  // Position the cannon on top of the vertical cylinder
+	builderRotatef(builder, 60.0f, 0.0f, 1.0f, 0.0f);  // Rotate the cannon cylinder to be horizontal
 
 	// Enable texture for the cannon
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, texID[3]);
-	gluQuadricTexture(quadric, GL_TRUE);  // Enable texture for the quadric
-
-	gluCylinder(quadric, 0.1f, 0.1f, 1.5f, 32, 32);  // Draw the cannon (radius = 0.15, length = 2.0)
-	glPopMatrix();
+	builderEnableTexture(builder, 1);
+	builderBindTexture(builder, texID[3]);
+	builderCylinder(builder, 0.1f, 0.1f, 1.5f, 32, 32, 1);  // Draw the cannon (radius = 0.15, length = 2.0)
+	builderPopMatrix(builder);
 
-	glPopMatrix();
-	gluDeleteQuadric(quadric);
+	builderPopMatrix(builder);
 
 	// Draw the front and back smaller parts
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, texID[3]);  // Bind the texture for smaller parts
+	builderEnableTexture(builder, 1);
+	builderBindTexture(builder, texID[3]);  // Bind the texture for smaller parts
 
 	// Front smaller part
-	glPushMatrix();
-	glTranslatef(0.0f, 0.0f, depth / 1.5 + 0.01f);  // Position it in front of the main body
-	glScalef(1.5f, 1.0f, 1.0f);
-	drawFrontBackPart(topWidth / 1.5f, bottomWidth / 1.5f, height / 2, depth / 2, 0.3f, depth / 4);  // Smaller trapezoid with cylinders
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, 0.0f, depth / 1.5 + 0.01f);  // Position it in front of the main body
+	builderScalef(builder, 1.5f, 1.0f, 1.0f);
+	buildFrontBackPart(builder, topWidth / 1.5f, bottomWidth / 1.5f, height / 2, depth / 2, 0.3f, depth / 4);  // Smaller trapezoid with cylinders
+	builderPopMatrix(builder);
 
 	// Back smaller part
-	glPushMatrix();
-	glTranslatef(0.0f, 0.0f, -depth / 1.35 - 0.01f);  // Position it behind the main body
-	glScalef(1.5f, 1.0f, 1.0f);
-	drawFrontBackPart(topWidth / 1.5f, bottomWidth / 1.5f, height / 2, depth / 2, 0.3f, depth / 4);  // Smaller trapezoid with cylinders
-	glPopMatrix();
+	builderPushMatrix(builder);
+	builderTranslatef(builder, 0.0f, 0.0f, -depth / 1.35 - 0.01f);  // Position it behind the main body
+	builderScalef(builder, 1.5f, 1.0f, 1.0f);
+	buildFrontBackPart(builder, topWidth / 1.5f, bottomWidth / 1.5f, height / 2, depth / 2, 0.3f, depth / 4);  // Smaller trapezoid with cylinders
+	builderPopMatrix(builder);
 
 	// Disable texture mapping after drawing
-	glDisable(GL_TEXTURE_2D);
+	builderEnableTexture(builder, 0);
 
 
 }
 
-void drawFrontBackPart(float topWidth, float bottomWidth, float height, float depth, float cylinderRadius, float cylinderLength) {
-	
-	GLUquadric* quadric = gluNewQuadric();  // Create a new quadric object for drawing disks
-
-	glPushMatrix();
-	glColor3f(0.1f, 0.1f, 0.1f);
-	glBegin(GL_QUADS);
+void buildFrontBackPart(meshbuilder_t* builder, float topWidth, float bottomWidth, float height, float depth, float cylinderRadius, float cylinderLength) {
+	builderPushMatrix(builder);
+	builderColor3f(builder, 0.1f, 0.1f, 0.1f);
+	builderBegin(builder, GL_QUADS);
 
 	/*
 	// Front face (connects top and bottom widths)
-	glVertex3f(-bottomWidth / 2, 0.0f, depth / 2);  // Bottom-left
-	glVertex3f(bottomWidth / 2, 0.0f, depth / 2);   // Bottom-right
-	glVertex3f(topWidth / 2, height, depth / 2);    // Top-right
-	glVertex3f(-topWidth / 2, height, depth / 2);   // Top-left
+	builderVertex3f(builder, -bottomWidth / 2, 0.0f, depth / 2);  // Bottom-left
+	builderVertex3f(builder, bottomWidth / 2, 0.0f, depth / 2);   // Bottom-right
+	builderVertex3f(builder, topWidth / 2, height, depth / 2);    // Top-right
+	builderVertex3f(builder, -topWidth / 2, height, depth / 2);   // Top-left
 
 	// Back face
-	glVertex3f(-bottomWidth / 2, 0.0f, -depth / 2);  // Bottom-left
-	glVertex3f(bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-right
-	glVertex3f(topWidth / 2, height, -depth / 2);    // Top-right
-	glVertex3f(-topWidth / 2, height, -depth / 2);   // Top-left
+	builderVertex3f(builder, -bottomWidth / 2, 0.0f, -depth / 2);  // Bottom-left
+	builderVertex3f(builder, bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-right
+	builderVertex3f(builder, topWidth / 2, height, -depth / 2);    // Top-right
+	builderVertex3f(builder, -topWidth / 2, height, -depth / 2);   // Top-left
 	*/
 
 	// Left face
-	glVertex3f(-bottomWidth / 2, 0.0f, depth / 2);    // Bottom-front
-	glVertex3f(-bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-back
-	glVertex3f(-topWidth / 2, height, -depth / 2);    // Top-back
-	glVertex3f(-topWidth / 2, height, depth / 2);     // Top-front
+	builderVertex3f(builder, -bottomWidth / 2, 0.0f, depth / 2);    // Bottom-front
+	builderVertex3f(builder, -bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-back
+	builderVertex3f(builder, -topWidth / 2, height, -depth / 2);    // Top-back
+	builderVertex3f(builder, -topWidth / 2, height, depth / 2);     // Top-front
 
 	// Right face
-	glVertex3f(bottomWidth / 2, 0.0f, depth / 2);    // Bottom-front
-	glVertex3f(bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-back
-	glVertex3f(topWidth / 2, height, -depth / 2);    // Top-back
-	glVertex3f(topWidth / 2, height, depth / 2);     // Top-front
+	builderVertex3f(builder, bottomWidth / 2, 0.0f, depth / 2);    // Bottom-front
+	builderVertex3f(builder, bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-back
+	builderVertex3f(builder, topWidth / 2, height, -depth / 2);    // Top-back
+	builderVertex3f(builder, topWidth / 2, height, depth / 2);     // Top-front
 
 	// Top face
-	glVertex3f(-topWidth / 2, height, depth / 2);    // Top-left
-	glVertex3f(topWidth / 2, height, depth / 2);     // Top-right
-	glVertex3f(topWidth / 2, height, -depth / 2);    // Bottom-right
-	glVertex3f(-topWidth / 2, height, -depth / 2);   // Bottom-left
+	builderVertex3f(builder, -topWidth / 2, height, depth / 2);    // Top-left
+	builderVertex3f(builder, topWidth / 2, height, depth / 2);     // Top-right
+	builderVertex3f(builder, topWidth / 2, height, -depth / 2);    // Bottom-right
+	builderVertex3f(builder, -topWidth / 2, height, -depth / 2);   // Bottom-left
 
 	// Bottom face
-	glVertex3f(-bottomWidth / 2, 0.0f, depth / 2);    // Top-left
-	glVertex3f(bottomWidth / 2, 0.0f, depth / 2);     // Top-right
-	glVertex3f(bottomWidth / 2, 0.0f, -depth / 2);    // Bottom-right
-	glVertex3f(-bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-left
+	builderVertex3f(builder, -bottomWidth / 2, 0.0f, depth / 2);    // Top-left
+	builderVertex3f(builder, bottomWidth / 2, 0.0f, depth / 2);     // Top-right
+	builderVertex3f(builder, bottomWidth / 2, 0.0f, -depth / 2);    // Bottom-right
+	builderVertex3f(builder, -bottomWidth / 2, 0.0f, -depth / 2);   // Bottom-left
 
-	glEnd();
+	builderEnd(builder);
 
 	// Draw three cylinders horizontally aligned in this part
 	for (int i = -1; i <= 1; i++) {
-		glPushMatrix();
-		glTranslatef(0.0f, 0.11f, -0.18f);
-		glTranslatef(i * (topWidth / 5), height / 4, 0.0f);  // Adjust the cylinder positions based on the part width
-		glScalef(0.4f, 0.8f, 1.7f);
-		glRotatef(90.0f, 0.0f, 0.0f, 1.0f);  // Rotate cylinder to be horizontal along the X-axis
-		gluCylinder(quadric, cylinderRadius, cylinderRadius, cylinderLength, 32, 32);
+		builderPushMatrix(builder);
+		builderTranslatef(builder, 0.0f, 0.11f, -0.18f);
+		builderTranslatef(builder, i * (topWidth / 5), height / 4, 0.0f);  // Adjust the cylinder positions based on the part width
+		builderScalef(builder, 0.4f, 0.8f, 1.7f);
+		builderRotatef(builder, 90.0f, 0.0f, 0.0f, 1.0f);  // Rotate cylinder to be horizontal along the X-axis
+		builderCylinder(builder, cylinderRadius, cylinderRadius, cylinderLength, 32, 32, 0);
 
 		// Draw the disk for the front side of the cylinder
-		glPushMatrix();
-		glColor3f(0.1f, 0.1f, 0.1f);
-		glTranslatef(0.0f, 0.0f, 0.0f);  // Position at the front end of the cylinder
-		gluDisk(quadric, 0.0f, cylinderRadius, 32, 1);  // Disk covering the front
-		glPopMatrix();
+		builderPushMatrix(builder);
+		builderColor3f(builder, 0.1f, 0.1f, 0.1f);
+		builderTranslatef(builder, 0.0f, 0.0f, 0.0f);  // Position at the front end of the cylinder
+		builderDisk(builder, 0.0f, cylinderRadius, 32, 1, 0);  // Disk covering the front
+		builderPopMatrix(builder);
 
 		// Draw the disk for the back side of the cylinder
-		glPushMatrix();
-		glColor3f(0.1f, 0.1f, 0.1f);
-		glTranslatef(0.0f, 0.0f, cylinderLength);  // Position at the back end of the cylinder
-		gluDisk(quadric, 0.0f, cylinderRadius, 32, 1);  // Disk covering the back
-		glPopMatrix();
+		builderPushMatrix(builder);
+		builderColor3f(builder, 0.1f, 0.1f, 0.1f);
+		builderTranslatef(builder, 0.0f, 0.0f, cylinderLength);  // Position at the back end of the cylinder
+		builderDisk(builder, 0.0f, cylinderRadius, 32, 1, 0);  // Disk covering the back
+		builderPopMatrix(builder);
 
-		glPopMatrix();
+		builderPopMatrix(builder);
 	}
 
 	
 
-	glPopMatrix();
-
-	gluDeleteQuadric(quadric);  // Clean up the quadric object
+	builderPopMatrix(builder);
 
 }
 
 
-void createTreeDisplayList() {
-	treeDisplayList = glGenLists(1);  // Generate a unique display list identifier
-	glNewList(treeDisplayList, GL_COMPILE);  // Start defining the display list
-
+// Built into meshes[MESH_TREE] by initMeshes().
+void buildTreeMesh(meshbuilder_t* builder) {
 	// Draw your tree
-	glScalef(0.75f, 0.75f, 0.75f);
-	drawTree(10.0f, 0.3f, 2.0f, 1.0f); // Example dimensions of the tree
-
-	glEndList();  // End the display list definition
+	builderScalef(builder, 0.75f, 0.75f, 0.75f);
+	buildTree(builder, 10.0f, 0.3f, 2.0f, 1.0f); // Example dimensions of the tree
 }
 
 void drawMultipleTrees() {
-	// Create the display list (only need to call this once, at initialization)
-	createTreeDisplayList();
+	// One draw call for every tree in treeGroup (placed by initInstanceGroups())
+	queueInstanceGroup(&treeGroup);
+}
 
-	// Draw the trees at different positions using the display list
-	//north-west
-	glPushMatrix();
-	glTranslatef(-5.0f, 0.0f, -10.0f);  // Position of the first tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+// Built into meshes[MESH_HOUSE] by initMeshes().
+void buildHouseMesh(meshbuilder_t* builder) {
+	builderScalef(builder, 2.0f, 2.0f, 2.0f);
+	buildHouse(builder, 2.0f, 2.0f, 4.0f);
+}
 
-	glPushMatrix();
-	glTranslatef(-14.0f, 0.0f, -15.0f);   // Position of the second tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
-
-	glPushMatrix();
-	glTranslatef(-27.0f, 0.0f, -20.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
-
-	glPushMatrix();
-	glTranslatef(-34.0f, 0.0f, -25.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
-
-	glPushMatrix();
-	glTranslatef(-25.0f, 0.0f, -30.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
-	// You can add more trees by changing the positions and calling the display list
-
-	//east-north
-	glPushMatrix();
-	glTranslatef(6.0f, 0.0f, -20.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
-
-	glPushMatrix();
-	glTranslatef(9.0f, 0.0f, -11.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
-
-	glPushMatrix();
-	glTranslatef(15.0f, 0.0f, -17.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+void drawMultipleHouses() {
+	// Draw the houses at the positions in housePlacements
+	queueInstanceGroup(&houseGroup);
+}
 
-	glPushMatrix();
-	glTranslatef(23.0f, 0.0f, -27.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	Allocate count drops (rounded up to whole cache lines of RAIN_ALIGN_DROPS) and
+	scatter them through a box around the origin, as if every one had just hit the
+	ground. Every array starts on a cache line, and every chunk gets its own lane
+	seeds, so the rain comes out the same however the chunks are shared out between
+	threads. Returns 0 if memory runs out.
+*/
+int initRainField(rainfield_t* field, int count) {
+	static const unsigned int laneSeeds[RAIN_LANES] = { 0x9E3779B9u, 0x7F4A7C15u, 0x94D049BBu, 0x2545F491u };
+	field->count = count;
+	field->capacity = (count + RAIN_ALIGN_DROPS - 1) / RAIN_ALIGN_DROPS * RAIN_ALIGN_DROPS;
+	if (field->capacity == 0) field->capacity = RAIN_ALIGN_DROPS;
+	field->chunkCount = (field->capacity + RAIN_CHUNK_DROPS - 1) / RAIN_CHUNK_DROPS;
+	field->memory = malloc((size_t)field->capacity * (4 + RAIN_LINE_FLOATS) * sizeof(float) + 63);
+	field->seeds = (unsigned int*)malloc((size_t)field->chunkCount * RAIN_LANES * sizeof(unsigned int));
+	if (field->memory == NULL || field->seeds == NULL) {
+		freeRainField(field);
+		return 0;
+	}
+	float* block = (float*)(((size_t)field->memory + 63) & ~(size_t)63);
+	field->x = block;
+	field->y = block + field->capacity;
+	field->z = block + 2 * field->capacity;
+	field->speed = block + 3 * field->capacity;
+	field->lines = block + 4 * field->capacity;
+	for (int i = 0; i < field->capacity; i++) {
+		field->y[i] = -1.0f;
+		field->speed[i] = 0.0f;
+	}
+	for (int chunk = 0; chunk < field->chunkCount; chunk++) {
+		for (int lane = 0; lane < RAIN_LANES; lane++) {
+			unsigned int seed = laneSeeds[lane] ^ ((unsigned int)chunk * 2654435761u);
+			field->seeds[chunk * RAIN_LANES + lane] = seed != 0 ? seed : laneSeeds[lane];	// xorshift never leaves 0.
+		}
+	}
+	field->boxX = field->boxZ = -RAIN_BOX_SIZE * 0.5f;
+	field->shiftX = field->shiftZ = 0.0f;
+	for (int chunk = 0; chunk < field->chunkCount; chunk++) {
+		updateRainScalar(field, field->lines, chunk);
+	}
+	return 1;
+}
 
-	glPushMatrix();
-	glTranslatef(35.0f, 0.0f, -22.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	Move the rain's box so it's centred on (x, z), ready for the next update. The
+	drops stay where they are in the world; the ones the box leaves behind come in
+	on its far side, as if the rain were tiled across the whole map.
+*/
+void centerRainBox(rainfield_t* field, float x, float z) {
+	float boxX = x - RAIN_BOX_SIZE * 0.5f;
+	float boxZ = z - RAIN_BOX_SIZE * 0.5f;
+	field->shiftX = fmodf(boxX - field->boxX, RAIN_BOX_SIZE);
+	field->shiftZ = fmodf(boxZ - field->boxZ, RAIN_BOX_SIZE);
+	field->boxX = boxX;
+	field->boxZ = boxZ;
+}
 
-	glPushMatrix();
-	glTranslatef(7.0f, 0.0f, -15.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+void freeRainField(rainfield_t* field) {
+	free(field->memory);
+	free(field->seeds);
+	memset(field, 0, sizeof(*field));
+}
 
-	//west-south
-	glPushMatrix();
-	glTranslatef(-5.0f, 0.0f, 10.0f);  // Position of the first tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	Let every drop in one chunk fall one frame's worth, move it back by the box's
+	shift (wrapping it round to the other side if that takes it out), and write its
+	line (bottom, then top, in world space) to lines, which needs room for the field's
+	capacity. Drops that go below the ground come back somewhere else in the box at a
+	new height and speed, taken from one xorshift step of their lane's seed: bits 24-31
+	give x, 16-23 z, 8-15 the height and 0-7 the speed. Every lane steps its seed for
+	every drop, falling or not, so the choice is a select rather than a branch, and
+	updateRainSimd() (four lanes at a time) ends up with exactly the same rain. Chunks
+	share nothing they write, so any number can be updated at once.
+*/
+void updateRainScalar(rainfield_t* field, float* lines, int chunk) {
+	float* x = field->x;
+	float* y = field->y;
+	float* z = field->z;
+	float* speed = field->speed;
+	unsigned int* seeds = field->seeds + chunk * RAIN_LANES;
+	float shiftX = field->shiftX;
+	float shiftZ = field->shiftZ;
+	int first = chunk * RAIN_CHUNK_DROPS;
+	int end = field->capacity - first < RAIN_CHUNK_DROPS ? field->capacity : first + RAIN_CHUNK_DROPS;
+	for (int i = first; i < end; i++) {
+		unsigned int seed = seeds[i % RAIN_LANES];
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		seeds[i % RAIN_LANES] = seed;
+
+		float fallen = y[i] - speed[i];
+		int respawn = fallen < 0.0f;
+		float driftedX = x[i] - shiftX;
+		float driftedZ = z[i] - shiftZ;
+		driftedX += driftedX < 0.0f ? RAIN_BOX_SIZE : 0.0f;
+		driftedX -= driftedX >= RAIN_BOX_SIZE ? RAIN_BOX_SIZE : 0.0f;
+		driftedZ += driftedZ < 0.0f ? RAIN_BOX_SIZE : 0.0f;
+		driftedZ -= driftedZ >= RAIN_BOX_SIZE ? RAIN_BOX_SIZE : 0.0f;
+		float newX = (float)((seed >> 24) & 0xFF) * (RAIN_BOX_SIZE / 256.0f);
+		float newZ = (float)((seed >> 16) & 0xFF) * (RAIN_BOX_SIZE / 256.0f);
+		float newY = (float)((seed >> 8) & 0xFF) * (50.0f / 256.0f) + 10.0f;		// 10 to 60
+		float newSpeed = (float)(seed & 0xFF) * (0.125f / 256.0f) + 0.125f;		// Gentle rain
+		x[i] = respawn ? newX : driftedX;
+		y[i] = respawn ? newY : fallen;
+		z[i] = respawn ? newZ : driftedZ;
+		speed[i] = respawn ? newSpeed : speed[i];
+
+		float* line = lines + i * RAIN_LINE_FLOATS;
+		line[0] = line[3] = field->boxX + x[i];
+		line[1] = y[i];
+		line[4] = y[i] + RAIN_DROP_LENGTH;
+		line[2] = line[5] = field->boxZ + z[i];
+	}
+}
 
-	glPushMatrix();
-	glTranslatef(-14.0f, 0.0f, 15.0f);   // Position of the second tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+#ifdef RAIN_SIMD
+// updateRainScalar() with SSE2, RAIN_LANES drops at a time.
+void updateRainSimd(rainfield_t* field, float* lines, int chunk) {
+	const __m128i byteMask = _mm_set1_epi32(0xFF);
+	const __m128 boxSize = _mm_set1_ps(RAIN_BOX_SIZE);
+	const __m128 spreadScale = _mm_set1_ps(RAIN_BOX_SIZE / 256.0f);
+	const __m128 shiftX = _mm_set1_ps(field->shiftX);
+	const __m128 shiftZ = _mm_set1_ps(field->shiftZ);
+	const __m128 boxX = _mm_set1_ps(field->boxX);
+	const __m128 boxZ = _mm_set1_ps(field->boxZ);
+	const __m128 heightScale = _mm_set1_ps(50.0f / 256.0f);
+	const __m128 heightOffset = _mm_set1_ps(10.0f);
+	const __m128 speedScale = _mm_set1_ps(0.125f / 256.0f);
+	const __m128 speedOffset = _mm_set1_ps(0.125f);
+	const __m128 dropLength = _mm_set1_ps(RAIN_DROP_LENGTH);
+	float* x = field->x;
+	float* y = field->y;
+	float* z = field->z;
+	float* speed = field->speed;
+	unsigned int* chunkSeeds = field->seeds + chunk * RAIN_LANES;
+	int first = chunk * RAIN_CHUNK_DROPS;
+	int end = field->capacity - first < RAIN_CHUNK_DROPS ? field->capacity : first + RAIN_CHUNK_DROPS;
+	__m128i seeds = _mm_loadu_si128((const __m128i*)chunkSeeds);
+	for (int i = first; i < end; i += RAIN_LANES) {
+		seeds = _mm_xor_si128(seeds, _mm_slli_epi32(seeds, 13));
+		seeds = _mm_xor_si128(seeds, _mm_srli_epi32(seeds, 17));
+		seeds = _mm_xor_si128(seeds, _mm_slli_epi32(seeds, 5));
+
+		__m128 oldSpeed = _mm_loadu_ps(speed + i);
+		__m128 fallen = _mm_sub_ps(_mm_loadu_ps(y + i), oldSpeed);
+		__m128 respawn = _mm_cmplt_ps(fallen, _mm_setzero_ps());
+		__m128 driftedX = _mm_sub_ps(_mm_loadu_ps(x + i), shiftX);
+		__m128 driftedZ = _mm_sub_ps(_mm_loadu_ps(z + i), shiftZ);
+		driftedX = _mm_add_ps(driftedX, _mm_and_ps(_mm_cmplt_ps(driftedX, _mm_setzero_ps()), boxSize));
+		driftedX = _mm_sub_ps(driftedX, _mm_and_ps(_mm_cmpge_ps(driftedX, boxSize), boxSize));
+		driftedZ = _mm_add_ps(driftedZ, _mm_and_ps(_mm_cmplt_ps(driftedZ, _mm_setzero_ps()), boxSize));
+		driftedZ = _mm_sub_ps(driftedZ, _mm_and_ps(_mm_cmpge_ps(driftedZ, boxSize), boxSize));
+		__m128 newX = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(seeds, 24)), spreadScale);
+		__m128 newZ = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(seeds, 16), byteMask)), spreadScale);
+		__m128 newY = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(seeds, 8), byteMask)), heightScale), heightOffset);
+		__m128 newSpeed = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(seeds, byteMask)), speedScale), speedOffset);
+		__m128 dropX = _mm_or_ps(_mm_and_ps(respawn, newX), _mm_andnot_ps(respawn, driftedX));
+		__m128 dropY = _mm_or_ps(_mm_and_ps(respawn, newY), _mm_andnot_ps(respawn, fallen));
+		__m128 dropZ = _mm_or_ps(_mm_and_ps(respawn, newZ), _mm_andnot_ps(respawn, driftedZ));
+		_mm_storeu_ps(x + i, dropX);
+		_mm_storeu_ps(y + i, dropY);
+		_mm_storeu_ps(z + i, dropZ);
+		_mm_storeu_ps(speed + i, _mm_or_ps(_mm_and_ps(respawn, newSpeed), _mm_andnot_ps(respawn, oldSpeed)));
+
+		// Interleave the four drops into x y z x top z lines in world space, two drops per three registers.
+		__m128 top = _mm_add_ps(dropY, dropLength);
+		dropX = _mm_add_ps(dropX, boxX);
+		dropZ = _mm_add_ps(dropZ, boxZ);
+		__m128 xyLow = _mm_unpacklo_ps(dropX, dropY);		// x0 y0 x1 y1
+		__m128 xyHigh = _mm_unpackhi_ps(dropX, dropY);
+		__m128 zxLow = _mm_unpacklo_ps(dropZ, dropX);		// z0 x0 z1 x1
+		__m128 zxHigh = _mm_unpackhi_ps(dropZ, dropX);
+		__m128 tzLow = _mm_unpacklo_ps(top, dropZ);			// t0 z0 t1 z1
+		__m128 tzHigh = _mm_unpackhi_ps(top, dropZ);
+		float* line = lines + i * RAIN_LINE_FLOATS;
+		_mm_storeu_ps(line, _mm_movelh_ps(xyLow, zxLow));							// x0 y0 z0 x0
+		_mm_storeu_ps(line + 4, _mm_shuffle_ps(tzLow, xyLow, _MM_SHUFFLE(3, 2, 1, 0)));	// t0 z0 x1 y1
+		_mm_storeu_ps(line + 8, _mm_movehl_ps(tzLow, zxLow));						// z1 x1 t1 z1
+		_mm_storeu_ps(line + 12, _mm_movelh_ps(xyHigh, zxHigh));
+		_mm_storeu_ps(line + 16, _mm_shuffle_ps(tzHigh, xyHigh, _MM_SHUFFLE(3, 2, 1, 0)));
+		_mm_storeu_ps(line + 20, _mm_movehl_ps(tzHigh, zxHigh));
+	}
+	_mm_storeu_si128((__m128i*)chunkSeeds, seeds);
+}
+#endif
 
-	glPushMatrix();
-	glTranslatef(-27.0f, 0.0f, 20.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	Set up the rain, and the pair of vertex buffers startRainUpdate() streams its
+	lines into if the driver can map buffers.
+*/
+void initializeRain() {
+	if (!initRainField(&rain, rainDropCount)) {
+		printf("Could not allocate %d rain drops\n", rainDropCount);
+		exit(1);
+	}
+	if (bufferMappingAvailable) {
+		glGenBuffers(2, rainBuffers);
+		for (int i = 0; i < 2; i++) {
+			glBindBuffer(GL_ARRAY_BUFFER, rainBuffers[i]);
+			glBufferData(GL_ARRAY_BUFFER, (size_t)rain.capacity * RAIN_LINE_FLOATS * sizeof(float), NULL, GL_STREAM_DRAW);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	rainLineCount = rain.count;
+	atexit(freeRain);
+}
 
-	glPushMatrix();
-	glTranslatef(-34.0f, 0.0f,25.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	Delete the rain and its vertex buffers. Registered with atexit() by initializeRain().
+*/
+void freeRain(void) {
+	// If the window has already been closed, its context took the buffers with it.
+	if (glutGetWindow() != 0 && rainBuffers[0] != 0) glDeleteBuffers(2, rainBuffers);
+	rainBuffers[0] = rainBuffers[1] = 0;
+	rainDrawBuffer = 0;
+	rainLineCount = 0;
+	freeRainField(&rain);
+}
 
-	glPushMatrix();
-	glTranslatef(-25.0f, 0.0f, 30.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+// One item of a rain update job (a rainupdate_t): one chunk of its field, on whichever thread claimed it.
+void updateRainChunk(void* context, int chunk) {
+	rainupdate_t* update = (rainupdate_t*)context;
+#ifdef RAIN_SIMD
+	updateRainSimd(update->field, update->lines, chunk);
+#else
+	updateRainScalar(update->field, update->lines, chunk);
+#endif
+}
 
-	//east-south
-	glPushMatrix();
-	glTranslatef(6.0f, 0.0f, 10.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	Start moving the rain on a frame, in a box kept centred on the camera, writing
+	the lines straight into whichever of rainBuffers the previous frame didn't draw
+	from. Mapping with GL_MAP_INVALIDATE_BUFFER_BIT tells the driver the old contents
+	can go, so it never waits for the GPU to finish with them. Without mappable
+	buffers the lines go to rain.lines, and drawRain() hands that over as a
+	client-side array. The chunks go to workerPool, which gets on with them while
+	display() draws the rest of the scene; finishRainUpdate() must be called before
+	the rain is drawn.
+*/
+void startRainUpdate() {
+	if (!renderState.rainActive) return;  // Don't update if rain is off
+
+	centerRainBox(&rain, renderState.cameraLookAt[0], renderState.cameraLookAt[2]);
+
+	float* lines = NULL;
+	if (rainBuffers[0] != 0) {
+		rainBufferIndex ^= 1;
+		glBindBuffer(GL_ARRAY_BUFFER, rainBuffers[rainBufferIndex]);
+		lines = (float*)glMapBufferRange(GL_ARRAY_BUFFER, 0, (size_t)rain.capacity * RAIN_LINE_FLOATS * sizeof(float),
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);  // The mapping outlives the binding, and the scene draws need it clear.
+	}
 
-	glPushMatrix();
-	glTranslatef(9.0f, 0.0f, 13.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+	rainUpdate.field = &rain;
+	rainUpdate.lines = lines != NULL ? lines : rain.lines;
+	rainJob.run = updateRainChunk;
+	rainJob.context = &rainUpdate;
+	rainJob.itemCount = rain.chunkCount;
+	startWorkerJob(&workerPool, &rainJob);
+	rainUpdatePending = 1;
+}
 
-	glPushMatrix();
-	glTranslatef(15.0f, 0.0f, 21.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	Take a share of whatever chunks of the rain startRainUpdate() handed out are
+	left, wait for the workers to finish theirs, then unmap the buffer the lines went
+	to (which only the GLUT thread may do).
+*/
+void finishRainUpdate() {
+	if (!rainUpdatePending) return;
+	finishWorkerJob(&workerPool, &rainJob);
+	rainUpdatePending = 0;
+
+	rainDrawBuffer = 0;
+	rainLineCount = rain.count;
+	if (rainUpdate.lines != rain.lines) {
+		// Unmapping fails if the buffer's contents were lost (e.g. to a display mode change), so skip a frame.
+		glBindBuffer(GL_ARRAY_BUFFER, rainBuffers[rainBufferIndex]);
+		if (glUnmapBuffer(GL_ARRAY_BUFFER)) rainDrawBuffer = rainBuffers[rainBufferIndex];
+		else rainLineCount = 0;
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+}
 
-	glPushMatrix();
-	glTranslatef(23.0f, 0.0f, 24.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+// Draw every drop's line with one call, from the buffer finishRainUpdate() just unmapped.
+void drawRain() {
 
-	glPushMatrix();
-	glTranslatef(25.0f, 0.0f, 35.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+	if (!renderState.rainActive) return;  // Don't draw if rain is off
 
-	glPushMatrix();
-	glTranslatef(7.0f, 0.0f, 31.0f);    // Position of the third tree
-	glCallList(treeDisplayList);       // Call the display list
-	glPopMatrix();
+	glColor3f(0.7f, 0.7f, 1.0f);  // Lighter blue color for gentler appearance
+	if (rainDrawBuffer != 0) glBindBuffer(GL_ARRAY_BUFFER, rainDrawBuffer);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, rainDrawBuffer != 0 ? (const GLvoid*)0 : rain.lines);
+	glDrawArrays(GL_LINES, 0, rainLineCount * 2);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	if (rainDrawBuffer != 0) glBindBuffer(GL_ARRAY_BUFFER, 0);
+	cullStats.rainDrawn += rainLineCount;
+}
 
+// Whether two fields hold exactly the same rain, lines and seeds (both must be the same size).
+int rainFieldsMatch(const rainfield_t* a, const rainfield_t* b) {
+	return memcmp(a->x, b->x, (size_t)a->capacity * (4 + RAIN_LINE_FLOATS) * sizeof(float)) == 0
+		&& memcmp(a->seeds, b->seeds, a->chunkCount * RAIN_LANES * sizeof(unsigned int)) == 0;
 }
 
-void createHouseDisplayList() {
-	HouseDisplayList = glGenLists(1);  // Generate a unique display list identifier
-	glNewList(HouseDisplayList, GL_COMPILE);  // Start defining the display list
+/*
+	Time updateRainScalar() and updateRainSimd() over 1,000, 100,000 and 1,000,000
+	drops (writing their lines to memory, as they would to a mapped vertex buffer,
+	and following a camera flying across the map), and check both leave the rain and
+	its lines exactly the same. Then time the whole update of 1,000,000 drops on 1, 2,
+	4, 8 and 16 threads (as many of those as there are processors for), and check
+	every thread count leaves the same rain as one.
+*/
+void runRainBenchmark(void) {
+	const int sizes[] = { 1000, 100000, 1000000 };
+
+	printf("Rain update, average per drop per frame:\n");
+	for (int s = 0; s < 3; s++) {
+		int frames = 100000000 / sizes[s];	// The same number of drop updates for every size.
+		rainfield_t scalar;
+		if (!initRainField(&scalar, sizes[s])) {
+			printf("  %d drops: out of memory\n", sizes[s]);
+			return;
+		}
+		unsigned long long start = pacingNowNs();
+		for (int f = 0; f < frames; f++) {
+			centerRainBox(&scalar, f * 0.3f, f * -0.2f);
+			for (int chunk = 0; chunk < scalar.chunkCount; chunk++) {
+				updateRainScalar(&scalar, scalar.lines, chunk);
+			}
+		}
+		double scalarNs = (double)(pacingNowNs() - start) / frames / sizes[s];
+#ifdef RAIN_SIMD
+		rainfield_t simd;
+		if (!initRainField(&simd, sizes[s])) {
+			printf("  %d drops: out of memory\n", sizes[s]);
+			freeRainField(&scalar);
+			return;
+		}
+		start = pacingNowNs();
+		for (int f = 0; f < frames; f++) {
+			centerRainBox(&simd, f * 0.3f, f * -0.2f);
+			for (int chunk = 0; chunk < simd.chunkCount; chunk++) {
+				updateRainSimd(&simd, simd.lines, chunk);
+			}
+		}
+		double simdNs = (double)(pacingNowNs() - start) / frames / sizes[s];
+		printf("  %7d drops: scalar %.2f ns, SSE2 %.2f ns (%.1fx faster), %s\n", sizes[s], scalarNs, simdNs,
+			simdNs > 0.0 ? scalarNs / simdNs : 0.0, rainFieldsMatch(&scalar, &simd) ? "same rain" : "DIFFERENT rain");
+		freeRainField(&simd);
+#else
+		printf("  %7d drops: scalar %.2f ns (built without SSE2)\n", sizes[s], scalarNs);
+#endif
+		freeRainField(&scalar);
+	}
 
-	// Draw your tree
-	glScalef(2.0f, 2.0f, 2.0f);
-	drawHouse(2.0f, 2.0f, 4.0f); // Example dimensions of the tree
+	const int drops = 1000000;
+	const int frames = 100;
+	int processors = processorCount();
+	rainfield_t reference;
+	double oneThreadRate = 0.0;
+	printf("Rain update of %d drops on the worker pool (%d processors), million drops per second:\n", drops, processors);
+	for (int threads = 1; threads <= 16 && (threads == 1 || threads <= processors); threads *= 2) {
+		rainfield_t field;
+		if (!initRainField(&field, drops)) {
+			printf("  out of memory\n");
+			break;
+		}
+		workerpool_t pool;
+		memset(&pool, 0, sizeof(pool));
+		if (threads > 1 && !startWorkerPool(&pool, threads - 1)) {
+			printf("  %2d threads: could not start the workers\n", threads);
+			freeRainField(&field);
+			break;
+		}
+		rainupdate_t update = { &field, field.lines };
+		workerjob_t job;
+		memset(&job, 0, sizeof(job));
+		job.run = updateRainChunk;
+		job.context = &update;
+		job.itemCount = field.chunkCount;
+		unsigned long long start = pacingNowNs();
+		for (int f = 0; f < frames; f++) {
+			centerRainBox(&field, f * 0.3f, f * -0.2f);
+			startWorkerJob(&pool, &job);
+			finishWorkerJob(&pool, &job);
+		}
+		unsigned long long elapsed = pacingNowNs() - start;
+		stopWorkerPool(&pool);
+
+		double rate = elapsed > 0 ? (double)drops * frames * 1000.0 / elapsed : 0.0;
+		if (threads == 1) {
+			oneThreadRate = rate;
+			reference = field;
+			printf("   1 thread:  %6.1f total\n", rate);
+			continue;
+		}
+		printf("  %2d threads: %6.1f total, %6.1f per thread (%.2fx one thread), %s\n", threads, rate, rate / threads,
+			oneThreadRate > 0.0 ? rate / oneThreadRate : 0.0, rainFieldsMatch(&reference, &field) ? "same rain" : "DIFFERENT rain");
+		freeRainField(&field);
+	}
+	if (oneThreadRate > 0.0) freeRainField(&reference);
+	if (processors < 2) printf("  (only one processor, so there is nothing to spread the work over)\n");
+}
 
-	glEndList();  // End the display list definition
+/*
+	Allocate every kind of particle's pool, and the scratch space to draw and emit
+	them, once, so nothing is allocated while they're spawned and die.
+*/
+void initParticles(void) {
+	memset(&particleSystem, 0, sizeof(particleSystem));
+	for (int type = 0; type < NUM_PARTICLE_TYPES; type++) {
+		particleSystem.pools[type].particles = (particle_t*)malloc(particleKinds[type].budget * sizeof(particle_t));
+		if (particleSystem.pools[type].particles == NULL) {
+			printf("Could not allocate %d %s particles\n", particleKinds[type].budget, particleKinds[type].name);
+			exit(1);
+		}
+	}
+	particleSystem.vertices = (float*)malloc(MAX_PARTICLES * PARTICLE_VERTEX_FLOATS * sizeof(float));
+	particleSystem.nearTanks = (int*)malloc((tankFleet.count + 1) * sizeof(int));
+	if (particleSystem.vertices == NULL || particleSystem.nearTanks == NULL) {
+		printf("Could not allocate the particles' scratch space\n");
+		exit(1);
+	}
+	particleSystem.spawnScale = 1.0f;
+	particleSystem.seed = 24680;
+	atexit(freeParticles);
 }
 
-void drawMultipleHouses() {
-	// Create the display list (only need to call this once, at initialization)
-	createHouseDisplayList();
+// Free the particle pools. Registered with atexit() by initParticles().
+void freeParticles(void) {
+	for (int type = 0; type < NUM_PARTICLE_TYPES; type++) {
+		free(particleSystem.pools[type].particles);
+	}
+	free(particleSystem.vertices);
+	free(particleSystem.nearTanks);
+	memset(&particleSystem, 0, sizeof(particleSystem));
+}
 
-	// Draw the trees at different positions using the display list
-	glPushMatrix();
-	glTranslatef(-10.0f, 0.0f, -5.0f);  // Position of the first tree
-	glCallList(HouseDisplayList);       // Call the display list
-	glPopMatrix();
+// A random number from 0 up to (not including) 1, for scattering particles.
+float particleRandom(void) {
+	return benchmarkRandom(&particleSystem.seed);
+}
 
-	glPushMatrix();
-	glTranslatef(15.0f, 0.0f, 0.0f);   // Position of the second tree
-	glCallList(HouseDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	Take a particle of the given kind from its pool, aged 0 with a random share of
+	the kind's life, for the caller to place. Returns NULL (and counts it dropped) if
+	the pool is used up or MAX_PARTICLES are already alive.
+*/
+particle_t* spawnParticle(particletype_t type) {
+	particlepool_t* pool = &particleSystem.pools[type];
+	if (pool->live == particleKinds[type].budget || particleSystem.live == MAX_PARTICLES) {
+		pool->dropped++;
+		return NULL;
+	}
+	particle_t* particle = &pool->particles[pool->live++];
+	particleSystem.live++;
+	pool->spawned++;
+	particle->age = 0.0f;
+	particle->life = particleKinds[type].life * (0.5f + 0.5f * particleRandom());
+	return particle;
+}
 
-	glPushMatrix();
-	glTranslatef(-10.0f, 0.0f, 5.0f);    // Position of the third tree
-	glCallList(HouseDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	How many particles an emitter should spawn now, when it would like count of them
+	(which needn't be whole) at full rate. The rate is cut by spawnScale, and what's
+	left over after rounding down is owed to the next frame.
+*/
+int particlesDue(particletype_t type, float count) {
+	particlepool_t* pool = &particleSystem.pools[type];
+	pool->spawnDebt += count * particleSystem.spawnScale;
+	int due = (int)pool->spawnDebt;
+	pool->spawnDebt -= (float)due;
+	return due;
+}
 
-	// You can add more trees by changing the positions and calling the display list
+/*
+	Cut the emitters' rates while frames take longer to draw than the frame pacing
+	allows them, and bring them back a little at a time once frames fit again, so
+	the particles thin out before the frame rate drops.
+*/
+void adjustParticleSpawnScale(unsigned long long frameCost) {
+	double fps = pacingMode == PACING_TARGET_FPS ? pacingTargetFps : TARGET_FPS;
+	unsigned long long budget = (unsigned long long)(NS_PER_SEC / fps);
+	if (frameCost > budget) {
+		particleSystem.spawnScale *= 0.8f;
+		if (particleSystem.spawnScale < PARTICLE_MIN_SPAWN_SCALE) particleSystem.spawnScale = PARTICLE_MIN_SPAWN_SCALE;
+	}
+	else if (frameCost < budget * 3 / 4) {
+		particleSystem.spawnScale += 0.05f;
+		if (particleSystem.spawnScale > 1.0f) particleSystem.spawnScale = 1.0f;
+	}
 }
 
-void initializeRain() {
-	for (int i = 0; i < NUM_RAIN_DROPS; i++) {
-		// Spread rain across a much larger area
-		rain[i].x = (float)(rand() % 200 - 100);  // -100 to +100 range
-		rain[i].y = (float)(rand() % 50 + 10);    // Higher starting point
-		rain[i].z = (float)(rand() % 200 - 100);  // -100 to +100 range
-		// Much slower speed for gentle rain
-		rain[i].speed = (rand() % 5 + 5) / 40.0f;  // Reduced speed significantly
+/*
+	Age and move every live particle of a kind by seconds. A particle that dies (or
+	falls through the ground) has the pool's last live particle moved into its slot,
+	so the live ones stay packed at the start of the pool.
+*/
+void moveParticles(particletype_t type, float seconds) {
+	const particlekind_t* kind = &particleKinds[type];
+	particlepool_t* pool = &particleSystem.pools[type];
+	float keep = 1.0f - kind->drag * seconds;
+	if (keep < 0.0f) keep = 0.0f;
+	int i = 0;
+	while (i < pool->live) {
+		particle_t* particle = &pool->particles[i];
+		particle->age += seconds;
+		particle->velocity[1] += kind->gravity * seconds;
+		for (int axis = 0; axis < 3; axis++) {
+			particle->velocity[axis] *= keep;
+			particle->position[axis] += particle->velocity[axis] * seconds;
+		}
+		if (particle->age >= particle->life || particle->position[1] < 0.0f) {
+			*particle = pool->particles[--pool->live];
+			particleSystem.live--;
+			continue;	// Look at the particle just moved into this slot.
+		}
+		i++;
 	}
 }
 
-void updateRain() {
-	if (!rainActive) return;  // Don't update if rain is off
+/*
+	Kick up dust in a ring round the aircraft while its rotors turn below
+	DOWNWASH_HEIGHT: the faster they spin and the lower it is, the more dust.
+*/
+void emitDownwashDust(float seconds) {
+	float height = renderState.objectLocation[1];
+	if (renderState.rotorSpeed <= 0.0f || height >= DOWNWASH_HEIGHT) return;
+	float strength = renderState.rotorSpeed / 15.0f * (1.0f - height / DOWNWASH_HEIGHT);	// 15 is flying speed (see think()).
+	int due = particlesDue(PARTICLE_DUST, DOWNWASH_RATE * strength * seconds);
+	for (int i = 0; i < due; i++) {
+		particle_t* particle = spawnParticle(PARTICLE_DUST);
+		if (particle == NULL) continue;
+		float angle = particleRandom() * 2.0f * PI;
+		float radius = 1.0f + particleRandom();
+		float outward = (2.0f + 3.0f * particleRandom()) * (0.5f + strength);
+		particle->position[0] = renderState.objectLocation[0] + cosf(angle) * radius;
+		particle->position[1] = 0.05f;
+		particle->position[2] = renderState.objectLocation[2] + sinf(angle) * radius;
+		particle->velocity[0] = cosf(angle) * outward;
+		particle->velocity[1] = 0.5f + particleRandom();
+		particle->velocity[2] = sinf(angle) * outward;
+	}
+}
 
-	for (int i = 0; i < NUM_RAIN_DROPS; i++) {
-		rain[i].y -= rain[i].speed;  // Move raindrop downwards
+/*
+	Puff smoke from the top of every tank within EXHAUST_DISTANCE of the camera, the
+	lone tank and tankFleet's alike, taking the tanks in turn so each gets its share
+	however few particles are due.
+*/
+void emitTankExhaust(float seconds) {
+	const float* camera = renderState.cameraLookAt;
+	const float leader[3] = { renderState.tankPosition[0] - 10.0f, 0.0f, renderState.tankPosition[2] - 20.0f };
+	int nearCount = 0;
+	for (int i = -1; i < tankGroup.count; i++) {
+		const float* position = i < 0 ? leader : tankGroup.instances[i].position;
+		float dx = position[0] - camera[0];
+		float dz = position[2] - camera[2];
+		if (dx * dx + dz * dz < EXHAUST_DISTANCE * EXHAUST_DISTANCE) particleSystem.nearTanks[nearCount++] = i;
+	}
+	if (nearCount == 0) return;
+
+	int due = particlesDue(PARTICLE_EXHAUST, EXHAUST_RATE * nearCount * seconds);
+	for (int i = 0; i < due; i++) {
+		particleSystem.exhaustCursor = (particleSystem.exhaustCursor + 1) % nearCount;
+		int tank = particleSystem.nearTanks[particleSystem.exhaustCursor];
+		const float* position = tank < 0 ? leader : tankGroup.instances[tank].position;
+		particle_t* particle = spawnParticle(PARTICLE_EXHAUST);
+		if (particle == NULL) continue;
+		particle->position[0] = position[0] + (particleRandom() - 0.5f) * 0.4f;
+		particle->position[1] = 1.1f;
+		particle->position[2] = position[2] + (particleRandom() - 0.5f) * 0.4f;
+		particle->velocity[0] = (particleRandom() - 0.5f) * 0.6f;
+		particle->velocity[1] = 0.6f + 0.4f * particleRandom();
+		particle->velocity[2] = (particleRandom() - 0.5f) * 0.6f;
+	}
+}
 
-		if (rain[i].y < 0.0f) {  // If it reaches the ground, reset the position
-			rain[i].y = (float)(rand() % 50 + 10);  // Reset to a random height
-			// Maintain the wide distribution when resetting positions
-			rain[i].x = (float)(rand() % 200 - 100);
-			rain[i].z = (float)(rand() % 200 - 100);
-			// Assign new random speed when resetting
-			rain[i].speed = (rand() % 5 + 5) / 40.0f;  // Keep consistent with initialization
+/*
+	Splash rain drops on the ground around the camera, as many as land there in
+	this many seconds. The rain falls a mean of 0.1875 units a frame, from a mean
+	height of 35 (see updateRainScalar()), so at TARGET_FPS SPLASH_LANDINGS of it
+	lands each second, anywhere in its box. Going by the clock rather than the frame
+	count keeps the splashes steady when frames are slow or fast, and the splashes
+	are spread the same way instead of being picked out of the rain's update.
+*/
+void emitRainSplashes(float seconds) {
+	if (!renderState.rainActive) return;
+	float share = (2.0f * SPLASH_DISTANCE) * (2.0f * SPLASH_DISTANCE) / (RAIN_BOX_SIZE * RAIN_BOX_SIZE);
+	int due = particlesDue(PARTICLE_SPLASH, rain.count * SPLASH_LANDINGS * share * seconds);
+	for (int i = 0; i < due; i++) {
+		float x = renderState.cameraLookAt[0] + (particleRandom() * 2.0f - 1.0f) * SPLASH_DISTANCE;
+		float z = renderState.cameraLookAt[2] + (particleRandom() * 2.0f - 1.0f) * SPLASH_DISTANCE;
+		for (int droplet = 0; droplet < SPLASH_DROPLETS; droplet++) {
+			particle_t* particle = spawnParticle(PARTICLE_SPLASH);
+			if (particle == NULL) continue;
+			float angle = particleRandom() * 2.0f * PI;
+			particle->position[0] = x;
+			particle->position[1] = 0.01f;
+			particle->position[2] = z;
+			particle->velocity[0] = cosf(angle) * 0.6f;
+			particle->velocity[1] = 1.0f + particleRandom();
+			particle->velocity[2] = sinf(angle) * 0.6f;
 		}
 	}
 }
 
-void drawRain() {
+/*
+	Move the particles on by the real time since the last frame, then let the
+	emitters spawn this frame's, at a rate cut back if the last frame ran over
+	budget. The spawned and dropped counts start again from 0 each frame.
+*/
+void updateParticles(void) {
+	unsigned long long now = pacingNowNs();
+	float seconds = particleSystem.lastUpdate != 0 ? (float)((double)(now - particleSystem.lastUpdate) / NS_PER_SEC) : 0.0f;
+	if (seconds > 0.1f) seconds = 0.1f;	// Don't let a stall fling everything across the map.
+	particleSystem.lastUpdate = now;
+
+	adjustParticleSpawnScale(displayCpuTime);
+	for (int type = 0; type < NUM_PARTICLE_TYPES; type++) {
+		particleSystem.pools[type].spawned = 0;
+		particleSystem.pools[type].dropped = 0;
+		moveParticles((particletype_t)type, seconds);
+	}
+	emitDownwashDust(seconds);
+	emitTankExhaust(seconds);
+	emitRainSplashes(seconds);
+}
 
-	if (!rainActive) return;  // Don't draw if rain is off
+/*
+	Draw every live particle as a blended point that fades out over its life, one
+	call per kind (each has its own point size). The particles are see-through, so
+	they're tested against the depth buffer but don't write to it.
+*/
+void drawParticles(void) {
+	if (particleSystem.live == 0) return;
+
+	float* vertex = particleSystem.vertices;
+	for (int type = 0; type < NUM_PARTICLE_TYPES; type++) {
+		const particlekind_t* kind = &particleKinds[type];
+		const particlepool_t* pool = &particleSystem.pools[type];
+		for (int i = 0; i < pool->live; i++) {
+			const particle_t* particle = &pool->particles[i];
+			vertex[0] = particle->position[0];
+			vertex[1] = particle->position[1];
+			vertex[2] = particle->position[2];
+			vertex[3] = kind->color[0];
+			vertex[4] = kind->color[1];
+			vertex[5] = kind->color[2];
+			vertex[6] = kind->color[3] * (1.0f - particle->age / particle->life);
+			vertex += PARTICLE_VERTEX_FLOATS;
+		}
+	}
 
-	glColor3f(0.7f, 0.7f, 1.0f);  // Lighter blue color for gentler appearance
-	glBegin(GL_LINES);
-	for (int i = 0; i < NUM_RAIN_DROPS; i++) {
-		glVertex3f(rain[i].x, rain[i].y, rain[i].z);
-		// Shorter rain drops for gentler appearance
-		glVertex3f(rain[i].x, rain[i].y + 0.5f, rain[i].z);  // Reduced drop length
+	glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_POINT_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_TEXTURE_2D);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDepthMask(GL_FALSE);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(3, GL_FLOAT, PARTICLE_VERTEX_FLOATS * sizeof(float), particleSystem.vertices);
+	glColorPointer(4, GL_FLOAT, PARTICLE_VERTEX_FLOATS * sizeof(float), particleSystem.vertices + 3);
+	int first = 0;
+	for (int type = 0; type < NUM_PARTICLE_TYPES; type++) {
+		int live = particleSystem.pools[type].live;
+		if (live == 0) continue;
+		glPointSize(particleKinds[type].pointSize);
+		glDrawArrays(GL_POINTS, first, live);
+		first += live;
 	}
-	glEnd();
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glPopAttrib();
 }
 
-void createTankDisplayList() {
-	TankDisplayList = glGenLists(1);  // Generate a unique display list identifier
-	glNewList(TankDisplayList, GL_COMPILE);  // Start defining the display list
+// Built into meshes[MESH_TANK] by initMeshes(). The tank's movement is applied at draw time by applyTankTransform().
+void buildTankMesh(meshbuilder_t* builder) {
+	builderPushMatrix(builder);
+	builderRotatef(builder, 270.0f, 0.0f, 1.0f, 0.0f);
+	buildTank(builder, 2.0f, 1.0f, 1.0f, 1.0f);  // Draw the tank (or call your custom tank drawing function)
+	builderPopMatrix(builder);
+}
 
-	glPushMatrix();
-	glTranslatef(tankPosition[0], tankPosition[1], tankPosition[2]); // Move tank to current position
+/*
+	Move and turn the current matrix to where the (interpolated) lone tank is. The
+	rest of the tanks are tankFleet's, placed by placeTanks().
+*/
+void applyTankTransform(void) {
+	glTranslatef(renderState.tankPosition[0], renderState.tankPosition[1], renderState.tankPosition[2]); // Move tank to current position
 	glTranslatef(-10.0f, 0.0f, -20.0f);
-	glRotatef(tankRotation, 0.0f, 1.0f, 0.0f);  // Rotate the tank around the Y-axis
-	glRotatef(270.0f, 0.0f, 1.0f, 0.0f);
-	drawTank(2.0f, 1.0f, 1.0f, 1.0f);  // Draw the tank (or call your custom tank drawing function)
-	glPopMatrix();
+	glRotatef(renderState.tankRotation, 0.0f, 1.0f, 0.0f);  // Rotate the tank around the Y-axis
+}
 
-	glEndList();  // End the display list definition
+// Point poses at room for count tanks (in one block, freed through poses->x). Returns 0 if memory runs out.
+int allocTankPoses(tankposes_t* poses, int count) {
+	float* block = (float*)malloc((count > 0 ? count : 1) * 3 * sizeof(float));
+	if (block == NULL) return 0;
+	poses->x = block;
+	poses->z = block + count;
+	poses->heading = block + 2 * count;
+	return 1;
 }
 
-void drawMultipleTanks() {
-	// Create the display list (only need to call this once, at initialization)
-	createTankDisplayList();
+// Copy every tank's pose (both must have been allocated for tankFleet.count tanks).
+void copyTankPoses(tankposes_t* to, const tankposes_t* from) {
+	memcpy(to->x, from->x, tankFleet.count * 3 * sizeof(float));
+}
 
-	// Draw the trees at different positions using the display list
-	glPushMatrix();
-	glTranslatef(30.0f, 0.0f, -5.0f);  // Position of the first tree
-	glCallList(TankDisplayList);       // Call the display list
-	glPopMatrix();
+/*
+	Set up the fleet: a tank on each of tankPlacements (moved off by the same offset
+	as the lone tank, and driving the same circle it does), plus extraTankCount
+	scattered over the ground with their own speeds and turning circles. Also makes
+	room for the copies the snapshots take. Called once from main(), before anything
+	is simulated. Returns 0 if memory runs out.
+*/
+int initTankFleet(void) {
+	int placedTanks = (int)(sizeof(tankPlacements) / sizeof(tankPlacements[0]));
+	tankFleet.count = placedTanks + extraTankCount;
+	tankFleet.speed = (float*)malloc(tankFleet.count * sizeof(float));
+	tankFleet.turnRate = (float*)malloc(tankFleet.count * sizeof(float));
+	if (tankFleet.speed == NULL || tankFleet.turnRate == NULL || !allocTankPoses(&tankFleet.pose, tankFleet.count)
+		|| !allocTankPoses(&previousTankPoses, tankFleet.count)) {
+		return 0;
+	}
+	for (int i = 0; i < 3; i++) {
+		if (!allocTankPoses(&snapshots[i].previousTanks, tankFleet.count) || !allocTankPoses(&snapshots[i].currentTanks, tankFleet.count)) {
+			return 0;
+		}
+	}
 
-	glPushMatrix();
-	glTranslatef(25.0f, 0.0f, 40.0f);   // Position of the second tree
-	glCallList(TankDisplayList);       // Call the display list
-	glPopMatrix();
+	for (int i = 0; i < placedTanks; i++) {
+		tankFleet.pose.x[i] = tankPlacements[i][0] - 10.0f;
+		tankFleet.pose.z[i] = tankPlacements[i][1] - 20.0f;
+		tankFleet.pose.heading[i] = 0.0f;
+		tankFleet.speed[i] = tankSpeed;
+		tankFleet.turnRate[i] = tankRotationSpeed;
+	}
 
-	glPushMatrix();
-	glTranslatef(-10.0f, 0.0f, 20.0f);    // Position of the third tree
-	glCallList(TankDisplayList);       // Call the display list
-	glPopMatrix();
+	// Like the extra trees, the extra tanks get their own random number sequence.
+	unsigned int seed = 54321u;
+	for (int i = placedTanks; i < tankFleet.count; i++) {
+		float random[5];
+		for (int k = 0; k < 5; k++) {
+			seed = seed * 1664525u + 1013904223u;
+			random[k] = (seed >> 8) / 16777216.0f;
+		}
+		tankFleet.pose.x[i] = (random[0] - 0.5f) * groundSize;
+		tankFleet.pose.z[i] = (random[1] - 0.5f) * groundSize;
+		tankFleet.pose.heading[i] = random[2] * 360.0f;
+		tankFleet.speed[i] = 1.0f + random[3] * 3.0f;
+		tankFleet.turnRate[i] = (random[4] - 0.5f) * 80.0f;
+	}
+	copyTankPoses(&previousTankPoses, &tankFleet.pose);
+	return 1;
+}
+
+// Drive every tank in the fleet one tick forward along its heading, turning as it goes. Called by think().
+void moveTankFleet(void) {
+	float* x = tankFleet.pose.x;
+	float* z = tankFleet.pose.z;
+	float* heading = tankFleet.pose.heading;
+	for (int i = 0; i < tankFleet.count; i++) {
+		float radians = heading[i] * PI / 180.0f;
+		float distance = tankFleet.speed[i] * FRAME_TIME_SEC;
+		x[i] -= sinf(radians) * distance;
+		z[i] -= cosf(radians) * distance;
+		heading[i] += tankFleet.turnRate[i] * FRAME_TIME_SEC;
+		if (heading[i] >= 360.0f) heading[i] -= 360.0f;
+		if (heading[i] < 0.0f) heading[i] += 360.0f;
+	}
+}
+
+/*
+	Move every tank (and its sceneIndex entry) to where it is this frame, alpha (0..1)
+	of the way between the snapshot's two copies of the fleet. Called by display()
+	before cullScene().
+*/
+void placeTanks(const worldsnapshot_t* snapshot, float alpha) {
+	const float leader[3] = {
+		renderState.tankPosition[0] - 10.0f, renderState.tankPosition[1], renderState.tankPosition[2] - 20.0f
+	};
+	spatialMove(&sceneIndex, SPATIAL_TANK, leader);
+
+	const tankposes_t* from = &snapshot->previousTanks;
+	const tankposes_t* to = &snapshot->currentTanks;
+	for (int i = 0; i < tankGroup.count; i++) {
+		meshinstance_t* tank = &tankGroup.instances[i];
+		tank->position[0] = from->x[i] + (to->x[i] - from->x[i]) * alpha;
+		tank->position[1] = 0.0f;
+		tank->position[2] = from->z[i] + (to->z[i] - from->z[i]) * alpha;
+		tank->yaw = lerpAngle(from->heading[i], to->heading[i], alpha);
+		spatialMove(&sceneIndex, tankGroup.spatialFirst + i, tank->position);
+	}
+	tankGroup.dirty = 1;
+}
 
-	// You can add more trees by changing the positions and calling the display list
+void drawMultipleTanks() {
+	// The tanks were moved into place by placeTanks()
+	queueInstanceGroup(&tankGroup);
 }
 
 void setupNightMode() {
-	if (rainActive) {
+	if (renderState.rainActive) {
 		// Darker ambient light for night time effect
 		GLfloat ambientLight[] = { 0.1f, 0.1f, 0.2f, 1.0f };  // Dark blue tint for night
-		glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambientLight);
+		sceneLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambientLight);
 
 		// Darker sky color for night time
 		glClearColor(0.0f, 0.0f, 0.1f, 1.0f);  // Almost black sky with slight blue tint
 
 		// Optionally dim the brightness of scene objects (like the ground)
 		GLfloat materialColor[] = { 0.2f, 0.2f, 0.3f, 1.0f };  // Darker materials for night effect
-		glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, materialColor);
+		cachedMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, materialColor);
 	}
 	else {
 		// Brighter ambient light for day time effect
 		GLfloat ambientLight[] = { 0.7f, 0.7f, 0.7f, 1.0f };  // Bright white light for daytime
-		glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambientLight);
+		sceneLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambientLight);
 
 		// Bright sky color for day time
 		glClearColor(0.5f, 0.7f, 1.0f, 1.0f);  // Light blue sky
 
 		// Restore normal brightness for scene objects
 		GLfloat materialColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };  // Normal materials for day effect
-		glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, materialColor);
+		cachedMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, materialColor);
+	}
+}
+
+/*
+	Handle our own command line options:
+		--pacing capped|uncapped|target		How rendered frames are paced (see pacingmode_t).
+		--fps N								Render at N frames per second (implies --pacing target).
+		--frame-histogram FILE				Write the frame time histogram to FILE (CSV) on exit.
+		--record FILE						Record keyboard input to FILE.
+		--replay FILE						Replay keyboard input from FILE without a window, then exit.
+		--replay-render						With --replay, also render every tick into a hidden window.
+		--profile-csv FILE					Write per-frame, per-pass timings to FILE (CSV).
+		--gpu-profile						Also time each render pass on the GPU with timer queries.
+		--single-thread						Run think() on the GLUT thread instead of its own thread.
+		--workers N							Help the GLUT thread move the rain with N worker threads (default: processors - 1).
+		--bench-grid						Time the ground grid with and without buffer objects, then exit.
+		--bench-spatial						Time the spatial index against linear scans without a window, then exit.
+		--bench-rain						Time the rain update with and without SSE2, and on 1 to 16 threads, without a window, then exit.
+		--ground-size N						Make the ground N units across (rounded up to whole chunks).
+		--trees N							Scatter N more trees over the ground.
+		--tanks N							Scatter N more tanks over the ground, each driving its own circle.
+		--rain-drops N						Make it rain N drops at a time (default DEFAULT_RAIN_DROPS, at most MAX_RAIN_DROPS).
+		--no-instancing						Draw repeated models in batches even if instanced arrays are supported.
+		--impostor-distance D				Draw trees farther than D units as impostors (0 turns them off).
+		--fixed-function					Light per vertex with the fixed-function pipeline even if GL 3.3 shaders are supported.
+
+	Anything else is left alone for glutInit() (e.g. -display, -geometry).
+*/
+void parseCommandLine(int argc, char** argv) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "capped") == 0) pacingMode = PACING_CAPPED;
+			else if (strcmp(argv[i], "uncapped") == 0) pacingMode = PACING_UNCAPPED;
+			else if (strcmp(argv[i], "target") == 0) pacingMode = PACING_TARGET_FPS;
+			else printf("Unknown pacing mode '%s' (expected capped, uncapped or target)\n", argv[i]);
+		}
+		else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+			pacingTargetFps = atof(argv[++i]);
+			if (pacingTargetFps <= 0.0) pacingTargetFps = TARGET_FPS;
+			pacingMode = PACING_TARGET_FPS;
+		}
+		else if (strcmp(argv[i], "--frame-histogram") == 0 && i + 1 < argc) {
+			frameHistogramFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			recordFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replayFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--replay-render") == 0) {
+			replayRender = 1;
+		}
+		else if (strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc) {
+			profileCsvFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--gpu-profile") == 0) {
+			gpuProfilingRequested = 1;
+		}
+		else if (strcmp(argv[i], "--single-thread") == 0) {
+			simulationThreadRequested = 0;
+		}
+		else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+			workerThreadCount = atoi(argv[++i]);
+			if (workerThreadCount < 0) workerThreadCount = 0;
+			if (workerThreadCount > MAX_WORKER_THREADS) workerThreadCount = MAX_WORKER_THREADS;
+		}
+		else if (strcmp(argv[i], "--bench-grid") == 0) {
+			gridBenchmarkRequested = 1;
+		}
+		else if (strcmp(argv[i], "--bench-spatial") == 0) {
+			spatialBenchmarkRequested = 1;
+		}
+		else if (strcmp(argv[i], "--bench-rain") == 0) {
+			rainBenchmarkRequested = 1;
+		}
+		else if (strcmp(argv[i], "--ground-size") == 0 && i + 1 < argc) {
+			groundSize = (float)atof(argv[++i]);
+			if (groundSize < GROUND_CHUNK_SIZE) groundSize = GROUND_CHUNK_SIZE;
+		}
+		else if (strcmp(argv[i], "--trees") == 0 && i + 1 < argc) {
+			extraTreeCount = atoi(argv[++i]);
+			if (extraTreeCount < 0) extraTreeCount = 0;
+		}
+		else if (strcmp(argv[i], "--tanks") == 0 && i + 1 < argc) {
+			extraTankCount = atoi(argv[++i]);
+			if (extraTankCount < 0) extraTankCount = 0;
+		}
+		else if (strcmp(argv[i], "--rain-drops") == 0 && i + 1 < argc) {
+			rainDropCount = atoi(argv[++i]);
+			if (rainDropCount < 0) rainDropCount = 0;
+			if (rainDropCount > MAX_RAIN_DROPS) rainDropCount = MAX_RAIN_DROPS;
+		}
+		else if (strcmp(argv[i], "--no-instancing") == 0) {
+			instancingRequested = 0;
+		}
+		else if (strcmp(argv[i], "--impostor-distance") == 0 && i + 1 < argc) {
+			impostorDistance = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--fixed-function") == 0) {
+			shaderLightingRequested = 0;
+		}
+		else if (strncmp(argv[i], "--", 2) == 0) {
+			printf("Ignoring unknown option '%s'\n", argv[i]);
+		}
+	}
+}
+
+/*
+	Monotonic clock in nanoseconds. Only differences between readings are meaningful.
+*/
+unsigned long long pacingNowNs(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency = { 0 };
+	LARGE_INTEGER counter;
+	if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	// Split the conversion so counter * NS_PER_SEC can't overflow on long runs.
+	unsigned long long seconds = counter.QuadPart / frequency.QuadPart;
+	unsigned long long remainder = counter.QuadPart % frequency.QuadPart;
+	return seconds * NS_PER_SEC + remainder * NS_PER_SEC / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * NS_PER_SEC + (unsigned long long)now.tv_nsec;
+#endif
+}
+
+/*
+	Give the CPU back to the OS for roughly duration nanoseconds (may overshoot).
+*/
+void pacingSleepNs(unsigned long long duration) {
+#ifdef _WIN32
+	Sleep((DWORD)(duration / NS_PER_MS));
+#else
+	struct timespec request;
+	request.tv_sec = (time_t)(duration / NS_PER_SEC);
+	request.tv_nsec = (long)(duration % NS_PER_SEC);
+	nanosleep(&request, NULL);
+#endif
+}
+
+#ifdef _WIN32
+// Hand back the 1 ms scheduler granularity main() asked for. Registered with atexit() in main().
+void restoreTimerPeriod(void) {
+	timeEndPeriod(1);
+}
+#endif
+
+/*
+	Block until pacingNowNs() reaches deadline: sleep while the deadline is comfortably
+	far away, then spin for the last PACING_SPIN_THRESHOLD_NS to hit it precisely.
+*/
+void pacingWaitUntil(unsigned long long deadline) {
+	unsigned long long now = pacingNowNs();
+	while (now < deadline) {
+		unsigned long long remaining = deadline - now;
+		if (remaining > PACING_SPIN_THRESHOLD_NS) {
+			pacingSleepNs(remaining - PACING_SPIN_THRESHOLD_NS);
+		}
+		now = pacingNowNs();
+	}
+}
+
+/*
+	Wait according to pacingMode until the next frame is due. Deadlines advance by a
+	fixed interval rather than from "now", so small wake-up errors don't accumulate.
+*/
+void pacingWaitForNextFrame(void) {
+	double fps;
+	switch (pacingMode) {
+	case PACING_CAPPED:
+		fps = TARGET_FPS;
+		break;
+	case PACING_TARGET_FPS:
+		fps = pacingTargetFps;
+		break;
+	default:
+		nextFrameDeadline = 0;
+		return;
+	}
+
+	unsigned long long interval = (unsigned long long)(NS_PER_SEC / fps);
+	unsigned long long now = pacingNowNs();
+
+	if (nextFrameDeadline == 0 || now > nextFrameDeadline + interval) {
+		// First frame in this mode, or we've fallen more than a frame behind: start a fresh schedule
+		// instead of rushing out a burst of frames to catch up.
+		nextFrameDeadline = now;
+	}
+	pacingWaitUntil(nextFrameDeadline);
+	nextFrameDeadline += interval;
+}
+
+/*
+	Add one frame time (in nanoseconds) to the rolling and whole-run histograms.
+*/
+void recordFrameTime(unsigned long long frameTime) {
+	unsigned long long bucket = frameTime / FRAME_HISTOGRAM_BUCKET_NS;
+	if (bucket >= FRAME_HISTOGRAM_BUCKETS) bucket = FRAME_HISTOGRAM_BUCKETS - 1;
+
+	// Forget the oldest frame once the rolling window is full.
+	if (frameTimes.historyCount == FRAME_HISTORY_SIZE) {
+		unsigned long long oldest = frameTimes.history[frameTimes.historyNext] / FRAME_HISTOGRAM_BUCKET_NS;
+		if (oldest >= FRAME_HISTOGRAM_BUCKETS) oldest = FRAME_HISTOGRAM_BUCKETS - 1;
+		frameTimes.buckets[oldest]--;
+	}
+	else {
+		frameTimes.historyCount++;
+	}
+
+	frameTimes.history[frameTimes.historyNext] = frameTime;
+	frameTimes.historyNext = (frameTimes.historyNext + 1) % FRAME_HISTORY_SIZE;
+	frameTimes.buckets[bucket]++;
+	frameTimes.runBuckets[bucket]++;
+	frameTimes.runFrames++;
+	if (frameTime > frameTimes.runMax) frameTimes.runMax = frameTime;
+}
+
+/*
+	Read the given percentile (0-100) out of a bucketed histogram holding count frames.
+	Returns the upper edge of the bucket it falls in, in nanoseconds.
+*/
+unsigned long long frameTimePercentile(const unsigned int* buckets, unsigned long long count, double percentile) {
+	if (count == 0) return 0;
+	unsigned long long rank = (unsigned long long)ceil(count * percentile / 100.0);
+	if (rank < 1) rank = 1;
+
+	unsigned long long seen = 0;
+	for (int i = 0; i < FRAME_HISTOGRAM_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank) return (i + 1) * FRAME_HISTOGRAM_BUCKET_NS;
+	}
+	return FRAME_HISTOGRAM_BUCKETS * FRAME_HISTOGRAM_BUCKET_NS;
+}
+
+/*
+	Print p50/p95/p99/max frame times for the rolling window and the whole run, and
+	write the whole-run histogram to frameHistogramFileName if one was given.
+	Registered with atexit() in main().
+*/
+void dumpFrameTimeHistogram(void) {
+	unsigned long long windowMax = 0;
+	for (int i = 0; i < frameTimes.historyCount; i++) {
+		if (frameTimes.history[i] > windowMax) windowMax = frameTimes.history[i];
+	}
+
+	printf("Frame times (pacing: %s)\n", pacingModeNames[pacingMode]);
+	printf("  last %d frames: p50 %.2f ms  p95 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+		frameTimes.historyCount,
+		frameTimePercentile(frameTimes.buckets, frameTimes.historyCount, 50.0) / (double)NS_PER_MS,
+		frameTimePercentile(frameTimes.buckets, frameTimes.historyCount, 95.0) / (double)NS_PER_MS,
+		frameTimePercentile(frameTimes.buckets, frameTimes.historyCount, 99.0) / (double)NS_PER_MS,
+		windowMax / (double)NS_PER_MS);
+	printf("  all %llu frames: p50 %.2f ms  p95 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+		frameTimes.runFrames,
+		frameTimePercentile(frameTimes.runBuckets, frameTimes.runFrames, 50.0) / (double)NS_PER_MS,
+		frameTimePercentile(frameTimes.runBuckets, frameTimes.runFrames, 95.0) / (double)NS_PER_MS,
+		frameTimePercentile(frameTimes.runBuckets, frameTimes.runFrames, 99.0) / (double)NS_PER_MS,
+		frameTimes.runMax / (double)NS_PER_MS);
+
+	if (frameHistogramFileName != NULL) {
+		FILE* file = fopen(frameHistogramFileName, "w");
+		if (file == NULL) {
+			printf("Could not write frame histogram to %s\n", frameHistogramFileName);
+			return;
+		}
+		fprintf(file, "bucket_start_ms,bucket_end_ms,frames\n");
+		for (int i = 0; i < FRAME_HISTOGRAM_BUCKETS; i++) {
+			if (frameTimes.runBuckets[i] == 0) continue;
+			fprintf(file, "%.1f,%.1f,%u\n", i * FRAME_HISTOGRAM_BUCKET_NS / (double)NS_PER_MS,
+				(i + 1) * FRAME_HISTOGRAM_BUCKET_NS / (double)NS_PER_MS, frameTimes.runBuckets[i]);
+		}
+		fclose(file);
+	}
+}
+
+/*
+	Advance the simulated world by one FRAME_TIME step: apply any input that arrived
+	since the last tick, then think(). Live play, replays and recordings all go
+	through here, which is what makes a replay reproduce the original run exactly.
+*/
+void simulationTick(void) {
+	applyQueuedInput();
+	captureInterpolationState(&previousState);
+	copyTankPoses(&previousTankPoses, &tankFleet.pose);
+	profileBegin(PASS_THINK);
+	think();
+	profileEnd(PASS_THINK);
+	simulationTicks++;
+}
+
+/*
+	Copy the world as of the newest tick into the triple buffer's back slot, then
+	swap it into the shared slot for display() to pick up. Only the thread running
+	the simulation may call this.
+*/
+void publishWorldSnapshot(unsigned long long tickTime) {
+	worldsnapshot_t* snapshot = &snapshots[snapshotBack];
+	snapshot->previous = previousState;
+	captureInterpolationState(&snapshot->current);
+	copyTankPoses(&snapshot->previousTanks, &previousTankPoses);
+	copyTankPoses(&snapshot->currentTanks, &tankFleet.pose);
+	snapshot->tick = simulationTicks;
+	snapshot->tickTime = tickTime;
+	snapshotBack = (int)(atomicExchange(&snapshotShared, snapshotBack | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH);
+}
+
+/*
+	The newest published snapshot. It stays valid (and unchanged) until the next
+	call, however many snapshots are published meanwhile. Only display() may call
+	this.
+*/
+const worldsnapshot_t* latestWorldSnapshot(void) {
+	if (atomicLoad(&snapshotShared) & SNAPSHOT_FRESH) {
+		snapshotFront = (int)(atomicExchange(&snapshotShared, snapshotFront) & ~SNAPSHOT_FRESH);
+	}
+	return &snapshots[snapshotFront];
+}
+
+#ifdef _WIN32
+static DWORD WINAPI simulationThreadEntry(LPVOID parameter) {
+	runSimulationLoop();
+	return 0;
+}
+#else
+static void* simulationThreadEntry(void* parameter) {
+	runSimulationLoop();
+	return NULL;
+}
+#endif
+
+/*
+	Start running the simulation on its own thread. From here on, only that thread
+	may touch simulation state; the GLUT thread just queues input and draws
+	snapshots. Returns 0 if the thread couldn't be created.
+*/
+int startSimulationThread(void) {
+	atomicStore(&simulationThreadRunning, 1);
+#ifdef _WIN32
+	simulationThread = CreateThread(NULL, 0, simulationThreadEntry, NULL, 0, NULL);
+	if (simulationThread == NULL) {
+		atomicStore(&simulationThreadRunning, 0);
+		return 0;
+	}
+#else
+	if (pthread_create(&simulationThread, NULL, simulationThreadEntry, NULL) != 0) {
+		atomicStore(&simulationThreadRunning, 0);
+		return 0;
+	}
+#endif
+	atexit(stopSimulationThread);
+	return 1;
+}
+
+/*
+	Ask the simulation thread to stop after its current tick, and wait for it.
+	Registered with atexit() by startSimulationThread().
+*/
+void stopSimulationThread(void) {
+	if (!atomicLoad(&simulationThreadRunning)) return;
+	atomicStore(&simulationThreadRunning, 0);
+#ifdef _WIN32
+	WaitForSingleObject(simulationThread, INFINITE);
+	CloseHandle(simulationThread);
+#else
+	pthread_join(simulationThread, NULL);
+#endif
+}
+
+/*
+	Body of the simulation thread: run one tick every FRAME_TIME milliseconds of
+	real time and publish a snapshot after each. Ticks are scheduled on a fixed
+	grid, so a late wake-up is made up on the next tick instead of drifting.
+*/
+void runSimulationLoop(void) {
+	unsigned long long interval = FRAME_TIME * NS_PER_MS;
+	unsigned long long nextTick = pacingNowNs() + interval;
+
+	while (atomicLoad(&simulationThreadRunning)) {
+		unsigned long long now = pacingNowNs();
+		if (now < nextTick) {
+			pacingSleepNs(nextTick - now);
+			continue;
+		}
+
+		// Don't try to catch up on huge stalls (see MAX_FRAME_CATCHUP).
+		if (now - nextTick > MAX_FRAME_CATCHUP * NS_PER_MS) {
+			nextTick = now;
+		}
+		simulationTick();
+		publishWorldSnapshot(nextTick);
+		nextTick += interval;
+	}
+}
+
+/*
+	Counting semaphores, for worker threads to sleep on until there's work. Thin
+	wrappers over Win32 semaphores and POSIX sem_t. semaphoreInit() returns 0 if the
+	semaphore couldn't be created.
+*/
+int semaphoreInit(semaphore_t* semaphore) {
+#ifdef _WIN32
+	*semaphore = CreateSemaphore(NULL, 0, MAX_WORKER_THREADS, NULL);
+	return *semaphore != NULL;
+#else
+	return sem_init(semaphore, 0, 0) == 0;
+#endif
+}
+
+void semaphorePost(semaphore_t* semaphore) {
+#ifdef _WIN32
+	ReleaseSemaphore(*semaphore, 1, NULL);
+#else
+	sem_post(semaphore);
+#endif
+}
+
+void semaphoreWait(semaphore_t* semaphore) {
+#ifdef _WIN32
+	WaitForSingleObject(*semaphore, INFINITE);
+#else
+	while (sem_wait(semaphore) != 0 && errno == EINTR) {
+		// Interrupted by a signal before it was posted, so wait again.
+	}
+#endif
+}
+
+void semaphoreDestroy(semaphore_t* semaphore) {
+#ifdef _WIN32
+	CloseHandle(*semaphore);
+#else
+	sem_destroy(semaphore);
+#endif
+}
+
+// How many processors the system has online (at least 1).
+int processorCount(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI workerThreadEntry(LPVOID parameter) {
+	runWorker((workerpool_t*)parameter);
+	return 0;
+}
+#else
+static void* workerThreadEntry(void* parameter) {
+	runWorker((workerpool_t*)parameter);
+	return NULL;
+}
+#endif
+
+/*
+	Start threadCount worker threads (at most MAX_WORKER_THREADS), asleep until
+	startWorkerJob() has something for them. Returns 0, with none left running, if
+	they couldn't all be started.
+*/
+int startWorkerPool(workerpool_t* pool, int threadCount) {
+	if (threadCount > MAX_WORKER_THREADS) threadCount = MAX_WORKER_THREADS;
+	pool->threadCount = 0;
+	pool->job = NULL;
+	if (!semaphoreInit(&pool->wake)) return 0;
+	if (!semaphoreInit(&pool->done)) {
+		semaphoreDestroy(&pool->wake);
+		return 0;
+	}
+	atomicStore(&pool->running, 1);
+	for (int i = 0; i < threadCount; i++) {
+#ifdef _WIN32
+		pool->threads[i] = CreateThread(NULL, 0, workerThreadEntry, pool, 0, NULL);
+		int started = pool->threads[i] != NULL;
+#else
+		int started = pthread_create(&pool->threads[i], NULL, workerThreadEntry, pool) == 0;
+#endif
+		if (!started) {
+			stopWorkerPool(pool);
+			return 0;
+		}
+		pool->threadCount++;
+	}
+	return 1;
+}
+
+/*
+	Wake every worker thread to stop, and wait for them. Must be called between jobs;
+	does nothing if the pool isn't running.
+*/
+void stopWorkerPool(workerpool_t* pool) {
+	if (!atomicLoad(&pool->running)) return;
+	atomicStore(&pool->running, 0);
+	for (int i = 0; i < pool->threadCount; i++) {
+		semaphorePost(&pool->wake);
+	}
+	for (int i = 0; i < pool->threadCount; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(pool->threads[i], INFINITE);
+		CloseHandle(pool->threads[i]);
+#else
+		pthread_join(pool->threads[i], NULL);
+#endif
+	}
+	semaphoreDestroy(&pool->wake);
+	semaphoreDestroy(&pool->done);
+	pool->threadCount = 0;
+}
+
+// Stop workerPool. Registered with atexit() by init() once the pool is started.
+void stopWorkerThreads(void) {
+	stopWorkerPool(&workerPool);
+}
+
+// Claim and run items of job, one at a time, until there are none left.
+void runWorkerJobItems(workerjob_t* job) {
+	for (;;) {
+		int item = (int)atomicFetchAdd(&job->nextItem, 1);
+		if (item >= job->itemCount) return;
+		job->run(job->context, item);
+	}
+}
+
+/*
+	Body of every worker thread: sleep until handed a job, help with it until nothing
+	is left to claim, say so, and go back to sleep, until the pool is stopped.
+*/
+void runWorker(workerpool_t* pool) {
+	for (;;) {
+		semaphoreWait(&pool->wake);
+		if (!atomicLoad(&pool->running)) return;
+		runWorkerJobItems(pool->job);
+		semaphorePost(&pool->done);
+	}
+}
+
+/*
+	Hand job to the pool and return straight away, so the caller can get on with
+	something else meanwhile. One worker is woken for each item after the first (the
+	caller takes its share in finishWorkerJob()), up to the whole pool; a pool with no
+	threads leaves everything to the caller. finishWorkerJob() must be called before
+	anything the job writes is used, or another job is started.
+*/
+void startWorkerJob(workerpool_t* pool, workerjob_t* job) {
+	job->nextItem = 0;
+	job->workersWoken = job->itemCount - 1 < pool->threadCount ? job->itemCount - 1 : pool->threadCount;
+	if (job->workersWoken < 0) job->workersWoken = 0;
+	pool->job = job;
+	for (int i = 0; i < job->workersWoken; i++) {
+		semaphorePost(&pool->wake);
+	}
+}
+
+/*
+	Run whatever is left of job on the calling thread, then wait for the workers to
+	finish the items they claimed. Everything the job wrote can be used afterwards.
+*/
+void finishWorkerJob(workerpool_t* pool, workerjob_t* job) {
+	runWorkerJobItems(job);
+	for (int i = 0; i < job->workersWoken; i++) {
+		semaphoreWait(&pool->done);
+	}
+}
+
+/*
+	Hold a keyboard event until the start of the next simulation tick. Called on
+	the GLUT thread; the event is stamped with its tick when it's applied.
+*/
+void queueInputEvent(inputeventtype_t type, unsigned char key) {
+	long tail = inputQueueTail;
+	long next = (tail + 1) % INPUT_QUEUE_SIZE;
+	if (next == atomicLoad(&inputQueueHead)) {
+		printf("Input queue full, dropping key %d\n", key);
+		return;
+	}
+	inputQueue[tail].type = (unsigned char)type;
+	inputQueue[tail].key = key;
+	atomicStore(&inputQueueTail, next);  // Publishes the event written above.
+}
+
+/*
+	Apply (and record, if recording) every queued event, in the order they arrived.
+*/
+void applyQueuedInput(void) {
+	long head = inputQueueHead;
+	while (head != atomicLoad(&inputQueueTail)) {
+		inputevent_t* event = &inputQueue[head];
+		event->tick = simulationTicks;
+		if (recordFile != NULL) {
+			recordInputEvent(event);
+		}
+		applyInputEvent(event);
+		head = (head + 1) % INPUT_QUEUE_SIZE;
+		atomicStore(&inputQueueHead, head);  // Hands the slot back to queueInputEvent().
+	}
+}
+
+/*
+	Pass a queued event back through the matching GLUT keyboard callback.
+*/
+void applyInputEvent(const inputevent_t* event) {
+	applyingInputEvent = 1;
+	switch (event->type) {
+	case INPUT_KEY_PRESSED:
+		keyPressed(event->key, 0, 0);
+		break;
+	case INPUT_KEY_RELEASED:
+		keyReleased(event->key, 0, 0);
+		break;
+	case INPUT_SPECIAL_PRESSED:
+		specialKeyPressed(event->key, 0, 0);
+		break;
+	case INPUT_SPECIAL_RELEASED:
+		specialKeyReleased(event->key, 0, 0);
+		break;
+	}
+	applyingInputEvent = 0;
+}
+
+/*
+	Point the helicopter's spotlight (GL_LIGHT2) forward and down from the rendered
+	helicopter position. Must be called after the camera has been set up, since
+	light positions are transformed by the current modelview matrix.
+*/
+void positionSpotlight(void) {
+	// Spotlight follows the helicopter
+	GLfloat spotlightPosition[] = { renderState.objectLocation[0], renderState.objectLocation[1] + 2.0f, renderState.objectLocation[2], 1.0f };
+
+	// Calculate the spotlight direction based on the helicopter's rotation (yaw)
+	float radians = renderState.objectRotation[1] * PI / 180.0f;
+	GLfloat spotlightDirection[] = { -sinf(radians), -0.5f, -cosf(radians) };  // Spotlight points forward and downward
+
+	sceneLightfv(GL_LIGHT2, GL_POSITION, spotlightPosition);
+	sceneLightfv(GL_LIGHT2, GL_SPOT_DIRECTION, spotlightDirection);
+}
+
+/*
+	Fill frameBlock with OpenGL's initial lighting state, which sceneLightfv(),
+	sceneLightf() and sceneLightModelfv() then keep it in step with. Called from
+	init() before any lights are set up.
+*/
+void resetFrameBlock(void) {
+	static const GLfloat initialAmbient[4] = { 0.2f, 0.2f, 0.2f, 1.0f };
+	memset(&frameBlock, 0, sizeof(frameBlock));
+	memcpy(frameBlock.ambient, initialAmbient, sizeof(initialAmbient));
+	frameBlock.fogEnd = 1.0f;
+	for (int i = 0; i < MAX_SHADER_LIGHTS; i++) {
+		shaderlight_t* light = &frameBlock.lights[i];
+		light->position[2] = 1.0f;
+		light->ambient[3] = 1.0f;
+		light->diffuse[3] = 1.0f;
+		light->specular[3] = 1.0f;
+		light->spotDirection[2] = -1.0f;
+		light->spotCosCutoff = -1.0f;
+		light->attenuation[0] = 1.0f;
+	}
+	// Only GL_LIGHT0 starts out white.
+	for (int c = 0; c < 3; c++) {
+		frameBlock.lights[0].diffuse[c] = 1.0f;
+		frameBlock.lights[0].specular[c] = 1.0f;
+	}
+}
+
+/*
+	glLightfv() that also records the parameter in frameBlock for the per-pixel
+	lighting shaders. Positions and spot directions are stored in eye space, moved
+	by the current modelview matrix just as OpenGL does.
+*/
+void sceneLightfv(GLenum light, GLenum pname, const GLfloat* params) {
+	glLightfv(light, pname, params);
+	int index = (int)(light - GL_LIGHT0);
+	if (index < 0 || index >= MAX_SHADER_LIGHTS) return;
+	shaderlight_t* mirror = &frameBlock.lights[index];
+	if (index >= frameBlock.lightCount) frameBlock.lightCount = index + 1;
+
+	switch (pname) {
+	case GL_POSITION:
+	case GL_SPOT_DIRECTION: {
+		GLfloat matrix[16];
+		glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
+		float w = pname == GL_POSITION ? params[3] : 0.0f;
+		GLfloat* eye = pname == GL_POSITION ? mirror->position : mirror->spotDirection;
+		for (int row = 0; row < 3; row++) {
+			eye[row] = matrix[row] * params[0] + matrix[4 + row] * params[1] + matrix[8 + row] * params[2] + matrix[12 + row] * w;
+		}
+		eye[3] = w;
+		break;
+	}
+	case GL_AMBIENT:
+		memcpy(mirror->ambient, params, sizeof(mirror->ambient));
+		break;
+	case GL_DIFFUSE:
+		memcpy(mirror->diffuse, params, sizeof(mirror->diffuse));
+		break;
+	case GL_SPECULAR:
+		memcpy(mirror->specular, params, sizeof(mirror->specular));
+		break;
+	case GL_SPOT_CUTOFF:
+		mirror->spotCosCutoff = params[0] >= 180.0f ? -1.0f : cosf(params[0] * (float)PI / 180.0f);
+		break;
+	case GL_SPOT_EXPONENT:
+		mirror->spotExponent = params[0];
+		break;
+	case GL_CONSTANT_ATTENUATION:
+		mirror->attenuation[0] = params[0];
+		break;
+	case GL_LINEAR_ATTENUATION:
+		mirror->attenuation[1] = params[0];
+		break;
+	case GL_QUADRATIC_ATTENUATION:
+		mirror->attenuation[2] = params[0];
+		break;
+	}
+}
+
+void sceneLightf(GLenum light, GLenum pname, GLfloat param) {
+	sceneLightfv(light, pname, &param);
+}
+
+// glLightModelfv() that also records GL_LIGHT_MODEL_AMBIENT in frameBlock.
+void sceneLightModelfv(GLenum pname, const GLfloat* params) {
+	glLightModelfv(pname, params);
+	if (pname == GL_LIGHT_MODEL_AMBIENT) {
+		memcpy(frameBlock.ambient, params, sizeof(frameBlock.ambient));
+	}
+}
+
+/*
+	Copy this frame's projection, lights and fog into the per-pixel lighting shaders'
+	uniform buffer, in one upload. Called from display() once the camera and the
+	spotlight are in place.
+*/
+void uploadFrameBlock(void) {
+	glGetFloatv(GL_PROJECTION_MATRIX, frameBlock.projection);
+	for (int i = 0; i < frameBlock.lightCount; i++) {
+		frameBlock.lights[i].enabled = glIsEnabled(GL_LIGHT0 + i) ? 1.0f : 0.0f;
+	}
+	frameBlock.fogEnabled = glIsEnabled(GL_FOG) ? 1.0f : 0.0f;
+	glBindBuffer(GL_UNIFORM_BUFFER, frameBlockBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frameBlock), &frameBlock);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// Little-endian helpers for the input recording format.
+static void writeUint32LE(unsigned char* bytes, unsigned int value) {
+	bytes[0] = (unsigned char)(value & 0xFF);
+	bytes[1] = (unsigned char)((value >> 8) & 0xFF);
+	bytes[2] = (unsigned char)((value >> 16) & 0xFF);
+	bytes[3] = (unsigned char)((value >> 24) & 0xFF);
+}
+
+static unsigned int readUint32LE(const unsigned char* bytes) {
+	return (unsigned int)bytes[0] | ((unsigned int)bytes[1] << 8) | ((unsigned int)bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+}
+
+static void writeRecordingHeader(FILE* file, unsigned int tickCount, unsigned int eventCount) {
+	unsigned char header[INPUT_RECORDING_HEADER_SIZE];
+	memcpy(header, "HREC", 4);
+	writeUint32LE(header + 4, INPUT_RECORDING_VERSION);
+	writeUint32LE(header + 8, TARGET_FPS);
+	writeUint32LE(header + 12, tickCount);
+	writeUint32LE(header + 16, eventCount);
+	fwrite(header, 1, sizeof(header), file);
+}
+
+/*
+	Open fileName for recording. The header is rewritten with the final tick and
+	event counts by finishInputRecording(), which runs on exit.
+*/
+int startInputRecording(const char* fileName) {
+	recordFile = fopen(fileName, "wb");
+	if (recordFile == NULL) {
+		printf("Could not open %s for recording\n", fileName);
+		return 0;
+	}
+	writeRecordingHeader(recordFile, 0, 0);
+	recordedEventCount = 0;
+	atexit(finishInputRecording);
+	printf("Recording input to %s\n", fileName);
+	return 1;
+}
+
+void recordInputEvent(const inputevent_t* event) {
+	unsigned char bytes[INPUT_RECORDING_EVENT_SIZE];
+	writeUint32LE(bytes, event->tick);
+	bytes[4] = event->type;
+	bytes[5] = event->key;
+	fwrite(bytes, 1, sizeof(bytes), recordFile);
+	recordedEventCount++;
+}
+
+void finishInputRecording(void) {
+	if (recordFile == NULL) return;
+	fseek(recordFile, 0, SEEK_SET);
+	writeRecordingHeader(recordFile, simulationTicks, recordedEventCount);
+	fclose(recordFile);
+	recordFile = NULL;
+	printf("Recorded %u events over %u ticks to %s\n", recordedEventCount, simulationTicks, recordFileName);
+}
+
+/*
+	Read a whole recording into replayEvents. Returns 0 (after printing why) if the
+	file is missing, malformed, or was recorded at a different simulation rate. A
+	header that promises more events than the file holds is treated as truncated.
+*/
+int loadInputRecording(const char* fileName) {
+	FILE* file = fopen(fileName, "rb");
+	if (file == NULL) {
+		printf("Could not open recording %s\n", fileName);
+		return 0;
+	}
+
+	unsigned char header[INPUT_RECORDING_HEADER_SIZE];
+	if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "HREC", 4) != 0
+		|| readUint32LE(header + 4) != INPUT_RECORDING_VERSION) {
+		printf("%s is not an input recording\n", fileName);
+		fclose(file);
+		return 0;
+	}
+	if (readUint32LE(header + 8) != TARGET_FPS) {
+		printf("%s was recorded at %u ticks/sec, but the simulation runs at %d\n", fileName, readUint32LE(header + 8), TARGET_FPS);
+		fclose(file);
+		return 0;
+	}
+	replayTickCount = readUint32LE(header + 12);
+	replayEventCount = readUint32LE(header + 16);
+
+	// Never trust the header's count further than the file's size backs it up.
+	long fileSize = -1;
+	if (fseek(file, 0, SEEK_END) == 0) fileSize = ftell(file);
+	if (fileSize < INPUT_RECORDING_HEADER_SIZE || fseek(file, INPUT_RECORDING_HEADER_SIZE, SEEK_SET) != 0) {
+		printf("Could not read %s\n", fileName);
+		fclose(file);
+		return 0;
+	}
+	unsigned long storedEvents = (unsigned long)(fileSize - INPUT_RECORDING_HEADER_SIZE) / INPUT_RECORDING_EVENT_SIZE;
+	if (replayEventCount > storedEvents) {
+		printf("%s is truncated (%lu of %u events)\n", fileName, storedEvents, replayEventCount);
+		replayEventCount = (unsigned int)storedEvents;
+	}
+
+	replayEvents = (inputevent_t*)malloc(((size_t)replayEventCount + 1) * sizeof(inputevent_t));
+	if (replayEvents == NULL) {
+		printf("Could not allocate %u events for %s\n", replayEventCount, fileName);
+		fclose(file);
+		return 0;
+	}
+	for (unsigned int i = 0; i < replayEventCount; i++) {
+		unsigned char bytes[INPUT_RECORDING_EVENT_SIZE];
+		if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
+			printf("%s is truncated (%u of %u events)\n", fileName, i, replayEventCount);
+			replayEventCount = i;
+			break;
+		}
+		if (bytes[4] > INPUT_SPECIAL_RELEASED) {
+			printf("%s has an event of unknown type %u\n", fileName, bytes[4]);
+			free(replayEvents);
+			replayEvents = NULL;
+			replayEventCount = 0;
+			fclose(file);
+			return 0;
+		}
+		replayEvents[i].tick = readUint32LE(bytes);
+		replayEvents[i].type = bytes[4];
+		replayEvents[i].key = bytes[5];
+	}
+	fclose(file);
+	return 1;
+}
+
+/*
+	Run the loaded recording tick by tick as fast as possible, feeding each event in
+	on the tick it was recorded on. With renderFrames set, display() draws every
+	tick too (into the hidden window). Prints throughput and a hash of the final
+	world state, which must match between runs of the same recording.
+*/
+int runReplay(int renderFrames) {
+	if (!loadInputRecording(replayFileName)) {
+		return 1;
+	}
+	if (renderFrames && profileCsvFileName != NULL && !startProfileCsv(profileCsvFileName)) {
+		return 1;
+	}
+
+	captureInterpolationState(&previousState);
+	copyTankPoses(&previousTankPoses, &tankFleet.pose);
+	publishWorldSnapshot(0);
+	renderAlpha = 1.0f;  // Always draw the newest tick.
+
+	unsigned int nextEvent = 0;
+	unsigned long long startTime = pacingNowNs();
+
+	while (simulationTicks < replayTickCount) {
+		while (nextEvent < replayEventCount && replayEvents[nextEvent].tick <= simulationTicks) {
+			queueInputEvent(replayEvents[nextEvent].type, replayEvents[nextEvent].key);
+			nextEvent++;
+		}
+		simulationTick();
+
+		if (renderFrames) {
+			publishWorldSnapshot(0);
+			glutMainLoopEvent();
+			display();
+		}
+	}
+	if (renderFrames) {
+		glFinish();  // Count the GPU's work too, not just the commands we queued.
+	}
+
+	double seconds = (pacingNowNs() - startTime) / (double)NS_PER_SEC;
+	printf("Replayed %u ticks (%u events) from %s%s\n", simulationTicks, nextEvent, replayFileName,
+		renderFrames ? " with rendering" : "");
+	printf("  %.3f s, %.1f ticks/sec (%.1fx real time)\n", seconds, seconds > 0.0 ? simulationTicks / seconds : 0.0,
+		seconds > 0.0 ? simulationTicks * FRAME_TIME_SEC / seconds : 0.0);
+	printf("  state hash %016llx\n", hashSimulationState());
+
+	free(replayEvents);
+	replayEvents = NULL;
+	return 0;
+}
+
+// FNV-1a, folded over the raw bytes of a block of simulation state.
+static unsigned long long hashBytes(unsigned long long hash, const void* data, size_t size) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+	Hash everything think() reads or writes, so two runs can be compared for
+	bit-for-bit identical simulation results.
+*/
+unsigned long long hashSimulationState(void) {
+	unsigned long long hash = 14695981039346656037ULL;
+	hash = hashBytes(hash, &simulationTicks, sizeof(simulationTicks));
+	hash = hashBytes(hash, objectLocation, sizeof(objectLocation));
+	hash = hashBytes(hash, objectRotation, sizeof(objectRotation));
+	hash = hashBytes(hash, cameraLookAt, sizeof(cameraLookAt));
+	hash = hashBytes(hash, tankPosition, sizeof(tankPosition));
+	hash = hashBytes(hash, &tankRotation, sizeof(tankRotation));
+	hash = hashBytes(hash, tankFleet.pose.x, tankFleet.count * 3 * sizeof(float));
+	hash = hashBytes(hash, &propellerRotationAngle, sizeof(propellerRotationAngle));
+	hash = hashBytes(hash, &rotorSpeed, sizeof(rotorSpeed));
+	hash = hashBytes(hash, &rotorsActive, sizeof(rotorsActive));
+	hash = hashBytes(hash, &heaveEnabled, sizeof(heaveEnabled));
+	hash = hashBytes(hash, &hasTakenOff, sizeof(hasTakenOff));
+	hash = hashBytes(hash, &timeHeldW, sizeof(timeHeldW));
+	hash = hashBytes(hash, &timeGrounded, sizeof(timeGrounded));
+	hash = hashBytes(hash, &wingAngle, sizeof(wingAngle));
+	hash = hashBytes(hash, &keyboardMotion, sizeof(keyboardMotion));
+	hash = hashBytes(hash, &rainActive, sizeof(rainActive));
+	return hash;
+}
+
+/*
+	Look up the OpenGL functions we use beyond 1.1 and record the context version.
+	Must be called with a current context (i.e. from init()).
+*/
+void loadGLExtensions(void) {
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if (version == NULL || sscanf(version, "%d.%d", &glMajorVersion, &glMinorVersion) != 2) {
+		glMajorVersion = 1;
+		glMinorVersion = 0;
+	}
+	printf("OpenGL %s (%s)\n", version ? version : "?", (const char*)glGetString(GL_RENDERER));
+
+	pglGenQueries = (GenQueriesFunc)glutGetProcAddress("glGenQueries");
+	pglDeleteQueries = (DeleteQueriesFunc)glutGetProcAddress("glDeleteQueries");
+	pglBeginQuery = (BeginQueryFunc)glutGetProcAddress("glBeginQuery");
+	pglEndQuery = (EndQueryFunc)glutGetProcAddress("glEndQuery");
+	pglGetQueryObjectiv = (GetQueryObjectivFunc)glutGetProcAddress("glGetQueryObjectiv");
+	pglGetQueryObjectui64v = (GetQueryObjectui64vFunc)glutGetProcAddress("glGetQueryObjectui64v");
+	if (pglGetQueryObjectui64v == NULL) {
+		pglGetQueryObjectui64v = (GetQueryObjectui64vFunc)glutGetProcAddress("glGetQueryObjectui64vEXT");
+	}
+
+	pglGenBuffers = (GenBuffersFunc)glutGetProcAddress("glGenBuffers");
+	pglDeleteBuffers = (DeleteBuffersFunc)glutGetProcAddress("glDeleteBuffers");
+	pglBindBuffer = (BindBufferFunc)glutGetProcAddress("glBindBuffer");
+	pglBufferData = (BufferDataFunc)glutGetProcAddress("glBufferData");
+	vertexBuffersAvailable = glVersionAtLeast(1, 5) && pglGenBuffers != NULL && pglDeleteBuffers != NULL
+		&& pglBindBuffer != NULL && pglBufferData != NULL;
+
+	pglMapBufferRange = (MapBufferRangeFunc)glutGetProcAddress("glMapBufferRange");
+	pglUnmapBuffer = (UnmapBufferFunc)glutGetProcAddress("glUnmapBuffer");
+	bufferMappingAvailable = glVersionAtLeast(3, 0) && vertexBuffersAvailable && pglMapBufferRange != NULL && pglUnmapBuffer != NULL;
+
+	pglCreateShader = (CreateShaderFunc)glutGetProcAddress("glCreateShader");
+	pglShaderSource = (ShaderSourceFunc)glutGetProcAddress("glShaderSource");
+	pglCompileShader = (CompileShaderFunc)glutGetProcAddress("glCompileShader");
+	pglGetShaderiv = (GetShaderivFunc)glutGetProcAddress("glGetShaderiv");
+	pglGetShaderInfoLog = (GetShaderInfoLogFunc)glutGetProcAddress("glGetShaderInfoLog");
+	pglDeleteShader = (DeleteShaderFunc)glutGetProcAddress("glDeleteShader");
+	pglCreateProgram = (CreateProgramFunc)glutGetProcAddress("glCreateProgram");
+	pglAttachShader = (AttachShaderFunc)glutGetProcAddress("glAttachShader");
+	pglBindAttribLocation = (BindAttribLocationFunc)glutGetProcAddress("glBindAttribLocation");
+	pglLinkProgram = (LinkProgramFunc)glutGetProcAddress("glLinkProgram");
+	pglGetProgramiv = (GetProgramivFunc)glutGetProcAddress("glGetProgramiv");
+	pglGetProgramInfoLog = (GetProgramInfoLogFunc)glutGetProcAddress("glGetProgramInfoLog");
+	pglDeleteProgram = (DeleteProgramFunc)glutGetProcAddress("glDeleteProgram");
+	pglUseProgram = (UseProgramFunc)glutGetProcAddress("glUseProgram");
+	pglGetUniformLocation = (GetUniformLocationFunc)glutGetProcAddress("glGetUniformLocation");
+	pglUniform1i = (Uniform1iFunc)glutGetProcAddress("glUniform1i");
+	pglUniform1f = (Uniform1fFunc)glutGetProcAddress("glUniform1f");
+	pglUniform1fv = (Uniform1fvFunc)glutGetProcAddress("glUniform1fv");
+	pglUniform3fv = (Uniform3fvFunc)glutGetProcAddress("glUniform3fv");
+	pglUniform4fv = (Uniform4fvFunc)glutGetProcAddress("glUniform4fv");
+	pglVertexAttribPointer = (VertexAttribPointerFunc)glutGetProcAddress("glVertexAttribPointer");
+	pglEnableVertexAttribArray = (EnableVertexAttribArrayFunc)glutGetProcAddress("glEnableVertexAttribArray");
+	pglDisableVertexAttribArray = (DisableVertexAttribArrayFunc)glutGetProcAddress("glDisableVertexAttribArray");
+	shadersAvailable = glVersionAtLeast(2, 0) && pglCreateShader != NULL && pglShaderSource != NULL
+		&& pglCompileShader != NULL && pglGetShaderiv != NULL && pglGetShaderInfoLog != NULL
+		&& pglDeleteShader != NULL && pglCreateProgram != NULL && pglAttachShader != NULL
+		&& pglBindAttribLocation != NULL && pglLinkProgram != NULL && pglGetProgramiv != NULL
+		&& pglGetProgramInfoLog != NULL && pglDeleteProgram != NULL && pglUseProgram != NULL
+		&& pglGetUniformLocation != NULL && pglUniform1i != NULL && pglUniform1f != NULL
+		&& pglUniform1fv != NULL && pglUniform3fv != NULL && pglUniform4fv != NULL
+		&& pglVertexAttribPointer != NULL
+		&& pglEnableVertexAttribArray != NULL && pglDisableVertexAttribArray != NULL;
+
+	pglVertexAttribDivisor = (VertexAttribDivisorFunc)glutGetProcAddress("glVertexAttribDivisor");
+	pglDrawElementsInstanced = (DrawElementsInstancedFunc)glutGetProcAddress("glDrawElementsInstanced");
+	instancingAvailable = glVersionAtLeast(3, 3) && shadersAvailable && vertexBuffersAvailable
+		&& pglVertexAttribDivisor != NULL && pglDrawElementsInstanced != NULL;
+
+	pglUniformMatrix3fv = (UniformMatrix3fvFunc)glutGetProcAddress("glUniformMatrix3fv");
+	pglUniformMatrix4fv = (UniformMatrix4fvFunc)glutGetProcAddress("glUniformMatrix4fv");
+	pglVertexAttrib4fv = (VertexAttrib4fvFunc)glutGetProcAddress("glVertexAttrib4fv");
+	pglBufferSubData = (BufferSubDataFunc)glutGetProcAddress("glBufferSubData");
+	pglGetUniformBlockIndex = (GetUniformBlockIndexFunc)glutGetProcAddress("glGetUniformBlockIndex");
+	pglUniformBlockBinding = (UniformBlockBindingFunc)glutGetProcAddress("glUniformBlockBinding");
+	pglBindBufferBase = (BindBufferBaseFunc)glutGetProcAddress("glBindBufferBase");
+	shaderLightingAvailable = glVersionAtLeast(3, 3) && shadersAvailable && vertexBuffersAvailable
+		&& pglUniformMatrix3fv != NULL && pglUniformMatrix4fv != NULL && pglVertexAttrib4fv != NULL
+		&& pglBufferSubData != NULL && pglGetUniformBlockIndex != NULL && pglUniformBlockBinding != NULL
+		&& pglBindBufferBase != NULL;
+
+	pglGenFramebuffers = (GenFramebuffersFunc)glutGetProcAddress("glGenFramebuffers");
+	pglDeleteFramebuffers = (DeleteFramebuffersFunc)glutGetProcAddress("glDeleteFramebuffers");
+	pglBindFramebuffer = (BindFramebufferFunc)glutGetProcAddress("glBindFramebuffer");
+	pglFramebufferTexture2D = (FramebufferTexture2DFunc)glutGetProcAddress("glFramebufferTexture2D");
+	pglCheckFramebufferStatus = (CheckFramebufferStatusFunc)glutGetProcAddress("glCheckFramebufferStatus");
+	pglGenRenderbuffers = (GenRenderbuffersFunc)glutGetProcAddress("glGenRenderbuffers");
+	pglDeleteRenderbuffers = (DeleteRenderbuffersFunc)glutGetProcAddress("glDeleteRenderbuffers");
+	pglBindRenderbuffer = (BindRenderbufferFunc)glutGetProcAddress("glBindRenderbuffer");
+	pglRenderbufferStorage = (RenderbufferStorageFunc)glutGetProcAddress("glRenderbufferStorage");
+	pglFramebufferRenderbuffer = (FramebufferRenderbufferFunc)glutGetProcAddress("glFramebufferRenderbuffer");
+	pglGenerateMipmap = (GenerateMipmapFunc)glutGetProcAddress("glGenerateMipmap");
+	framebuffersAvailable = (glVersionAtLeast(3, 0) || hasGLExtension("GL_ARB_framebuffer_object"))
+		&& pglGenFramebuffers != NULL && pglDeleteFramebuffers != NULL && pglBindFramebuffer != NULL
+		&& pglFramebufferTexture2D != NULL && pglCheckFramebufferStatus != NULL && pglGenRenderbuffers != NULL
+		&& pglDeleteRenderbuffers != NULL && pglBindRenderbuffer != NULL && pglRenderbufferStorage != NULL
+		&& pglFramebufferRenderbuffer != NULL && pglGenerateMipmap != NULL;
+}
+
+int glVersionAtLeast(int major, int minor) {
+	return glMajorVersion > major || (glMajorVersion == major && glMinorVersion >= minor);
+}
+
+/*
+	Check the extension string for an exact (whole word) match of name.
+*/
+int hasGLExtension(const char* name) {
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	size_t length = strlen(name);
+	while (extensions != NULL && (extensions = strstr(extensions, name)) != NULL) {
+		if (extensions[length] == ' ' || extensions[length] == '\0') return 1;
+		extensions += length;
+	}
+	return 0;
+}
+
+/*
+	Forget everything the state cache knows, so the next call of each kind goes to the
+	driver. Needed after anything changes cached state behind its back (such as a
+	glPopAttrib() that undoes cached calls made since the matching glPushAttrib()).
+*/
+void resetStateCache(void) {
+	memset(&stateCache, 0, sizeof(stateCache));
+}
+
+// Where a capability's state is kept in stateCache, or -1 if it isn't cached.
+int stateCacheCapIndex(GLenum cap) {
+	for (int i = 0; i < STATE_CACHE_CAPS; i++) {
+		if (stateCacheCaps[i] == cap) return i;
+	}
+	return -1;
+}
+
+/*
+	Whether count values match the cached ones, in which case the call setting them
+	can be skipped. Otherwise the cache takes the new values. Counts the call in
+	stateCacheStats either way.
+*/
+int stateCacheMatches(GLfloat* cached, unsigned char* known, const GLfloat* values, int count) {
+	if (*known && memcmp(cached, values, count * sizeof(GLfloat)) == 0) {
+		stateCacheStats.callsSkipped++;
+		return 1;
+	}
+	memcpy(cached, values, count * sizeof(GLfloat));
+	*known = 1;
+	stateCacheStats.callsMade++;
+	return 0;
+}
+
+// glEnable() / glDisable() through the state cache.
+void setCachedCapability(GLenum cap, int enabled) {
+	int i = stateCacheCapIndex(cap);
+	if (i >= 0 && stateCache.capKnown[i] && stateCache.capEnabled[i] == enabled) {
+		stateCacheStats.callsSkipped++;
+		return;
+	}
+	if (enabled) glEnable(cap);
+	else glDisable(cap);
+	stateCacheStats.callsMade++;
+	if (i < 0) return;
+	stateCache.capKnown[i] = 1;
+	stateCache.capEnabled[i] = (unsigned char)enabled;
+
+	// Ambient and diffuse hold whatever colour was last tracked, so they can't be trusted after this.
+	if (cap == GL_COLOR_MATERIAL) {
+		for (int face = 0; face < 2; face++) {
+			stateCache.materialKnown[face][0] = 0;
+			stateCache.materialKnown[face][1] = 0;
+		}
+	}
+}
+
+void cachedEnable(GLenum cap) {
+	setCachedCapability(cap, 1);
+}
+
+void cachedDisable(GLenum cap) {
+	setCachedCapability(cap, 0);
+}
+
+// glBindTexture(GL_TEXTURE_2D, texture) through the state cache.
+void cachedBindTexture(GLuint texture) {
+	if (stateCache.textureKnown && stateCache.texture == texture) {
+		stateCacheStats.callsSkipped++;
+		return;
+	}
+	glBindTexture(GL_TEXTURE_2D, texture);
+	stateCache.texture = texture;
+	stateCache.textureKnown = 1;
+	stateCacheStats.callsMade++;
+}
+
+/*
+	glMaterialfv() through the state cache, for GL_AMBIENT, GL_DIFFUSE,
+	GL_AMBIENT_AND_DIFFUSE, GL_SPECULAR and GL_SHININESS (anything else is passed
+	straight on). Ambient and diffuse aren't cached while GL_COLOR_MATERIAL may be on,
+	since init() points it at them and the current colour overwrites them.
+*/
+void cachedMaterialfv(GLenum face, GLenum pname, const GLfloat* params) {
+	int slots[2];
+	int slotCount = 0;
+	if (pname == GL_AMBIENT || pname == GL_AMBIENT_AND_DIFFUSE) slots[slotCount++] = 0;
+	if (pname == GL_DIFFUSE || pname == GL_AMBIENT_AND_DIFFUSE) slots[slotCount++] = 1;
+	if (pname == GL_SPECULAR) slots[slotCount++] = 2;
+	if (pname == GL_SHININESS) slots[slotCount++] = 3;
+	int colorMaterial = stateCacheCapIndex(GL_COLOR_MATERIAL);
+	int colorMaterialOff = stateCache.capKnown[colorMaterial] && !stateCache.capEnabled[colorMaterial];
+	int count = pname == GL_SHININESS ? 1 : 4;
+
+	int cacheable = slotCount > 0 && (slots[0] >= 2 || colorMaterialOff);
+	int matches = cacheable;
+	for (int f = 0; f < 2 && matches; f++) {
+		if ((f == 0 && face == GL_BACK) || (f == 1 && face == GL_FRONT)) continue;
+		for (int s = 0; s < slotCount && matches; s++) {
+			matches = stateCache.materialKnown[f][slots[s]] && memcmp(stateCache.material[f][slots[s]], params, count * sizeof(GLfloat)) == 0;
+		}
+	}
+	if (matches) {
+		stateCacheStats.callsSkipped++;
+		return;
+	}
+
+	glMaterialfv(face, pname, params);
+	stateCacheStats.callsMade++;
+	for (int f = 0; f < 2; f++) {
+		if ((f == 0 && face == GL_BACK) || (f == 1 && face == GL_FRONT)) continue;
+		for (int s = 0; s < slotCount; s++) {
+			memcpy(stateCache.material[f][slots[s]], params, count * sizeof(GLfloat));
+			stateCache.materialKnown[f][slots[s]] = (unsigned char)cacheable;
+		}
+	}
+}
+
+void cachedMaterialf(GLenum face, GLenum pname, GLfloat param) {
+	cachedMaterialfv(face, pname, &param);
+}
+
+/*
+	glFogfv() / glFogf() / glFogi() through the state cache, for the colour, mode,
+	start, end and density.
+*/
+void cachedFogfv(GLenum pname, const GLfloat* params) {
+	int slot = -1;
+	switch (pname) {
+	case GL_FOG_COLOR: slot = 0; break;
+	case GL_FOG_MODE: slot = 1; break;
+	case GL_FOG_START: slot = 2; break;
+	case GL_FOG_END: slot = 3; break;
+	case GL_FOG_DENSITY: slot = 4; break;
+	}
+	if (slot >= 0 && stateCacheMatches(stateCache.fog[slot], &stateCache.fogKnown[slot], params, slot == 0 ? 4 : 1)) {
+		return;
+	}
+	if (slot < 0) stateCacheStats.callsMade++;
+	glFogfv(pname, params);
+}
+
+void cachedFogf(GLenum pname, GLfloat param) {
+	cachedFogfv(pname, &param);
+}
+
+void cachedFogi(GLenum pname, GLint param) {
+	GLfloat value = (GLfloat)param;
+	cachedFogfv(pname, &value);
+}
+
+// glHint(GL_FOG_HINT, mode) through the state cache.
+void cachedFogHint(GLenum mode) {
+	if (stateCache.fogHintKnown && stateCache.fogHint == mode) {
+		stateCacheStats.callsSkipped++;
+		return;
+	}
+	glHint(GL_FOG_HINT, mode);
+	stateCache.fogHint = mode;
+	stateCache.fogHintKnown = 1;
+	stateCacheStats.callsMade++;
+}
+
+/*
+	Create both sets of timer queries, if the driver supports GL_TIME_ELAPSED
+	(core in OpenGL 3.3, or GL_ARB_timer_query / GL_EXT_timer_query before that).
+*/
+void initGpuProfiler(void) {
+	int supported = glVersionAtLeast(3, 3) || hasGLExtension("GL_ARB_timer_query") || hasGLExtension("GL_EXT_timer_query");
+	if (!supported || pglGenQueries == NULL || pglBeginQuery == NULL || pglEndQuery == NULL
+		|| pglGetQueryObjectiv == NULL || pglGetQueryObjectui64v == NULL) {
+		printf("GPU profiling unavailable: timer queries are not supported by this driver\n");
+		return;
+	}
+	glGenQueries(NUM_PASSES, gpuQueries[0]);
+	glGenQueries(NUM_PASSES, gpuQueries[1]);
+	gpuProfilingEnabled = 1;
+}
+
+/*
+	Read back the queries this frame is about to reuse (issued two frames ago)
+	into gpuResults. A result that isn't available yet is dropped rather than
+	waited for.
+*/
+void readGpuProfileResults(void) {
+	int parity = renderedFrames & 1;
+	for (int pass = 0; pass < NUM_PASSES; pass++) {
+		gpuResults[pass] = 0;
+		if (!gpuQueryIssued[parity][pass]) continue;
+
+		GLint available = 0;
+		glGetQueryObjectiv(gpuQueries[parity][pass], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(gpuQueries[parity][pass], GL_QUERY_RESULT, &elapsed);
+			gpuResults[pass] = elapsed;
+		}
+		else {
+			gpuResultsDropped++;
+		}
+		gpuQueryIssued[parity][pass] = 0;
+	}
+}
+
+/*
+	(Re)build mesh as a size x size grid of divisions x divisions cells, running
+	from origin to origin + size on both x and z, with texture coordinates of
+	texturesPerUnit times the position. The index buffer holds two triangles per
+	cell, then a line for every cell edge (for wireframe mode). Returns 0 if the
+	buffers couldn't be filled.
+*/
+int buildGroundMesh(groundmesh_t* mesh, float origin, float size, int divisions, float texturesPerUnit) {
+	int rowVertices = divisions + 1;
+	int vertexCount = rowVertices * rowVertices;
+	int triangleIndexCount = divisions * divisions * 6;
+	int lineIndexCount = divisions * rowVertices * 4;
+	float step = size / (float)divisions;
+
+	float* vertices = malloc(vertexCount * 5 * sizeof(float));
+	GLuint* indices = malloc((triangleIndexCount + lineIndexCount) * sizeof(GLuint));
+	if (vertices == NULL || indices == NULL) {
+		free(vertices);
+		free(indices);
+		return 0;
+	}
+
+	// Vertex (i, j) sits at x = i, z = j in grid steps from the -halfSize corner.
+	float* vertex = vertices;
+	for (int i = 0; i < rowVertices; i++) {
+		for (int j = 0; j < rowVertices; j++) {
+			float x = origin + i * step;
+			float z = origin + j * step;
+			*vertex++ = x;
+			*vertex++ = 0.0f;
+			*vertex++ = z;
+			*vertex++ = x * texturesPerUnit;
+			*vertex++ = z * texturesPerUnit;
+		}
+	}
+
+	// Same corner order (and winding) as the quads drawXZGridImmediate() draws.
+	GLuint* index = indices;
+	for (int i = 0; i < divisions; i++) {
+		for (int j = 0; j < divisions; j++) {
+			GLuint corner = i * rowVertices + j;
+			*index++ = corner;
+			*index++ = corner + rowVertices;
+			*index++ = corner + rowVertices + 1;
+			*index++ = corner;
+			*index++ = corner + rowVertices + 1;
+			*index++ = corner + 1;
+		}
+	}
+	for (int i = 0; i < rowVertices; i++) {
+		for (int j = 0; j < divisions; j++) {
+			*index++ = i * rowVertices + j;			// Along z.
+			*index++ = i * rowVertices + j + 1;
+			*index++ = j * rowVertices + i;			// Along x.
+			*index++ = (j + 1) * rowVertices + i;
+		}
+	}
+
+	if (mesh->vertexBuffer == 0) {
+		glGenBuffers(1, &mesh->vertexBuffer);
+		glGenBuffers(1, &mesh->indexBuffer);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, vertexCount * 5 * sizeof(float), vertices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, (triangleIndexCount + lineIndexCount) * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	free(vertices);
+	free(indices);
+
+	if (glGetError() == GL_OUT_OF_MEMORY) {
+		glDeleteBuffers(1, &mesh->vertexBuffer);
+		glDeleteBuffers(1, &mesh->indexBuffer);
+		mesh->vertexBuffer = mesh->indexBuffer = 0;
+		return 0;
+	}
+
+	mesh->size = size;
+	mesh->divisions = divisions;
+	mesh->triangleIndexCount = triangleIndexCount;
+	mesh->lineIndexCount = lineIndexCount;
+	return 1;
+}
+
+/*
+	Point the vertex and texture coordinate arrays at mesh's buffers. Any number
+	of drawGroundMesh() calls can follow, then unbindGroundMesh().
+*/
+void bindGroundMesh(const groundmesh_t* mesh) {
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 5 * sizeof(float), (const GLvoid*)0);
+	glTexCoordPointer(2, GL_FLOAT, 5 * sizeof(float), (const GLvoid*)(3 * sizeof(float)));
+}
+
+/*
+	Draw the bound mesh with one call. Wireframe draws the cell edges as lines, so it
+	looks the same as the old quads in GL_LINE mode rather than showing every
+	triangle's diagonal.
+*/
+void drawGroundMesh(const groundmesh_t* mesh) {
+	if (renderState.renderFill) {
+		glDrawElements(GL_TRIANGLES, mesh->triangleIndexCount, GL_UNSIGNED_INT, (const GLvoid*)0);
+	}
+	else {
+		glDrawElements(GL_LINES, mesh->lineIndexCount, GL_UNSIGNED_INT, (const GLvoid*)(mesh->triangleIndexCount * sizeof(GLuint)));
+	}
+}
+
+void unbindGroundMesh(void) {
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/*
+	Build one chunk mesh per level of detail. Chunk meshes start at (0, 0) and are
+	moved into place when drawn; every chunk starts on a whole unit, so one texture
+	repeat per unit lines up across chunk edges just like the single grid did.
+*/
+int buildGroundChunks(void) {
+	for (int level = 0; level < GROUND_LOD_LEVELS; level++) {
+		if (!buildGroundMesh(&groundChunkMeshes[level], 0.0f, GROUND_CHUNK_SIZE, groundLodDivisions[level], 1.0f)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+	Time the grid pass as display() draws it (100 x 100, 200 divisions), first in
+	immediate mode and then from buffer objects. Each draw is followed by glFinish(),
+	so the times cover the driver and the GPU, not just queueing the commands.
+*/
+void runGridBenchmark(void) {
+	const int warmupDraws = 10;
+	const int timedDraws = 200;
+	double results[2] = { 0.0, 0.0 };
+
+	captureInterpolationState(&renderState);  // Filled polygons, as at startup.
+	glLoadIdentity();
+	gluLookAt(cameraLookAt[0], cameraLookAt[1], cameraLookAt[2], objectLocation[0], objectLocation[1], objectLocation[2], 0, 1, 0);
+
+	for (int path = 0; path < 2; path++) {
+		if (path == 1 && !vertexBuffersAvailable) break;
+		for (int i = 0; i < warmupDraws + timedDraws; i++) {
+			unsigned long long start = pacingNowNs();
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			if (path == 0) {
+				cachedBindTexture(texID[1]);
+				cachedEnable(GL_TEXTURE_2D);
+				glColor3f(0.6f, 0.6f, 0.6f);
+				drawXZGridImmediate(100.0f, 200);
+				cachedDisable(GL_TEXTURE_2D);
+			}
+			else {
+				drawXZGrid(100.0f, 200);
+			}
+			glFinish();
+			if (i >= warmupDraws) results[path] += (pacingNowNs() - start) / (double)NS_PER_MS;
+		}
+		results[path] /= timedDraws;
+	}
+
+	printf("Grid pass (100 x 100, 200 divisions), average of %d draws:\n", timedDraws);
+	printf("  immediate mode:  %.3f ms\n", results[0]);
+	if (vertexBuffersAvailable) {
+		printf("  buffer objects:  %.3f ms (%.1fx faster)\n", results[1], results[1] > 0.0 ? results[0] / results[1] : 0.0);
+	}
+	else {
+		printf("  buffer objects:  not supported by this driver\n");
+	}
+}
+
+/*
+	Start an empty model, with an identity matrix and OpenGL's initial current state
+	(and GL_COLOR_MATERIAL on, as init() leaves it).
+*/
+void initMeshBuilder(meshbuilder_t* builder) {
+	static const meshmaterial_t defaultMaterial = {
+		0, 1, { 0.2f, 0.2f, 0.2f, 1.0f }, { 0.8f, 0.8f, 0.8f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }, 0.0f
+	};
+	memset(builder, 0, sizeof(*builder));
+	for (int i = 0; i < 16; i++) {
+		builder->matrix[0][i] = (i % 5 == 0) ? 1.0f : 0.0f;
+	}
+	builder->normal[2] = 1.0f;
+	builder->color[0] = builder->color[1] = builder->color[2] = builder->color[3] = 255;
+	builder->material = defaultMaterial;
+	builder->detail = 1.0f;
+}
+
+void freeMeshBuilder(meshbuilder_t* builder) {
+	free(builder->vertices);
+	free(builder->indices);
+	builder->vertices = NULL;
+	builder->indices = NULL;
+}
+
+/*
+	Make room for more vertices and indices. Returns 0 (and marks the builder failed)
+	if memory runs out.
+*/
+int builderReserve(meshbuilder_t* builder, int vertices, int indices) {
+	if (builder->vertexCount + vertices > builder->vertexCapacity) {
+		int capacity = builder->vertexCapacity ? builder->vertexCapacity : 1024;
+		while (capacity < builder->vertexCount + vertices) capacity *= 2;
+		meshvertex_t* grown = (meshvertex_t*)realloc(builder->vertices, capacity * sizeof(meshvertex_t));
+		if (grown == NULL) {
+			builder->failed = 1;
+			return 0;
+		}
+		builder->vertices = grown;
+		builder->vertexCapacity = capacity;
+	}
+	if (builder->indexCount + indices > builder->indexCapacity) {
+		int capacity = builder->indexCapacity ? builder->indexCapacity : 2048;
+		while (capacity < builder->indexCount + indices) capacity *= 2;
+		GLuint* grown = (GLuint*)realloc(builder->indices, capacity * sizeof(GLuint));
+		if (grown == NULL) {
+			builder->failed = 1;
+			return 0;
+		}
+		builder->indices = grown;
+		builder->indexCapacity = capacity;
+	}
+	return 1;
+}
+
+// Post-multiply the current matrix by m (column-major), as glMultMatrixf() does.
+void builderMultMatrix(meshbuilder_t* builder, const float m[16]) {
+	float* current = builder->matrix[builder->matrixDepth];
+	float result[16];
+	for (int column = 0; column < 4; column++) {
+		for (int row = 0; row < 4; row++) {
+			float sum = 0.0f;
+			for (int k = 0; k < 4; k++) {
+				sum += current[k * 4 + row] * m[column * 4 + k];
+			}
+			result[column * 4 + row] = sum;
+		}
+	}
+	memcpy(current, result, sizeof(result));
+}
+
+void builderPushMatrix(meshbuilder_t* builder) {
+	if (builder->matrixDepth + 1 >= MESH_MATRIX_DEPTH) {
+		builder->failed = 1;
+		return;
+	}
+	memcpy(builder->matrix[builder->matrixDepth + 1], builder->matrix[builder->matrixDepth], sizeof(builder->matrix[0]));
+	builder->matrixDepth++;
+}
+
+void builderPopMatrix(meshbuilder_t* builder) {
+	if (builder->matrixDepth == 0) {
+		builder->failed = 1;
+		return;
+	}
+	builder->matrixDepth--;
+}
+
+void builderTranslatef(meshbuilder_t* builder, float x, float y, float z) {
+	float m[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, x, y, z, 1 };
+	builderMultMatrix(builder, m);
+}
+
+void builderRotatef(meshbuilder_t* builder, float angle, float x, float y, float z) {
+	float length = sqrtf(x * x + y * y + z * z);
+	if (length == 0.0f) return;
+	x /= length; y /= length; z /= length;
+	float c = cosf(angle * (float)PI / 180.0f);
+	float s = sinf(angle * (float)PI / 180.0f);
+	float t = 1.0f - c;
+	float m[16] = {
+		x * x * t + c,     y * x * t + z * s, x * z * t - y * s, 0,
+		x * y * t - z * s, y * y * t + c,     y * z * t + x * s, 0,
+		x * z * t + y * s, y * z * t - x * s, z * z * t + c,     0,
+		0,                 0,                 0,                 1
+	};
+	builderMultMatrix(builder, m);
+}
+
+void builderScalef(meshbuilder_t* builder, float x, float y, float z) {
+	float m[16] = { x, 0, 0, 0, 0, y, 0, 0, 0, 0, z, 0, 0, 0, 0, 1 };
+	builderMultMatrix(builder, m);
+}
+
+void builderNormal3f(meshbuilder_t* builder, float x, float y, float z) {
+	builder->normal[0] = x;
+	builder->normal[1] = y;
+	builder->normal[2] = z;
+	builder->normalSet = 1;
+}
+
+void builderTexCoord2f(meshbuilder_t* builder, float s, float t) {
+	builder->texCoord[0] = s;
+	builder->texCoord[1] = t;
+}
+
+void builderColor3f(meshbuilder_t* builder, float red, float green, float blue) {
+	float color[3] = { red, green, blue };
+	for (int i = 0; i < 3; i++) {
+		float clamped = color[i] < 0.0f ? 0.0f : (color[i] > 1.0f ? 1.0f : color[i]);
+		builder->color[i] = (GLubyte)(clamped * 255.0f + 0.5f);
+	}
+	builder->color[3] = 255;
+}
+
+// Stands in for glEnable(GL_TEXTURE_2D) / glDisable(GL_TEXTURE_2D).
+void builderEnableTexture(meshbuilder_t* builder, int enabled) {
+	builder->textureEnabled = enabled;
+}
+
+void builderBindTexture(meshbuilder_t* builder, GLuint texture) {
+	builder->boundTexture = texture;
+}
+
+// Stands in for glEnable(GL_COLOR_MATERIAL) / glDisable(GL_COLOR_MATERIAL).
+void builderColorMaterial(meshbuilder_t* builder, int enabled) {
+	builder->material.colorMaterial = enabled;
+}
+
+void builderMaterialfv(meshbuilder_t* builder, GLenum pname, const GLfloat* params) {
+	if (pname == GL_AMBIENT || pname == GL_AMBIENT_AND_DIFFUSE) {
+		memcpy(builder->material.ambient, params, sizeof(builder->material.ambient));
+	}
+	if (pname == GL_DIFFUSE || pname == GL_AMBIENT_AND_DIFFUSE) {
+		memcpy(builder->material.diffuse, params, sizeof(builder->material.diffuse));
+	}
+	if (pname == GL_SPECULAR) {
+		memcpy(builder->material.specular, params, sizeof(builder->material.specular));
+	}
+	if (pname == GL_SHININESS) {
+		builder->material.shininess = params[0];
+	}
+}
+
+void builderMaterialf(meshbuilder_t* builder, GLenum pname, GLfloat param) {
+	if (pname == GL_SHININESS) {
+		builder->material.shininess = param;
+	}
+}
+
+void builderBegin(meshbuilder_t* builder, GLenum mode) {
+	builder->primitive = mode;
+	builder->primitiveStart = builder->vertexCount;
+}
+
+void builderVertex3f(meshbuilder_t* builder, float x, float y, float z) {
+	if (!builderReserve(builder, 1, 0)) return;
+	const float* m = builder->matrix[builder->matrixDepth];
+	meshvertex_t* vertex = &builder->vertices[builder->vertexCount++];
+
+	vertex->position[0] = m[0] * x + m[4] * y + m[8] * z + m[12];
+	vertex->position[1] = m[1] * x + m[5] * y + m[9] * z + m[13];
+	vertex->position[2] = m[2] * x + m[6] * y + m[10] * z + m[14];
+
+	// Normals go through the inverse transpose of the upper 3x3, which is its cofactor
+	// matrix divided by the determinant. Only the direction matters, so just the
+	// determinant's sign is kept.
+	float cofactor[9] = {
+		m[5] * m[10] - m[6] * m[9], m[6] * m[8] - m[4] * m[10], m[4] * m[9] - m[5] * m[8],
+		m[2] * m[9] - m[1] * m[10], m[0] * m[10] - m[2] * m[8], m[1] * m[8] - m[0] * m[9],
+		m[1] * m[6] - m[2] * m[5], m[2] * m[4] - m[0] * m[6], m[0] * m[5] - m[1] * m[4]
+	};
+	float sign = (m[0] * cofactor[0] + m[4] * cofactor[1] + m[8] * cofactor[2]) < 0.0f ? -1.0f : 1.0f;
+	const float* n = builder->normal;
+	float normal[3];
+	float length = 0.0f;
+	for (int row = 0; row < 3; row++) {
+		normal[row] = sign * (cofactor[row * 3] * n[0] + cofactor[row * 3 + 1] * n[1] + cofactor[row * 3 + 2] * n[2]);
+		length += normal[row] * normal[row];
+	}
+	length = sqrtf(length);
+	for (int row = 0; row < 3; row++) {
+		vertex->normal[row] = length > 0.0f ? normal[row] / length : 0.0f;
+	}
+
+	vertex->texCoord[0] = builder->texCoord[0];
+	vertex->texCoord[1] = builder->texCoord[1];
+	memcpy(vertex->color, builder->color, sizeof(vertex->color));
+}
+
+/*
+	The part that triangles drawn with the builder's current state belong to: the last
+	part if its material matches, otherwise a new one starting at the next index.
+*/
+meshpart_t* builderCurrentPart(meshbuilder_t* builder) {
+	meshmaterial_t material = builder->material;
+	material.texture = builder->textureEnabled ? builder->boundTexture : 0;
+
+	if (builder->partCount > 0) {
+		meshpart_t* last = &builder->parts[builder->partCount - 1];
+		if (memcmp(&last->material, &material, sizeof(material)) == 0) {
+			return last;
+		}
+		if (last->indexCount == 0) {
+			last->material = material;
+			return last;
+		}
+	}
+	if (builder->partCount == MESH_MAX_PARTS) {
+		builder->failed = 1;
+		return NULL;
+	}
+	meshpart_t* part = &builder->parts[builder->partCount++];
+	part->material = material;
+	part->firstIndex = builder->indexCount;
+	part->indexCount = 0;
+	return part;
+}
+
+/*
+	Turn the vertices since builderBegin() into triangles. Lines and points aren't
+	collected.
+
+	Models that never give a normal would be lit with whatever normal OpenGL was left
+	with by earlier drawing, so their GL_TRIANGLES and GL_QUADS get face normals instead.
+*/
+void builderEnd(meshbuilder_t* builder) {
+	int first = builder->primitiveStart;
+	int count = builder->vertexCount - first;
+	GLenum mode = builder->primitive;
+	int faceSize = mode == GL_TRIANGLES ? 3 : (mode == GL_QUADS ? 4 : 0);
+
+	if (!builder->normalSet && faceSize != 0) {
+		for (int face = first; face + faceSize <= builder->vertexCount; face += faceSize) {
+			const float* p0 = builder->vertices[face].position;
+			const float* p1 = builder->vertices[face + 1].position;
+			const float* p2 = builder->vertices[face + 2].position;
+			float a[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			float b[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			float normal[3] = { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+			float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+			if (length == 0.0f) continue;
+			for (int v = face; v < face + faceSize; v++) {
+				for (int i = 0; i < 3; i++) builder->vertices[v].normal[i] = normal[i] / length;
+			}
+		}
+	}
+
+	if (count < 3 || !builderReserve(builder, 0, count * 3)) return;
+	meshpart_t* part = builderCurrentPart(builder);
+	if (part == NULL) return;
+
+	GLuint* out = builder->indices + builder->indexCount;
+	GLuint base = (GLuint)first;
+	switch (mode) {
+	case GL_TRIANGLES:
+		for (int i = 0; i + 2 < count; i += 3) {
+			*out++ = base + i; *out++ = base + i + 1; *out++ = base + i + 2;
+		}
+		break;
+	case GL_QUADS:
+		for (int i = 0; i + 3 < count; i += 4) {
+			*out++ = base + i; *out++ = base + i + 1; *out++ = base + i + 2;
+			*out++ = base + i; *out++ = base + i + 2; *out++ = base + i + 3;
+		}
+		break;
+	case GL_TRIANGLE_STRIP:
+		for (int i = 2; i < count; i++) {
+			// Every other triangle is flipped to keep the strip's winding consistent
+			*out++ = base + ((i & 1) ? i - 1 : i - 2);
+			*out++ = base + ((i & 1) ? i - 2 : i - 1);
+			*out++ = base + i;
+		}
+		break;
+	case GL_QUAD_STRIP:
+		for (int i = 0; i + 3 < count; i += 2) {
+			*out++ = base + i; *out++ = base + i + 1; *out++ = base + i + 3;
+			*out++ = base + i; *out++ = base + i + 3; *out++ = base + i + 2;
+		}
+		break;
+	case GL_TRIANGLE_FAN:
+	case GL_POLYGON:
+		for (int i = 2; i < count; i++) {
+			*out++ = base; *out++ = base + i - 1; *out++ = base + i;
+		}
+		break;
+	default:
+		break;
+	}
+	int added = (int)(out - (builder->indices + builder->indexCount));
+	builder->indexCount += added;
+	part->indexCount += added;
+}
+
+// How many of the slices or stacks asked for a curved shape gets at the builder's level of detail.
+int builderDivisions(const meshbuilder_t* builder, int divisions, int minimum) {
+	int scaled = (int)(divisions * builder->detail + 0.5f);
+	if (scaled < minimum) scaled = minimum;
+	return scaled < divisions ? scaled : divisions;
+}
+
+/*
+	Same geometry, normals and texture coordinates as gluCylinder() with the quadric's
+	texturing set to textured: along +z from the origin, starting at baseRadius.
+	Slices and stacks are scaled down by builderDivisions(), as for the other shapes.
+*/
+void builderCylinder(meshbuilder_t* builder, float baseRadius, float topRadius, float height, int slices, int stacks, int textured) {
+	slices = builderDivisions(builder, slices, 6);
+	stacks = builderDivisions(builder, stacks, 1);
+	float deltaRadius = baseRadius - topRadius;
+	float slantLength = sqrtf(deltaRadius * deltaRadius + height * height);
+	float zNormal = deltaRadius / slantLength;
+	float xyNormal = height / slantLength;
+
+	for (int j = 0; j < stacks; j++) {
+		float zLow = j * height / stacks;
+		float zHigh = (j + 1) * height / stacks;
+		float radiusLow = baseRadius - deltaRadius * ((float)j / stacks);
+		float radiusHigh = baseRadius - deltaRadius * ((float)(j + 1) / stacks);
+
+		builderBegin(builder, GL_QUAD_STRIP);
+		for (int i = 0; i <= slices; i++) {
+			float angle = 2.0f * (float)PI * (i == slices ? 0 : i) / slices;
+			float s = sinf(angle);
+			float c = cosf(angle);
+			builderNormal3f(builder, s * xyNormal, c * xyNormal, zNormal);
+			if (textured) builderTexCoord2f(builder, 1.0f - (float)i / slices, (float)j / stacks);
+			builderVertex3f(builder, radiusLow * s, radiusLow * c, zLow);
+			if (textured) builderTexCoord2f(builder, 1.0f - (float)i / slices, (float)(j + 1) / stacks);
+			builderVertex3f(builder, radiusHigh * s, radiusHigh * c, zHigh);
+		}
+		builderEnd(builder);
+	}
+}
+
+/*
+	Same as gluDisk(): a flat ring (or disk, when innerRadius is 0) in the z = 0 plane, facing +z.
+*/
+void builderDisk(meshbuilder_t* builder, float innerRadius, float outerRadius, int slices, int loops, int textured) {
+	slices = builderDivisions(builder, slices, 6);
+	loops = builderDivisions(builder, loops, 1);
+	builderNormal3f(builder, 0.0f, 0.0f, 1.0f);
+	for (int l = 0; l < loops; l++) {
+		float radiusLow = innerRadius + (outerRadius - innerRadius) * ((float)l / loops);
+		float radiusHigh = innerRadius + (outerRadius - innerRadius) * ((float)(l + 1) / loops);
+
+		if (radiusLow == 0.0f) {
+			builderBegin(builder, GL_TRIANGLE_FAN);
+			if (textured) builderTexCoord2f(builder, 0.5f, 0.5f);
+			builderVertex3f(builder, 0.0f, 0.0f, 0.0f);
+		}
+		else {
+			builderBegin(builder, GL_QUAD_STRIP);
+		}
+		for (int i = slices; i >= 0; i--) {
+			float angle = 2.0f * (float)PI * (i == slices ? 0 : i) / slices;
+			float s = sinf(angle);
+			float c = cosf(angle);
+			if (radiusLow != 0.0f) {
+				if (textured) builderTexCoord2f(builder, 0.5f + s * radiusLow / (2.0f * outerRadius), 0.5f + c * radiusLow / (2.0f * outerRadius));
+				builderVertex3f(builder, radiusLow * s, radiusLow * c, 0.0f);
+			}
+			if (textured) builderTexCoord2f(builder, 0.5f + s * radiusHigh / (2.0f * outerRadius), 0.5f + c * radiusHigh / (2.0f * outerRadius));
+			builderVertex3f(builder, radiusHigh * s, radiusHigh * c, 0.0f);
+		}
+		builderEnd(builder);
+	}
+}
+
+/*
+	Same as glutSolidCone(): base in the z = 0 plane facing -z, apex at z = height.
+	Like GLUT's, it has no texture coordinates.
+*/
+void builderCone(meshbuilder_t* builder, float base, float height, int slices, int stacks) {
+	slices = builderDivisions(builder, slices, 6);
+	stacks = builderDivisions(builder, stacks, 1);
+	float slantLength = sqrtf(height * height + base * base);
+	float cosNormal = height / slantLength;
+	float sinNormal = base / slantLength;
+
+	builderNormal3f(builder, 0.0f, 0.0f, -1.0f);
+	builderBegin(builder, GL_TRIANGLE_FAN);
+	builderVertex3f(builder, 0.0f, 0.0f, 0.0f);
+	for (int i = slices; i >= 0; i--) {
+		float angle = 2.0f * (float)PI * (i == slices ? 0 : i) / slices;
+		builderVertex3f(builder, cosf(angle) * base, sinf(angle) * base, 0.0f);
+	}
+	builderEnd(builder);
+
+	for (int j = 0; j < stacks; j++) {
+		float zLow = j * height / stacks;
+		float zHigh = (j + 1) * height / stacks;
+		float radiusLow = base * (1.0f - (float)j / stacks);
+		float radiusHigh = base * (1.0f - (float)(j + 1) / stacks);
+
+		builderBegin(builder, GL_QUAD_STRIP);
+		for (int i = 0; i <= slices; i++) {
+			float angle = 2.0f * (float)PI * (i == slices ? 0 : i) / slices;
+			float s = sinf(angle);
+			float c = cosf(angle);
+			builderNormal3f(builder, c * cosNormal, s * cosNormal, sinNormal);
+			builderVertex3f(builder, c * radiusLow, s * radiusLow, zLow);
+			builderVertex3f(builder, c * radiusHigh, s * radiusHigh, zHigh);
+		}
+		builderEnd(builder);
+	}
+}
+
+/*
+	Same as gluSphere(): centred on the origin, with its poles on the z axis.
+*/
+void builderSphere(meshbuilder_t* builder, float radius, int slices, int stacks, int textured) {
+	slices = builderDivisions(builder, slices, 6);
+	stacks = builderDivisions(builder, stacks, 4);
+	for (int j = 0; j < stacks; j++) {
+		float rhoLow = (float)PI * j / stacks;
+		float rhoHigh = (float)PI * (j + 1) / stacks;
+
+		builderBegin(builder, GL_QUAD_STRIP);
+		for (int i = 0; i <= slices; i++) {
+			float theta = 2.0f * (float)PI * (i == slices ? 0 : i) / slices;
+			float s = sinf(theta);
+			float c = cosf(theta);
+			builderNormal3f(builder, s * sinf(rhoLow), c * sinf(rhoLow), cosf(rhoLow));
+			if (textured) builderTexCoord2f(builder, 1.0f - (float)i / slices, 1.0f - (float)j / stacks);
+			builderVertex3f(builder, radius * s * sinf(rhoLow), radius * c * sinf(rhoLow), radius * cosf(rhoLow));
+			builderNormal3f(builder, s * sinf(rhoHigh), c * sinf(rhoHigh), cosf(rhoHigh));
+			if (textured) builderTexCoord2f(builder, 1.0f - (float)i / slices, 1.0f - (float)(j + 1) / stacks);
+			builderVertex3f(builder, radius * s * sinf(rhoHigh), radius * c * sinf(rhoHigh), radius * cosf(rhoHigh));
+		}
+		builderEnd(builder);
+	}
+}
+
+/*
+	Same as glutSolidCube(): size across, centred on the origin, one flat normal per face.
+	Like GLUT's, it has no texture coordinates.
+*/
+void builderCube(meshbuilder_t* builder, float size) {
+	// Each face's normal, then two edges whose cross product is the normal, so the corners go anticlockwise.
+	static const float faces[6][3][3] = {
+		{ { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } },
+		{ { -1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 1.0f, 0.0f } },
+		{ { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 1.0f, 0.0f, 0.0f } },
+		{ { 0.0f, -1.0f, 0.0f }, { 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } },
+		{ { 0.0f, 0.0f, 1.0f }, { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f } },
+		{ { 0.0f, 0.0f, -1.0f }, { 0.0f, 1.0f, 0.0f }, { 1.0f, 0.0f, 0.0f } }
+	};
+	static const float corners[4][2] = { { -1.0f, -1.0f }, { 1.0f, -1.0f }, { 1.0f, 1.0f }, { -1.0f, 1.0f } };
+	float half = size / 2.0f;
+
+	builderBegin(builder, GL_QUADS);
+	for (int f = 0; f < 6; f++) {
+		const float* normal = faces[f][0];
+		const float* u = faces[f][1];
+		const float* v = faces[f][2];
+		builderNormal3f(builder, normal[0], normal[1], normal[2]);
+		for (int i = 0; i < 4; i++) {
+			builderVertex3f(builder,
+				(normal[0] + corners[i][0] * u[0] + corners[i][1] * v[0]) * half,
+				(normal[1] + corners[i][0] * u[1] + corners[i][1] * v[1]) * half,
+				(normal[2] + corners[i][0] * u[2] + corners[i][1] * v[2]) * half);
+		}
+	}
+	builderEnd(builder);
+}
+
+/*
+	Find the unit-sized primitive with this shape and tessellation, building it the first
+	time it's asked for. Returns NULL if it can't be built (or the cache is full).
+*/
+primitive_t* cachedPrimitive(primitivetype_t type, int slices, int stacks) {
+	for (int i = 0; i < primitiveCount; i++) {
+		primitive_t* primitive = &primitiveCache[i];
+		if (primitive->type == type && primitive->slices == slices && primitive->stacks == stacks) {
+			return primitive;
+		}
+	}
+	if (primitiveCount == MAX_PRIMITIVES) {
+		printf("Primitive cache is full; increase MAX_PRIMITIVES\n");
+		return NULL;
+	}
+
+	meshbuilder_t builder;
+	initMeshBuilder(&builder);
+	switch (type) {
+	case PRIMITIVE_SPHERE: builderSphere(&builder, 1.0f, slices, stacks, 0); break;
+	}
+	if (builder.failed || builder.indexCount == 0) {
+		freeMeshBuilder(&builder);
+		return NULL;
+	}
+
+	if (primitiveCount == 0) {
+		atexit(freePrimitives);
+	}
+	primitive_t* primitive = &primitiveCache[primitiveCount++];
+	primitive->type = type;
+	primitive->slices = slices;
+	primitive->stacks = stacks;
+	primitive->indexCount = builder.indexCount;
+	primitive->vertices = builder.vertices;
+	primitive->indices = builder.indices;
+	primitive->vertexBuffer = 0;
+	primitive->indexBuffer = 0;
+	if (vertexBuffersAvailable) {
+		GLuint buffers[2];
+		glGenBuffers(2, buffers);
+		primitive->vertexBuffer = buffers[0];
+		primitive->indexBuffer = buffers[1];
+		glBindBuffer(GL_ARRAY_BUFFER, primitive->vertexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, builder.vertexCount * sizeof(meshvertex_t), builder.vertices, GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, primitive->indexBuffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, builder.indexCount * sizeof(GLuint), builder.indices, GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		freeMeshBuilder(&builder);
+		primitive->vertices = NULL;
+		primitive->indices = NULL;
+	}
+	return primitive;
+}
+
+/*
+	Draw a cached primitive scaled by (x, y, z) about the current matrix. Like the GLU
+	sphere it replaces, it uses the current colour, material and texture, and
+	has no texture coordinates of its own.
+*/
+void drawPrimitive(const primitive_t* primitive, float x, float y, float z) {
+	if (primitive == NULL) return;
+	const char* base = (const char*)primitive->vertices;
+	const void* indices = primitive->indices;
+	if (primitive->vertexBuffer != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, primitive->vertexBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, primitive->indexBuffer);
+		base = NULL;
+		indices = NULL;
+	}
+	glPushMatrix();
+	glScalef(x, y, z);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(meshvertex_t), base + offsetof(meshvertex_t, position));
+	glNormalPointer(GL_FLOAT, sizeof(meshvertex_t), base + offsetof(meshvertex_t, normal));
+	glDrawElements(GL_TRIANGLES, primitive->indexCount, GL_UNSIGNED_INT, indices);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glPopMatrix();
+	if (primitive->vertexBuffer != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+}
+
+// Drop-in replacement for gluSphere(), drawn from the primitive cache.
+void drawSphere(float radius, int slices, int stacks) {
+	drawPrimitive(cachedPrimitive(PRIMITIVE_SPHERE, slices, stacks), radius, radius, radius);
+}
+
+/*
+	Delete the primitive cache. Registered with atexit() when the first primitive is built.
+*/
+void freePrimitives(void) {
+	// If the window has already been closed, its context took the buffers with it.
+	int contextAlive = glutGetWindow() != 0;
+	for (int i = 0; i < primitiveCount; i++) {
+		primitive_t* primitive = &primitiveCache[i];
+		if (contextAlive && primitive->vertexBuffer != 0) {
+			glDeleteBuffers(1, &primitive->vertexBuffer);
+			glDeleteBuffers(1, &primitive->indexBuffer);
+		}
+		free(primitive->vertices);
+		free(primitive->indices);
+	}
+	primitiveCount = 0;
+}
+
+/*
+	Build every model in the mesh registry at each level of detail, one after another in
+	the same buffers, and copy them into buffer objects when the driver has them
+	(otherwise the builder's arrays are kept and drawn from memory). Called once from
+	init(), after the textures are loaded. Returns 0 if a model couldn't be built.
+*/
+int initMeshes(void) {
+	for (int id = 0; id < NUM_MESHES; id++) {
+		meshentry_t* mesh = &meshes[id];
+		meshbuilder_t builder;
+		initMeshBuilder(&builder);
+
+		for (int level = 0; level < MESH_LOD_LEVELS; level++) {
+			// Each level starts from a fresh builder, then is appended to the first.
+			meshbuilder_t levelBuilder;
+			initMeshBuilder(&levelBuilder);
+			levelBuilder.detail = meshLodDetail[level];
+			mesh->build(&levelBuilder);
+			if (levelBuilder.failed || levelBuilder.indexCount == 0
+				|| !builderReserve(&builder, levelBuilder.vertexCount, levelBuilder.indexCount)) {
+				printf("Could not build the %s mesh\n", mesh->name);
+				freeMeshBuilder(&levelBuilder);
+				freeMeshBuilder(&builder);
+				return 0;
+			}
+
+			// The coarser levels fit inside the finest one, so it sets the bounds.
+			if (level == 0) {
+				mesh->radius = 0.0f;
+				memcpy(mesh->boxMin, levelBuilder.vertices[0].position, sizeof(mesh->boxMin));
+				memcpy(mesh->boxMax, levelBuilder.vertices[0].position, sizeof(mesh->boxMax));
+				for (int i = 0; i < levelBuilder.vertexCount; i++) {
+					const float* p = levelBuilder.vertices[i].position;
+					float distance = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+					if (distance > mesh->radius) mesh->radius = distance;
+					for (int axis = 0; axis < 3; axis++) {
+						mesh->boxMin[axis] = fminf(mesh->boxMin[axis], p[axis]);
+						mesh->boxMax[axis] = fmaxf(mesh->boxMax[axis], p[axis]);
+					}
+				}
+			}
+
+			meshlod_t* lod = &mesh->lods[level];
+			lod->partCount = levelBuilder.partCount;
+			lod->triangleCount = levelBuilder.indexCount / 3;
+			for (int i = 0; i < levelBuilder.partCount; i++) {
+				lod->parts[i] = levelBuilder.parts[i];
+				lod->parts[i].firstIndex += builder.indexCount;
+				lod->parts[i].materialId = internMeshMaterial(&lod->parts[i].material);
+				if (lod->parts[i].materialId < 0) levelBuilder.failed = 1;
+			}
+			if (levelBuilder.failed) {
+				printf("Too many materials to build the %s mesh\n", mesh->name);
+				freeMeshBuilder(&levelBuilder);
+				freeMeshBuilder(&builder);
+				return 0;
+			}
+			for (int i = 0; i < levelBuilder.indexCount; i++) {
+				builder.indices[builder.indexCount + i] = levelBuilder.indices[i] + builder.vertexCount;
+			}
+			memcpy(builder.vertices + builder.vertexCount, levelBuilder.vertices, levelBuilder.vertexCount * sizeof(meshvertex_t));
+			builder.vertexCount += levelBuilder.vertexCount;
+			builder.indexCount += levelBuilder.indexCount;
+			freeMeshBuilder(&levelBuilder);
+		}
+
+		mesh->vertexCount = builder.vertexCount;
+		mesh->indexCount = builder.indexCount;
+		if (vertexBuffersAvailable) {
+			GLuint buffers[2];
+			glGenBuffers(2, buffers);
+			mesh->vertexBuffer = buffers[0];
+			mesh->indexBuffer = buffers[1];
+			glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
+			glBufferData(GL_ARRAY_BUFFER, builder.vertexCount * sizeof(meshvertex_t), builder.vertices, GL_STATIC_DRAW);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, builder.indexCount * sizeof(GLuint), builder.indices, GL_STATIC_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			freeMeshBuilder(&builder);
+		}
+		else {
+			mesh->vertices = builder.vertices;
+			mesh->indices = builder.indices;
+		}
+	}
+	atexit(freeMeshes);
+	return 1;
+}
+
+/*
+	Point the fixed-function vertex arrays at a mesh's vertices, and bind its indices.
+	Indices for glDrawElements() then come from meshIndices().
+*/
+void bindMeshArrays(const meshentry_t* mesh) {
+	const char* base = (const char*)mesh->vertices;
+	if (mesh->vertexBuffer != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
+		base = NULL;
+	}
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(meshvertex_t), base + offsetof(meshvertex_t, position));
+	glNormalPointer(GL_FLOAT, sizeof(meshvertex_t), base + offsetof(meshvertex_t, normal));
+	glTexCoordPointer(2, GL_FLOAT, sizeof(meshvertex_t), base + offsetof(meshvertex_t, texCoord));
+	glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(meshvertex_t), base + offsetof(meshvertex_t, color));
+}
+
+// Where glDrawElements() finds a part's indices, once bindMeshArrays() has been called.
+const void* meshIndices(const meshentry_t* mesh, const meshpart_t* part) {
+	if (mesh->indexBuffer != 0) {
+		return (const void*)(part->firstIndex * sizeof(GLuint));
+	}
+	return mesh->indices + part->firstIndex;
+}
+
+// Bind a part's texture and turn texturing on, or turn it off when texture is 0.
+void applyMeshTexture(GLuint texture) {
+	if (texture != 0) {
+		cachedBindTexture(texture);
+		cachedEnable(GL_TEXTURE_2D);
+	}
+	else {
+		cachedDisable(GL_TEXTURE_2D);
+	}
+}
+
+// Set either GL_COLOR_MATERIAL or a part's own ambient and diffuse colours, and its highlight.
+void applyMeshColors(const meshmaterial_t* material) {
+	if (material->colorMaterial) {
+		cachedEnable(GL_COLOR_MATERIAL);
+	}
+	else {
+		cachedDisable(GL_COLOR_MATERIAL);
+		cachedMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, material->ambient);
+		cachedMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, material->diffuse);
+	}
+	cachedMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, material->specular);
+	cachedMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, material->shininess);
+}
+
+/*
+	Set the fixed-function state for one part of a mesh: its texture, and either
+	GL_COLOR_MATERIAL or its own ambient and diffuse colours.
+*/
+void applyMeshMaterial(const meshmaterial_t* material) {
+	applyMeshTexture(material->texture);
+	applyMeshColors(material);
+}
+
+/*
+	Undo bindMeshArrays() and applyMeshMaterial(), leaving texturing off, GL_COLOR_MATERIAL
+	on and no specular highlight, the state the rest of display() expects.
+*/
+void unbindMeshArrays(void) {
+	static const GLfloat noSpecular[] = { 0.0f, 0.0f, 0.0f, 1.0f };
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	if (vertexBuffersAvailable) {
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+	cachedDisable(GL_TEXTURE_2D);
+	cachedEnable(GL_COLOR_MATERIAL);
+	cachedMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, noSpecular);
+	cachedMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 0.0f);
+}
+
+/*
+	Pick the level of detail for a copy of a mesh at position (in world space), drawn at
+	scale, from how big its bounding sphere looks from the camera. current is the level
+	the copy was last drawn at: it only moves to another level once it's
+	MESH_LOD_HYSTERESIS past the threshold between them.
+*/
+int selectMeshLod(meshid_t id, const float position[3], float scale, int current) {
+	const float* eye = renderState.cameraLookAt;
+	float dx = position[0] - eye[0];
+	float dy = position[1] - eye[1];
+	float dz = position[2] - eye[2];
+	float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+	if (distance < CAMERA_NEAR) return 0;
+
+	// Radius in pixels, with the projection reshape() sets up.
+	float pixelsPerUnit = windowHeight / (2.0f * tanf(CAMERA_FOV_Y * (float)PI / 360.0f));
+	float pixels = meshes[id].radius * scale * pixelsPerUnit / distance;
+
+	int level = 0;
+	while (level < MESH_LOD_LEVELS - 1) {
+		float threshold = meshLodPixels[level] * (level < current ? 1.0f + MESH_LOD_HYSTERESIS : 1.0f - MESH_LOD_HYSTERESIS);
+		if (pixels >= threshold) break;
+		level++;
+	}
+	return level;
+}
+
+// Count one frame's copies of a mesh at a level in meshLodStats.
+void countMeshLod(meshid_t id, int level, int copies) {
+	const meshentry_t* mesh = &meshes[id];
+	meshLodStats.copiesDrawn[level] += copies;
+	meshLodStats.trianglesDrawn += mesh->lods[level].triangleCount * copies;
+	meshLodStats.trianglesSaved += (mesh->lods[0].triangleCount - mesh->lods[level].triangleCount) * copies;
+}
+
+// Draw one copy of a mesh at a level of detail with the current matrix.
+void drawMesh(meshid_t id, int level) {
+	const meshentry_t* mesh = &meshes[id];
+	const meshlod_t* lod = &mesh->lods[level];
+	bindMeshArrays(mesh);
+	for (int i = 0; i < lod->partCount; i++) {
+		const meshpart_t* part = &lod->parts[i];
+		applyMeshMaterial(&part->material);
+		glDrawElements(GL_TRIANGLES, part->indexCount, GL_UNSIGNED_INT, meshIndices(mesh, part));
+	}
+	unbindMeshArrays();
+	countMeshLod(id, level, 1);
+}
+
+/*
+	Find a material in meshMaterials, adding it if it's new, so parts with the same
+	surface share an id the render queue can sort and compare by. Returns -1 if the
+	table is full.
+*/
+int internMeshMaterial(const meshmaterial_t* material) {
+	for (int id = 0; id < meshMaterialCount; id++) {
+		if (memcmp(&meshMaterials[id], material, sizeof(*material)) == 0) return id;
+	}
+	if (meshMaterialCount == MAX_MESH_MATERIALS) return -1;
+	meshMaterials[meshMaterialCount] = *material;
+	return meshMaterialCount++;
+}
+
+// Start collecting this frame's draws, dropping any left over from the last one.
+void beginRenderQueue(void) {
+	renderQueue.count = 0;
+	renderQueue.impostorCount = 0;
+}
+
+/*
+	The order the render queue is drawn in: by shader, then texture, then material,
+	then mesh (so its vertex arrays stay bound), then front to back by depth (the
+	distance in front of the camera).
+*/
+unsigned long long renderKey(int shader, GLuint texture, int material, meshid_t mesh, float depth) {
+	float fraction = depth / CAMERA_FAR;
+	if (fraction < 0.0f) fraction = 0.0f;
+	if (fraction > 1.0f) fraction = 1.0f;
+	return ((unsigned long long)(shader & 0x1) << 63)
+		| ((unsigned long long)(texture & 0x7FFF) << 48)
+		| ((unsigned long long)(material & 0xFF) << 40)
+		| ((unsigned long long)(mesh & 0xFF) << 32)
+		| (unsigned long long)(fraction * 65535.0f);
+}
+
+// Add an item to the render queue, growing it as needed. Returns NULL if memory runs out.
+renderitem_t* pushRenderItem(meshid_t mesh, int level, int part) {
+	if (renderQueue.count == renderQueue.capacity) {
+		int capacity = renderQueue.capacity ? renderQueue.capacity * 2 : 64;
+		renderitem_t* items = (renderitem_t*)realloc(renderQueue.items, capacity * sizeof(renderitem_t));
+		if (items == NULL) return NULL;
+		renderQueue.items = items;
+		renderQueue.capacity = capacity;
+	}
+	renderitem_t* item = &renderQueue.items[renderQueue.count++];
+	item->mesh = mesh;
+	item->level = level;
+	item->part = part;
+	item->group = NULL;
+	item->first = 0;
+	item->count = 1;
+	return item;
+}
+
+// Queue one copy of a mesh at a level of detail, to be drawn with the current matrix.
+void queueMesh(meshid_t id, int level) {
+	const meshlod_t* lod = &meshes[id].lods[level];
+	float matrix[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
+	for (int i = 0; i < lod->partCount; i++) {
+		renderitem_t* item = pushRenderItem(id, level, i);
+		if (item == NULL) break;
+		memcpy(item->matrix, matrix, sizeof(item->matrix));
+		item->key = renderKey(0, lod->parts[i].material.texture, lod->parts[i].materialId, id, -matrix[14]);
+	}
+	countMeshLod(id, level, 1);
+}
+
+/*
+	Queue the one copy of a mesh that isn't in an instance group, which the current
+	matrix puts at position (in world space), at the level of detail that suits it.
+*/
+void queueMeshAt(meshid_t id, const float position[3]) {
+	meshLods[id] = selectMeshLod(id, position, 1.0f, meshLods[id]);
+	queueMesh(id, meshLods[id]);
+}
+
+/*
+	Count the state changes drawing items in this order takes: the ones
+	flushRenderQueue() makes when the item's shader, mesh, texture or material
+	differs from the one before.
+*/
+void countRenderStateChanges(const renderitem_t* items, int count, renderstats_t* stats) {
+	int shader = -1;
+	meshid_t mesh = NUM_MESHES;	// No mesh yet.
+	long texture = -1;
+	int material = -1;
+	memset(stats, 0, sizeof(*stats));
+	stats->items = count;
+	for (int i = 0; i < count; i++) {
+		const renderitem_t* item = &items[i];
+		const meshpart_t* part = &meshes[item->mesh].lods[item->level].parts[item->part];
+		int itemShader = item->group != NULL && instanceProgram.program != 0;
+		if (itemShader != shader) {
+			stats->shaderSwitches++;
+			shader = itemShader;
+			texture = -1;
+			material = -1;
+		}
+		if (item->mesh != mesh) {
+			stats->arrayBinds++;
+			mesh = item->mesh;
+		}
+		if ((long)part->material.texture != texture) {
+			stats->textureBinds++;
+			texture = (long)part->material.texture;
+		}
+		if (part->materialId != material) {
+			stats->materialChanges++;
+			material = part->materialId;
+		}
+	}
+}
+
+int compareRenderItems(const void* a, const void* b) {
+	unsigned long long keyA = ((const renderitem_t*)a)->key;
+	unsigned long long keyB = ((const renderitem_t*)b)->key;
+	return keyA < keyB ? -1 : (keyA > keyB ? 1 : 0);
+}
+
+/*
+	Sort the render queue and draw it, only changing the shader, vertex arrays,
+	texture and material when the next item needs different ones. The state changes
+	are counted in renderStats, and what the queue would have taken in the order it
+	was filled in renderStatsUnsorted. With per-pixel lighting every item is drawn
+	with lightingProgram or its instanced variant, and the fixed-function lighting
+	and material state is left alone. The impostor runs are drawn last. Leaves the
+	queue empty and the state the rest of display() expects (see unbindMeshArrays()).
+*/
+void flushRenderQueue(void) {
+	countRenderStateChanges(renderQueue.items, renderQueue.count, &renderStatsUnsorted);
+	qsort(renderQueue.items, renderQueue.count, sizeof(renderitem_t), compareRenderItems);
+	countRenderStateChanges(renderQueue.items, renderQueue.count, &renderStats);
+
+	int lit = lightingProgram.program != 0;
+	const shaderprogram_t* program = NULL;	// NULL for the fixed-function pipeline.
+	int shader = -1;
+	meshid_t mesh = NUM_MESHES;	// No mesh bound yet.
+	long texture = -1;
+	int material = -1;
+	lightcolors_t lightColors;
+	lightColors.saved = 0;
+	glPushMatrix();
+	for (int i = 0; i < renderQueue.count; i++) {
+		const renderitem_t* item = &renderQueue.items[i];
+		const meshentry_t* entry = &meshes[item->mesh];
+		const meshpart_t* part = &entry->lods[item->level].parts[item->part];
+		int itemShader = item->group != NULL && instanceProgram.program != 0;
+
+		if (itemShader != shader) {
+			const shaderprogram_t* next = itemShader ? &instanceProgram : (lit ? &lightingProgram : NULL);
+			if (shader == 1) {
+				glVertexAttribDivisor(INSTANCE_PLACEMENT_ATTRIBUTE, 0);
+				glVertexAttribDivisor(INSTANCE_TINT_ATTRIBUTE, 0);
+				glDisableVertexAttribArray(INSTANCE_PLACEMENT_ATTRIBUTE);
+				glDisableVertexAttribArray(INSTANCE_TINT_ATTRIBUTE);
+			}
+			if (next != NULL) {
+				glUseProgram(next->program);
+				glUniform1i(next->texture, 0);
+				if (!lit) {
+					// The per-pixel shaders get these from the Frame block.
+					GLfloat lightEnabled[3];
+					for (int light = 0; light < 3; light++) {
+						lightEnabled[light] = glIsEnabled(GL_LIGHT0 + light) ? 1.0f : 0.0f;
+					}
+					glUniform1fv(next->lightEnabled, 3, lightEnabled);
+					glUniform1i(next->fogEnabled, glIsEnabled(GL_FOG));
+				}
+			}
+			else if (program != NULL) {
+				glUseProgram(0);
+			}
+			if (itemShader) {
+				glEnableVertexAttribArray(INSTANCE_PLACEMENT_ATTRIBUTE);
+				glEnableVertexAttribArray(INSTANCE_TINT_ATTRIBUTE);
+				glVertexAttribDivisor(INSTANCE_PLACEMENT_ATTRIBUTE, 1);
+				glVertexAttribDivisor(INSTANCE_TINT_ATTRIBUTE, 1);
+			}
+			program = next;
+			shader = itemShader;
+			texture = -1;
+			material = -1;
+		}
+		if (item->mesh != mesh) {
+			if (lit) bindMeshAttributes(entry);
+			else bindMeshArrays(entry);
+			mesh = item->mesh;
+		}
+		if ((long)part->material.texture != texture) {
+			if (!lit) applyMeshTexture(part->material.texture);
+			else if (part->material.texture != 0) cachedBindTexture(part->material.texture);
+			if (program != NULL) glUniform1i(program->useTexture, part->material.texture != 0);
+			texture = (long)part->material.texture;
+		}
+		if (part->materialId != material) {
+			if (!lit) applyMeshColors(&part->material);
+			if (program != NULL) applyShaderMaterial(program, &part->material);
+			material = part->materialId;
+		}
+
+		const void* indices = meshIndices(entry, part);
+		if (lit) setShaderMatrices(program, item->matrix);
+		else glLoadMatrixf(item->matrix);
+		if (item->group == NULL) {
+			glDrawElements(GL_TRIANGLES, part->indexCount, GL_UNSIGNED_INT, indices);
+		}
+		else if (shader == 1) {
+			// GL 3.3 has no base instance, so the run is found by moving the attribute pointers.
+			size_t first = item->first * sizeof(meshinstance_t);
+			glBindBuffer(GL_ARRAY_BUFFER, item->group->buffer);
+			glVertexAttribPointer(INSTANCE_PLACEMENT_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, sizeof(meshinstance_t), (const void*)(first + offsetof(meshinstance_t, position)));
+			glVertexAttribPointer(INSTANCE_TINT_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, sizeof(meshinstance_t), (const void*)(first + offsetof(meshinstance_t, tint)));
+			glDrawElementsInstanced(GL_TRIANGLES, part->indexCount, GL_UNSIGNED_INT, indices, item->count);
+		}
+		else {
+			const meshinstance_t* instances = item->group->drawOrder + item->first;
+			if (!lit && !lightColors.saved) saveLightColors(&lightColors);
+			for (int j = 0; j < item->count; j++) {
+				const meshinstance_t* instance = &instances[j];
+				if (lit) {
+					float placed[16];
+					placeInstanceMatrix(item->matrix, instance, placed);
+					setShaderMatrices(program, placed);
+					glUniform3fv(program->modelTint, 1, instance->tint);
+					glDrawElements(GL_TRIANGLES, part->indexCount, GL_UNSIGNED_INT, indices);
+					continue;
+				}
+				tintLightColors(&lightColors, instance->tint);
+				glPushMatrix();
+				glTranslatef(instance->position[0], instance->position[1], instance->position[2]);
+				glRotatef(instance->yaw, 0.0f, 1.0f, 0.0f);
+				glScalef(instance->scale, instance->scale, instance->scale);
+				glDrawElements(GL_TRIANGLES, part->indexCount, GL_UNSIGNED_INT, indices);
+				glPopMatrix();
+			}
+			if (lit) glUniform3fv(program->modelTint, 1, UNTINTED);
+		}
+	}
+	if (lightColors.saved) tintLightColors(&lightColors, UNTINTED);
+	if (shader == 1) {
+		glVertexAttribDivisor(INSTANCE_PLACEMENT_ATTRIBUTE, 0);
+		glVertexAttribDivisor(INSTANCE_TINT_ATTRIBUTE, 0);
+		glDisableVertexAttribArray(INSTANCE_PLACEMENT_ATTRIBUTE);
+		glDisableVertexAttribArray(INSTANCE_TINT_ATTRIBUTE);
+	}
+	if (program != NULL) {
+		glUseProgram(0);
+	}
+	if (renderQueue.count > 0) {
+		if (lit) unbindShaderAttributes();
+		else unbindMeshArrays();
+	}
+	for (int i = 0; i < renderQueue.impostorCount; i++) {
+		const impostorrun_t* run = &renderQueue.impostors[i];
+		const instancegroup_t* group = run->group;
+		glLoadMatrixf(run->matrix);
+		drawImpostors(group->impostor, group->drawOrder + group->levelStart[INSTANCE_IMPOSTOR], group->levelCount[INSTANCE_IMPOSTOR]);
+	}
+	glPopMatrix();
+	renderQueue.count = 0;
+	renderQueue.impostorCount = 0;
+}
+
+/*
+	Delete the registry's buffers and the instance groups' copies. Registered with
+	atexit() by initMeshes().
+*/
+void freeMeshes(void) {
+	// If the window has already been closed, its context took the buffers with it.
+	int contextAlive = glutGetWindow() != 0;
+	instancegroup_t* groups[] = { &treeGroup, &houseGroup, &tankGroup };
+	for (int i = 0; i < 3; i++) {
+		if (contextAlive && groups[i]->buffer != 0) glDeleteBuffers(1, &groups[i]->buffer);
+		free(groups[i]->instances);
+		free(groups[i]->drawOrder);
+		free(groups[i]->lods);
+		groups[i]->instances = NULL;
+		groups[i]->drawOrder = NULL;
+		groups[i]->lods = NULL;
+		groups[i]->count = 0;
+		groups[i]->buffer = 0;
+	}
+	if (contextAlive && instanceProgram.program != 0) {
+		glDeleteProgram(instanceProgram.program);
+		instanceProgram.program = 0;
+	}
+	if (contextAlive && lightingProgram.program != 0) {
+		glDeleteProgram(lightingProgram.program);
+		glDeleteBuffers(1, &frameBlockBuffer);
+		lightingProgram.program = 0;
+		frameBlockBuffer = 0;
+	}
+	if (contextAlive && treeImpostor.texture != 0) glDeleteTextures(1, &treeImpostor.texture);
+	free(treeImpostor.vertices);
+	treeImpostor.texture = 0;
+	treeImpostor.vertices = NULL;
+	treeImpostor.capacity = 0;
+	freeSpatialIndex(&sceneIndex);
+	free(sceneVisibleEntries);
+	sceneVisibleEntries = NULL;
+	free(renderQueue.items);
+	memset(&renderQueue, 0, sizeof(renderQueue));
+	for (int id = 0; id < NUM_MESHES; id++) {
+		meshentry_t* mesh = &meshes[id];
+		if (contextAlive && mesh->vertexBuffer != 0) {
+			glDeleteBuffers(1, &mesh->vertexBuffer);
+			glDeleteBuffers(1, &mesh->indexBuffer);
+		}
+		free(mesh->vertices);
+		free(mesh->indices);
+		mesh->vertices = NULL;
+		mesh->indices = NULL;
+		mesh->vertexBuffer = 0;
+		mesh->indexBuffer = 0;
+		memset(mesh->lods, 0, sizeof(mesh->lods));
+	}
+}
+
+/*
+	Compile and link a GLSL program, binding each named vertex attribute to its slot
+	first. header goes in front of both sources (a #version line and #defines, say).
+	Compile and link errors are printed with name, and 0 is returned.
+*/
+GLuint buildShaderProgram(const char* name, const char* header, const char* vertexSource, const char* fragmentSource,
+	const char* const* attributes, const GLuint* attributeSlots, int attributeCount) {
+	const char* sources[2] = { vertexSource, fragmentSource };
+	const GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	GLuint shaders[2] = { 0, 0 };
+	char log[1024];
+	GLint status = 0;
+
+	for (int i = 0; i < 2; i++) {
+		shaders[i] = glCreateShader(types[i]);
+		const char* strings[2] = { header, sources[i] };
+		glShaderSource(shaders[i], 2, strings, NULL);
+		glCompileShader(shaders[i]);
+		glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &status);
+		if (!status) {
+			glGetShaderInfoLog(shaders[i], sizeof(log), NULL, log);
+			printf("Could not compile the %s %s shader:\n%s\n", name, i == 0 ? "vertex" : "fragment", log);
+			glDeleteShader(shaders[0]);
+			if (shaders[1] != 0) glDeleteShader(shaders[1]);
+			return 0;
+		}
+	}
+
+	GLuint program = glCreateProgram();
+	glAttachShader(program, shaders[0]);
+	glAttachShader(program, shaders[1]);
+	for (int i = 0; i < attributeCount; i++) {
+		glBindAttribLocation(program, attributeSlots[i], attributes[i]);
+	}
+	glLinkProgram(program);
+	// The shaders stay alive as long as they're attached, so they can be flagged for deletion now.
+	glDeleteShader(shaders[0]);
+	glDeleteShader(shaders[1]);
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		printf("Could not link the %s shader program:\n%s\n", name, log);
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+/*
+	Shaders for queued instance groups. Each instance is turned, scaled and moved by its
+	attributes, then lit the way the fixed-function pipeline would: per vertex, with the
+	lights and fog read from the compatibility profile's built-in state. Only the lights
+	initLights() sets up (0 to 2) and linear fog are handled. With per-pixel lighting,
+	instances use buildLightingProgram()'s instanced variant instead.
+*/
+const char* instanceVertexShader =
+	"#version 120\n"
+	"attribute vec4 instancePlacement;\n"	// x, y, z, yaw (degrees)
+	"attribute vec4 instanceTint;\n"		// r, g, b, scale
+	"uniform float lightEnabled[3];\n"
+	"uniform bool colorMaterial;\n"
+	"uniform vec4 materialAmbient;\n"
+	"uniform vec4 materialDiffuse;\n"
+	"uniform vec4 materialSpecular;\n"
+	"uniform float materialShininess;\n"
+	"varying vec4 litColor;\n"
+	"varying float fogDistance;\n"
+	"vec4 shadeLight(gl_LightSourceParameters light, vec3 eye, vec3 normal, vec4 ambient, vec4 diffuse) {\n"
+	"	vec3 toLight = light.position.xyz;\n"
+	"	vec3 halfway = light.halfVector.xyz;\n"	// Only valid for directional lights
+	"	float attenuation = 1.0;\n"
+	"	if (light.position.w != 0.0) {\n"
+	"		toLight -= eye;\n"
+	"		float range = length(toLight);\n"
+	"		toLight /= range;\n"
+	"		halfway = normalize(toLight + vec3(0.0, 0.0, 1.0));\n"
+	"		attenuation = 1.0 / (light.constantAttenuation + light.linearAttenuation * range\n"
+	"			+ light.quadraticAttenuation * range * range);\n"
+	"		if (light.spotCutoff <= 90.0) {\n"
+	"			float spot = dot(-toLight, normalize(light.spotDirection));\n"
+	"			attenuation *= spot < light.spotCosCutoff ? 0.0 : pow(spot, light.spotExponent);\n"
+	"		}\n"
+	"	}\n"
+	"	else {\n"
+	"		toLight = normalize(toLight);\n"
+	"	}\n"
+	"	float lambert = max(dot(normal, toLight), 0.0);\n"
+	"	vec4 color = light.ambient * ambient + light.diffuse * diffuse * lambert;\n"
+	"	if (lambert > 0.0) {\n"
+	"		float highlight = max(dot(normal, halfway), 0.0);\n"
+	"		color += light.specular * materialSpecular * (materialShininess > 0.0 ? pow(highlight, materialShininess) : 1.0);\n"
+	"	}\n"
+	"	return attenuation * color;\n"
+	"}\n"
+	"void main() {\n"
+	"	float yaw = radians(instancePlacement.w);\n"
+	"	mat3 turn = mat3(cos(yaw), 0.0, -sin(yaw), 0.0, 1.0, 0.0, sin(yaw), 0.0, cos(yaw));\n"
+	"	vec4 world = vec4(turn * (gl_Vertex.xyz * instanceTint.w) + instancePlacement.xyz, 1.0);\n"
+	"	vec4 eye = gl_ModelViewMatrix * world;\n"
+	"	vec3 normal = normalize(gl_NormalMatrix * (turn * gl_Normal));\n"
+	"	vec4 tint = vec4(instanceTint.rgb, 1.0);\n"
+	"	vec4 ambient = (colorMaterial ? gl_Color : materialAmbient) * tint;\n"
+	"	vec4 diffuse = (colorMaterial ? gl_Color : materialDiffuse) * tint;\n"
+	"	vec4 color = gl_FrontMaterial.emission + gl_LightModel.ambient * ambient;\n"
+	// Constant indices let the compiler fold each light's state, as it does for fixed-function.
+	"	if (lightEnabled[0] != 0.0) color += shadeLight(gl_LightSource[0], eye.xyz, normal, ambient, diffuse);\n"
+	"	if (lightEnabled[1] != 0.0) color += shadeLight(gl_LightSource[1], eye.xyz, normal, ambient, diffuse);\n"
+	"	if (lightEnabled[2] != 0.0) color += shadeLight(gl_LightSource[2], eye.xyz, normal, ambient, diffuse);\n"
+	"	litColor = vec4(clamp(color.rgb, 0.0, 1.0), diffuse.a);\n"
+	"	gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+	"	fogDistance = abs(eye.z);\n"
+	"	gl_Position = gl_ProjectionMatrix * eye;\n"
+	"}\n";
+
+const char* instanceFragmentShader =
+	"#version 120\n"
+	"uniform bool useTexture;\n"
+	"uniform bool fogEnabled;\n"
+	"uniform sampler2D diffuseTexture;\n"
+	"varying vec4 litColor;\n"
+	"varying float fogDistance;\n"
+	"void main() {\n"
+	"	vec4 color = litColor;\n"
+	"	if (useTexture) color *= texture2D(diffuseTexture, gl_TexCoord[0].st);\n"
+	"	if (fogEnabled) {\n"
+	"		float fog = clamp((gl_Fog.end - fogDistance) * gl_Fog.scale, 0.0, 1.0);\n"
+	"		color.rgb = mix(gl_Fog.color.rgb, color.rgb, fog);\n"
+	"	}\n"
+	"	gl_FragColor = color;\n"
+	"}\n";
+
+/*
+	Per-pixel lighting shaders, written against the GLSL 3.30 core profile: nothing
+	comes from the compatibility profile's built-in state. Vertices come in through the
+	SHADER_*_ATTRIBUTE slots, matrices and the material through uniforms, and the
+	projection, lights and fog through the Frame block (frameBlock). Lights and linear
+	fog follow the fixed-function equations, but per fragment, so highlights and the
+	spotlight's pool don't depend on how finely a model is tessellated.
+	buildLightingProgram() puts the #version line, frameBlockSource and the defines in
+	front; INSTANCED adds the instancing shader's per-copy attributes.
+*/
+const char* frameBlockSource =
+	"struct Light {\n"
+	"	vec4 position;\n"		// Eye space; w is 0 for a directional light
+	"	vec4 ambient;\n"
+	"	vec4 diffuse;\n"
+	"	vec4 specular;\n"
+	"	vec4 spotDirection;\n"	// Eye space
+	"	float spotCosCutoff;\n"	// -1 when it isn't a spotlight
+	"	float spotExponent;\n"
+	"	float enabled;\n"
+	"	vec4 attenuation;\n"	// Constant, linear, quadratic
+	"};\n"
+	"layout(std140) uniform Frame {\n"
+	"	mat4 projection;\n"
+	"	vec4 sceneAmbient;\n"
+	"	vec4 fogColor;\n"
+	"	float fogStart;\n"
+	"	float fogEnd;\n"
+	"	float fogEnabled;\n"
+	"	int lightCount;\n"
+	"	Light lights[MAX_SHADER_LIGHTS];\n"
+	"};\n";
+
+const char* lightingVertexShader =
+	"in vec3 position;\n"
+	"in vec3 normal;\n"
+	"in vec2 texCoord;\n"
+	"in vec4 color;\n"
+	"#ifdef INSTANCED\n"
+	"in vec4 instancePlacement;\n"	// x, y, z, yaw (degrees)
+	"in vec4 instanceTint;\n"		// r, g, b, scale
+	"#else\n"
+	"uniform vec3 modelTint;\n"		// Set per copy by the batched fallback, white otherwise.
+	"#endif\n"
+	"uniform mat4 modelView;\n"
+	"uniform mat3 normalMatrix;\n"
+	"out vec3 eyePosition;\n"
+	"out vec3 eyeNormal;\n"
+	"out vec2 surfaceTexCoord;\n"
+	"out vec4 surfaceColor;\n"
+	"out vec4 tint;\n"
+	"void main() {\n"
+	"	vec3 objectPosition = position;\n"
+	"	vec3 objectNormal = normal;\n"
+	"#ifdef INSTANCED\n"
+	"	float yaw = radians(instancePlacement.w);\n"
+	"	mat3 turn = mat3(cos(yaw), 0.0, -sin(yaw), 0.0, 1.0, 0.0, sin(yaw), 0.0, cos(yaw));\n"
+	"	objectPosition = turn * (position * instanceTint.w) + instancePlacement.xyz;\n"
+	"	objectNormal = turn * normal;\n"
+	"	tint = vec4(instanceTint.rgb, 1.0);\n"
+	"#else\n"
+	"	tint = vec4(modelTint, 1.0);\n"
+	"#endif\n"
+	"	vec4 eye = modelView * vec4(objectPosition, 1.0);\n"
+	"	eyePosition = eye.xyz;\n"
+	"	eyeNormal = normalMatrix * objectNormal;\n"
+	"	surfaceTexCoord = texCoord;\n"
+	"	surfaceColor = color;\n"
+	"	gl_Position = projection * eye;\n"
+	"}\n";
+
+const char* lightingFragmentShader =
+	"uniform bool colorMaterial;\n"
+	"uniform vec4 materialAmbient;\n"
+	"uniform vec4 materialDiffuse;\n"
+	"uniform vec4 materialSpecular;\n"
+	"uniform float materialShininess;\n"
+	"uniform bool useTexture;\n"
+	"uniform sampler2D diffuseTexture;\n"
+	"in vec3 eyePosition;\n"
+	"in vec3 eyeNormal;\n"
+	"in vec2 surfaceTexCoord;\n"
+	"in vec4 surfaceColor;\n"
+	"in vec4 tint;\n"
+	"out vec4 fragmentColor;\n"
+	"void main() {\n"
+	"	vec3 normal = normalize(eyeNormal);\n"
+	"	vec3 toEye = normalize(-eyePosition);\n"
+	"	vec4 ambient = (colorMaterial ? surfaceColor : materialAmbient) * tint;\n"
+	"	vec4 diffuse = (colorMaterial ? surfaceColor : materialDiffuse) * tint;\n"
+	"	vec4 color = sceneAmbient * ambient;\n"
+	"	for (int i = 0; i < lightCount; i++) {\n"
+	"		if (lights[i].enabled == 0.0) continue;\n"
+	"		vec3 toLight = lights[i].position.xyz;\n"
+	"		float attenuation = 1.0;\n"
+	"		if (lights[i].position.w != 0.0) {\n"
+	"			toLight -= eyePosition;\n"
+	"			float range = length(toLight);\n"
+	"			toLight /= range;\n"
+	"			attenuation = 1.0 / dot(lights[i].attenuation.xyz, vec3(1.0, range, range * range));\n"
+	"			if (lights[i].spotCosCutoff >= 0.0) {\n"
+	"				float spot = dot(-toLight, normalize(lights[i].spotDirection.xyz));\n"
+	"				attenuation *= spot < lights[i].spotCosCutoff ? 0.0 : pow(spot, lights[i].spotExponent);\n"
+	"			}\n"
+	"		}\n"
+	"		else {\n"
+	"			toLight = normalize(toLight);\n"
+	"		}\n"
+	"		float lambert = max(dot(normal, toLight), 0.0);\n"
+	"		vec4 lit = lights[i].ambient * ambient + lights[i].diffuse * diffuse * lambert;\n"
+	"		if (lambert > 0.0) {\n"
+	"			float highlight = max(dot(normal, normalize(toLight + toEye)), 0.0);\n"
+	"			lit += lights[i].specular * materialSpecular * (materialShininess > 0.0 ? pow(highlight, materialShininess) : 1.0);\n"
+	"		}\n"
+	"		color += attenuation * lit;\n"
+	"	}\n"
+	"	color = vec4(clamp(color.rgb, 0.0, 1.0), diffuse.a);\n"
+	"	if (useTexture) color *= texture(diffuseTexture, surfaceTexCoord);\n"
+	// Fog by depth rather than distance, to match what's still drawn fixed-function.
+	"	if (fogEnabled != 0.0) {\n"
+	"		float fog = clamp((fogEnd - abs(eyePosition.z)) / (fogEnd - fogStart), 0.0, 1.0);\n"
+	"		color.rgb = mix(fogColor.rgb, color.rgb, fog);\n"
+	"	}\n"
+	"	fragmentColor = color;\n"
+	"}\n";
+
+/*
+	Build the per-pixel lighting program, with instancing or without, and attach it to
+	the Frame block's binding point. Returns 0 (having printed why) if it won't build.
+*/
+GLuint buildLightingProgram(const char* name, int instanced) {
+	static const char* const attributes[] = { "position", "normal", "texCoord", "color", "instancePlacement", "instanceTint" };
+	static const GLuint slots[] = {
+		SHADER_POSITION_ATTRIBUTE, SHADER_NORMAL_ATTRIBUTE, SHADER_TEXCOORD_ATTRIBUTE, SHADER_COLOR_ATTRIBUTE,
+		INSTANCE_PLACEMENT_ATTRIBUTE, INSTANCE_TINT_ATTRIBUTE
+	};
+	char header[2048];
+	sprintf(header, "#version 330 core\n#define MAX_SHADER_LIGHTS %d\n%s%s", MAX_SHADER_LIGHTS,
+		instanced ? "#define INSTANCED\n" : "", frameBlockSource);
+	GLuint program = buildShaderProgram(name, header, lightingVertexShader, lightingFragmentShader, attributes, slots, instanced ? 6 : 4);
+	if (program == 0) return 0;
+	GLuint block = glGetUniformBlockIndex(program, "Frame");
+	if (block != GL_INVALID_INDEX) glUniformBlockBinding(program, block, FRAME_BLOCK_BINDING);
+	return program;
+}
+
+// Look up the uniform locations the drawing code sets (see shaderprogram_t).
+void getShaderUniforms(shaderprogram_t* program) {
+	GLuint id = program->program;
+	program->lightEnabled = glGetUniformLocation(id, "lightEnabled");
+	program->fogEnabled = glGetUniformLocation(id, "fogEnabled");
+	program->useTexture = glGetUniformLocation(id, "useTexture");
+	program->colorMaterial = glGetUniformLocation(id, "colorMaterial");
+	program->ambient = glGetUniformLocation(id, "materialAmbient");
+	program->diffuse = glGetUniformLocation(id, "materialDiffuse");
+	program->specular = glGetUniformLocation(id, "materialSpecular");
+	program->shininess = glGetUniformLocation(id, "materialShininess");
+	program->texture = glGetUniformLocation(id, "diffuseTexture");
+	program->modelView = glGetUniformLocation(id, "modelView");
+	program->normalMatrix = glGetUniformLocation(id, "normalMatrix");
+	program->modelTint = glGetUniformLocation(id, "modelTint");
+}
+
+/*
+	Light with the per-pixel shaders instead of the fixed-function pipeline, if the
+	driver has OpenGL 3.3 and --fixed-function wasn't given: build the program and the
+	uniform buffer behind the Frame block. Called once from init(), before
+	initInstanceGroups(), which builds the instanced variant to go with it.
+*/
+void initShaderLighting(void) {
+	if (!shaderLightingAvailable || !shaderLightingRequested) {
+		printf("Lighting per vertex with the fixed-function pipeline\n");
+		return;
+	}
+	lightingProgram.program = buildLightingProgram("per-pixel lighting", 0);
+	if (lightingProgram.program == 0) {
+		printf("Lighting per vertex with the fixed-function pipeline\n");
+		return;
+	}
+	getShaderUniforms(&lightingProgram);
+
+	// Uniforms keep their values between uses, so everything but the batched fallback draws untinted.
+	glUseProgram(lightingProgram.program);
+	glUniform3fv(lightingProgram.modelTint, 1, UNTINTED);
+	glUseProgram(0);
+
+	glGenBuffers(1, &frameBlockBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, frameBlockBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(frameBlock), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, frameBlockBuffer);
+	printf("Lighting per pixel with GLSL 3.30 shaders (up to %d lights)\n", MAX_SHADER_LIGHTS);
+}
+
+/*
+	The matrix that turns a model's normals into eye space: the inverse transpose of
+	modelView's upper 3x3, whose columns are the cross products of its other columns
+	over its determinant.
+*/
+void normalMatrixOf(const float modelView[16], float normal[9]) {
+	const float* a = &modelView[0];
+	const float* b = &modelView[4];
+	const float* c = &modelView[8];
+	float bc[3] = { b[1] * c[2] - b[2] * c[1], b[2] * c[0] - b[0] * c[2], b[0] * c[1] - b[1] * c[0] };
+	float ca[3] = { c[1] * a[2] - c[2] * a[1], c[2] * a[0] - c[0] * a[2], c[0] * a[1] - c[1] * a[0] };
+	float ab[3] = { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+	float determinant = a[0] * bc[0] + a[1] * bc[1] + a[2] * bc[2];
+	float scale = determinant != 0.0f ? 1.0f / determinant : 1.0f;
+	for (int i = 0; i < 3; i++) {
+		normal[i] = bc[i] * scale;
+		normal[3 + i] = ca[i] * scale;
+		normal[6 + i] = ab[i] * scale;
+	}
+}
+
+// Hand a program the matrices for drawing with modelView, in place of glLoadMatrixf().
+void setShaderMatrices(const shaderprogram_t* program, const float modelView[16]) {
+	float normal[9];
+	normalMatrixOf(modelView, normal);
+	glUniformMatrix4fv(program->modelView, 1, GL_FALSE, modelView);
+	glUniformMatrix3fv(program->normalMatrix, 1, GL_FALSE, normal);
+}
+
+// setShaderMatrices() with the current modelview matrix.
+void loadShaderModelView(const shaderprogram_t* program) {
+	float modelView[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, modelView);
+	setShaderMatrices(program, modelView);
+}
+
+/*
+	matrix followed by an instance's placement (the glTranslatef(), glRotatef() and
+	glScalef() the batched fallback does), for drawing it with the shaders.
+*/
+void placeInstanceMatrix(const float matrix[16], const meshinstance_t* instance, float placed[16]) {
+	float radians = instance->yaw * (float)PI / 180.0f;
+	float s = instance->scale;
+	const float local[16] = {
+		cosf(radians) * s, 0.0f, -sinf(radians) * s, 0.0f,
+		0.0f, s, 0.0f, 0.0f,
+		sinf(radians) * s, 0.0f, cosf(radians) * s, 0.0f,
+		instance->position[0], instance->position[1], instance->position[2], 1.0f
+	};
+	for (int column = 0; column < 4; column++) {
+		for (int row = 0; row < 4; row++) {
+			placed[column * 4 + row] = matrix[row] * local[column * 4] + matrix[4 + row] * local[column * 4 + 1]
+				+ matrix[8 + row] * local[column * 4 + 2] + matrix[12 + row] * local[column * 4 + 3];
+		}
+	}
+}
+
+/*
+	Remember the scene ambient and the enabled lights' ambient and diffuse colours, so
+	tintLightColors() can scale them.
+*/
+void saveLightColors(lightcolors_t* colors) {
+	glGetFloatv(GL_LIGHT_MODEL_AMBIENT, colors->sceneAmbient);
+	colors->lightCount = 0;
+	for (int light = 0; light < 8; light++) {
+		if (!glIsEnabled(GL_LIGHT0 + light)) continue;
+		colors->lights[colors->lightCount] = GL_LIGHT0 + light;
+		glGetLightfv(GL_LIGHT0 + light, GL_AMBIENT, colors->ambient[colors->lightCount]);
+		glGetLightfv(GL_LIGHT0 + light, GL_DIFFUSE, colors->diffuse[colors->lightCount]);
+		colors->lightCount++;
+	}
+	colors->tint[0] = colors->tint[1] = colors->tint[2] = 1.0f;
+	colors->saved = 1;
+}
+
+/*
+	Tint what the fixed-function pipeline draws next, the way the shaders' tint does:
+	scaling every ambient and diffuse light by the tint scales the ambient and diffuse
+	terms it lights a model with, whether they come from glMaterial() or the vertex
+	colours, and leaves the highlight alone. A white tint puts the saved colours back.
+*/
+void tintLightColors(lightcolors_t* colors, const float tint[3]) {
+	if (memcmp(colors->tint, tint, sizeof(colors->tint)) == 0) return;
+	memcpy(colors->tint, tint, sizeof(colors->tint));
+	GLfloat scaled[4];
+	for (int i = 0; i < 3; i++) scaled[i] = colors->sceneAmbient[i] * tint[i];
+	scaled[3] = colors->sceneAmbient[3];
+	glLightModelfv(GL_LIGHT_MODEL_AMBIENT, scaled);
+	for (int light = 0; light < colors->lightCount; light++) {
+		for (int i = 0; i < 3; i++) scaled[i] = colors->ambient[light][i] * tint[i];
+		scaled[3] = colors->ambient[light][3];
+		glLightfv(colors->lights[light], GL_AMBIENT, scaled);
+		for (int i = 0; i < 3; i++) scaled[i] = colors->diffuse[light][i] * tint[i];
+		scaled[3] = colors->diffuse[light][3];
+		glLightfv(colors->lights[light], GL_DIFFUSE, scaled);
+	}
+}
+
+// Set a part's material on a program: colour material or its own colours, and its highlight.
+void applyShaderMaterial(const shaderprogram_t* program, const meshmaterial_t* material) {
+	glUniform1i(program->colorMaterial, material->colorMaterial);
+	glUniform4fv(program->ambient, 1, material->ambient);
+	glUniform4fv(program->diffuse, 1, material->diffuse);
+	glUniform4fv(program->specular, 1, material->specular);
+	glUniform1f(program->shininess, material->shininess);
+}
+
+// bindMeshArrays() for the per-pixel lighting shaders: the same vertices, through generic attributes.
+void bindMeshAttributes(const meshentry_t* mesh) {
+	const char* base = (const char*)mesh->vertices;
+	if (mesh->vertexBuffer != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
+		base = NULL;
+	}
+	glEnableVertexAttribArray(SHADER_POSITION_ATTRIBUTE);
+	glEnableVertexAttribArray(SHADER_NORMAL_ATTRIBUTE);
+	glEnableVertexAttribArray(SHADER_TEXCOORD_ATTRIBUTE);
+	glEnableVertexAttribArray(SHADER_COLOR_ATTRIBUTE);
+	glVertexAttribPointer(SHADER_POSITION_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, sizeof(meshvertex_t), base + offsetof(meshvertex_t, position));
+	glVertexAttribPointer(SHADER_NORMAL_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, sizeof(meshvertex_t), base + offsetof(meshvertex_t, normal));
+	glVertexAttribPointer(SHADER_TEXCOORD_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, sizeof(meshvertex_t), base + offsetof(meshvertex_t, texCoord));
+	glVertexAttribPointer(SHADER_COLOR_ATTRIBUTE, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(meshvertex_t), base + offsetof(meshvertex_t, color));
+}
+
+/*
+	bindGroundMesh() for the per-pixel lighting shaders. The ground has no normals or
+	colours of its own, so every vertex gets straight up and groundColor.
+*/
+void bindGroundAttributes(const groundmesh_t* mesh) {
+	static const GLfloat up[4] = { 0.0f, 1.0f, 0.0f, 1.0f };
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
+	glEnableVertexAttribArray(SHADER_POSITION_ATTRIBUTE);
+	glEnableVertexAttribArray(SHADER_TEXCOORD_ATTRIBUTE);
+	glVertexAttribPointer(SHADER_POSITION_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (const void*)0);
+	glVertexAttribPointer(SHADER_TEXCOORD_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (const void*)(3 * sizeof(float)));
+	glVertexAttrib4fv(SHADER_NORMAL_ATTRIBUTE, up);
+	glVertexAttrib4fv(SHADER_COLOR_ATTRIBUTE, groundColor);
+}
+
+// Undo bindMeshAttributes() or bindGroundAttributes().
+void unbindShaderAttributes(void) {
+	glDisableVertexAttribArray(SHADER_POSITION_ATTRIBUTE);
+	glDisableVertexAttribArray(SHADER_NORMAL_ATTRIBUTE);
+	glDisableVertexAttribArray(SHADER_TEXCOORD_ATTRIBUTE);
+	glDisableVertexAttribArray(SHADER_COLOR_ATTRIBUTE);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+/*
+	Fill the instance groups from the placement arrays (plus extraTreeCount trees spread
+	over the ground, and a tank for each of tankFleet's), and set up instanced drawing if
+	the driver supports it. Called once from init(), after initMeshes(). Returns 0 if
+	memory runs out.
+*/
+int initInstanceGroups(void) {
+	int placedTrees = (int)(sizeof(treePlacements) / sizeof(treePlacements[0]));
+	int houses = (int)(sizeof(housePlacements) / sizeof(housePlacements[0]));
+	int tanks = tankFleet.count;
+	instancegroup_t* groups[] = { &treeGroup, &houseGroup, &tankGroup };
+	const int counts[] = { placedTrees + extraTreeCount, houses, tanks };
+
+	for (int i = 0; i < 3; i++) {
+		groups[i]->count = counts[i];
+		groups[i]->instances = (meshinstance_t*)malloc(counts[i] * sizeof(meshinstance_t));
+		groups[i]->drawOrder = (meshinstance_t*)malloc(counts[i] * sizeof(meshinstance_t));
+		groups[i]->lods = (unsigned char*)calloc(counts[i], 1);
+		if (groups[i]->instances == NULL || groups[i]->drawOrder == NULL || groups[i]->lods == NULL) return 0;
+		for (int j = 0; j < counts[i]; j++) {
+			meshinstance_t* instance = &groups[i]->instances[j];
+			if (i == 2) {
+				instance->position[0] = tankFleet.pose.x[j];
+				instance->position[2] = tankFleet.pose.z[j];
+				instance->yaw = tankFleet.pose.heading[j];
+			}
+			else {
+				const float* placement = i == 0 ? treePlacements[j < placedTrees ? j : 0] : housePlacements[j];
+				instance->position[0] = placement[0];
+				instance->position[2] = placement[1];
+				instance->yaw = 0.0f;
+			}
+			instance->position[1] = 0.0f;
+			instance->tint[0] = instance->tint[1] = instance->tint[2] = 1.0f;
+			instance->scale = 1.0f;
+		}
+		groups[i]->dirty = 1;
+	}
+
+	// The extra trees get their own random number sequence, so asking for them doesn't
+	// change anything else that uses rand().
+	unsigned int seed = 12345u;
+	for (int j = placedTrees; j < treeGroup.count; j++) {
+		meshinstance_t* tree = &treeGroup.instances[j];
+		float random[5];
+		for (int k = 0; k < 5; k++) {
+			seed = seed * 1664525u + 1013904223u;
+			random[k] = (seed >> 8) / 16777216.0f;
+		}
+		tree->position[0] = (random[0] - 0.5f) * groundSize;
+		tree->position[2] = (random[1] - 0.5f) * groundSize;
+		tree->yaw = random[2] * 360.0f;
+		tree->scale = 0.8f + random[3] * 0.4f;
+		tree->tint[0] = tree->tint[2] = 0.85f + random[4] * 0.15f;
+	}
+
+	if (instancingAvailable && instancingRequested) {
+		static const char* const attributes[] = { "instancePlacement", "instanceTint" };
+		static const GLuint slots[] = { INSTANCE_PLACEMENT_ATTRIBUTE, INSTANCE_TINT_ATTRIBUTE };
+		if (lightingProgram.program != 0) {
+			instanceProgram.program = buildLightingProgram("per-pixel instancing", 1);
+		}
+		else {
+			instanceProgram.program = buildShaderProgram("instancing", "", instanceVertexShader, instanceFragmentShader, attributes, slots, 2);
+		}
+	}
+	if (instanceProgram.program != 0) {
+		getShaderUniforms(&instanceProgram);
+		for (int i = 0; i < 3; i++) {
+			glGenBuffers(1, &groups[i]->buffer);
+		}
+		printf("Drawing %d trees, %d houses and %d tanks with instanced arrays\n", treeGroup.count, houses, tanks);
+	}
+	else {
+		printf("Drawing %d trees, %d houses and %d tanks in batches\n", treeGroup.count, houses, tanks);
+	}
+	return 1;
+}
+
+/*
+	Drop each instance cullScene() didn't find in view, and pick a level of detail (or its
+	group's impostor) for the rest, and when any has changed bucket (or the instances
+	have changed), sort them by bucket into drawOrder. Returns 1 if drawOrder was rebuilt.
+*/
+int sortInstancesByLod(instancegroup_t* group) {
+	int changed = group->dirty;
+	for (int j = 0; j < group->count; j++) {
+		const meshinstance_t* instance = &group->instances[j];
+		int previous = group->lods[j];
+		int level = INSTANCE_CULLED;
+		if (sceneEntryVisible(group->spatialFirst + j)) {
+			// Copies coming back into view (or back from the impostor) start from the coarsest level.
+			int wasImpostor = previous == INSTANCE_IMPOSTOR;
+			level = INSTANCE_IMPOSTOR;
+			if (!useImpostor(group, instance->position, wasImpostor)) {
+				level = selectMeshLod(group->mesh, instance->position, instance->scale, previous < MESH_LOD_LEVELS ? previous : MESH_LOD_LEVELS - 1);
+			}
+		}
+		if (level != group->lods[j]) {
+			group->lods[j] = (unsigned char)level;
+			changed = 1;
+		}
+	}
+	if (!changed) return 0;
+
+	// Counting sort: count each bucket, then place every instance after the buckets before its own.
+	int next[INSTANCE_BUCKETS];
+	memset(group->levelCount, 0, sizeof(group->levelCount));
+	for (int j = 0; j < group->count; j++) {
+		group->levelCount[group->lods[j]]++;
+	}
+	for (int level = 0, start = 0; level < INSTANCE_BUCKETS; level++) {
+		group->levelStart[level] = next[level] = start;
+		start += group->levelCount[level];
+	}
+	for (int j = 0; j < group->count; j++) {
+		group->drawOrder[next[group->lods[j]]++] = group->instances[j];
+	}
+	return 1;
+}
+
+/*
+	Queue every instance in a group, each at its own level of detail: one render item
+	per part of each level in use, drawn by flushRenderQueue() with instanced arrays
+	when it can, otherwise one instance after another with the fixed-function pipeline.
+	Impostors are queued as one run, which flushRenderQueue() draws in one batch after
+	the items, and instances outside the view frustum aren't drawn.
+*/
+void queueInstanceGroup(instancegroup_t* group) {
+	const meshentry_t* mesh = &meshes[group->mesh];
+	if (group->count == 0) return;
+	int sorted = sortInstancesByLod(group);
+	group->dirty = 0;
+
+	if (instanceProgram.program != 0 && sorted) {
+		// Only the instances drawn as meshes are needed: impostors and culled ones come after them.
+		glBindBuffer(GL_ARRAY_BUFFER, group->buffer);
+		glBufferData(GL_ARRAY_BUFFER, group->levelStart[INSTANCE_IMPOSTOR] * sizeof(meshinstance_t), group->drawOrder, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	float matrix[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
+	int shader = instanceProgram.program != 0;
+	for (int level = 0; level < MESH_LOD_LEVELS; level++) {
+		const meshlod_t* lod = &mesh->lods[level];
+		if (group->levelCount[level] == 0) continue;
+		for (int i = 0; i < lod->partCount; i++) {
+			renderitem_t* item = pushRenderItem(group->mesh, level, i);
+			if (item == NULL) break;
+			item->group = group;
+			item->first = group->levelStart[level];
+			item->count = group->levelCount[level];
+			memcpy(item->matrix, matrix, sizeof(item->matrix));
+			// The copies are spread over the map, so they sort as if at the camera.
+			item->key = renderKey(shader, lod->parts[i].material.texture, lod->parts[i].materialId, group->mesh, 0.0f);
+		}
+		countMeshLod(group->mesh, level, group->levelCount[level]);
+	}
+	if (group->levelCount[INSTANCE_IMPOSTOR] > 0 && renderQueue.impostorCount < MAX_IMPOSTOR_RUNS) {
+		impostorrun_t* run = &renderQueue.impostors[renderQueue.impostorCount++];
+		run->group = group;
+		memcpy(run->matrix, matrix, sizeof(run->matrix));
+	}
+}
+
+/*
+	Whether a copy at position should be drawn as its group's impostor: it's farther
+	than impostorDistance from the camera, by MESH_LOD_HYSTERESIS either way depending
+	on whether it was an impostor last frame.
+*/
+int useImpostor(const instancegroup_t* group, const float position[3], int wasImpostor) {
+	if (group->impostor == NULL || group->impostor->texture == 0 || impostorDistance <= 0.0f) return 0;
+	const float* eye = renderState.cameraLookAt;
+	float dx = position[0] - eye[0];
+	float dy = position[1] - eye[1];
+	float dz = position[2] - eye[2];
+	float threshold = impostorDistance * (wasImpostor ? 1.0f - MESH_LOD_HYSTERESIS : 1.0f + MESH_LOD_HYSTERESIS);
+	return dx * dx + dy * dy + dz * dz > threshold * threshold;
+}
+
+/*
+	Photograph each impostor's mesh from IMPOSTOR_VIEWS angles around +y into its texture,
+	through a framebuffer object. The mesh is lit from the camera (as LIGHT0 lights the
+	scene) with the daytime ambient, and drawImpostors() dims the pictures at night.
+	Called once from init(), after initInstanceGroups(). Without framebuffer objects, or
+	with --impostor-distance 0, every tree stays a mesh.
+*/
+void initImpostors(void) {
+	treeGroup.impostor = &treeImpostor;
+	if (impostorDistance <= 0.0f) return;
+	if (!framebuffersAvailable) {
+		printf("Framebuffer objects are not supported; distant trees will be drawn in full\n");
+		return;
+	}
+	if (!bakeImpostor(&treeImpostor)) {
+		printf("Could not render the tree impostors; distant trees will be drawn in full\n");
+		return;
+	}
+	printf("Drawing trees beyond %.0f units as impostors\n", impostorDistance);
+}
+
+// Render one impostor's views (see initImpostors()). Returns 0 if the framebuffer can't be used.
+int bakeImpostor(impostor_t* impostor) {
+	const meshentry_t* mesh = &meshes[impostor->mesh];
+	static const GLfloat clearColor[] = { 0.15f, 0.3f, 0.1f, 0.0f };	// Close to the foliage, so filtering doesn't darken the edges.
+	static const GLfloat headlightPosition[] = { 0.0f, 0.0f, 1.0f, 0.0f };
+	static const GLfloat white[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	static const GLfloat ambient[] = { IMPOSTOR_BAKE_AMBIENT, IMPOSTOR_BAKE_AMBIENT, IMPOSTOR_BAKE_AMBIENT, 1.0f };
+
+	// Wide enough for the mesh turned to any angle about +y.
+	impostor->halfWidth = 0.0f;
+	for (int i = 0; i < 4; i++) {
+		float x = (i & 1) ? mesh->boxMax[0] : mesh->boxMin[0];
+		float z = (i & 2) ? mesh->boxMax[2] : mesh->boxMin[2];
+		impostor->halfWidth = fmaxf(impostor->halfWidth, sqrtf(x * x + z * z));
+	}
+	impostor->bottom = mesh->boxMin[1];
+	impostor->top = mesh->boxMax[1];
+
+	glGenTextures(1, &impostor->texture);
+	cachedBindTexture(impostor->texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, IMPOSTOR_VIEWS * IMPOSTOR_VIEW_WIDTH, IMPOSTOR_VIEW_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	cachedBindTexture(0);
+
+	GLuint framebuffer, depthBuffer;
+	GLint previousFramebuffer;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+	glGenRenderbuffers(1, &depthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, IMPOSTOR_VIEWS * IMPOSTOR_VIEW_WIDTH, IMPOSTOR_VIEW_HEIGHT);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, impostor->texture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+	int complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+	if (complete) {
+		glPushAttrib(GL_ALL_ATTRIB_BITS);
+		glMatrixMode(GL_PROJECTION);
+		glPushMatrix();
+		glLoadIdentity();
+		glOrtho(-impostor->halfWidth, impostor->halfWidth, impostor->bottom, impostor->top,
+			-impostor->halfWidth - 1.0f, impostor->halfWidth + 1.0f);
+		glMatrixMode(GL_MODELVIEW);
+		glPushMatrix();
+		glLoadIdentity();
+
+		glEnable(GL_DEPTH_TEST);
+		glDisable(GL_FOG);
+		glEnable(GL_LIGHTING);
+		glEnable(GL_LIGHT0);
+		glDisable(GL_LIGHT1);
+		glDisable(GL_LIGHT2);
+		glLightfv(GL_LIGHT0, GL_POSITION, headlightPosition);
+		glLightfv(GL_LIGHT0, GL_DIFFUSE, white);
+		glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambient);
+		glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		// View v looks at the mesh from angle v * 360 / IMPOSTOR_VIEWS about +y (0 is from +z).
+		for (int view = 0; view < IMPOSTOR_VIEWS; view++) {
+			glViewport(view * IMPOSTOR_VIEW_WIDTH, 0, IMPOSTOR_VIEW_WIDTH, IMPOSTOR_VIEW_HEIGHT);
+			glLoadIdentity();
+			glRotatef(-view * 360.0f / IMPOSTOR_VIEWS, 0.0f, 1.0f, 0.0f);
+			drawMesh(impostor->mesh, 0);
+		}
+
+		glPopMatrix();
+		glMatrixMode(GL_PROJECTION);
+		glPopMatrix();
+		glMatrixMode(GL_MODELVIEW);
+		glPopAttrib();
+		resetStateCache();  // drawMesh() went through the cache, and the pop undid it.
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, (GLuint)previousFramebuffer);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteRenderbuffers(1, &depthBuffer);
+	if (!complete) {
+		glDeleteTextures(1, &impostor->texture);
+		impostor->texture = 0;
+		return 0;
+	}
+
+	cachedBindTexture(impostor->texture);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	cachedBindTexture(0);
+	return 1;
+}
+
+/*
+	Draw copies of an impostor's mesh as textured quads, all in one draw call. Each quad
+	turns about +y to face the camera and shows the view taken from closest to the
+	direction it's seen from, so a tree keeps its shape as the camera circles it.
+*/
+void drawImpostors(impostor_t* impostor, const meshinstance_t* instances, int count) {
+	if (count > impostor->capacity) {
+		float* vertices = (float*)realloc(impostor->vertices, count * 4 * IMPOSTOR_VERTEX_FLOATS * sizeof(float));
+		if (vertices == NULL) return;
+		impostor->vertices = vertices;
+		impostor->capacity = count;
+	}
+
+	// The views were taken in daylight: scale them by the current ambient (with LIGHT0 counted as 1).
+	GLfloat ambient[4];
+	glGetFloatv(GL_LIGHT_MODEL_AMBIENT, ambient);
+	float brightness[3];
+	for (int c = 0; c < 3; c++) {
+		brightness[c] = (ambient[c] + 1.0f) / (IMPOSTOR_BAKE_AMBIENT + 1.0f);
+	}
+
+	const float* eye = renderState.cameraLookAt;
+	float* vertex = impostor->vertices;
+	for (int i = 0; i < count; i++) {
+		const meshinstance_t* instance = &instances[i];
+		float dx = eye[0] - instance->position[0];
+		float dz = eye[2] - instance->position[2];
+		float length = sqrtf(dx * dx + dz * dz);
+		if (length < 1e-4f) {
+			dx = 0.0f; dz = 1.0f; length = 1.0f;
+		}
+
+		// Half the quad's width along the camera's right (+y cross the direction to the camera).
+		float rightX = dz / length * impostor->halfWidth * instance->scale;
+		float rightZ = -dx / length * impostor->halfWidth * instance->scale;
+		float bottom = instance->position[1] + impostor->bottom * instance->scale;
+		float top = instance->position[1] + impostor->top * instance->scale;
+
+		// The direction to the camera in the model's own frame picks the view.
+		float angle = atan2f(dx, dz) * 180.0f / (float)PI - instance->yaw;
+		int view = (int)floorf(angle * IMPOSTOR_VIEWS / 360.0f + 0.5f) % IMPOSTOR_VIEWS;
+		if (view < 0) view += IMPOSTOR_VIEWS;
+
+		for (int corner = 0; corner < 4; corner++) {
+			float side = (corner == 0 || corner == 3) ? -1.0f : 1.0f;
+			*vertex++ = instance->position[0] + side * rightX;
+			*vertex++ = corner < 2 ? bottom : top;
+			*vertex++ = instance->position[2] + side * rightZ;
+			*vertex++ = (view + (side > 0.0f ? 1.0f : 0.0f)) / IMPOSTOR_VIEWS;
+			*vertex++ = corner < 2 ? 0.0f : 1.0f;
+			*vertex++ = instance->tint[0] * brightness[0];
+			*vertex++ = instance->tint[1] * brightness[1];
+			*vertex++ = instance->tint[2] * brightness[2];
+		}
+	}
+
+	// Unlit and alpha-tested, so they need no sorting; fog still applies. The pop undoes the
+	// enables, so they bypass the state cache; the texture binding isn't saved, so it doesn't.
+	glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT);
+	glDisable(GL_LIGHTING);
+	glEnable(GL_TEXTURE_2D);
+	cachedBindTexture(impostor->texture);
+	glEnable(GL_ALPHA_TEST);
+	glAlphaFunc(GL_GREATER, 0.5f);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(3, GL_FLOAT, IMPOSTOR_VERTEX_FLOATS * sizeof(float), impostor->vertices);
+	glTexCoordPointer(2, GL_FLOAT, IMPOSTOR_VERTEX_FLOATS * sizeof(float), impostor->vertices + 3);
+	glColorPointer(3, GL_FLOAT, IMPOSTOR_VERTEX_FLOATS * sizeof(float), impostor->vertices + 5);
+	glDrawArrays(GL_QUADS, 0, count * 4);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	cachedBindTexture(0);
+	glPopAttrib();
+
+	const meshentry_t* mesh = &meshes[impostor->mesh];
+	meshLodStats.impostorsDrawn += count;
+	meshLodStats.trianglesDrawn += 2 * count;
+	meshLodStats.trianglesSaved += (mesh->lods[0].triangleCount - 2) * count;
+}
+
+/*
+	Set up an empty index over the rectangle from (minX, minZ) to (maxX, maxZ), with
+	room for capacity entries. Returns 0 if memory runs out.
+*/
+int initSpatialIndex(spatialindex_t* index, float minX, float minZ, float maxX, float maxZ, int capacity) {
+	memset(index, 0, sizeof(*index));
+	index->originX = minX;
+	index->originZ = minZ;
+	index->cellsX = (int)ceilf((maxX - minX) / SPATIAL_CELL_SIZE);
+	index->cellsZ = (int)ceilf((maxZ - minZ) / SPATIAL_CELL_SIZE);
+	if (index->cellsX < 1) index->cellsX = 1;
+	if (index->cellsZ < 1) index->cellsZ = 1;
+	index->cells = (int*)malloc(index->cellsX * index->cellsZ * sizeof(int));
+	index->entries = (spatialentry_t*)malloc(capacity * sizeof(spatialentry_t));
+	if (index->cells == NULL || index->entries == NULL) {
+		freeSpatialIndex(index);
+		return 0;
+	}
+	for (int i = 0; i < index->cellsX * index->cellsZ; i++) {
+		index->cells[i] = -1;
+	}
+	index->oversized = -1;
+	index->capacity = capacity;
+	index->minY = FLT_MAX;
+	index->maxY = -FLT_MAX;
+	return 1;
+}
+
+void freeSpatialIndex(spatialindex_t* index) {
+	free(index->cells);
+	free(index->entries);
+	index->cells = NULL;
+	index->entries = NULL;
+	index->count = index->capacity = 0;
+}
+
+/*
+	The cell a box belongs in: the one holding its centre, as long as the box is no
+	wider than a cell (so it reaches at most half a cell over). Anything wider, or
+	centred off the grid, returns -1, for the oversized list.
+*/
+int spatialCellOf(const spatialindex_t* index, const float boxMin[3], const float boxMax[3]) {
+	float x = (boxMin[0] + boxMax[0]) * 0.5f - index->originX;
+	float z = (boxMin[2] + boxMax[2]) * 0.5f - index->originZ;
+	if (boxMax[0] - boxMin[0] > SPATIAL_CELL_SIZE || boxMax[2] - boxMin[2] > SPATIAL_CELL_SIZE) return -1;
+	if (x < 0.0f || z < 0.0f || x >= index->cellsX * SPATIAL_CELL_SIZE || z >= index->cellsZ * SPATIAL_CELL_SIZE) return -1;
+	int cellX = (int)(x / SPATIAL_CELL_SIZE);
+	int cellZ = (int)(z / SPATIAL_CELL_SIZE);
+	if (cellX >= index->cellsX) cellX = index->cellsX - 1;
+	if (cellZ >= index->cellsZ) cellZ = index->cellsZ - 1;
+	return cellZ * index->cellsX + cellX;
+}
+
+// Grow the index's vertical extent (which only ever grows) to take in an entry's box.
+void spatialFitHeight(spatialindex_t* index, const spatialentry_t* entry) {
+	if (entry->boxMin[1] < index->minY) index->minY = entry->boxMin[1];
+	if (entry->boxMax[1] > index->maxY) index->maxY = entry->boxMax[1];
+}
+
+// Link an entry into the front of its cell's list (or the oversized list).
+void spatialLink(spatialindex_t* index, int id) {
+	spatialentry_t* entry = &index->entries[id];
+	int* head = entry->cell >= 0 ? &index->cells[entry->cell] : &index->oversized;
+	entry->prev = -1;
+	entry->next = *head;
+	if (*head != -1) index->entries[*head].prev = id;
+	*head = id;
+}
+
+void spatialUnlink(spatialindex_t* index, int id) {
+	spatialentry_t* entry = &index->entries[id];
+	if (entry->prev != -1) index->entries[entry->prev].next = entry->next;
+	else if (entry->cell >= 0) index->cells[entry->cell] = entry->next;
+	else index->oversized = entry->next;
+	if (entry->next != -1) index->entries[entry->next].prev = entry->prev;
+}
+
+/*
+	Add an object standing at position, with a (world-space) bounding box, to the index.
+	Returns its entry number (entries are numbered in the order they're added), or -1
+	if the index is full.
+*/
+int spatialInsert(spatialindex_t* index, spatialkind_t kind, int instance, const float position[3], const float boxMin[3], const float boxMax[3]) {
+	if (index->count == index->capacity) return -1;
+	int id = index->count++;
+	spatialentry_t* entry = &index->entries[id];
+	memset(entry, 0, sizeof(*entry));
+	memcpy(entry->position, position, sizeof(entry->position));
+	memcpy(entry->boxMin, boxMin, sizeof(entry->boxMin));
+	memcpy(entry->boxMax, boxMax, sizeof(entry->boxMax));
+	entry->kind = kind;
+	entry->instance = instance;
+	entry->cell = spatialCellOf(index, boxMin, boxMax);
+	spatialLink(index, id);
+	spatialFitHeight(index, entry);
+	return id;
+}
+
+// Move an entry (and its box) to stand at position. It's only relinked if that takes it into another cell.
+void spatialMove(spatialindex_t* index, int id, const float position[3]) {
+	spatialentry_t* entry = &index->entries[id];
+	for (int axis = 0; axis < 3; axis++) {
+		float offset = position[axis] - entry->position[axis];
+		entry->boxMin[axis] += offset;
+		entry->boxMax[axis] += offset;
+		entry->position[axis] = position[axis];
+	}
+	int cell = spatialCellOf(index, entry->boxMin, entry->boxMax);
+	if (cell != entry->cell) {
+		spatialUnlink(index, id);
+		entry->cell = cell;
+		spatialLink(index, id);
+	}
+	spatialFitHeight(index, entry);
+}
+
+/*
+	Write the entries whose boxes are (at least partly) inside the frustum to
+	results, up to maxResults of them. Returns how many there are in all. Cells are
+	tested as boxes grown by half a cell, since that's as far as their entries can
+	reach, first SPATIAL_BLOCK_CELLS square at a time and then one by one.
+*/
+int spatialQueryFrustum(const spatialindex_t* index, const frustum_t* frustum, int* results, int maxResults) {
+	int found = 0;
+	for (int id = index->oversized; id != -1; id = index->entries[id].next) {
+		const spatialentry_t* entry = &index->entries[id];
+		if (frustumIntersectsBox(frustum, entry->boxMin, entry->boxMax)) {
+			if (found < maxResults) results[found] = id;
+			found++;
+		}
+	}
+
+	const float margin = SPATIAL_CELL_SIZE * 0.5f;
+	const float blockSize = SPATIAL_BLOCK_CELLS * SPATIAL_CELL_SIZE;
+	for (int blockZ = 0; blockZ < index->cellsZ; blockZ += SPATIAL_BLOCK_CELLS) {
+		for (int blockX = 0; blockX < index->cellsX; blockX += SPATIAL_BLOCK_CELLS) {
+			const float blockMin[3] = {
+				index->originX + blockX * SPATIAL_CELL_SIZE - margin, index->minY, index->originZ + blockZ * SPATIAL_CELL_SIZE - margin
+			};
+			const float blockMax[3] = { blockMin[0] + blockSize + 2.0f * margin, index->maxY, blockMin[2] + blockSize + 2.0f * margin };
+			if (!frustumIntersectsBox(frustum, blockMin, blockMax)) continue;
+
+			int lastX = blockX + SPATIAL_BLOCK_CELLS < index->cellsX ? blockX + SPATIAL_BLOCK_CELLS : index->cellsX;
+			int lastZ = blockZ + SPATIAL_BLOCK_CELLS < index->cellsZ ? blockZ + SPATIAL_BLOCK_CELLS : index->cellsZ;
+			for (int cellZ = blockZ; cellZ < lastZ; cellZ++) {
+				for (int cellX = blockX; cellX < lastX; cellX++) {
+					int head = index->cells[cellZ * index->cellsX + cellX];
+					if (head == -1) continue;
+					const float boxMin[3] = {
+						index->originX + cellX * SPATIAL_CELL_SIZE - margin, index->minY, index->originZ + cellZ * SPATIAL_CELL_SIZE - margin
+					};
+					const float boxMax[3] = {
+						boxMin[0] + SPATIAL_CELL_SIZE + 2.0f * margin, index->maxY, boxMin[2] + SPATIAL_CELL_SIZE + 2.0f * margin
+					};
+					if (!frustumIntersectsBox(frustum, boxMin, boxMax)) continue;
+					for (int id = head; id != -1; id = index->entries[id].next) {
+						const spatialentry_t* entry = &index->entries[id];
+						if (frustumIntersectsBox(frustum, entry->boxMin, entry->boxMax)) {
+							if (found < maxResults) results[found] = id;
+							found++;
+						}
+					}
+				}
+			}
+		}
+	}
+	return found;
+}
+
+// Whether an entry's box overlaps the sphere around center.
+int spatialEntryWithin(const spatialentry_t* entry, const float center[3], float radius) {
+	float distanceSquared = 0.0f;
+	for (int axis = 0; axis < 3; axis++) {
+		float outside = 0.0f;
+		if (center[axis] < entry->boxMin[axis]) outside = entry->boxMin[axis] - center[axis];
+		else if (center[axis] > entry->boxMax[axis]) outside = center[axis] - entry->boxMax[axis];
+		distanceSquared += outside * outside;
+	}
+	return distanceSquared <= radius * radius;
+}
+
+/*
+	Write the entries whose boxes overlap the sphere around center to results, up
+	to maxResults of them (results may be NULL to just count). Returns how many there
+	are in all.
+*/
+int spatialQueryRadius(const spatialindex_t* index, const float center[3], float radius, int* results, int maxResults) {
+	int found = 0;
+	for (int id = index->oversized; id != -1; id = index->entries[id].next) {
+		if (spatialEntryWithin(&index->entries[id], center, radius)) {
+			if (found < maxResults) results[found] = id;
+			found++;
+		}
+	}
+
+	// Cells whose entries could reach the sphere.
+	float reach = radius + SPATIAL_CELL_SIZE * 0.5f;
+	int firstX = (int)floorf((center[0] - reach - index->originX) / SPATIAL_CELL_SIZE);
+	int lastX = (int)floorf((center[0] + reach - index->originX) / SPATIAL_CELL_SIZE);
+	int firstZ = (int)floorf((center[2] - reach - index->originZ) / SPATIAL_CELL_SIZE);
+	int lastZ = (int)floorf((center[2] + reach - index->originZ) / SPATIAL_CELL_SIZE);
+	if (firstX < 0) firstX = 0;
+	if (firstZ < 0) firstZ = 0;
+	if (lastX >= index->cellsX) lastX = index->cellsX - 1;
+	if (lastZ >= index->cellsZ) lastZ = index->cellsZ - 1;
+	for (int cellZ = firstZ; cellZ <= lastZ; cellZ++) {
+		for (int cellX = firstX; cellX <= lastX; cellX++) {
+			for (int id = index->cells[cellZ * index->cellsX + cellX]; id != -1; id = index->entries[id].next) {
+				if (spatialEntryWithin(&index->entries[id], center, radius)) {
+					if (found < maxResults) results[found] = id;
+					found++;
+				}
+			}
+		}
+	}
+	return found;
+}
+
+/*
+	Where a ray from origin along the unit vector direction first touches an entry's
+	box: if that's nearer than *nearest, update *nearest and *hit. A ray starting
+	inside the box touches it at 0.
+*/
+void spatialRayTest(const spatialindex_t* index, int id, const float origin[3], const float direction[3], float* nearest, int* hit) {
+	const spatialentry_t* entry = &index->entries[id];
+	float enter = 0.0f;
+	float leave = *nearest;
+	for (int axis = 0; axis < 3; axis++) {
+		if (direction[axis] == 0.0f) {
+			if (origin[axis] < entry->boxMin[axis] || origin[axis] > entry->boxMax[axis]) return;
+			continue;
+		}
+		float t0 = (entry->boxMin[axis] - origin[axis]) / direction[axis];
+		float t1 = (entry->boxMax[axis] - origin[axis]) / direction[axis];
+		if (t0 > t1) { float swap = t0; t0 = t1; t1 = swap; }
+		if (t0 > enter) enter = t0;
+		if (t1 < leave) leave = t1;
+		if (enter > leave) return;
+	}
+	if (enter < *nearest) {
+		*nearest = enter;
+		*hit = id;
+	}
+}
+
+/*
+	The nearest entry a ray from origin along the unit vector direction touches
+	within maxDistance, or -1; its distance goes in *hitDistance. Walks the cells
+	the ray crosses in order, checking each one's neighbours too (their entries can
+	reach half a cell over), and stops once it's past the nearest hit so far. The
+	walk covers one more ring of (empty) cells round the grid, for entries reaching
+	over its edge.
+*/
+int spatialQueryRay(spatialindex_t* index, const float origin[3], const float direction[3], float maxDistance, float* hitDistance) {
+	int hit = -1;
+	float nearest = maxDistance;
+	unsigned int stamp = ++index->stamp;
+	for (int id = index->oversized; id != -1; id = index->entries[id].next) {
+		spatialRayTest(index, id, origin, direction, &nearest, &hit);
+	}
+
+	// Clip the ray to the grid and the ring around it.
+	const int axes[2] = { 0, 2 };
+	const float gridMin[2] = { index->originX - SPATIAL_CELL_SIZE, index->originZ - SPATIAL_CELL_SIZE };
+	const float gridMax[2] = {
+		index->originX + (index->cellsX + 1) * SPATIAL_CELL_SIZE, index->originZ + (index->cellsZ + 1) * SPATIAL_CELL_SIZE
+	};
+	float enter = 0.0f;
+	float leave = maxDistance;
+	for (int a = 0; a < 2; a++) {
+		float start = origin[axes[a]];
+		float step = direction[axes[a]];
+		if (step == 0.0f) {
+			if (start < gridMin[a] || start > gridMax[a]) enter = leave + 1.0f;
+			continue;
+		}
+		float t0 = (gridMin[a] - start) / step;
+		float t1 = (gridMax[a] - start) / step;
+		if (t0 > t1) { float swap = t0; t0 = t1; t1 = swap; }
+		if (t0 > enter) enter = t0;
+		if (t1 < leave) leave = t1;
+	}
+
+	if (enter <= leave) {
+		// Cell the clipped ray starts in (counting the ring), and when it crosses into the next cell along each axis.
+		int cell[2];
+		int cellStep[2];
+		int cellCount[2] = { index->cellsX + 2, index->cellsZ + 2 };
+		float next[2];
+		float delta[2];
+		for (int a = 0; a < 2; a++) {
+			float step = direction[axes[a]];
+			float position = origin[axes[a]] + step * enter - gridMin[a];
+			cell[a] = (int)floorf(position / SPATIAL_CELL_SIZE);
+			if (cell[a] < 0) cell[a] = 0;
+			if (cell[a] >= cellCount[a]) cell[a] = cellCount[a] - 1;
+			cellStep[a] = step > 0.0f ? 1 : -1;
+			if (step == 0.0f) {
+				next[a] = delta[a] = FLT_MAX;
+			}
+			else {
+				float boundary = gridMin[a] + (cell[a] + (step > 0.0f ? 1 : 0)) * SPATIAL_CELL_SIZE;
+				next[a] = (boundary - origin[axes[a]]) / step;
+				delta[a] = SPATIAL_CELL_SIZE / fabsf(step);
+			}
+		}
+
+		float cellEnter = enter;
+		while (cellEnter <= leave && cellEnter <= nearest) {
+			// Leaving the ring out, the grid's cells are numbered from 1 here.
+			for (int z = cell[1] - 2; z <= cell[1]; z++) {
+				for (int x = cell[0] - 2; x <= cell[0]; x++) {
+					if (x < 0 || z < 0 || x >= index->cellsX || z >= index->cellsZ) continue;
+					for (int id = index->cells[z * index->cellsX + x]; id != -1; id = index->entries[id].next) {
+						if (index->entries[id].stamp == stamp) continue;
+						index->entries[id].stamp = stamp;
+						spatialRayTest(index, id, origin, direction, &nearest, &hit);
+					}
+				}
+			}
+			int a = next[0] < next[1] ? 0 : 1;
+			cell[a] += cellStep[a];
+			if (cell[a] < 0 || cell[a] >= cellCount[a]) break;
+			cellEnter = next[a];
+			next[a] += delta[a];
+		}
+	}
+
+	if (hit != -1 && hitDistance != NULL) *hitDistance = nearest;
+	return hit;
+}
+
+/*
+	World-space box around a copy of a mesh standing at position, drawn at scale and
+	turned any way about the y axis.
+*/
+void meshBounds(meshid_t id, const float position[3], float scale, float boxMin[3], float boxMax[3]) {
+	const meshentry_t* mesh = &meshes[id];
+	float x = fmaxf(fabsf(mesh->boxMin[0]), fabsf(mesh->boxMax[0]));
+	float z = fmaxf(fabsf(mesh->boxMin[2]), fabsf(mesh->boxMax[2]));
+	float reach = sqrtf(x * x + z * z) * scale;
+	boxMin[0] = position[0] - reach;
+	boxMax[0] = position[0] + reach;
+	boxMin[1] = position[1] + mesh->boxMin[1] * scale;
+	boxMax[1] = position[1] + mesh->boxMax[1] * scale;
+	boxMin[2] = position[2] - reach;
+	boxMax[2] = position[2] + reach;
+}
+
+/*
+	Put every object display() draws into sceneIndex: first the ones it draws on
+	their own, so each one's entry number is its kind, then every instance of each
+	group. Called once from init(), after initInstanceGroups(). Returns 0 if memory
+	runs out.
+*/
+int initSceneIndex(void) {
+	instancegroup_t* groups[] = { &treeGroup, &houseGroup, &tankGroup };
+	const spatialkind_t groupKinds[] = { SPATIAL_TREE, SPATIAL_HOUSE, SPATIAL_TANK };
+	int capacity = NUM_SPATIAL_KINDS + treeGroup.count + houseGroup.count + tankGroup.count;
+	float half = groundSize * 0.5f;
+	if (!initSpatialIndex(&sceneIndex, -half, -half, half, half, capacity)) return 0;
+	sceneVisibleEntries = (int*)malloc(capacity * sizeof(int));
+	if (sceneVisibleEntries == NULL) return 0;
+
+	float boxMin[3];
+	float boxMax[3];
+	meshBounds(MESH_TREE, standaloneTreePosition, 1.0f, boxMin, boxMax);
+	spatialInsert(&sceneIndex, SPATIAL_TREE, -1, standaloneTreePosition, boxMin, boxMax);
+	meshBounds(MESH_HOUSE, standaloneHousePosition, 1.0f, boxMin, boxMax);
+	spatialInsert(&sceneIndex, SPATIAL_HOUSE, -1, standaloneHousePosition, boxMin, boxMax);
+	const float tankPosition[3] = { -10.0f, 0.0f, -20.0f };	// Moved every frame by placeTanks().
+	meshBounds(MESH_TANK, tankPosition, 1.0f, boxMin, boxMax);
+	spatialInsert(&sceneIndex, SPATIAL_TANK, -1, tankPosition, boxMin, boxMax);
+
+	// The boxes display() draws the hangar (half sunk, stretched 3x along z) and the airstrip (stretched 1.5x) in.
+	const float hangarPosition[3] = { 0.0f, 0.0f, 8.0f };
+	const float hangarMin[3] = { -3.0f, -3.3f, 8.0f };
+	const float hangarMax[3] = { 3.0f, 2.7f, 20.0f };
+	spatialInsert(&sceneIndex, SPATIAL_HANGAR, -1, hangarPosition, hangarMin, hangarMax);
+	const float airstripPosition[3] = { 0.0f, 0.0f, -10.0f };
+	const float airstripMin[3] = { -3.0f, -0.025f, -40.0f };
+	const float airstripMax[3] = { 3.0f, 0.035f, 20.0f };
+	spatialInsert(&sceneIndex, SPATIAL_AIRSTRIP, -1, airstripPosition, airstripMin, airstripMax);
+
+	for (int i = 0; i < 3; i++) {
+		groups[i]->spatialFirst = sceneIndex.count;
+		for (int j = 0; j < groups[i]->count; j++) {
+			const meshinstance_t* instance = &groups[i]->instances[j];
+			meshBounds(groups[i]->mesh, instance->position, instance->scale, boxMin, boxMax);
+			spatialInsert(&sceneIndex, groupKinds[i], j, instance->position, boxMin, boxMax);
+		}
+	}
+	return 1;
+}
+
+/*
+	Find which of sceneIndex's entries are inside the view frustum this frame, marking
+	them with sceneFrame, and count them in cullStats. Called by display() once the
+	frustum is built and the tanks are placed.
+*/
+void cullScene(void) {
+	int visible = spatialQueryFrustum(&sceneIndex, &viewFrustum, sceneVisibleEntries, sceneIndex.count);
+	sceneFrame++;
+	for (int i = 0; i < visible; i++) {
+		sceneIndex.entries[sceneVisibleEntries[i]].visibleFrame = sceneFrame;
+	}
+	cullStats.objectsDrawn += visible;
+	cullStats.objectsCulled += sceneIndex.count - visible;
+}
+
+// Whether cullScene() found an entry of sceneIndex in view this frame.
+int sceneEntryVisible(int id) {
+	return sceneIndex.entries[id].visibleFrame == sceneFrame;
+}
+
+// Next number in [0, 1) from the same generator initInstanceGroups() scatters trees with.
+float benchmarkRandom(unsigned int* seed) {
+	*seed = *seed * 1664525u + 1013904223u;
+	return (*seed >> 8) / 16777216.0f;
+}
+
+/*
+	Time building, updating and querying a spatial index of 1,000, 100,000 and
+	1,000,000 random objects (one per 16 square units, so the scene's density),
+	against a linear scan over the same objects, and check both give the same answers.
+*/
+void runSpatialBenchmark(void) {
+	const int sizes[] = { 1000, 100000, 1000000 };
+	const int queries = 200;
+	unsigned int seed = 12345u;
+
+	printf("Spatial index (%.0f-unit cells) against a linear scan, average per operation:\n", SPATIAL_CELL_SIZE);
+	for (int s = 0; s < 3; s++) {
+		int count = sizes[s];
+		float half = sqrtf((float)count) * 2.0f;
+		spatialindex_t index;
+		int* results = (int*)malloc(count * sizeof(int));
+		if (results == NULL || !initSpatialIndex(&index, -half, -half, half, half, count)) {
+			printf("  %d objects: out of memory\n", count);
+			free(results);
+			return;
+		}
+		unsigned long long start = pacingNowNs();
+		for (int i = 0; i < count; i++) {
+			const float position[3] = { (benchmarkRandom(&seed) - 0.5f) * 2.0f * half, 0.0f, (benchmarkRandom(&seed) - 0.5f) * 2.0f * half };
+			float reach = 0.5f + benchmarkRandom(&seed) * 4.0f;
+			float height = 1.0f + benchmarkRandom(&seed) * 7.0f;
+			const float boxMin[3] = { position[0] - reach, 0.0f, position[2] - reach };
+			const float boxMax[3] = { position[0] + reach, height, position[2] + reach };
+			spatialInsert(&index, SPATIAL_TREE, i, position, boxMin, boxMax);
+		}
+		double buildNs = (double)(pacingNowNs() - start) / count;
+
+		// Move a tenth of the objects a few units, as the tanks move.
+		int moves = count / 10;
+		start = pacingNowNs();
+		for (int i = 0; i < moves; i++) {
+			int id = (int)(benchmarkRandom(&seed) * count) % count;
+			const spatialentry_t* entry = &index.entries[id];
+			const float position[3] = {
+				entry->position[0] + (benchmarkRandom(&seed) - 0.5f) * 10.0f, 0.0f, entry->position[2] + (benchmarkRandom(&seed) - 0.5f) * 10.0f
+			};
+			spatialMove(&index, id, position);
+		}
+		double moveNs = (double)(pacingNowNs() - start) / moves;
+
+		double indexNs[3] = { 0.0, 0.0, 0.0 };
+		double scanNs[3] = { 0.0, 0.0, 0.0 };
+		int mismatches = 0;
+		for (int q = 0; q < queries; q++) {
+			const float eye[3] = { (benchmarkRandom(&seed) - 0.5f) * 2.0f * half, 10.0f + benchmarkRandom(&seed) * 40.0f, (benchmarkRandom(&seed) - 0.5f) * 2.0f * half };
+			float heading = benchmarkRandom(&seed) * 2.0f * (float)PI;
+			const float target[3] = { eye[0] + cosf(heading) * 20.0f, 0.0f, eye[2] + sinf(heading) * 20.0f };
+			float forward[3] = { target[0] - eye[0], target[1] - eye[1], target[2] - eye[2] };
+			float length = sqrtf(forward[0] * forward[0] + forward[1] * forward[1] + forward[2] * forward[2]);
+			forward[0] /= length;
+			forward[1] /= length;
+			forward[2] /= length;
+			frustum_t frustum;
+			buildViewFrustum(&frustum, eye, target, 4.0f / 3.0f);
+
+			// Frustum, radius and ray queries from the index...
+			int found[3];
+			int hit;
+			float hitDistance;
+			start = pacingNowNs();
+			found[0] = spatialQueryFrustum(&index, &frustum, results, count);
+			indexNs[0] += (double)(pacingNowNs() - start);
+			start = pacingNowNs();
+			found[1] = spatialQueryRadius(&index, target, 20.0f, results, count);
+			indexNs[1] += (double)(pacingNowNs() - start);
+			start = pacingNowNs();
+			hit = spatialQueryRay(&index, eye, forward, CAMERA_FAR, &hitDistance);
+			indexNs[2] += (double)(pacingNowNs() - start);
+
+			// ...and the same by testing every object.
+			int scanned[3] = { 0, 0, 0 };
+			int scanHit = -1;
+			float nearest = CAMERA_FAR;
+			start = pacingNowNs();
+			for (int id = 0; id < count; id++) {
+				scanned[0] += frustumIntersectsBox(&frustum, index.entries[id].boxMin, index.entries[id].boxMax);
+			}
+			scanNs[0] += (double)(pacingNowNs() - start);
+			start = pacingNowNs();
+			for (int id = 0; id < count; id++) {
+				scanned[1] += spatialEntryWithin(&index.entries[id], target, 20.0f);
+			}
+			scanNs[1] += (double)(pacingNowNs() - start);
+			start = pacingNowNs();
+			for (int id = 0; id < count; id++) {
+				spatialRayTest(&index, id, eye, forward, &nearest, &scanHit);
+			}
+			scanNs[2] += (double)(pacingNowNs() - start);
+			mismatches += (found[0] != scanned[0]) + (found[1] != scanned[1]) + (hit != scanHit);
+		}
+
+		printf("  %7d objects: insert %.0f ns, move %.0f ns, %d queries %s\n", count, buildNs, moveNs, queries,
+			mismatches == 0 ? "matched the scan" : "DID NOT MATCH the scan");
+		const char* names[3] = { "frustum", "radius 20", "ray" };
+		for (int k = 0; k < 3; k++) {
+			double indexUs = indexNs[k] / queries / 1000.0;
+			double scanUs = scanNs[k] / queries / 1000.0;
+			printf("    %-10s %10.1f us (scan %10.1f us, %.1fx faster)\n", names[k], indexUs, scanUs, indexUs > 0.0 ? scanUs / indexUs : 0.0);
+		}
+		freeSpatialIndex(&index);
+		free(results);
+	}
+}
+
+/*
+	Build the frustum seen by a camera at eye looking at target (with +y up), using
+	the projection reshape() sets up. The planes are worked out directly in world
+	space, so nothing has to be read back from OpenGL.
+*/
+void buildViewFrustum(frustum_t* frustum, const float eye[3], const float target[3], float aspect) {
+	float forward[3] = { target[0] - eye[0], target[1] - eye[1], target[2] - eye[2] };
+	float length = sqrtf(forward[0] * forward[0] + forward[1] * forward[1] + forward[2] * forward[2]);
+	if (length < 1e-6f) {
+		forward[0] = 0.0f; forward[1] = 0.0f; forward[2] = -1.0f;
+	}
+	else {
+		forward[0] /= length; forward[1] /= length; forward[2] /= length;
+	}
+
+	// right = forward x up, then up = right x forward, as gluLookAt() does.
+	float right[3] = { -forward[2], 0.0f, forward[0] };
+	length = sqrtf(right[0] * right[0] + right[2] * right[2]);
+	if (length < 1e-6f) {
+		right[0] = 1.0f; right[2] = 0.0f;  // Looking straight up or down: any horizontal axis will do.
+	}
+	else {
+		right[0] /= length; right[2] /= length;
+	}
+	float up[3] = {
+		right[1] * forward[2] - right[2] * forward[1],
+		right[2] * forward[0] - right[0] * forward[2],
+		right[0] * forward[1] - right[1] * forward[0]
+	};
+
+	float tanY = tanf(CAMERA_FOV_Y * (float)PI / 360.0f);
+	float tanX = tanY * aspect;
+
+	// Inward normals: each side plane contains the eye and one edge of the view.
+	float normals[6][3];
+	for (int i = 0; i < 3; i++) {
+		normals[0][i] = forward[i] * tanX + right[i];	// Left.
+		normals[1][i] = forward[i] * tanX - right[i];	// Right.
+		normals[2][i] = forward[i] * tanY + up[i];		// Bottom.
+		normals[3][i] = forward[i] * tanY - up[i];		// Top.
+		normals[4][i] = forward[i];						// Near.
+		normals[5][i] = -forward[i];					// Far.
+	}
+
+	for (int p = 0; p < 6; p++) {
+		float* plane = frustum->planes[p];
+		float n = sqrtf(normals[p][0] * normals[p][0] + normals[p][1] * normals[p][1] + normals[p][2] * normals[p][2]);
+		plane[0] = normals[p][0] / n;
+		plane[1] = normals[p][1] / n;
+		plane[2] = normals[p][2] / n;
+		plane[3] = -(plane[0] * eye[0] + plane[1] * eye[1] + plane[2] * eye[2]);
+	}
+	frustum->planes[4][3] -= CAMERA_NEAR;
+	frustum->planes[5][3] += CAMERA_FAR;
+}
+
+/*
+	Conservative box test: returns 0 only if the axis-aligned box is entirely
+	outside one of the frustum's planes.
+*/
+int frustumIntersectsBox(const frustum_t* frustum, const float boxMin[3], const float boxMax[3]) {
+	for (int p = 0; p < 6; p++) {
+		const float* plane = frustum->planes[p];
+		// The box corner farthest along the plane's normal.
+		float x = plane[0] >= 0.0f ? boxMax[0] : boxMin[0];
+		float y = plane[1] >= 0.0f ? boxMax[1] : boxMin[1];
+		float z = plane[2] >= 0.0f ? boxMax[2] : boxMin[2];
+		if (plane[0] * x + plane[1] * y + plane[2] * z + plane[3] < 0.0f) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+	Conservative sphere test: returns 0 only if the sphere is entirely outside one of
+	the frustum's planes.
+*/
+int frustumIntersectsSphere(const frustum_t* frustum, const float center[3], float radius) {
+	for (int p = 0; p < 6; p++) {
+		const float* plane = frustum->planes[p];
+		if (plane[0] * center[0] + plane[1] * center[1] + plane[2] * center[2] + plane[3] < -radius) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Test the bounding sphere of an object that isn't in sceneIndex against this frame's view frustum, counting it in cullStats.
+int sphereVisible(const float center[3], float radius) {
+	int visible = frustumIntersectsSphere(&viewFrustum, center, radius);
+	if (visible) cullStats.objectsDrawn++;
+	else cullStats.objectsCulled++;
+	return visible;
+}
+
+/*
+	Whether a pass gets a GPU query. think() has no GPU work (and may not run on the GL
+	thread), and the models pass only queues draws for the render queue pass to make.
+*/
+int passGpuTimed(profilepass_t pass) {
+	return pass != PASS_THINK && pass != PASS_MODELS;
+}
+
+/*
+	Mark the start of a timed pass. Each pass must only be timed by one thread.
+*/
+void profileBegin(profilepass_t pass) {
+	profilePassStart[pass] = pacingNowNs();
+
+	if (gpuProfilingEnabled && passGpuTimed(pass)) {
+		glBeginQuery(GL_TIME_ELAPSED, gpuQueries[renderedFrames & 1][pass]);
+	}
+}
+
+/*
+	Mark the end of a timed pass and publish its duration to the profile ring.
+	Safe to call from any thread: a slot is claimed with an atomic increment and
+	only marked readable (via its sequence number) once it's fully written.
+*/
+void profileEnd(profilepass_t pass) {
+	if (gpuProfilingEnabled && passGpuTimed(pass)) {
+		glEndQuery(GL_TIME_ELAPSED);
+		gpuQueryIssued[renderedFrames & 1][pass] = 1;
+	}
+
+	unsigned long long duration = pacingNowNs() - profilePassStart[pass];
+	long index = atomicFetchAdd(&profileWriteIndex, 1);
+	profilesample_t* sample = &profileRing[index & (PROFILE_RING_SIZE - 1)];
+	sample->pass = pass;
+	sample->duration = duration;
+	atomicStore(&sample->sequence, index + 1);
+}
+
+/*
+	Drain the profile ring into this frame's per-pass totals, then close the frame:
+	its totals join the rolling window and, if enabled, a row in the CSV file.
+
+	With GPU profiling on, GPU times arrive two frames late (see gpuQueries), so
+	CPU times are held back for two frames and each CSV row is written once both
+	halves of that frame are known.
+*/
+void collectProfileSamples(void) {
+	long writeIndex = atomicLoad(&profileWriteIndex);
+
+	// If writers lapped us, the oldest samples are gone: skip to the oldest one still in the ring.
+	if (writeIndex - profileReadIndex > PROFILE_RING_SIZE) {
+		profileReadIndex = writeIndex - PROFILE_RING_SIZE;
+	}
+
+	while (profileReadIndex < writeIndex) {
+		profilesample_t* sample = &profileRing[profileReadIndex & (PROFILE_RING_SIZE - 1)];
+		if (atomicLoad(&sample->sequence) != profileReadIndex + 1) {
+			break;  // Claimed but not written yet; pick it up next frame.
+		}
+		passStats[sample->pass].cpuThisFrame += sample->duration;
+		profileReadIndex++;
+	}
+
+	int parity = renderedFrames & 1;
+
+	if (profileCsvFile != NULL) {
+		if (!gpuProfilingEnabled) {
+			fprintf(profileCsvFile, "%u", renderedFrames);
+			for (int pass = 0; pass < NUM_PASSES; pass++) {
+				fprintf(profileCsvFile, ",%.4f", passStats[pass].cpuThisFrame / (double)NS_PER_MS);
+			}
+			fprintf(profileCsvFile, "\n");
+		}
+		else if (renderedFrames >= 2) {
+			fprintf(profileCsvFile, "%u", renderedFrames - 2);
+			for (int pass = 0; pass < NUM_PASSES; pass++) {
+				fprintf(profileCsvFile, ",%.4f,%.4f", passStats[pass].cpuPending[parity] / (double)NS_PER_MS,
+					gpuResults[pass] / (double)NS_PER_MS);
+			}
+			fprintf(profileCsvFile, "\n");
+		}
+	}
+
+	for (int pass = 0; pass < NUM_PASSES; pass++) {
+		passStats[pass].cpuTime[profileWindowNext] = passStats[pass].cpuThisFrame;
+		passStats[pass].gpuTime[profileWindowNext] = gpuResults[pass];
+		passStats[pass].cpuPending[parity] = passStats[pass].cpuThisFrame;
+		passStats[pass].cpuThisFrame = 0;
+	}
+	profileWindowNext = (profileWindowNext + 1) % PROFILE_WINDOW_FRAMES;
+	if (profileWindowCount < PROFILE_WINDOW_FRAMES) profileWindowCount++;
+	renderedFrames++;
+}
+
+/*
+	Overlay the rolling average and maximum CPU time of each pass in the top-left
+	corner of the window, using GLUT bitmap text.
+*/
+void drawProfilerHud(void) {
+	char line[128];
+	int y = 20;
+
+	glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_POLYGON_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_FOG);
+	glDisable(GL_TEXTURE_2D);
+	glDisable(GL_DEPTH_TEST);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	gluOrtho2D(0, windowWidth, windowHeight, 0);  // Top-left origin, one unit per pixel.
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+
+	glColor3f(1.0f, 1.0f, 0.0f);
+	if (gpuProfilingEnabled) {
+		sprintf(line, "%-16s %8s %8s %8s %8s   (last %d frames)", "pass", "cpu avg", "cpu max", "gpu avg", "gpu max", profileWindowCount);
+	}
+	else {
+		sprintf(line, "%-16s %8s %8s   (last %d frames)", "pass", "cpu avg", "cpu max", profileWindowCount);
+	}
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	double totalCpuAverage = 0.0, totalGpuAverage = 0.0;
+	for (int pass = 0; pass < NUM_PASSES; pass++) {
+		unsigned long long cpuSum = 0, cpuMax = 0, gpuSum = 0, gpuMax = 0;
+		for (int i = 0; i < profileWindowCount; i++) {
+			cpuSum += passStats[pass].cpuTime[i];
+			gpuSum += passStats[pass].gpuTime[i];
+			if (passStats[pass].cpuTime[i] > cpuMax) cpuMax = passStats[pass].cpuTime[i];
+			if (passStats[pass].gpuTime[i] > gpuMax) gpuMax = passStats[pass].gpuTime[i];
+		}
+		double cpuAverage = profileWindowCount > 0 ? cpuSum / (double)profileWindowCount / NS_PER_MS : 0.0;
+		double gpuAverage = profileWindowCount > 0 ? gpuSum / (double)profileWindowCount / NS_PER_MS : 0.0;
+		totalCpuAverage += cpuAverage;
+		totalGpuAverage += gpuAverage;
+
+		y += 15;
+		if (gpuProfilingEnabled && passGpuTimed(pass)) {
+			sprintf(line, "%-16s %8.3f %8.3f %8.3f %8.3f", profilePassNames[pass], cpuAverage, cpuMax / (double)NS_PER_MS,
+				gpuAverage, gpuMax / (double)NS_PER_MS);
+		}
+		else if (gpuProfilingEnabled) {
+			sprintf(line, "%-16s %8.3f %8.3f %8s %8s", profilePassNames[pass], cpuAverage, cpuMax / (double)NS_PER_MS, "-", "-");
+		}
+		else {
+			sprintf(line, "%-16s %8.3f %8.3f", profilePassNames[pass], cpuAverage, cpuMax / (double)NS_PER_MS);
+		}
+		glRasterPos2i(10, y);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+	}
+
+	y += 15;
+	if (gpuProfilingEnabled) {
+		sprintf(line, "%-16s %8.3f %8s %8.3f %8s   (%u gpu results dropped)", "total", totalCpuAverage, "", totalGpuAverage, "", gpuResultsDropped);
+	}
+	else {
+		sprintf(line, "%-16s %8.3f", "total", totalCpuAverage);
+	}
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	y += 20;
+	sprintf(line, "ground: %d chunks drawn, %d culled, %d triangles", groundStats.chunksDrawn, groundStats.chunksCulled,
+		groundStats.trianglesDrawn);
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	y += 15;
+	sprintf(line, "aircraft: %d draw calls, %d vertices", aircraftStats.drawCalls, aircraftStats.verticesSubmitted);
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	y += 15;
+	sprintf(line, "models: %d/%d/%d copies per level, %d impostors, %d triangles, %d saved", meshLodStats.copiesDrawn[0],
+		meshLodStats.copiesDrawn[1], meshLodStats.copiesDrawn[2], meshLodStats.impostorsDrawn, meshLodStats.trianglesDrawn,
+		meshLodStats.trianglesSaved);
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	y += 15;
+	sprintf(line, "culling: %d objects drawn, %d culled, %d rain drops drawn", cullStats.objectsDrawn,
+		cullStats.objectsCulled, cullStats.rainDrawn);
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	// Live and free particles of each kind, then what this frame's emitters managed.
+	y += 15;
+	int length = sprintf(line, "particles (live/free):");
+	int spawned = 0;
+	int dropped = 0;
+	for (int type = 0; type < NUM_PARTICLE_TYPES; type++) {
+		const particlepool_t* pool = &particleSystem.pools[type];
+		length += sprintf(line + length, " %s %d/%d", particleKinds[type].name, pool->live, particleKinds[type].budget - pool->live);
+		spawned += pool->spawned;
+		dropped += pool->dropped;
+	}
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+	y += 15;
+	sprintf(line, "particles: %d of %d live, %d spawned, %d dropped, spawning at %d%%", particleSystem.live, MAX_PARTICLES,
+		spawned, dropped, (int)(particleSystem.spawnScale * 100.0f + 0.5f));
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	y += 15;
+	sprintf(line, "state cache: %d GL calls made, %d skipped as redundant", stateCacheStats.callsMade, stateCacheStats.callsSkipped);
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	// State changes the render queue made, with what the same draws would have taken unsorted.
+	y += 15;
+	sprintf(line, "queue: %d draws, %d/%d shaders, %d/%d arrays, %d/%d textures, %d/%d materials (sorted/unsorted)",
+		renderStats.items, renderStats.shaderSwitches, renderStatsUnsorted.shaderSwitches, renderStats.arrayBinds,
+		renderStatsUnsorted.arrayBinds, renderStats.textureBinds, renderStatsUnsorted.textureBinds,
+		renderStats.materialChanges, renderStatsUnsorted.materialChanges);
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	// What's around and under the aircraft, from the spatial index.
+	const float down[3] = { 0.0f, -1.0f, 0.0f };
+	float belowDistance = 0.0f;
+	int nearby = spatialQueryRadius(&sceneIndex, renderState.objectLocation, 20.0f, NULL, 0);
+	int below = spatialQueryRay(&sceneIndex, renderState.objectLocation, down, CAMERA_FAR, &belowDistance);
+	y += 15;
+	if (below >= 0) {
+		sprintf(line, "nearby: %d objects within 20 units, %s %.1f below", nearby, spatialKindNames[sceneIndex.entries[below].kind], belowDistance);
+	}
+	else {
+		sprintf(line, "nearby: %d objects within 20 units, nothing below", nearby);
+	}
+	glRasterPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)line);
+
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopAttrib();
+}
+
+/*
+	Open fileName for per-frame pass timings: one row per rendered frame, one
+	column per pass (in milliseconds). Closed by finishProfileCsv() on exit.
+*/
+int startProfileCsv(const char* fileName) {
+	profileCsvFile = fopen(fileName, "w");
+	if (profileCsvFile == NULL) {
+		printf("Could not open %s for profiling output\n", fileName);
+		return 0;
+	}
+	fprintf(profileCsvFile, "frame");
+	for (int pass = 0; pass < NUM_PASSES; pass++) {
+		fprintf(profileCsvFile, ",%s_cpu_ms", profilePassNames[pass]);
+		if (gpuProfilingEnabled) fprintf(profileCsvFile, ",%s_gpu_ms", profilePassNames[pass]);
+	}
+	fprintf(profileCsvFile, "\n");
+	atexit(finishProfileCsv);
+	return 1;
+}
+
+void finishProfileCsv(void) {
+	if (profileCsvFile == NULL) return;
+	fclose(profileCsvFile);
+	profileCsvFile = NULL;
+}
+
+/*
+	Blend between two angles in degrees, taking the short way round so that a
+	wrap from 359 to 0 doesn't spin the object backwards for one frame.
+*/
+float lerpAngle(float from, float to, float t) {
+	float delta = to - from;
+	while (delta > 180.0f) delta -= 360.0f;
+	while (delta < -180.0f) delta += 360.0f;
+	return from + delta * t;
+}
+
+/*
+	Copy the interpolated parts of the current world state into state.
+*/
+void captureInterpolationState(interpstate_t* state) {
+	for (int i = 0; i < 3; i++) {
+		state->objectLocation[i] = objectLocation[i];
+		state->objectRotation[i] = objectRotation[i];
+		state->tankPosition[i] = tankPosition[i];
+		state->cameraLookAt[i] = cameraLookAt[i];
+	}
+	state->tankRotation = tankRotation;
+	state->propellerRotationAngle = propellerRotationAngle;
+	state->renderFill = renderFillEnabled;
+	state->rainActive = rainActive;
+	state->rotorSpeed = rotorSpeed;
+}
+
+/*
+	Fill renderState with the world as it was alpha (0..1) of the way from the
+	snapshot's previous state to its current one. This never touches the live
+	simulation variables, so display() can run while the next tick is simulated.
+*/
+void interpolateRenderState(const worldsnapshot_t* snapshot, float alpha) {
+	const interpstate_t* from = &snapshot->previous;
+	const interpstate_t* to = &snapshot->current;
+	for (int i = 0; i < 3; i++) {
+		renderState.objectLocation[i] = from->objectLocation[i] + (to->objectLocation[i] - from->objectLocation[i]) * alpha;
+		renderState.objectRotation[i] = lerpAngle(from->objectRotation[i], to->objectRotation[i], alpha);
+		renderState.tankPosition[i] = from->tankPosition[i] + (to->tankPosition[i] - from->tankPosition[i]) * alpha;
+		renderState.cameraLookAt[i] = from->cameraLookAt[i] + (to->cameraLookAt[i] - from->cameraLookAt[i]) * alpha;
 	}
+	renderState.tankRotation = lerpAngle(from->tankRotation, to->tankRotation, alpha);
+	renderState.propellerRotationAngle = lerpAngle(from->propellerRotationAngle, to->propellerRotationAngle, alpha);
+	renderState.renderFill = to->renderFill;
+	renderState.rainActive = to->rainActive;
+	renderState.rotorSpeed = to->rotorSpeed;
 }
 
-/******************************************************************************/
\ No newline at end of file
+/******************************************************************************/
\ No newline at end of file